@@ -11,9 +11,9 @@
 
 static int migrate_block(struct f2fs_sb_info *sbi, u64 from, u64 to)
 {
-	void *raw = calloc(BLOCK_SZ, 1);
-	struct seg_entry *se;
+	void *raw = f2fs_blk_alloc();
 	struct f2fs_summary sum;
+	u32 segno;
 	u64 offset;
 	int ret, type;
 
@@ -27,20 +27,20 @@ static int migrate_block(struct f2fs_sb_info *sbi, u64 from, u64 to)
 	ret = dev_write_block(raw, to);
 	ASSERT(ret >= 0);
 
-	/* update sit bitmap & valid_blocks && se->type */
-	se = get_seg_entry(sbi, GET_SEGNO(sbi, from));
+	/* update sit bitmap & valid_blocks && segment type */
+	segno = GET_SEGNO(sbi, from);
 	offset = OFFSET_IN_SEG(sbi, from);
-	type = se->type;
-	se->valid_blocks--;
-	f2fs_clear_bit(offset, (char *)se->cur_valid_map);
-	se->dirty = 1;
+	type = SE_TYPE(sbi, segno);
+	SE_VALID_BLOCKS(sbi, segno)--;
+	f2fs_clear_bit(offset, (char *)SE_VALID_MAP(sbi, segno));
+	SE_DIRTY(sbi, segno) = 1;
 
-	se = get_seg_entry(sbi, GET_SEGNO(sbi, to));
+	segno = GET_SEGNO(sbi, to);
 	offset = OFFSET_IN_SEG(sbi, to);
-	se->type = type;
-	se->valid_blocks++;
-	f2fs_set_bit(offset, (char *)se->cur_valid_map);
-	se->dirty = 1;
+	SE_TYPE(sbi, segno) = type;
+	SE_VALID_BLOCKS(sbi, segno)++;
+	f2fs_set_bit(offset, (char *)SE_VALID_MAP(sbi, segno));
+	SE_DIRTY(sbi, segno) = 1;
 
 	/* read/write SSA */
 	get_sum_entry(sbi, from, &sum);
@@ -56,14 +56,14 @@ static int migrate_block(struct f2fs_sb_info *sbi, u64 from, u64 to)
 	DBG(0, "Migrate %s block %"PRIx64" -> %"PRIx64"\n",
 					IS_DATASEG(type) ? "data" : "node",
 					from, to);
-	free(raw);
+	f2fs_blk_free(raw);
 	return 0;
 }
 
 int f2fs_defragment(struct f2fs_sb_info *sbi, u64 from, u64 len, u64 to, int left)
 {
-	struct seg_entry *se;
 	u64 idx, offset;
+	u32 segno;
 
 	/* flush NAT/SIT journal entries */
 	flush_journal_entries(sbi);
@@ -71,13 +71,15 @@ int f2fs_defragment(struct f2fs_sb_info *sbi, u64 from, u64 len, u64 to, int lef
 	for (idx = from; idx < from + len; idx++) {
 		u64 target = to;
 
-		se = get_seg_entry(sbi, GET_SEGNO(sbi, idx));
+		segno = GET_SEGNO(sbi, idx);
 		offset = OFFSET_IN_SEG(sbi, idx);
 
-		if (!f2fs_test_bit(offset, (const char *)se->cur_valid_map))
+		if (!f2fs_test_bit(offset,
+				(const char *)SE_VALID_MAP(sbi, segno)))
 			continue;
 
-		if (find_next_free_block(sbi, &target, left, se->type)) {
+		if (find_next_free_block(sbi, &target, left,
+						SE_TYPE(sbi, segno))) {
 			ASSERT_MSG("Not enough space to migrate blocks");
 			break;
 		}
@@ -125,8 +125,23 @@ static struct f2fs_dir_entry *find_in_block(void *block,
 	return find_target_dentry(name, len, namehash, max_slots, &d);
 }
 
+/* clear the slots of @dentry, the caller writes its block back */
+static void remove_dentry(struct f2fs_dentry_ptr *d,
+			struct f2fs_dir_entry *dentry)
+{
+	int bit_pos = dentry - d->dentry;
+	int slots = GET_DENTRY_SLOTS(le16_to_cpu(dentry->name_len));
+	int i;
+
+	for (i = 0; i < slots; i++) {
+		test_and_clear_bit_le(bit_pos + i, d->bitmap);
+		memset(d->filename[bit_pos + i], 0, F2FS_SLOT_LEN);
+	}
+	memset(dentry, 0, sizeof(struct f2fs_dir_entry));
+}
+
 static int find_in_level(struct f2fs_sb_info *sbi,struct f2fs_node *dir,
-		unsigned int level, struct dentry *de)
+		unsigned int level, struct dentry *de, int remove)
 {
 	unsigned int nbucket, nblock;
 	unsigned int bidx, end_block;
@@ -135,25 +150,42 @@ static int find_in_level(struct f2fs_sb_info *sbi,struct f2fs_node *dir,
 	void *dentry_blk;
 	int max_slots = 214;
 	nid_t ino = dir->footer.ino;
+	int dir_level = dir->i.i_dir_level;
 	f2fs_hash_t namehash;
 	int ret = 0;
 
 	namehash = f2fs_dentry_hash(de->name, de->len);
 
-	nbucket = dir_buckets(level);
+	/* all in the inode, which the caller writes back after a remove */
+	if (dir->i.i_inline & F2FS_INLINE_DENTRY) {
+		struct f2fs_dentry_ptr d;
+
+		make_dentry_ptr(&d, inline_data_addr(dir), 2);
+		dentry = find_target_dentry(de->name, de->len, namehash,
+								NULL, &d);
+		if (!dentry)
+			return 0;
+		de->ino = le32_to_cpu(dentry->ino);
+		if (remove)
+			remove_dentry(&d, dentry);
+		return 1;
+	}
+
+	nbucket = dir_buckets(level + dir_level);
 	nblock = bucket_blocks(level);
 
-	bidx = dir_block_index(level, 0, le32_to_cpu(namehash) % nbucket);
+	bidx = dir_block_index(level, dir_level,
+				le32_to_cpu(namehash) % nbucket);
 	end_block = bidx + nblock;
 
-	dentry_blk = calloc(BLOCK_SZ, 1);
+	dentry_blk = f2fs_blk_alloc();
 	ASSERT(dentry_blk);
 
 	for (; bidx < end_block; bidx++) {
 
 		/* Firstly, we should know direct node of target data blk */
 		if (dn.node_blk && dn.node_blk != dn.inode_blk)
-			free(dn.node_blk);
+			f2fs_blk_free(dn.node_blk);
 
 		set_new_dnode(&dn, dir, NULL, ino);
 		get_dnode_of_data(sbi, &dn, bidx, LOOKUP_NODE);
@@ -168,13 +200,23 @@ static int find_in_level(struct f2fs_sb_info *sbi,struct f2fs_node *dir,
 		if (dentry) {
 			ret = 1;
 			de->ino = le32_to_cpu(dentry->ino);
+			if (remove) {
+				struct f2fs_dentry_ptr d;
+
+				make_dentry_ptr(&d, dentry_blk, 1);
+				remove_dentry(&d, dentry);
+				ret = dev_write_block(dentry_blk,
+							dn.data_blkaddr);
+				ASSERT(ret >= 0);
+				ret = 1;
+			}
 			break;
 		}
 	}
 
 	if (dn.node_blk && dn.node_blk != dn.inode_blk)
-		free(dn.node_blk);
-	free(dentry_blk);
+		f2fs_blk_free(dn.node_blk);
+	f2fs_blk_free(dentry_blk);
 
 	return ret;
 }
@@ -186,8 +228,26 @@ static int f2fs_find_entry(struct f2fs_sb_info *sbi,
 	unsigned int level;
 
 	max_depth = dir->i.i_current_depth;
+	if (dir->i.i_inline & F2FS_INLINE_DENTRY)
+		max_depth = 1;
 	for (level = 0; level < max_depth; level ++) {
-		if (find_in_level(sbi, dir, level, de))
+		if (find_in_level(sbi, dir, level, de, 0))
+			return 1;
+	}
+	return 0;
+}
+
+static int f2fs_remove_entry(struct f2fs_sb_info *sbi,
+				struct f2fs_node *dir, struct dentry *de)
+{
+	unsigned int max_depth;
+	unsigned int level;
+
+	max_depth = dir->i.i_current_depth;
+	if (dir->i.i_inline & F2FS_INLINE_DENTRY)
+		max_depth = 1;
+	for (level = 0; level < max_depth; level++) {
+		if (find_in_level(sbi, dir, level, de, 1))
 			return 1;
 	}
 	return 0;
@@ -213,41 +273,81 @@ static void f2fs_update_dentry(nid_t ino, umode_t mode,
 		test_and_set_bit_le(bit_pos + i, d->bitmap);
 }
 
+/*
+ * Move the inline dentries of @dir at @blkaddr to its first dentry block,
+ * as the kernel does once they are full. That block is bucket 0 of level 0
+ * only with dir_level 0, which the directory is given.
+ */
+static void convert_inline_dir(struct f2fs_sb_info *sbi, struct f2fs_node *dir,
+							block_t blkaddr)
+{
+	struct f2fs_inline_dentry *inline_de = inline_data_addr(dir);
+	struct f2fs_dentry_block *dentry_blk;
+	struct dnode_of_data dn = {0};
+	int ret;
+
+	dentry_blk = f2fs_blk_alloc();
+	ASSERT(dentry_blk);
+
+	set_new_dnode(&dn, dir, NULL, le32_to_cpu(dir->footer.ino));
+	get_dnode_of_data(sbi, &dn, 0, ALLOC_NODE);
+	new_data_block(sbi, dentry_blk, &dn, CURSEG_HOT_DATA);
+
+	memcpy(dentry_blk->dentry_bitmap, inline_de->dentry_bitmap,
+					INLINE_DENTRY_BITMAP_SIZE);
+	memcpy(dentry_blk->dentry, inline_de->dentry,
+					sizeof(inline_de->dentry));
+	memcpy(dentry_blk->filename, inline_de->filename,
+					sizeof(inline_de->filename));
+	ret = dev_write_block(dentry_blk, dn.data_blkaddr);
+	ASSERT(ret >= 0);
+
+	memset(inline_de, 0, MAX_INLINE_DATA);
+	dir->i.i_inline &= ~F2FS_INLINE_DENTRY;
+	dir->i.i_dir_level = 0;
+	dir->i.i_current_depth = cpu_to_le32(1);
+	if (le64_to_cpu(dir->i.i_size) < F2FS_BLKSIZE)
+		dir->i.i_size = cpu_to_le64(F2FS_BLKSIZE);
+	ret = dev_write_block(dir, blkaddr);
+	ASSERT(ret >= 0);
+
+	f2fs_blk_free(dentry_blk);
+}
+
 /*
  * f2fs_add_link - Add a new file(dir) to parent dir.
  */
 static int f2fs_add_link(struct f2fs_sb_info *sbi, struct f2fs_node *parent,
-			struct f2fs_node *child, block_t p_blkaddr)
+			const unsigned char *name, int name_len, nid_t ino,
+			umode_t mode, block_t p_blkaddr)
 {
 	int level = 0, current_depth, bit_pos;
 	int nbucket, nblock, bidx, block;
-	const unsigned char *name = child->i.i_name;
-	int name_len = le32_to_cpu(child->i.i_namelen);
 	int slots = GET_DENTRY_SLOTS(name_len);
 	f2fs_hash_t dentry_hash = f2fs_dentry_hash(name, name_len);
 	struct f2fs_dentry_block *dentry_blk;
 	struct f2fs_dentry_ptr d;
 	struct dnode_of_data dn = {0};
 	nid_t pino = le32_to_cpu(parent->footer.ino);
-	nid_t ino = le32_to_cpu(child->footer.ino);
-	umode_t mode = le16_to_cpu(child->i.i_mode);
+	int dir_level;
 	int ret;
 
-	if (parent == NULL || child == NULL)
-		return -EINVAL;
-
 	if (!pino) {
 		ERR_MSG("Wrong parent ino:%d \n", pino);
 		return -EINVAL;
 	}
 
-	dentry_blk = calloc(BLOCK_SZ, 1);
+	if (parent->i.i_inline & F2FS_INLINE_DENTRY)
+		convert_inline_dir(sbi, parent, p_blkaddr);
+	dir_level = parent->i.i_dir_level;
+
+	dentry_blk = f2fs_blk_alloc();
 	ASSERT(dentry_blk);
 
 	current_depth = le32_to_cpu(parent->i.i_current_depth);
 start:
 	if (current_depth == MAX_DIR_HASH_DEPTH) {
-		free(dentry_blk);
+		f2fs_blk_free(dentry_blk);
 		ERR_MSG("\tError: MAX_DIR_HASH\n");
 		return -ENOSPC;
 	}
@@ -256,15 +356,16 @@ start:
 	if (level == current_depth)
 		++current_depth;
 
-	nbucket = dir_buckets(level);
+	nbucket = dir_buckets(level + dir_level);
 	nblock = bucket_blocks(level);
-	bidx = dir_block_index(level, 0, le32_to_cpu(dentry_hash) % nbucket);
+	bidx = dir_block_index(level, dir_level,
+				le32_to_cpu(dentry_hash) % nbucket);
 
 	for (block = bidx; block <= (bidx + nblock - 1); block++) {
 
 		/* Firstly, we should know the direct node of target data blk */
 		if (dn.node_blk && dn.node_blk != dn.inode_blk)
-			free(dn.node_blk);
+			f2fs_blk_free(dn.node_blk);
 
 		set_new_dnode(&dn, parent, NULL, pino);
 		get_dnode_of_data(sbi, &dn, block, ALLOC_NODE);
@@ -324,8 +425,8 @@ add_dentry:
 	}
 
 	if (dn.node_blk != dn.inode_blk)
-		free(dn.node_blk);
-	free(dentry_blk);
+		f2fs_blk_free(dn.node_blk);
+	f2fs_blk_free(dentry_blk);
 	return 0;
 }
 
@@ -341,7 +442,7 @@ static void make_empty_dir(struct f2fs_sb_info *sbi, struct f2fs_node *inode)
 
 	get_node_info(sbi, ino, &ni);
 
-	dent_blk = calloc(BLOCK_SZ, 1);
+	dent_blk = f2fs_blk_zalloc();
 	ASSERT(dent_blk);
 
 	dent_blk->dentry[0].hash_code = 0;
@@ -366,7 +467,7 @@ static void make_empty_dir(struct f2fs_sb_info *sbi, struct f2fs_node *inode)
 	ASSERT(ret >= 0);
 
 	inode->i.i_addr[0] = cpu_to_le32(blkaddr);
-	free(dent_blk);
+	f2fs_blk_free(dent_blk);
 }
 
 static void page_symlink(struct f2fs_sb_info *sbi, struct f2fs_node *inode,
@@ -389,7 +490,7 @@ static void page_symlink(struct f2fs_sb_info *sbi, struct f2fs_node *inode,
 		return;
 	}
 
-	data_blk = calloc(BLOCK_SZ, 1);
+	data_blk = f2fs_blk_zalloc();
 	ASSERT(data_blk);
 
 	memcpy(data_blk, symname, symlen);
@@ -401,38 +502,74 @@ static void page_symlink(struct f2fs_sb_info *sbi, struct f2fs_node *inode,
 	ASSERT(ret >= 0);
 
 	inode->i.i_addr[0] = cpu_to_le32(blkaddr);
-	free(data_blk);
+	f2fs_blk_free(data_blk);
+}
+
+/* the inode types sload creates */
+static int dentry_supported(struct dentry *de)
+{
+	return de->file_type == F2FS_FT_DIR ||
+		de->file_type == F2FS_FT_REG_FILE ||
+		de->file_type == F2FS_FT_SYMLINK;
+}
+
+static mode_t dentry_mode(struct dentry *de)
+{
+	if (de->file_type == F2FS_FT_DIR)
+		return de->mode | S_IFDIR;
+	if (de->file_type == F2FS_FT_REG_FILE)
+		return de->mode | S_IFREG;
+	ASSERT(de->file_type == F2FS_FT_SYMLINK);
+	return de->mode | S_IFLNK;
+}
+
+/* the cold file extensions given to mkfs.f2fs, matched as the kernel does */
+static int is_cold_file(struct f2fs_sb_info *sbi, struct dentry *de)
+{
+	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
+	const char *name = (const char *)de->name;
+	int i, count = get_sb(extension_count);
+
+	if (count > F2FS_MAX_EXTENSION)
+		count = F2FS_MAX_EXTENSION;
+
+	for (i = 0; i < count; i++) {
+		const char *ext = (const char *)sb->extension_list[i];
+		int len = strnlen(ext, sizeof(sb->extension_list[i]));
+
+		if (len && de->len > len + 1 && name[de->len - len - 1] == '.' &&
+				!strncasecmp(name + de->len - len, ext, len))
+			return 1;
+	}
+	return 0;
 }
 
 static void init_inode_block(struct f2fs_sb_info *sbi,
 		struct f2fs_node *node_blk, struct dentry *de)
 {
 	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
-	mode_t mode = de->mode;
+	mode_t mode = dentry_mode(de);
 	int links = 1;
 	unsigned int size;
 	int blocks = 1;
 
 	if (de->file_type == F2FS_FT_DIR) {
-		mode |= S_IFDIR;
 		size = 4096;
 		links++;
 		blocks++;
 	} else if (de->file_type == F2FS_FT_REG_FILE) {
-		mode |= S_IFREG;
 		size = 0;
-	} else if (de->file_type == F2FS_FT_SYMLINK) {
+	} else {
 		ASSERT(de->link);
-		mode |= S_IFLNK;
 		size = strlen(de->link);
 		if (size + 1 > MAX_INLINE_DATA)
 			blocks++;
-	} else {
-		ASSERT(0);
 	}
 
 	node_blk->i.i_mode = cpu_to_le16(mode);
 	node_blk->i.i_advise = 0;
+	if (de->file_type == F2FS_FT_REG_FILE && is_cold_file(sbi, de))
+		node_blk->i.i_advise |= FADVISE_COLD_BIT;
 	node_blk->i.i_uid = cpu_to_le32(de->uid);
 	node_blk->i.i_gid = cpu_to_le32(de->gid);
 	node_blk->i.i_links = cpu_to_le32(links);
@@ -463,16 +600,44 @@ static void init_inode_block(struct f2fs_sb_info *sbi,
 		make_empty_dir(sbi, node_blk);
 	else if (S_ISLNK(mode))
 		page_symlink(sbi, node_blk, de->link, size);
+
+	inode_init_xattrs(sbi, node_blk, de);
 }
 
-int f2fs_create(struct f2fs_sb_info *sbi, struct dentry *de)
+/* write the inode of @de, which is linked into no directory yet */
+void f2fs_make_inode(struct f2fs_sb_info *sbi, struct dentry *de)
 {
-	struct f2fs_node *parent, *child;
-	struct node_info ni;
+	struct f2fs_node *child;
 	struct f2fs_summary sum;
+	struct node_info ni;
 	block_t blkaddr;
 	int ret;
 
+	child = f2fs_blk_zalloc();
+	ASSERT(child);
+
+	f2fs_alloc_nid(sbi, &de->ino, 1);
+	get_node_info(sbi, de->ino, &ni);
+
+	init_inode_block(sbi, child, de);
+
+	set_summary(&sum, de->ino, 0, ni.version);
+	reserve_new_block(sbi, &blkaddr, &sum, CURSEG_HOT_NODE);
+
+	/* update nat info */
+	update_nat_blkaddr(sbi, de->ino, de->ino, blkaddr);
+
+	ret = dev_write_block(child, blkaddr);
+	ASSERT(ret >= 0);
+	f2fs_blk_free(child);
+}
+
+int f2fs_create(struct f2fs_sb_info *sbi, struct dentry *de)
+{
+	struct f2fs_node *parent;
+	struct node_info ni;
+	int ret;
+
 	/* Find if there is a */
 	get_node_info(sbi, de->pino, &ni);
 	if (ni.blk_addr == NULL_ADDR) {
@@ -480,7 +645,7 @@ int f2fs_create(struct f2fs_sb_info *sbi, struct dentry *de)
 		return -1;
 	}
 
-	parent = calloc(BLOCK_SZ, 1);
+	parent = f2fs_blk_alloc();
 	ASSERT(parent);
 
 	ret = dev_read_block(parent, ni.blk_addr);
@@ -495,38 +660,22 @@ int f2fs_create(struct f2fs_sb_info *sbi, struct dentry *de)
 		goto free_parent_dir;
 	}
 
-	child = calloc(BLOCK_SZ, 1);
-	ASSERT(child);
-
-	f2fs_alloc_nid(sbi, &de->ino, 1);
-
-	init_inode_block(sbi, child, de);
+	f2fs_make_inode(sbi, de);
 
-	ret = f2fs_add_link(sbi, parent, child, ni.blk_addr);
+	ret = f2fs_add_link(sbi, parent, de->name, de->len, de->ino,
+					dentry_mode(de), ni.blk_addr);
 	if (ret) {
 		MSG(0, "Skip the existing \"%s\" pino=%x ERR=%d\n",
 					de->name, de->pino, ret);
-		goto free_child_dir;
+		goto free_parent_dir;
 	}
 
-	/* write child */
-	set_summary(&sum, de->ino, 0, ni.version);
-	reserve_new_block(sbi, &blkaddr, &sum, CURSEG_HOT_NODE);
-
-	/* update nat info */
-	update_nat_blkaddr(sbi, de->ino, de->ino, blkaddr);
-
-	ret = dev_write_block(child, blkaddr);
-	ASSERT(ret >= 0);
-
 	update_free_segments(sbi);
 	MSG(1, "Info: Create \"%s\" type=%x, ino=%x / %x into \"%s\"\n",
 			de->full_path, de->file_type,
 			de->ino, de->pino, de->path);
-free_child_dir:
-	free(child);
 free_parent_dir:
-	free(parent);
+	f2fs_blk_free(parent);
 	return 0;
 }
 
@@ -540,6 +689,443 @@ int f2fs_symlink(struct f2fs_sb_info *sbi, struct dentry *de)
 	return f2fs_create(sbi, de);
 }
 
+/*
+ * f2fs_build_dentries() lays out a whole new directory in memory, with
+ * the dentry blocks indexed by their offset in the directory.
+ */
+struct dir_builder {
+	int dir_level;
+	unsigned int depth;
+	unsigned int nr_blks;
+	struct f2fs_dentry_block **blks;
+};
+
+static struct f2fs_dentry_block *dir_builder_block(struct dir_builder *b,
+							unsigned int bidx)
+{
+	if (bidx >= b->nr_blks) {
+		unsigned int nr = b->nr_blks ? b->nr_blks : 16;
+
+		while (nr <= bidx)
+			nr *= 2;
+		b->blks = realloc(b->blks, nr * sizeof(void *));
+		ASSERT(b->blks);
+		memset(b->blks + b->nr_blks, 0,
+				(nr - b->nr_blks) * sizeof(void *));
+		b->nr_blks = nr;
+	}
+	if (!b->blks[bidx]) {
+		b->blks[bidx] = f2fs_blk_zalloc();
+		ASSERT(b->blks[bidx]);
+	}
+	return b->blks[bidx];
+}
+
+/* the same placement f2fs_add_link() does, on blocks held in memory */
+static int dir_builder_add(struct dir_builder *b, const unsigned char *name,
+				int name_len, nid_t ino, umode_t mode)
+{
+	int slots = GET_DENTRY_SLOTS(name_len);
+	f2fs_hash_t dentry_hash = f2fs_dentry_hash(name, name_len);
+	struct f2fs_dentry_block *dentry_blk;
+	struct f2fs_dentry_ptr d;
+	unsigned int level, nbucket, bidx, block;
+	int bit_pos;
+
+	for (level = 0; level < MAX_DIR_HASH_DEPTH; level++) {
+		nbucket = dir_buckets(level + b->dir_level);
+		bidx = dir_block_index(level, b->dir_level,
+					le32_to_cpu(dentry_hash) % nbucket);
+
+		for (block = bidx; block < bidx + bucket_blocks(level);
+								block++) {
+			dentry_blk = dir_builder_block(b, block);
+			bit_pos = room_for_filename(dentry_blk->dentry_bitmap,
+					slots, NR_DENTRY_IN_BLOCK);
+			if (bit_pos < NR_DENTRY_IN_BLOCK)
+				goto add_dentry;
+		}
+	}
+	ERR_MSG("\tError: MAX_DIR_HASH\n");
+	return -ENOSPC;
+
+add_dentry:
+	make_dentry_ptr(&d, (void *)dentry_blk, 1);
+	f2fs_update_dentry(ino, mode, &d, name, name_len, dentry_hash, bit_pos);
+	if (level + 1 > b->depth)
+		b->depth = level + 1;
+	return 0;
+}
+
+/*
+ * Pick the smallest dir_level whose first hash level has room for twice
+ * the slots of all the entries, so most lookups read a single bucket.
+ */
+static int dir_builder_level(struct dentry *de, int entries)
+{
+	unsigned long slots = 2;	/* "." and ".." */
+	int dir_level = 0;
+	int i;
+
+	for (i = 0; i < entries; i++)
+		slots += GET_DENTRY_SLOTS(de[i].len);
+
+	while (dir_level < MAX_DIR_HASH_DEPTH / 2 &&
+			(unsigned long)dir_buckets(dir_level) * bucket_blocks(0) *
+					NR_DENTRY_IN_BLOCK < 2 * slots)
+		dir_level++;
+	return dir_level;
+}
+
+/* a directory holding nothing but the block made by make_empty_dir() */
+static int dir_is_new(struct f2fs_node *dir, struct f2fs_dentry_block *blk)
+{
+	int i;
+
+	if (dir->i.i_inline & F2FS_INLINE_DENTRY ||
+			le32_to_cpu(dir->i.i_current_depth) != 1 ||
+			dir->i.i_dir_level ||
+			le64_to_cpu(dir->i.i_size) != F2FS_BLKSIZE)
+		return 0;
+
+	for (i = 0; i < SIZE_OF_DENTRY_BITMAP; i++)
+		if (blk->dentry_bitmap[i] != (i ? 0 : 0x3))
+			return 0;
+	return 1;
+}
+
+/*
+ * Write the inodes of the new children in runs of contiguous node blocks,
+ * placing their dentries in @b as they are made.
+ */
+static void dir_builder_create(struct f2fs_sb_info *sbi, struct dir_builder *b,
+		struct f2fs_node *parent, struct node_info *pni,
+		struct dentry *de, int entries)
+{
+	struct f2fs_summary sums[SLOAD_RUN_BLKS];
+	char *buf;
+	int i = 0, ret;
+
+	buf = malloc(SLOAD_RUN_BLKS * F2FS_BLKSIZE);
+	ASSERT(buf);
+
+	while (i < entries) {
+		unsigned int nr = 0, n, k;
+		block_t blkaddr;
+
+		for (k = i; k < entries && nr < SLOAD_RUN_BLKS; k++)
+			if (dentry_supported(de + k) && !de[k].ino)
+				nr++;
+		if (!nr)
+			break;
+
+		nr = reserve_new_blocks(sbi, &blkaddr, nr, CURSEG_HOT_NODE);
+		memset(buf, 0, nr * F2FS_BLKSIZE);
+
+		for (n = 0; n < nr; i++) {
+			struct f2fs_node *child;
+
+			if (!dentry_supported(de + i) || de[i].ino)
+				continue;
+
+			child = (struct f2fs_node *)(buf + n * F2FS_BLKSIZE);
+			f2fs_alloc_nid(sbi, &de[i].ino, 1);
+			init_inode_block(sbi, child, de + i);
+
+			ret = dir_builder_add(b, de[i].name, de[i].len,
+					de[i].ino, dentry_mode(de + i));
+			ASSERT(ret == 0);
+			if (de[i].file_type == F2FS_FT_DIR) {
+				u32 links = le32_to_cpu(parent->i.i_links);
+
+				parent->i.i_links = cpu_to_le32(links + 1);
+			}
+
+			set_summary(&sums[n], de[i].ino, 0, pni->version);
+			update_nat_blkaddr(sbi, de[i].ino, de[i].ino,
+							blkaddr + n);
+			n++;
+
+			MSG(1, "Info: Create \"%s\" type=%x, ino=%x / %x "
+					"into \"%s\"\n", de[i].full_path,
+					de[i].file_type, de[i].ino, de[i].pino,
+					de[i].path);
+		}
+
+		ret = dev_write(buf, (u64)blkaddr * F2FS_BLKSIZE,
+						nr * F2FS_BLKSIZE);
+		ASSERT(ret >= 0);
+		update_sum_entries(sbi, blkaddr, sums, nr);
+	}
+	free(buf);
+}
+
+/*
+ * Give every dentry block but the first, which keeps its address, a new
+ * one. The blocks under each direct node are allocated in contiguous runs
+ * and written with one request per run.
+ */
+static void dir_builder_write(struct f2fs_sb_info *sbi, struct dir_builder *b,
+			struct f2fs_node *parent, nid_t pino, block_t blk0)
+{
+	struct f2fs_summary sums[SLOAD_RUN_BLKS];
+	struct dnode_of_data dn = {0};
+	unsigned int bidx = 1, dn_start = 0, dn_end = 0, last = 0;
+	struct node_info ni;
+	char *buf;
+	int ret;
+
+	ret = dev_write_block(b->blks[0], blk0);
+	ASSERT(ret >= 0);
+
+	buf = malloc(SLOAD_RUN_BLKS * F2FS_BLKSIZE);
+	ASSERT(buf);
+
+	while (1) {
+		unsigned int i, nr = 0;
+		block_t blkaddr;
+
+		while (bidx < b->nr_blks && !b->blks[bidx])
+			bidx++;
+		if (bidx >= b->nr_blks)
+			break;
+
+		if (!dn.node_blk || bidx >= dn_end) {
+			if (dn.ndirty) {
+				ret = dev_write_block(dn.node_blk,
+							dn.node_blkaddr);
+				ASSERT(ret >= 0);
+			}
+			if (dn.node_blk && dn.node_blk != dn.inode_blk)
+				f2fs_blk_free(dn.node_blk);
+
+			set_new_dnode(&dn, parent, NULL, pino);
+			get_dnode_of_data(sbi, &dn, bidx, ALLOC_NODE);
+			get_node_info(sbi, dn.nid, &ni);
+			dn_start = bidx - dn.ofs_in_node;
+			dn_end = dn_start + ADDRS_PER_PAGE(dn.node_blk);
+		}
+
+		for (i = bidx; i < dn_end && i < b->nr_blks &&
+						nr < SLOAD_RUN_BLKS; i++)
+			if (b->blks[i])
+				nr++;
+		nr = reserve_new_blocks(sbi, &blkaddr, nr, CURSEG_HOT_DATA);
+
+		for (i = 0; i < nr; bidx++) {
+			if (!b->blks[bidx])
+				continue;
+			memcpy(buf + i * F2FS_BLKSIZE, b->blks[bidx],
+							F2FS_BLKSIZE);
+			dn.ofs_in_node = bidx - dn_start;
+			dn.data_blkaddr = blkaddr + i;
+			set_data_blkaddr(&dn);
+			inc_inode_blocks(&dn);
+			set_summary(&sums[i], dn.nid, dn.ofs_in_node,
+							ni.version);
+			last = bidx;
+			i++;
+		}
+
+		ret = dev_write(buf, (u64)blkaddr * F2FS_BLKSIZE,
+						nr * F2FS_BLKSIZE);
+		ASSERT(ret >= 0);
+		update_sum_entries(sbi, blkaddr, sums, nr);
+	}
+
+	if (dn.ndirty) {
+		ret = dev_write_block(dn.node_blk, dn.node_blkaddr);
+		ASSERT(ret >= 0);
+	}
+	if (dn.node_blk && dn.node_blk != dn.inode_blk)
+		f2fs_blk_free(dn.node_blk);
+
+	parent->i.i_size = cpu_to_le64((u64)(last + 1) * F2FS_BLKSIZE);
+	free(buf);
+}
+
+/* place children whose inodes were written by f2fs_make_inode() */
+static void dir_builder_link(struct dir_builder *b, struct f2fs_node *parent,
+					struct dentry *de, int entries)
+{
+	int i, ret;
+
+	for (i = 0; i < entries; i++) {
+		if (!de[i].ino)
+			continue;
+
+		ret = dir_builder_add(b, de[i].name, de[i].len, de[i].ino,
+							dentry_mode(de + i));
+		ASSERT(ret == 0);
+		if (de[i].file_type == F2FS_FT_DIR) {
+			u32 links = le32_to_cpu(parent->i.i_links);
+
+			parent->i.i_links = cpu_to_le32(links + 1);
+		}
+	}
+}
+
+/* add one child to a directory which already has entries */
+static void dir_link_one(struct f2fs_sb_info *sbi, struct f2fs_node *parent,
+			block_t p_blkaddr, struct dentry *de, int make_inode)
+{
+	int ret;
+
+	if (make_inode && !de->ino) {
+		f2fs_create(sbi, de);
+		return;
+	}
+	if (!de->ino)
+		return;
+
+	if (f2fs_find_entry(sbi, parent, de)) {
+		MSG(0, "Skip the existing \"%s\" pino=%x\n",
+					de->name, de->pino);
+		if (de->file_type == F2FS_FT_REG_FILE)
+			de->ino = 0;
+		return;
+	}
+	ret = f2fs_add_link(sbi, parent, de->name, de->len, de->ino,
+						dentry_mode(de), p_blkaddr);
+	if (ret)
+		MSG(0, "Skip \"%s\" pino=%x ERR=%d\n",
+					de->name, de->pino, ret);
+}
+
+/*
+ * A directory with no entries yet is laid out in memory from the whole
+ * list and each of its blocks is written once; otherwise the entries are
+ * added one by one.
+ */
+static int dir_build(struct f2fs_sb_info *sbi, nid_t pino, struct dentry *de,
+					int entries, int make_inodes)
+{
+	struct dir_builder b = {0};
+	struct f2fs_node *parent;
+	struct node_info ni;
+	block_t blk0;
+	unsigned int i;
+	int ret;
+
+	get_node_info(sbi, pino, &ni);
+	if (ni.blk_addr == NULL_ADDR) {
+		MSG(0, "No parent directory pino=%x\n", pino);
+		return -1;
+	}
+
+	parent = f2fs_blk_alloc();
+	ASSERT(parent);
+	ret = dev_read_block(parent, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	blk0 = le32_to_cpu(parent->i.i_addr[0]);
+	b.dir_level = dir_builder_level(de, entries);
+	dir_builder_block(&b, 0);
+	if (!(parent->i.i_inline & F2FS_INLINE_DENTRY) &&
+			IS_VALID_BLK_ADDR(sbi, blk0)) {
+		ret = dev_read_block(b.blks[0], blk0);
+		ASSERT(ret >= 0);
+	}
+
+	if (!entries || !dir_is_new(parent, b.blks[0])) {
+		for (i = 0; i < entries; i++)
+			if (dentry_supported(de + i))
+				dir_link_one(sbi, parent, ni.blk_addr, de + i,
+								make_inodes);
+		goto out;
+	}
+
+	dir_builder_link(&b, parent, de, entries);
+	if (make_inodes)
+		dir_builder_create(sbi, &b, parent, &ni, de, entries);
+	dir_builder_write(sbi, &b, parent, pino, blk0);
+
+	parent->i.i_current_depth = cpu_to_le32(b.depth);
+	parent->i.i_dir_level = b.dir_level;
+	ret = dev_write_block(parent, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	update_free_segments(sbi);
+out:
+	for (i = 0; i < b.nr_blks; i++)
+		f2fs_blk_free(b.blks[i]);
+	free(b.blks);
+	f2fs_blk_free(parent);
+	return 0;
+}
+
+/*
+ * Create the children @de of the directory @pino. Entries which have an
+ * ino already are further names of that inode and are only linked.
+ */
+int f2fs_build_dentries(struct f2fs_sb_info *sbi, nid_t pino,
+					struct dentry *de, int entries)
+{
+	return dir_build(sbi, pino, de, entries, 1);
+}
+
+/* link the children @de, made by f2fs_make_inode(), into @pino */
+int f2fs_link_dentries(struct f2fs_sb_info *sbi, nid_t pino,
+					struct dentry *de, int entries)
+{
+	return dir_build(sbi, pino, de, entries, 0);
+}
+
+void f2fs_inc_links(struct f2fs_sb_info *sbi, nid_t ino, int nr)
+{
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	int ret;
+
+	get_node_info(sbi, ino, &ni);
+	node_blk = f2fs_blk_alloc();
+	ASSERT(node_blk);
+	ret = dev_read_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	node_blk->i.i_links = cpu_to_le32(le32_to_cpu(node_blk->i.i_links) + nr);
+
+	ret = dev_write_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+	f2fs_blk_free(node_blk);
+}
+
+/* look @de->name up in the directory @pino, and fill in its ino and type */
+int f2fs_lookup(struct f2fs_sb_info *sbi, nid_t pino, struct dentry *de)
+{
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	int found, ret;
+
+	node_blk = f2fs_blk_alloc();
+	ASSERT(node_blk);
+
+	get_node_info(sbi, pino, &ni);
+	ret = dev_read_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	found = f2fs_find_entry(sbi, node_blk, de);
+	if (found) {
+		umode_t mode;
+
+		get_node_info(sbi, de->ino, &ni);
+		ret = dev_read_block(node_blk, ni.blk_addr);
+		ASSERT(ret >= 0);
+
+		mode = le16_to_cpu(node_blk->i.i_mode);
+		if (S_ISDIR(mode))
+			de->file_type = F2FS_FT_DIR;
+		else if (S_ISREG(mode))
+			de->file_type = F2FS_FT_REG_FILE;
+		else if (S_ISLNK(mode))
+			de->file_type = F2FS_FT_SYMLINK;
+		else
+			de->file_type = F2FS_FT_UNKNOWN;
+	}
+	f2fs_blk_free(node_blk);
+	return found;
+}
+
 int f2fs_find_path(struct f2fs_sb_info *sbi, char *path, nid_t *ino)
 {
 	struct f2fs_node *parent;
@@ -553,7 +1139,7 @@ int f2fs_find_path(struct f2fs_sb_info *sbi, char *path, nid_t *ino)
 		return -ENOENT;
 
 	*ino = F2FS_ROOT_INO(sbi);
-	parent = calloc(BLOCK_SZ, 1);
+	parent = f2fs_blk_alloc();
 	ASSERT(parent);
 
 	p = strtok(path, "/");
@@ -579,6 +1165,193 @@ int f2fs_find_path(struct f2fs_sb_info *sbi, char *path, nid_t *ino)
 		p = strtok(NULL, "/");
 	}
 err:
-	free(parent);
+	f2fs_blk_free(parent);
 	return err;
 }
+
+struct dir_list {
+	nid_t pino;
+	struct dentry *de;
+	int nr, max;
+};
+
+static void dir_list_add(struct dir_list *list, struct f2fs_dentry_ptr *d)
+{
+	unsigned long bit_pos = 0;
+
+	while (bit_pos < d->max) {
+		struct f2fs_dir_entry *dentry = &d->dentry[bit_pos];
+		const char *name = (const char *)d->filename[bit_pos];
+		int len = le16_to_cpu(dentry->name_len);
+		struct dentry *de;
+
+		if (!test_bit_le(bit_pos, d->bitmap) || !len) {
+			bit_pos++;
+			continue;
+		}
+		bit_pos += GET_DENTRY_SLOTS(len);
+
+		if ((len == 1 && name[0] == '.') ||
+				(len == 2 && !memcmp(name, "..", 2)))
+			continue;
+
+		if (list->nr == list->max) {
+			list->max = list->max ? list->max * 2 : 64;
+			list->de = realloc(list->de,
+					list->max * sizeof(struct dentry));
+			ASSERT(list->de);
+		}
+		de = &list->de[list->nr++];
+		memset(de, 0, sizeof(struct dentry));
+		de->name = (u8 *)strndup(name, len);
+		ASSERT(de->name);
+		de->len = len;
+		de->ino = le32_to_cpu(dentry->ino);
+		de->file_type = dentry->file_type;
+		de->pino = list->pino;
+	}
+}
+
+static int dir_list_block(struct node_walk *walk,
+		struct node_walk_level *level, u16 ofs, block_t blkaddr)
+{
+	struct f2fs_dentry_block *blk;
+	struct f2fs_dentry_ptr d;
+	int ret;
+
+	if (blkaddr == NULL_ADDR || blkaddr == NEW_ADDR ||
+			!IS_VALID_BLK_ADDR(walk->sbi, blkaddr))
+		return 0;
+
+	blk = f2fs_blk_alloc();
+	ASSERT(blk);
+	ret = dev_read_block(blk, blkaddr);
+	ASSERT(ret >= 0);
+
+	make_dentry_ptr(&d, blk, 1);
+	dir_list_add(walk->private, &d);
+	f2fs_blk_free(blk);
+	return 0;
+}
+
+static const struct node_walk_ops dir_list_ops = {
+	.node = node_walk_read_node,
+	.data = dir_list_block,
+};
+
+/*
+ * The entries of the directory @ino but "." and "..", with their names,
+ * inos and types. Free them with f2fs_free_dentries().
+ */
+struct dentry *f2fs_read_dentries(struct f2fs_sb_info *sbi, nid_t ino,
+								int *nr)
+{
+	struct dir_list list = { .pino = ino };
+	struct f2fs_node *node_blk;
+	struct node_walk walk;
+	struct node_info ni;
+	int ret;
+
+	node_blk = f2fs_blk_alloc();
+	ASSERT(node_blk);
+	get_node_info(sbi, ino, &ni);
+	ret = dev_read_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	if (node_blk->i.i_inline & F2FS_INLINE_DENTRY) {
+		struct f2fs_dentry_ptr d;
+
+		make_dentry_ptr(&d, inline_data_addr(node_blk), 2);
+		dir_list_add(&list, &d);
+	} else {
+		node_walk_init(&walk, sbi, &dir_list_ops, &list);
+		node_walk(&walk, &ni, node_blk);
+	}
+
+	f2fs_blk_free(node_blk);
+	*nr = list.nr;
+	return list.de;
+}
+
+void f2fs_free_dentries(struct dentry *de, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		free((void *)de[i].name);
+	free(de);
+}
+
+/* drop a link to @ino, freeing it with its last one */
+static int dir_drop_link(struct f2fs_sb_info *sbi, nid_t ino)
+{
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	int dir, ret;
+
+	node_blk = f2fs_blk_alloc();
+	ASSERT(node_blk);
+	get_node_info(sbi, ino, &ni);
+	ret = dev_read_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	dir = S_ISDIR(le16_to_cpu(node_blk->i.i_mode));
+	if (dir) {
+		struct dentry *de;
+		int i, nr;
+
+		de = f2fs_read_dentries(sbi, ino, &nr);
+		for (i = 0; i < nr; i++)
+			dir_drop_link(sbi, de[i].ino);
+		f2fs_free_dentries(de, nr);
+		f2fs_free_inode(sbi, node_blk);
+	} else if (le32_to_cpu(node_blk->i.i_links) > 1) {
+		node_blk->i.i_links =
+			cpu_to_le32(le32_to_cpu(node_blk->i.i_links) - 1);
+		ret = dev_write_block(node_blk, ni.blk_addr);
+		ASSERT(ret >= 0);
+	} else {
+		f2fs_free_inode(sbi, node_blk);
+	}
+	f2fs_blk_free(node_blk);
+	return dir;
+}
+
+/*
+ * Remove the entry @de->name from the directory @pino. The inode it named
+ * loses a link and is freed with its last one; a directory is freed along
+ * with everything below it.
+ */
+int f2fs_unlink(struct f2fs_sb_info *sbi, nid_t pino, struct dentry *de)
+{
+	struct f2fs_node *parent;
+	struct node_info ni;
+	int dirty, ret;
+
+	parent = f2fs_blk_alloc();
+	ASSERT(parent);
+	get_node_info(sbi, pino, &ni);
+	ret = dev_read_block(parent, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	/* inline dentries are removed from the inode itself */
+	dirty = parent->i.i_inline & F2FS_INLINE_DENTRY;
+	if (!f2fs_remove_entry(sbi, parent, de)) {
+		f2fs_blk_free(parent);
+		return -ENOENT;
+	}
+
+	if (dir_drop_link(sbi, de->ino)) {
+		parent->i.i_links =
+			cpu_to_le32(le32_to_cpu(parent->i.i_links) - 1);
+		dirty = 1;
+	}
+	if (dirty) {
+		ret = dev_write_block(parent, ni.blk_addr);
+		ASSERT(ret >= 0);
+	}
+	MSG(1, "Info: Remove \"%.*s\" ino=%x / %x\n",
+				de->len, de->name, de->ino, pino);
+	f2fs_blk_free(parent);
+	return 0;
+}
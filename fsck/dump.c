@@ -37,8 +37,8 @@ void nat_dump(struct f2fs_sb_info *sbi, int start_nat, int end_nat)
 	int fd, ret, pack = 1;
 	unsigned int i;
 
-	nat_block = (struct f2fs_nat_block *)calloc(BLOCK_SZ, 1);
-	node_block = (struct f2fs_node *)calloc(BLOCK_SZ, 1);
+	nat_block = f2fs_blk_alloc();
+	node_block = f2fs_blk_alloc();
 	ASSERT(nat_block);
 
 	nr_nat_blks = get_sb(segment_count_nat) <<
@@ -104,17 +104,16 @@ void nat_dump(struct f2fs_sb_info *sbi, int start_nat, int end_nat)
 		}
 	}
 
-	free(nat_block);
-	free(node_block);
+	f2fs_blk_free(nat_block);
+	f2fs_blk_free(node_block);
 
 	close(fd);
 }
 
 void sit_dump(struct f2fs_sb_info *sbi, int start_sit, int end_sit)
 {
-	struct seg_entry *se;
 	struct sit_info *sit_i = SIT_I(sbi);
-	unsigned int segno;
+	unsigned int segno, vblocks;
 	char buf[BUF_SZ];
 	u32 free_segs = 0;;
 	u64 valid_blocks = 0;
@@ -131,25 +130,25 @@ void sit_dump(struct f2fs_sb_info *sbi, int start_sit, int end_sit)
 	ASSERT(ret >= 0);
 
 	for (segno = start_sit; segno < end_sit; segno++) {
-		se = get_seg_entry(sbi, segno);
+		vblocks = SE_VALID_BLOCKS(sbi, segno);
 		offset = SIT_BLOCK_OFFSET(sit_i, segno);
 		i = f2fs_test_bit(offset, sit_i->sit_bitmap)?2:1;
 		memset(buf, 0, BUF_SZ);
 		snprintf(buf, BUF_SZ, "\nsegno:%8u\tvblocks:%3u\tseg_type:%d\tsit_pack:%d\n\n",
-							segno, se->valid_blocks, se->type, i);
+					segno, vblocks, SE_TYPE(sbi, segno), i);
 
 		ret = write(fd, buf, strlen(buf));
 		ASSERT(ret >= 0);
 
-		if (se->valid_blocks == 0x0) {
+		if (vblocks == 0x0) {
 			free_segs++;
 		} else {
-			ASSERT(se->valid_blocks <= 512);
-			valid_blocks += se->valid_blocks;
+			ASSERT(vblocks <= 512);
+			valid_blocks += vblocks;
 
 			for (i = 0; i < 64; i++) {
 				memset(buf, 0, BUF_SZ);
-				snprintf(buf, BUF_SZ, "  %02x", *(se->cur_valid_map + i));
+				snprintf(buf, BUF_SZ, "  %02x", *(SE_VALID_MAP(sbi, segno) + i));
 				ret = write(fd, buf, strlen(buf));
 				ASSERT(ret >= 0);
 				if((i+1) % 16 == 0) {
@@ -246,92 +245,38 @@ static void dump_data_blk(__u64 offset, u32 blkaddr)
 	dev_write_dump(buf, offset, F2FS_BLKSIZE);
 }
 
-static void dump_node_blk(struct f2fs_sb_info *sbi, int ntype,
-						u32 nid, u64 *ofs)
+static int dump_walk_data(struct node_walk *walk,
+		struct node_walk_level *level, u16 ofs_in_node,
+		block_t blkaddr)
 {
-	struct node_info ni;
-	struct f2fs_node *node_blk;
-	u32 skip = 0;
-	u32 i, idx;
-
-	switch (ntype) {
-	case TYPE_DIRECT_NODE:
-		skip = idx = ADDRS_PER_BLOCK;
-		break;
-	case TYPE_INDIRECT_NODE:
-		idx = NIDS_PER_BLOCK;
-		skip = idx * ADDRS_PER_BLOCK;
-		break;
-	case TYPE_DOUBLE_INDIRECT_NODE:
-		skip = 0;
-		idx = NIDS_PER_BLOCK;
-		break;
-	}
-
-	if (nid == 0) {
-		*ofs += skip;
-		return;
-	}
-
-	get_node_info(sbi, nid, &ni);
-
-	node_blk = calloc(BLOCK_SZ, 1);
-	dev_read_block(node_blk, ni.blk_addr);
-
-	for (i = 0; i < idx; i++, (*ofs)++) {
-		switch (ntype) {
-		case TYPE_DIRECT_NODE:
-			dump_data_blk(*ofs * F2FS_BLKSIZE,
-					le32_to_cpu(node_blk->dn.addr[i]));
-			break;
-		case TYPE_INDIRECT_NODE:
-			dump_node_blk(sbi, TYPE_DIRECT_NODE,
-					le32_to_cpu(node_blk->in.nid[i]), ofs);
-			break;
-		case TYPE_DOUBLE_INDIRECT_NODE:
-			dump_node_blk(sbi, TYPE_INDIRECT_NODE,
-					le32_to_cpu(node_blk->in.nid[i]), ofs);
-			break;
-		}
-	}
-	free(node_blk);
+	dump_data_blk((__u64)walk->pgofs * F2FS_BLKSIZE, blkaddr);
+	return 0;
 }
 
-static void dump_inode_blk(struct f2fs_sb_info *sbi, u32 nid,
+static const struct node_walk_ops dump_walk_ops = {
+	.node = node_walk_read_node,
+	.data = dump_walk_data,
+};
+
+static void dump_inode_blk(struct f2fs_sb_info *sbi, struct node_info *ni,
 					struct f2fs_node *node_blk)
 {
-	u32 i = 0;
-	u64 ofs = 0;
+	struct node_walk walk;
 
 	/* TODO: need to dump xattr */
 
 	if((node_blk->i.i_inline & F2FS_INLINE_DATA)){
-		DBG(3, "ino[0x%x] has inline data!\n", nid);
+		DBG(3, "ino[0x%x] has inline data!\n", ni->nid);
 		/* recover from inline data */
 		dev_write_dump(((unsigned char *)node_blk) + INLINE_DATA_OFFSET,
 							0, MAX_INLINE_DATA);
 		return;
 	}
 
-	/* check data blocks in inode */
-	for (i = 0; i < ADDRS_PER_INODE(&node_blk->i); i++, ofs++)
-		dump_data_blk(ofs * F2FS_BLKSIZE,
-				le32_to_cpu(node_blk->i.i_addr[i]));
-
-	/* check node blocks in inode */
-	for (i = 0; i < 5; i++) {
-		if (i == 0 || i == 1)
-			dump_node_blk(sbi, TYPE_DIRECT_NODE,
-					node_blk->i.i_nid[i], &ofs);
-		else if (i == 2 || i == 3)
-			dump_node_blk(sbi, TYPE_INDIRECT_NODE,
-					node_blk->i.i_nid[i], &ofs);
-		else if (i == 4)
-			dump_node_blk(sbi, TYPE_DOUBLE_INDIRECT_NODE,
-					node_blk->i.i_nid[i], &ofs);
-		else
-			ASSERT(0);
-	}
+	/* dump data blocks in inode and its node blocks */
+	node_walk_init(&walk, sbi, &dump_walk_ops, NULL);
+	walk.prefetch_data = 1;
+	node_walk(&walk, ni, node_blk);
 }
 
 void dump_file(struct f2fs_sb_info *sbi, struct node_info *ni,
@@ -367,7 +312,7 @@ void dump_file(struct f2fs_sb_info *sbi, struct node_info *ni,
 		ASSERT(config.dump_fd >= 0);
 
 		/* dump file's data */
-		dump_inode_blk(sbi, ni->ino, node_blk);
+		dump_inode_blk(sbi, ni, node_blk);
 
 		/* adjust file size */
 		ret = ftruncate(config.dump_fd, le32_to_cpu(inode->i_size));
@@ -384,7 +329,7 @@ void dump_node(struct f2fs_sb_info *sbi, nid_t nid)
 
 	get_node_info(sbi, nid, &ni);
 
-	node_blk = calloc(BLOCK_SZ, 1);
+	node_blk = f2fs_blk_alloc();
 	dev_read_block(node_blk, ni.blk_addr);
 
 	DBG(1, "Node ID               [0x%x]\n", nid);
@@ -406,7 +351,7 @@ void dump_node(struct f2fs_sb_info *sbi, nid_t nid)
 		MSG(0, "Invalid node block\n\n");
 	}
 
-	free(node_blk);
+	f2fs_blk_free(node_blk);
 }
 
 static void dump_node_from_blkaddr(u32 blk_addr)
@@ -414,7 +359,7 @@ static void dump_node_from_blkaddr(u32 blk_addr)
 	struct f2fs_node *node_blk;
 	int ret;
 
-	node_blk = calloc(BLOCK_SZ, 1);
+	node_blk = f2fs_blk_alloc();
 	ASSERT(node_blk);
 
 	ret = dev_read_block(node_blk, blk_addr);
@@ -425,7 +370,7 @@ static void dump_node_from_blkaddr(u32 blk_addr)
 	else
 		print_inode_info(&node_blk->i, 1);
 
-	free(node_blk);
+	f2fs_blk_free(node_blk);
 }
 
 static void dump_data_offset(u32 blk_addr, int ofs_in_node)
@@ -436,7 +381,7 @@ static void dump_data_offset(u32 blk_addr, int ofs_in_node)
 	unsigned int node_ofs;
 	int ret;
 
-	node_blk = calloc(BLOCK_SZ, 1);
+	node_blk = f2fs_blk_alloc();
 	ASSERT(node_blk);
 
 	ret = dev_read_block(node_blk, blk_addr);
@@ -463,7 +408,7 @@ got_it:
 	setlocale(LC_ALL, "");
 	MSG(0, " - Data offset       : 0x%x (4KB), %'u (bytes)\n",
 				bidx, bidx * 4096);
-	free(node_blk);
+	f2fs_blk_free(node_blk);
 }
 
 static void dump_node_offset(u32 blk_addr)
@@ -471,14 +416,14 @@ static void dump_node_offset(u32 blk_addr)
 	struct f2fs_node *node_blk;
 	int ret;
 
-	node_blk = calloc(BLOCK_SZ, 1);
+	node_blk = f2fs_blk_alloc();
 	ASSERT(node_blk);
 
 	ret = dev_read_block(node_blk, blk_addr);
 	ASSERT(ret >= 0);
 
 	MSG(0, " - Node offset       : 0x%x\n", ofs_of_node(node_blk));
-	free(node_blk);
+	f2fs_blk_free(node_blk);
 }
 
 int dump_info_from_blkaddr(struct f2fs_sb_info *sbi, u32 blk_addr)
@@ -63,21 +63,6 @@ struct f2fs_nm_info {
 	char *nid_bitmap;
 };
 
-struct seg_entry {
-	unsigned short valid_blocks;    /* # of valid blocks */
-	unsigned char *cur_valid_map;   /* validity bitmap of blocks */
-	/*
-	 * # of valid blocks and the validity bitmap stored in the the last
-	 * checkpoint pack. This information is used by the SSR mode.
-	 */
-	unsigned short ckpt_valid_blocks;
-	unsigned char *ckpt_valid_map;
-	unsigned char type;             /* segment type like CURSEG_XXX_TYPE */
-	unsigned char orig_type;        /* segment type like CURSEG_XXX_TYPE */
-	unsigned long long mtime;       /* modification time of the segment */
-	int dirty;
-};
-
 struct sec_entry {
 	unsigned int valid_blocks;      /* # of valid blocks in a section */
 };
@@ -93,7 +78,20 @@ struct sit_info {
 	unsigned long *dirty_sentries_bitmap;   /* bitmap for dirty sentries */
 	unsigned int dirty_sentries;            /* # of dirty sentries */
 	unsigned int sents_per_block;           /* # of SIT entries per block */
-	struct seg_entry *sentries;             /* SIT segment-level cache */
+
+	/*
+	 * SIT segment-level cache, one array per field indexed by segno so
+	 * that scans over all segments stay sequential. The ckpt_ fields hold
+	 * the state stored in the last checkpoint pack.
+	 */
+	unsigned short *valid_blocks;           /* # of valid blocks */
+	unsigned short *ckpt_valid_blocks;
+	unsigned char *seg_type;                /* segment type like CURSEG_XXX_TYPE */
+	unsigned char *orig_type;               /* seg_type in the checkpoint */
+	unsigned long long *mtime;              /* modification time of the segment */
+	unsigned char *seg_dirty;               /* SIT entry needs a write back */
+	unsigned char *cur_valid_map;           /* validity bitmaps of blocks */
+	unsigned char *ckpt_valid_map;
 	struct sec_entry *sec_entries;          /* SIT section-level cache */
 
 	unsigned long long elapsed_time;        /* elapsed time after mount */
@@ -133,6 +131,14 @@ struct f2fs_dentry_ptr {
 	int max;
 };
 
+/* an xattr of a new inode, named with its "user." or other prefix */
+struct dentry_xattr {
+	struct dentry_xattr *next;
+	char *name;
+	char *value;
+	size_t size;
+};
+
 struct dentry {
 	char *path;
 	char *full_path;
@@ -142,14 +148,17 @@ struct dentry {
 	unsigned long size;
 	u8 file_type;
 	u16 mode;
-	u16 uid;
-	u16 gid;
+	u32 uid;
+	u32 gid;
 	u32 *inode;
 	u32 mtime;
 	char *secon;
+	struct dentry_xattr *xattrs;
 	uint64_t capabilities;
 	nid_t ino;
 	nid_t pino;
+	int hard_link;		/* another name of an inode made earlier */
+	int sparse;		/* fewer blocks allocated than its size */
 };
 
 /* different from dnode_of_data in kernel */
@@ -163,6 +172,19 @@ struct dnode_of_data {
 	int idirty, ndirty;
 };
 
+/* a regular file sload is appending data blocks to, see segment.c */
+struct data_writer {
+	nid_t ino;
+	block_t inode_blkaddr;
+	struct f2fs_node *inode;
+	struct dnode_of_data dn;
+	u32 dn_version;			/* of the node in dn */
+	pgoff_t pgofs;			/* next file offset to write */
+	int type;			/* CURSEG_*_DATA log to write to */
+	u32 ext_fofs, ext_blk, ext_len;	/* longest contiguous run */
+	u32 cur_fofs, cur_blk, cur_len;	/* run being extended */
+};
+
 struct f2fs_sb_info {
 	struct f2fs_fsck *fsck;
 
@@ -171,6 +193,7 @@ struct f2fs_sb_info {
 	struct f2fs_sm_info *sm_info;
 	struct f2fs_checkpoint *ckpt;
 	int cur_cp;
+	struct meta_cache *meta_cache;		/* NAT/SIT/SSA held by sload */
 
 	struct list_head orphan_inode_list;
 	unsigned int n_orphans;
@@ -199,7 +222,8 @@ struct f2fs_sb_info {
 	u32 s_next_generation;                  /* for NFS support */
 
 	unsigned int cur_victim_sec;            /* current victim section num */
-	u32 free_segments;
+	u32 free_segments;			/* kept by reserve_new_blocks() */
+	u64 alloc_cursor[NO_CHECK_TYPE];	/* where its next search starts */
 };
 
 static inline struct f2fs_super_block *F2FS_RAW_SUPER(struct f2fs_sb_info *sbi)
@@ -232,6 +256,17 @@ static inline struct sit_info *SIT_I(struct f2fs_sb_info *sbi)
 	return (struct sit_info *)(SM_I(sbi)->sit_info);
 }
 
+#define SE_VALID_BLOCKS(sbi, segno)	(SIT_I(sbi)->valid_blocks[segno])
+#define SE_CKPT_VALID_BLOCKS(sbi, segno) (SIT_I(sbi)->ckpt_valid_blocks[segno])
+#define SE_TYPE(sbi, segno)		(SIT_I(sbi)->seg_type[segno])
+#define SE_ORIG_TYPE(sbi, segno)	(SIT_I(sbi)->orig_type[segno])
+#define SE_MTIME(sbi, segno)		(SIT_I(sbi)->mtime[segno])
+#define SE_DIRTY(sbi, segno)		(SIT_I(sbi)->seg_dirty[segno])
+#define SE_VALID_MAP(sbi, segno)					\
+	(SIT_I(sbi)->cur_valid_map + (size_t)(segno) * SIT_VBLOCK_MAP_SIZE)
+#define SE_CKPT_VALID_MAP(sbi, segno)					\
+	(SIT_I(sbi)->ckpt_valid_map + (size_t)(segno) * SIT_VBLOCK_MAP_SIZE)
+
 static inline void *inline_data_addr(struct f2fs_node *node_blk)
 {
 	return (void *)&(node_blk->i.i_addr[1]);
@@ -10,27 +10,26 @@
  */
 #include "fsck.h"
 
-char *tree_mark;
-uint32_t tree_mark_size = 256;
+__thread char *tree_mark;
+__thread uint32_t tree_mark_size = 256;
 
 static inline int f2fs_set_main_bitmap(struct f2fs_sb_info *sbi, u32 blk,
 								int type)
 {
 	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
-	struct seg_entry *se;
+	u32 segno = GET_SEGNO(sbi, blk);
 	int fix = 0;
 
-	se = get_seg_entry(sbi, GET_SEGNO(sbi, blk));
-	if (se->type >= NO_CHECK_TYPE)
+	if (SE_TYPE(sbi, segno) >= NO_CHECK_TYPE)
 		fix = 1;
-	else if (IS_DATASEG(se->type) != IS_DATASEG(type))
+	else if (IS_DATASEG(SE_TYPE(sbi, segno)) != IS_DATASEG(type))
 		fix = 1;
 
 	/* just check data and node types */
 	if (fix) {
 		DBG(1, "Wrong segment type [0x%x] %x -> %x",
-				GET_SEGNO(sbi, blk), se->type, type);
-		se->type = type;
+				segno, SE_TYPE(sbi, segno), type);
+		SE_TYPE(sbi, segno) = type;
 	}
 	return f2fs_set_bit(BLKOFF_FROM_MAIN(sbi, blk), fsck->main_area_bitmap);
 }
@@ -50,6 +49,103 @@ static inline int f2fs_test_sit_bitmap(struct f2fs_sb_info *sbi, u32 blk)
 	return f2fs_test_bit(BLKOFF_FROM_MAIN(sbi, blk), fsck->sit_area_bitmap);
 }
 
+static inline int fsck_stat_bucket(u64 val)
+{
+	int i = 0;
+
+	while (val && i < FSCK_STAT_BUCKETS - 1) {
+		val >>= 1;
+		i++;
+	}
+	return i;
+}
+
+/* called for every valid data block in file offset order */
+static void fsck_stat_data_blk(struct f2fs_sb_info *sbi,
+				struct child_info *child, u32 blk_addr)
+{
+	struct fsck_stats *stat = &F2FS_FSCK(sbi)->stat;
+	u32 nseg, dseg, dist;
+
+	if (!child->stat_blks || child->stat_last_blk + 1 != blk_addr ||
+			child->stat_last_pgofs + 1 != child->pgofs)
+		child->stat_extents++;
+	child->stat_last_blk = blk_addr;
+	child->stat_last_pgofs = child->pgofs;
+	child->stat_blks++;
+
+	if (!child->node_blk)
+		return;
+
+	nseg = GET_SEGNO(sbi, child->node_blk);
+	dseg = GET_SEGNO(sbi, blk_addr);
+	dist = nseg > dseg ? nseg - dseg : dseg - nseg;
+
+	stat->locality_hist[fsck_stat_bucket(dist)]++;
+	stat->locality_dist += dist;
+	stat->locality_blks++;
+}
+
+static void fsck_stat_inode(struct f2fs_sb_info *sbi,
+		struct f2fs_node *node_blk, struct child_info *child,
+		enum FILE_TYPE ftype)
+{
+	struct fsck_stats *stat = &F2FS_FSCK(sbi)->stat;
+
+	switch (ftype) {
+	case F2FS_FT_REG_FILE:
+		stat->reg_files++;
+		break;
+	case F2FS_FT_DIR:
+		stat->dirs++;
+		stat->hash_depth_hist[fsck_stat_bucket(
+			le32_to_cpu(node_blk->i.i_current_depth))]++;
+		break;
+	case F2FS_FT_SYMLINK:
+		stat->symlinks++;
+		break;
+	default:
+		stat->others++;
+		break;
+	}
+
+	if (node_blk->i.i_inline & F2FS_INLINE_DATA)
+		stat->inline_data++;
+	if (node_blk->i.i_inline & F2FS_INLINE_DENTRY)
+		stat->inline_dentry++;
+
+	if (!child->stat_blks)
+		return;
+
+	stat->extent_hist[fsck_stat_bucket(child->stat_extents)]++;
+	stat->extents += child->stat_extents;
+	stat->data_blks += child->stat_blks;
+	stat->data_files++;
+	if (child->stat_extents > 1)
+		stat->fragmented_files++;
+}
+
+static void fsck_stat_dentries(struct f2fs_sb_info *sbi, u8 *bitmap,
+							int max)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	u32 used = 0;
+	int i;
+
+	for (i = 0; i < max; i++)
+		if (test_bit_le(i, bitmap))
+			used++;
+
+	if (max == NR_DENTRY_IN_BLOCK) {
+		fsck->stat.dentry_blks++;
+		fsck->stat.dentry_slots += used;
+	} else {
+		fsck->stat.inline_dentry_slots += used;
+	}
+	if (fsck->dentry_depth > fsck->stat.max_dir_depth)
+		fsck->stat.max_dir_depth = fsck->dentry_depth;
+}
+
 static int add_into_hard_link_list(struct f2fs_sb_info *sbi,
 						u32 nid, u32 link_cnt)
 {
@@ -129,7 +225,6 @@ static int is_valid_ssa_node_blk(struct f2fs_sb_info *sbi, u32 nid,
 {
 	struct f2fs_summary_block *sum_blk;
 	struct f2fs_summary *sum_entry;
-	struct seg_entry * se;
 	u32 segno, offset;
 	int need_fix = 0, ret = 0;
 	int type;
@@ -148,8 +243,7 @@ static int is_valid_ssa_node_blk(struct f2fs_sb_info *sbi, u32 nid,
 		}
 
 		need_fix = 1;
-		se = get_seg_entry(sbi, segno);
-		if(IS_NODESEG(se->type)) {
+		if (IS_NODESEG(SE_TYPE(sbi, segno))) {
 			FIX_MSG("Summary footer indicates a node segment: 0x%x", segno);
 			sum_blk->footer.entry_type = SUM_TYPE_NODE;
 		} else {
@@ -207,7 +301,7 @@ static int is_valid_summary(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 	struct node_info ni;
 	int ret = 0;
 
-	node_blk = (struct f2fs_node *)calloc(BLOCK_SZ, 1);
+	node_blk = f2fs_blk_alloc();
 	ASSERT(node_blk != NULL);
 
 	if (!IS_VALID_NID(sbi, nid))
@@ -234,7 +328,7 @@ static int is_valid_summary(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 	if (blk_addr == le32_to_cpu(target_blk_addr))
 		ret = 1;
 out:
-	free(node_blk);
+	f2fs_blk_free(node_blk);
 	return ret;
 }
 
@@ -243,7 +337,6 @@ static int is_valid_ssa_data_blk(struct f2fs_sb_info *sbi, u32 blk_addr,
 {
 	struct f2fs_summary_block *sum_blk;
 	struct f2fs_summary *sum_entry;
-	struct seg_entry * se;
 	u32 segno, offset;
 	int need_fix = 0, ret = 0;
 	int type;
@@ -262,8 +355,7 @@ static int is_valid_ssa_data_blk(struct f2fs_sb_info *sbi, u32 blk_addr,
 		}
 
 		need_fix = 1;
-		se = get_seg_entry(sbi, segno);
-		if (IS_DATASEG(se->type)) {
+		if (IS_DATASEG(SE_TYPE(sbi, segno))) {
 			FIX_MSG("Summary footer indicates a data segment: 0x%x", segno);
 			sum_blk->footer.entry_type = SUM_TYPE_DATA;
 		} else {
@@ -474,7 +566,7 @@ static int fsck_chk_xattr_blk(struct f2fs_sb_info *sbi, u32 ino,
 	if (x_nid == 0x0)
 		return 0;
 
-	node_blk = (struct f2fs_node *)calloc(BLOCK_SZ, 1);
+	node_blk = f2fs_blk_alloc();
 	ASSERT(node_blk != NULL);
 
 	/* Sanity check */
@@ -488,56 +580,10 @@ static int fsck_chk_xattr_blk(struct f2fs_sb_info *sbi, u32 ino,
 	f2fs_set_main_bitmap(sbi, ni.blk_addr, CURSEG_COLD_NODE);
 	DBG(2, "ino[0x%x] x_nid[0x%x]\n", ino, x_nid);
 out:
-	free(node_blk);
+	f2fs_blk_free(node_blk);
 	return ret;
 }
 
-int fsck_chk_node_blk(struct f2fs_sb_info *sbi, struct f2fs_inode *inode,
-		u32 nid, u8 *name, enum FILE_TYPE ftype, enum NODE_TYPE ntype,
-		u32 *blk_cnt, struct child_info *child)
-{
-	struct node_info ni;
-	struct f2fs_node *node_blk = NULL;
-
-	node_blk = (struct f2fs_node *)calloc(BLOCK_SZ, 1);
-	ASSERT(node_blk != NULL);
-
-	if (sanity_check_nid(sbi, nid, node_blk, ftype, ntype, &ni, name))
-		goto err;
-
-	if (ntype == TYPE_INODE) {
-		fsck_chk_inode_blk(sbi, nid, ftype, node_blk, blk_cnt, &ni);
-	} else {
-		switch (ntype) {
-		case TYPE_DIRECT_NODE:
-			f2fs_set_main_bitmap(sbi, ni.blk_addr,
-							CURSEG_WARM_NODE);
-			fsck_chk_dnode_blk(sbi, inode, nid, ftype, node_blk,
-					blk_cnt, child, &ni);
-			break;
-		case TYPE_INDIRECT_NODE:
-			f2fs_set_main_bitmap(sbi, ni.blk_addr,
-							CURSEG_COLD_NODE);
-			fsck_chk_idnode_blk(sbi, inode, ftype, node_blk,
-					blk_cnt, child);
-			break;
-		case TYPE_DOUBLE_INDIRECT_NODE:
-			f2fs_set_main_bitmap(sbi, ni.blk_addr,
-							CURSEG_COLD_NODE);
-			fsck_chk_didnode_blk(sbi, inode, ftype, node_blk,
-					blk_cnt, child);
-			break;
-		default:
-			ASSERT(0);
-		}
-	}
-	free(node_blk);
-	return 0;
-err:
-	free(node_blk);
-	return -EINVAL;
-}
-
 static inline void get_extent_info(struct extent_info *ext,
 					struct f2fs_extent *i_ext)
 {
@@ -596,23 +642,235 @@ unmatched:
 	child->state |= FSCK_UNMATCHED_EXTENT;
 }
 
-/* start with valid nid and blkaddr */
-void fsck_chk_inode_blk(struct f2fs_sb_info *sbi, u32 nid,
-		enum FILE_TYPE ftype, struct f2fs_node *node_blk,
-		u32 *blk_cnt, struct node_info *ni)
+struct fsck_walk {
+	struct f2fs_inode *inode;
+	struct child_info *child;
+	enum FILE_TYPE ftype;
+	u32 *blk_cnt;
+};
+
+/*
+ * A directory tree is checked without recursion.  Every inode being checked
+ * and every dentry block being scanned gets a frame on fsck->frames, and the
+ * child inodes of a dentry block are pushed on top of it one by one, so the
+ * checks and messages keep the order of a depth-first walk.
+ */
+enum {
+	FRAME_WALK,		/* walking the node tree of the inode */
+	FRAME_CHECK,		/* its blocks are counted, check the inode */
+	FRAME_LINKS,		/* check the inode, but not its i_blocks */
+	FRAME_DONE,		/* nothing left, e.g. another hard link */
+	FRAME_DENTRIES,		/* dentries of the inode frame below */
+};
+
+struct fsck_frame {
+	int state;
+
+	/* inode */
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	enum FILE_TYPE ftype;
+	u32 i_links;
+	u64 i_size;
+	u64 i_blocks;
+	u32 blk_cnt;
+	struct child_info child;
+	struct fsck_walk fw;
+	struct node_walk walk;
+	int need_fix;
+
+	/* dentries, of a block or inline in dir->node_blk */
+	struct fsck_frame *dir;
+	struct f2fs_dentry_block *de_blk;	/* NULL for inline dentries */
+	block_t blk_addr;
+	u8 *bitmap;
+	struct f2fs_dir_entry *dentry;
+	__u8 (*filenames)[F2FS_SLOT_LEN];
+	int max;
+	int last_blk;
+	int encrypted;
+	int level;
+	int n;			/* next entry of the batch to check */
+	int dentries;
+	int fixed;
+	struct dentry_batch *batch;	/* kept when the frame is reused */
+};
+
+static void fsck_push_dentries(struct f2fs_sb_info *, block_t, int, int);
+
+static struct fsck_frame *fsck_push_frame(struct f2fs_fsck *fsck)
+{
+	struct dentry_batch *batch;
+	struct fsck_frame *f;
+
+	if (fsck->nr_frames == fsck->max_frames) {
+		u32 max = fsck->max_frames ? fsck->max_frames * 2 : 16;
+
+		fsck->frames = realloc(fsck->frames,
+					max * sizeof(struct fsck_frame *));
+		ASSERT(fsck->frames);
+		memset(fsck->frames + fsck->max_frames, 0,
+			(max - fsck->max_frames) * sizeof(struct fsck_frame *));
+		fsck->max_frames = max;
+	}
+
+	f = fsck->frames[fsck->nr_frames];
+	if (!f) {
+		f = calloc(1, sizeof(struct fsck_frame));
+		ASSERT(f);
+		fsck->frames[fsck->nr_frames] = f;
+	}
+	fsck->nr_frames++;
+
+	batch = f->batch;
+	memset(f, 0, sizeof(struct fsck_frame));
+	f->batch = batch;
+	return f;
+}
+
+static int fsck_walk_node(struct node_walk *walk, nid_t nid,
+		enum NODE_TYPE ntype, struct f2fs_node *node_blk,
+		struct node_info *ni)
+{
+	struct f2fs_sb_info *sbi = walk->sbi;
+	struct fsck_walk *fw = walk->private;
+	struct node_walk_level *parent = &walk->stack[walk->depth - 1];
+
+	if (sanity_check_nid(sbi, nid, node_blk, fw->ftype, ntype, ni, NULL)) {
+		if (config.fix_on) {
+			node_walk_clear_slot(walk);
+			if (parent->ntype == TYPE_INODE)
+				FIX_MSG("[0x%x] i_nid[%d] = 0", parent->nid,
+					parent->idx -
+					ADDRS_PER_INODE(&parent->node_blk->i));
+			else if (parent->ntype == TYPE_INDIRECT_NODE)
+				FIX_MSG("Set indirect node 0x%x -> 0\n",
+							parent->idx);
+			else
+				FIX_MSG("Set double indirect node 0x%x -> 0\n",
+							parent->idx);
+		} else if (parent->ntype != TYPE_INODE) {
+			printf("should delete in.nid[i] = 0;\n");
+		}
+		return -EINVAL;
+	}
+
+	if (ntype == TYPE_DIRECT_NODE) {
+		f2fs_set_main_bitmap(sbi, ni->blk_addr, CURSEG_WARM_NODE);
+		fw->child->p_ino = nid;
+		fw->child->pp_ino = le32_to_cpu(fw->inode->i_pino);
+	} else {
+		f2fs_set_main_bitmap(sbi, ni->blk_addr, CURSEG_COLD_NODE);
+	}
+	return 0;
+}
+
+/* pauses the walk to scan a dentry block of a directory */
+static int fsck_walk_data(struct node_walk *walk,
+		struct node_walk_level *level, u16 ofs_in_node,
+		block_t blkaddr)
+{
+	struct fsck_walk *fw = walk->private;
+	struct child_info *child = fw->child;
+	int last_blk, encrypted;
+	int ret;
+
+	child->pgofs = walk->pgofs;
+	child->node_blk = level->blk_addr;
+
+	/* check extent info */
+	check_extent_info(child, blkaddr, 0);
+
+	if (blkaddr == 0)
+		return 0;
+
+	last_blk = le64_to_cpu(fw->inode->i_blocks) == *fw->blk_cnt;
+	encrypted = file_is_encrypt(fw->inode->i_advise);
+	ret = fsck_chk_data_blk(walk->sbi, blkaddr, child, last_blk,
+			fw->ftype, level->nid, ofs_in_node, level->version,
+			encrypted);
+	if (!ret) {
+		*fw->blk_cnt = *fw->blk_cnt + 1;
+		if (fw->ftype == F2FS_FT_DIR && blkaddr != NEW_ADDR) {
+			fsck_push_dentries(walk->sbi, blkaddr, last_blk,
+							encrypted);
+			return 1;
+		}
+	} else if (config.fix_on) {
+		node_walk_clear_slot(walk);
+		if (level->ntype == TYPE_INODE)
+			FIX_MSG("[0x%x] i_addr[%d] = 0", level->nid,
+							ofs_in_node);
+		else
+			FIX_MSG("[0x%x] dn.addr[%d] = 0", level->nid,
+							ofs_in_node);
+	}
+	return 0;
+}
+
+static void fsck_walk_leave(struct node_walk *walk,
+				struct node_walk_level *level)
+{
+	struct fsck_walk *fw = walk->private;
+	int ret;
+
+	if (level->dirty && !config.ro) {
+		ret = dev_write_block(level->node_blk, level->blk_addr);
+		ASSERT(ret >= 0);
+	}
+	*fw->blk_cnt = *fw->blk_cnt + 1;
+}
+
+static const struct node_walk_ops fsck_walk_ops = {
+	.node = fsck_walk_node,
+	.data = fsck_walk_data,
+	.leave = fsck_walk_leave,
+};
+
+static void fsck_inode_walked(struct fsck_frame *f)
+{
+	struct child_info *child = &f->child;
+
+	if (f->walk.stack[0].dirty)
+		f->need_fix = 1;
+	child->pgofs = f->walk.pgofs;
+
+	/* check uncovered range in the back of extent */
+	check_extent_info(child, 0, 1);
+
+	if (child->state & FSCK_UNMATCHED_EXTENT) {
+		ASSERT_MSG("ino: 0x%x has wrong ext: [pgofs:%u, blk:%u, len:%u]",
+				f->ni.nid, child->ei.fofs, child->ei.blk,
+				child->ei.len);
+		if (config.fix_on)
+			f->need_fix = 1;
+	}
+	f->state = FRAME_CHECK;
+}
+
+/* start checking the inode of a new frame, with valid nid and blkaddr */
+static void fsck_inode_begin(struct f2fs_sb_info *sbi, struct fsck_frame *f)
 {
 	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
-	struct child_info child = {0, 2, 0, 0, 0, 0};
-	enum NODE_TYPE ntype;
+	struct f2fs_node *node_blk = f->node_blk;
+	struct node_info *ni = &f->ni;
+	enum FILE_TYPE ftype = f->ftype;
+	u32 nid = ni->nid;
 	u32 i_links = le32_to_cpu(node_blk->i.i_links);
-	u64 i_size = le64_to_cpu(node_blk->i.i_size);
-	u64 i_blocks = le64_to_cpu(node_blk->i.i_blocks);
-	child.p_ino = nid;
-	child.pp_ino = le32_to_cpu(node_blk->i.i_pino);
-	child.dir_level = node_blk->i.i_dir_level;
-	unsigned int idx = 0;
-	int need_fix = 0;
-	int ret;
+
+	f->i_links = i_links;
+	f->i_size = le64_to_cpu(node_blk->i.i_size);
+	f->i_blocks = le64_to_cpu(node_blk->i.i_blocks);
+	f->child.links = 2;
+	f->child.p_ino = nid;
+	f->child.pp_ino = le32_to_cpu(node_blk->i.i_pino);
+	f->child.dir_level = node_blk->i.i_dir_level;
+	f->fw.inode = &node_blk->i;
+	f->fw.child = &f->child;
+	f->fw.ftype = ftype;
+	f->fw.blk_cnt = &f->blk_cnt;
+	node_walk_init(&f->walk, sbi, &fsck_walk_ops, &f->fw);
+	f->state = FRAME_CHECK;
 
 	if (f2fs_test_main_bitmap(sbi, ni->blk_addr) == 0)
 		fsck->chk.valid_inode_cnt++;
@@ -636,30 +894,32 @@ void fsck_chk_inode_blk(struct f2fs_sb_info *sbi, u32 nid,
 				if (config.fix_on) {
 					node_blk->i.i_links =
 						cpu_to_le32(i_links + 1);
-					need_fix = 1;
+					f->need_fix = 1;
 					FIX_MSG("File: 0x%x "
 						"i_links= 0x%x -> 0x%x",
 						nid, i_links, i_links + 1);
 				}
-				goto skip_blkcnt_fix;
+				f->state = FRAME_LINKS;
+				return;
 			}
 			/* No need to go deep into the node */
+			f->state = FRAME_DONE;
 			return;
 		}
 	}
 
 	if (fsck_chk_xattr_blk(sbi, nid,
-			le32_to_cpu(node_blk->i.i_xattr_nid), blk_cnt) &&
+			le32_to_cpu(node_blk->i.i_xattr_nid), &f->blk_cnt) &&
 			config.fix_on) {
 		node_blk->i.i_xattr_nid = 0;
-		need_fix = 1;
+		f->need_fix = 1;
 		FIX_MSG("Remove xattr block: 0x%x, x_nid = 0x%x",
 				nid, le32_to_cpu(node_blk->i.i_xattr_nid));
 	}
 
 	if (ftype == F2FS_FT_CHRDEV || ftype == F2FS_FT_BLKDEV ||
 			ftype == F2FS_FT_FIFO || ftype == F2FS_FT_SOCK)
-		goto check;
+		return;
 
 	if((node_blk->i.i_inline & F2FS_INLINE_DATA)) {
 		if (le32_to_cpu(node_blk->i.i_addr[0]) != 0) {
@@ -667,8 +927,8 @@ void fsck_chk_inode_blk(struct f2fs_sb_info *sbi, u32 nid,
 			FIX_MSG("inline_data has wrong 0'th block = %x",
 					le32_to_cpu(node_blk->i.i_addr[0]));
 			node_blk->i.i_addr[0] = 0;
-			node_blk->i.i_blocks = cpu_to_le64(*blk_cnt);
-			need_fix = 1;
+			node_blk->i.i_blocks = cpu_to_le64(f->blk_cnt);
+			f->need_fix = 1;
 		}
 		if (!(node_blk->i.i_inline & F2FS_DATA_EXIST)) {
 			char buf[MAX_INLINE_DATA];
@@ -678,122 +938,56 @@ void fsck_chk_inode_blk(struct f2fs_sb_info *sbi, u32 nid,
 							MAX_INLINE_DATA)) {
 				FIX_MSG("inline_data has DATA_EXIST");
 				node_blk->i.i_inline |= F2FS_DATA_EXIST;
-				need_fix = 1;
+				f->need_fix = 1;
 			}
 		}
 		DBG(3, "ino[0x%x] has inline data!\n", nid);
-		goto check;
+		return;
 	}
 	if((node_blk->i.i_inline & F2FS_INLINE_DENTRY)) {
 		DBG(3, "ino[0x%x] has inline dentry!\n", nid);
-		ret = fsck_chk_inline_dentries(sbi, node_blk, &child);
-		if (ret < 0) {
-			/* should fix this bug all the time */
-			need_fix = 1;
-		}
-		goto check;
-	}
-
-	/* readahead node blocks */
-	for (idx = 0; idx < 5; idx++) {
-		u32 nid = le32_to_cpu(node_blk->i.i_nid[idx]);
-
-		if (nid != 0) {
-			struct node_info ni;
-
-			get_node_info(sbi, nid, &ni);
-			if (IS_VALID_BLK_ADDR(sbi, ni.blk_addr))
-				dev_reada_block(ni.blk_addr);
-		}
+		fsck_push_dentries(sbi, NULL_ADDR, 1,
+				file_is_encrypt(node_blk->i.i_advise));
+		return;
 	}
 
 	/* init extent info */
-	get_extent_info(&child.ei, &node_blk->i.i_ext);
-	child.last_blk = 0;
-
-	/* check data blocks in inode */
-	for (idx = 0; idx < ADDRS_PER_INODE(&node_blk->i);
-						idx++, child.pgofs++) {
-		block_t blkaddr = le32_to_cpu(node_blk->i.i_addr[idx]);
-
-		/* check extent info */
-		check_extent_info(&child, blkaddr, 0);
-
-		if (blkaddr != 0) {
-			ret = fsck_chk_data_blk(sbi,
-					blkaddr,
-					&child, (i_blocks == *blk_cnt),
-					ftype, nid, idx, ni->version,
-					file_is_encrypt(node_blk->i.i_advise));
-			if (!ret) {
-				*blk_cnt = *blk_cnt + 1;
-			} else if (config.fix_on) {
-				node_blk->i.i_addr[idx] = 0;
-				need_fix = 1;
-				FIX_MSG("[0x%x] i_addr[%d] = 0", nid, idx);
-			}
-		}
-	}
-
-	/* check node blocks in inode */
-	for (idx = 0; idx < 5; idx++) {
-		nid_t i_nid = le32_to_cpu(node_blk->i.i_nid[idx]);
+	get_extent_info(&f->child.ei, &node_blk->i.i_ext);
+	f->child.last_blk = 0;
 
-		if (idx == 0 || idx == 1)
-			ntype = TYPE_DIRECT_NODE;
-		else if (idx == 2 || idx == 3)
-			ntype = TYPE_INDIRECT_NODE;
-		else if (idx == 4)
-			ntype = TYPE_DOUBLE_INDIRECT_NODE;
-		else
-			ASSERT(0);
-
-		if (i_nid == 0x0)
-			goto skip;
-
-		ret = fsck_chk_node_blk(sbi, &node_blk->i, i_nid,
-				NULL, ftype, ntype, blk_cnt, &child);
-		if (!ret) {
-			*blk_cnt = *blk_cnt + 1;
-		} else if (ret == -EINVAL) {
-			if (config.fix_on) {
-				node_blk->i.i_nid[idx] = 0;
-				need_fix = 1;
-				FIX_MSG("[0x%x] i_nid[%d] = 0", nid, idx);
-			}
-skip:
-			if (ntype == TYPE_DIRECT_NODE)
-				child.pgofs += ADDRS_PER_BLOCK;
-			else if (ntype == TYPE_INDIRECT_NODE)
-				child.pgofs += ADDRS_PER_BLOCK * NIDS_PER_BLOCK;
-			else
-				child.pgofs += ADDRS_PER_BLOCK *
-						NIDS_PER_BLOCK * NIDS_PER_BLOCK;
-		}
+	/* check data blocks and node blocks of the inode */
+	f->state = FRAME_WALK;
+	if (!node_walk(&f->walk, ni, node_blk))
+		fsck_inode_walked(f);
+}
 
-	}
+static void fsck_inode_end(struct f2fs_sb_info *sbi, struct fsck_frame *f)
+{
+	struct f2fs_node *node_blk = f->node_blk;
+	struct child_info *child = &f->child;
+	enum FILE_TYPE ftype = f->ftype;
+	u32 nid = f->ni.nid;
+	u32 i_links = f->i_links;
+	u64 i_size = f->i_size;
+	u64 i_blocks = f->i_blocks;
+	int ret;
 
-	/* check uncovered range in the back of extent */
-	check_extent_info(&child, 0, 1);
+	if (f->state == FRAME_LINKS)
+		goto skip_blkcnt_fix;
 
-	if (child.state & FSCK_UNMATCHED_EXTENT) {
-		ASSERT_MSG("ino: 0x%x has wrong ext: [pgofs:%u, blk:%u, len:%u]",
-				nid, child.ei.fofs, child.ei.blk, child.ei.len);
-		if (config.fix_on)
-			need_fix = 1;
-	}
-check:
-	if (i_blocks != *blk_cnt) {
+	if (i_blocks != f->blk_cnt) {
 		ASSERT_MSG("ino: 0x%x has i_blocks: %08"PRIx64", "
 				"but has %u blocks",
-				nid, i_blocks, *blk_cnt);
+				nid, i_blocks, f->blk_cnt);
 		if (config.fix_on) {
-			node_blk->i.i_blocks = cpu_to_le64(*blk_cnt);
-			need_fix = 1;
+			node_blk->i.i_blocks = cpu_to_le64(f->blk_cnt);
+			f->need_fix = 1;
 			FIX_MSG("[0x%x] i_blocks=0x%08"PRIx64" -> 0x%x",
-					nid, i_blocks, *blk_cnt);
+					nid, i_blocks, f->blk_cnt);
 		}
 	}
+	if (config.stats_path)
+		fsck_stat_inode(sbi, node_blk, child, ftype);
 skip_blkcnt_fix:
 	if (ftype == F2FS_FT_ORPHAN)
 		DBG(1, "Orphan Inode: 0x%x [%s] i_blocks: %u\n\n",
@@ -806,25 +1000,25 @@ skip_blkcnt_fix:
 				le32_to_cpu(node_blk->footer.ino),
 				node_blk->i.i_name,
 				le32_to_cpu(node_blk->i.i_current_depth),
-				child.files);
+				child->files);
 
-		if (i_links != child.links) {
+		if (i_links != child->links) {
 			ASSERT_MSG("ino: 0x%x i_links: %u, real links: %u",
-					nid, i_links, child.links);
+					nid, i_links, child->links);
 			if (config.fix_on) {
-				node_blk->i.i_links = cpu_to_le32(child.links);
-				need_fix = 1;
+				node_blk->i.i_links = cpu_to_le32(child->links);
+				f->need_fix = 1;
 				FIX_MSG("Dir: 0x%x i_links= 0x%x -> 0x%x",
-						nid, i_links, child.links);
+						nid, i_links, child->links);
 			}
 		}
-		if (child.dots < 2 &&
+		if (child->dots < 2 &&
 				!(node_blk->i.i_inline & F2FS_INLINE_DOTS)) {
 			ASSERT_MSG("ino: 0x%x dots: %u",
-					nid, child.dots);
+					nid, child->dots);
 			if (config.fix_on) {
 				node_blk->i.i_inline |= F2FS_INLINE_DOTS;
-				need_fix = 1;
+				f->need_fix = 1;
 				FIX_MSG("Dir: 0x%x set inline_dots", nid);
 			}
 		}
@@ -836,7 +1030,7 @@ skip_blkcnt_fix:
 			u64 i_size = i_blocks * F2FS_BLKSIZE;
 
 			node_blk->i.i_size = cpu_to_le64(i_size);
-			need_fix = 1;
+			f->need_fix = 1;
 			FIX_MSG("Symlink: recover 0x%x with i_size=%lu",
 							nid, i_size);
 		}
@@ -847,132 +1041,52 @@ skip_blkcnt_fix:
 				nid, i_links);
 		if (config.fix_on) {
 			node_blk->i.i_links = 0;
-			need_fix = 1;
+			f->need_fix = 1;
 			FIX_MSG("ino: 0x%x orphan_inode, i_links= 0x%x -> 0",
 					nid, i_links);
 		}
 	}
-	if (need_fix && !config.ro) {
+	if (f->need_fix && !config.ro) {
 		/* drop extent information to avoid potential wrong access */
 		node_blk->i.i_ext.len = 0;
-		ret = dev_write_block(node_blk, ni->blk_addr);
+		ret = dev_write_block(node_blk, f->ni.blk_addr);
 		ASSERT(ret >= 0);
 	}
 }
 
-int fsck_chk_dnode_blk(struct f2fs_sb_info *sbi, struct f2fs_inode *inode,
-		u32 nid, enum FILE_TYPE ftype, struct f2fs_node *node_blk,
-		u32 *blk_cnt, struct child_info *child, struct node_info *ni)
+/* carry on with the inode frame on top, returns 0 once it is finished */
+static int fsck_inode_step(struct f2fs_sb_info *sbi, struct fsck_frame *f)
 {
-	int idx, ret;
-	int need_fix = 0;
-	child->p_ino = nid;
-	child->pp_ino = le32_to_cpu(inode->i_pino);
-
-	for (idx = 0; idx < ADDRS_PER_BLOCK; idx++, child->pgofs++) {
-		block_t blkaddr = le32_to_cpu(node_blk->dn.addr[idx]);
-
-		check_extent_info(child, blkaddr, 0);
-
-		if (blkaddr == 0x0)
-			continue;
-		ret = fsck_chk_data_blk(sbi,
-			blkaddr, child,
-			le64_to_cpu(inode->i_blocks) == *blk_cnt, ftype,
-			nid, idx, ni->version,
-			file_is_encrypt(inode->i_advise));
-		if (!ret) {
-			*blk_cnt = *blk_cnt + 1;
-		} else if (config.fix_on) {
-			node_blk->dn.addr[idx] = 0;
-			need_fix = 1;
-			FIX_MSG("[0x%x] dn.addr[%d] = 0", nid, idx);
-		}
-	}
-	if (need_fix && !config.ro) {
-		ret = dev_write_block(node_blk, ni->blk_addr);
-		ASSERT(ret >= 0);
+	if (f->state == FRAME_WALK) {
+		if (node_walk_resume(&f->walk))
+			return 1;
+		fsck_inode_walked(f);
 	}
+	if (f->state != FRAME_DONE)
+		fsck_inode_end(sbi, f);
 	return 0;
 }
 
-int fsck_chk_idnode_blk(struct f2fs_sb_info *sbi, struct f2fs_inode *inode,
-		enum FILE_TYPE ftype, struct f2fs_node *node_blk, u32 *blk_cnt,
-		struct child_info *child)
+/* push the frame of inode @nid, or return -EINVAL if it does not check out */
+static int fsck_push_inode(struct f2fs_sb_info *sbi, u32 nid, u8 *name,
+				enum FILE_TYPE ftype, u32 blk_cnt)
 {
-	int need_fix = 0, ret;
-	int i = 0;
-
-	for (i = 0; i < NIDS_PER_BLOCK; i++) {
-		if (le32_to_cpu(node_blk->in.nid[i]) == 0x0)
-			goto skip;
-		ret = fsck_chk_node_blk(sbi, inode,
-				le32_to_cpu(node_blk->in.nid[i]), NULL,
-				ftype, TYPE_DIRECT_NODE, blk_cnt, child);
-		if (!ret)
-			*blk_cnt = *blk_cnt + 1;
-		else if (ret == -EINVAL) {
-			if (!config.fix_on)
-				printf("should delete in.nid[i] = 0;\n");
-			else {
-				node_blk->in.nid[i] = 0;
-				need_fix = 1;
-				FIX_MSG("Set indirect node 0x%x -> 0\n", i);
-			}
-skip:
-			child->pgofs += ADDRS_PER_BLOCK;
-		}
-	}
-
-	if (need_fix && !config.ro) {
-		struct node_info ni;
-		nid_t nid = le32_to_cpu(node_blk->footer.nid);
-
-		get_node_info(sbi, nid, &ni);
-		ret = dev_write_block(node_blk, ni.blk_addr);
-		ASSERT(ret >= 0);
-	}
-
-	return 0;
-}
-
-int fsck_chk_didnode_blk(struct f2fs_sb_info *sbi, struct f2fs_inode *inode,
-		enum FILE_TYPE ftype, struct f2fs_node *node_blk, u32 *blk_cnt,
-		struct child_info *child)
-{
-	int i = 0;
-	int need_fix = 0, ret = 0;
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct fsck_frame *f = fsck_push_frame(fsck);
 
-	for (i = 0; i < NIDS_PER_BLOCK; i++) {
-		if (le32_to_cpu(node_blk->in.nid[i]) == 0x0)
-			goto skip;
-		ret = fsck_chk_node_blk(sbi, inode,
-				le32_to_cpu(node_blk->in.nid[i]), NULL,
-				ftype, TYPE_INDIRECT_NODE, blk_cnt, child);
-		if (!ret)
-			*blk_cnt = *blk_cnt + 1;
-		else if (ret == -EINVAL) {
-			if (!config.fix_on)
-				printf("should delete in.nid[i] = 0;\n");
-			else {
-				node_blk->in.nid[i] = 0;
-				need_fix = 1;
-				FIX_MSG("Set double indirect node 0x%x -> 0\n", i);
-			}
-skip:
-			child->pgofs += ADDRS_PER_BLOCK * NIDS_PER_BLOCK;
-		}
-	}
+	f->node_blk = f2fs_blk_alloc();
+	ASSERT(f->node_blk != NULL);
 
-	if (need_fix && !config.ro) {
-		struct node_info ni;
-		nid_t nid = le32_to_cpu(node_blk->footer.nid);
-
-		get_node_info(sbi, nid, &ni);
-		ret = dev_write_block(node_blk, ni.blk_addr);
-		ASSERT(ret >= 0);
+	if (sanity_check_nid(sbi, nid, f->node_blk, ftype, TYPE_INODE,
+							&f->ni, name)) {
+		f2fs_blk_free(f->node_blk);
+		fsck->nr_frames--;
+		return -EINVAL;
 	}
 
+	f->ftype = ftype;
+	f->blk_cnt = blk_cnt;
+	fsck_inode_begin(sbi, f);
 	return 0;
 }
 
@@ -1067,10 +1181,9 @@ static void print_dentry(__u32 depth, __u8 *name,
 }
 
 static int f2fs_check_hash_code(struct f2fs_dir_entry *dentry,
-			const unsigned char *name, u32 len, int encrypted)
+			const unsigned char *name, u32 len,
+			f2fs_hash_t hash_code, int encrypted)
 {
-	f2fs_hash_t hash_code = f2fs_dentry_hash(name, len);
-
 	/* fix hash_code made by old buggy code */
 	if (dentry->hash_code != hash_code) {
 		unsigned char new[F2FS_NAME_LEN + 1];
@@ -1127,15 +1240,11 @@ static int __get_current_level(int dir_level, u32 pgofs)
 	return i;
 }
 
-static int f2fs_check_dirent_position(u8 *name, u16 name_len, u32 pgofs,
-						u8 dir_level, u32 pino)
+static int f2fs_check_dirent_position(u8 *name, f2fs_hash_t namehash,
+				int level, u32 pgofs, u8 dir_level, u32 pino)
 {
-	f2fs_hash_t namehash = f2fs_dentry_hash(name, name_len);
 	unsigned int nbucket, nblock;
 	unsigned int bidx, end_block;
-	int level;
-
-	level = __get_current_level(dir_level, pgofs);
 
 	nbucket = dir_buckets(level, dir_level);
 	nblock = bucket_blocks(level);
@@ -1156,7 +1265,7 @@ static int f2fs_check_dirent_position(u8 *name, u16 name_len, u32 pgofs,
 static int __chk_dots_dentries(struct f2fs_sb_info *sbi,
 			       struct f2fs_dir_entry *dentry,
 			       struct child_info *child,
-			       u8 *name, int len,
+			       u8 *name, int len, f2fs_hash_t hash_code,
 			       __u8 (*filename)[F2FS_SLOT_LEN],
 			       int encrypted)
 {
@@ -1187,7 +1296,7 @@ static int __chk_dots_dentries(struct f2fs_sb_info *sbi,
 		}
 	}
 
-	if (f2fs_check_hash_code(dentry, name, len, encrypted))
+	if (f2fs_check_hash_code(dentry, name, len, hash_code, encrypted))
 		fixed = 1;
 
 	if (name[len] != '\0') {
@@ -1207,57 +1316,44 @@ static void nullify_dentry(struct f2fs_dir_entry *dentry, int offs,
 	memset(*filename, 0, F2FS_SLOT_LEN);
 }
 
-static int __chk_dentries(struct f2fs_sb_info *sbi, struct child_info *child,
+/* valid dentries of one dentry block, decoded in a single bitmap pass */
+struct dentry_batch {
+	int nr;
+	int slot[NR_DENTRY_IN_BLOCK];
+	int name_len[NR_DENTRY_IN_BLOCK];
+	const unsigned char *name[NR_DENTRY_IN_BLOCK];
+	f2fs_hash_t hash[NR_DENTRY_IN_BLOCK];
+	/* NUL-terminated copies, packed back to back */
+	u8 names[NR_DENTRY_IN_BLOCK * (F2FS_SLOT_LEN + 1)];
+};
+
+static void __decode_dentries(struct f2fs_sb_info *sbi, struct node_walk *walk,
 			u8 *bitmap, struct f2fs_dir_entry *dentry,
-			__u8 (*filenames)[F2FS_SLOT_LEN],
-			int max, int last_blk, int encrypted)
+			__u8 (*filenames)[F2FS_SLOT_LEN], int max,
+			struct dentry_batch *batch, int *fixed)
 {
-	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	u8 *names = batch->names;
 	enum FILE_TYPE ftype;
-	int dentries = 0;
-	u32 blk_cnt;
-	u8 *name;
-	u16 name_len;;
-	int ret = 0;
-	int fixed = 0;
-	int i, slots;
-
-	/* readahead inode blocks */
-	for (i = 0; i < max; i++) {
-		u32 ino;
-
-		if (test_bit_le(i, bitmap) == 0)
-			continue;
-
-		ino = le32_to_cpu(dentry[i].ino);
-
-		if (IS_VALID_NID(sbi, ino)) {
-			struct node_info ni;
-
-			get_node_info(sbi, ino, &ni);
-			if (IS_VALID_BLK_ADDR(sbi, ni.blk_addr)) {
-				dev_reada_block(ni.blk_addr);
-				name_len = le16_to_cpu(dentry[i].name_len);
-				if (name_len > 0)
-					i += (name_len + F2FS_SLOT_LEN - 1) / F2FS_SLOT_LEN - 1;
-				continue;
-			}
-		}
-	}
+	struct node_info ni;
+	u16 name_len;
+	u32 ino;
+	int i;
 
+	batch->nr = 0;
 	for (i = 0; i < max;) {
 		if (test_bit_le(i, bitmap) == 0) {
 			i++;
 			continue;
 		}
-		if (!IS_VALID_NID(sbi, le32_to_cpu(dentry[i].ino))) {
+		ino = le32_to_cpu(dentry[i].ino);
+		if (!IS_VALID_NID(sbi, ino)) {
 			ASSERT_MSG("Bad dentry 0x%x with invalid NID/ino 0x%x",
-				    i, le32_to_cpu(dentry[i].ino));
+				    i, ino);
 			if (config.fix_on) {
 				FIX_MSG("Clear bad dentry 0x%x with bad ino 0x%x",
-					i, le32_to_cpu(dentry[i].ino));
+					i, ino);
 				test_and_clear_bit_le(i, bitmap);
-				fixed = 1;
+				*fixed = 1;
 			}
 			i++;
 			continue;
@@ -1266,32 +1362,114 @@ static int __chk_dentries(struct f2fs_sb_info *sbi, struct child_info *child,
 		ftype = dentry[i].file_type;
 		if ((ftype <= F2FS_FT_UNKNOWN || ftype > F2FS_FT_LAST_FILE_TYPE)) {
 			ASSERT_MSG("Bad dentry 0x%x with unexpected ftype 0x%x",
-						le32_to_cpu(dentry[i].ino), ftype);
+						ino, ftype);
 			if (config.fix_on) {
 				FIX_MSG("Clear bad dentry 0x%x with bad ftype 0x%x",
 					i, ftype);
 				test_and_clear_bit_le(i, bitmap);
-				fixed = 1;
+				*fixed = 1;
 			}
 			i++;
 			continue;
 		}
 
 		name_len = le16_to_cpu(dentry[i].name_len);
-
 		if (name_len == 0) {
 			ASSERT_MSG("Bad dentry 0x%x with zero name_len", i);
 			if (config.fix_on) {
 				FIX_MSG("Clear bad dentry 0x%x", i);
 				test_and_clear_bit_le(i, bitmap);
-				fixed = 1;
+				*fixed = 1;
 			}
 			i++;
 			continue;
 		}
-		name = calloc(name_len + 1, 1);
-		memcpy(name, filenames[i], name_len);
-		slots = (name_len + F2FS_SLOT_LEN - 1) / F2FS_SLOT_LEN;
+
+		if (name_len > F2FS_NAME_LEN || i + (name_len +
+				F2FS_SLOT_LEN - 1) / F2FS_SLOT_LEN > max) {
+			ASSERT_MSG("Bad dentry 0x%x with name_len 0x%x",
+					i, name_len);
+			if (config.fix_on) {
+				FIX_MSG("Clear bad dentry 0x%x", i);
+				test_and_clear_bit_le(i, bitmap);
+				*fixed = 1;
+			}
+			i++;
+			continue;
+		}
+
+		/* readahead the inode blocks of the children to come */
+		get_node_info(sbi, ino, &ni);
+		if (IS_VALID_BLK_ADDR(sbi, ni.blk_addr))
+			node_walk_prefetch(walk, ni.blk_addr, 1);
+
+		memcpy(names, filenames[i], name_len);
+		names[name_len] = '\0';
+
+		batch->slot[batch->nr] = i;
+		batch->name_len[batch->nr] = name_len;
+		batch->name[batch->nr] = names;
+		batch->nr++;
+
+		names += name_len + 1;
+		i += (name_len + F2FS_SLOT_LEN - 1) / F2FS_SLOT_LEN;
+	}
+
+	f2fs_dentry_hash_batch(batch->name, batch->name_len, batch->nr,
+							batch->hash);
+}
+
+/* result of the child inode checked for the current entry of @f */
+static void fsck_dentry_done(struct fsck_frame *f, int ret)
+{
+	struct dentry_batch *batch = f->batch;
+	struct child_info *child = &f->dir->child;
+	struct f2fs_dir_entry *dentry = f->dentry;
+	int i = batch->slot[f->n];
+	int name_len = batch->name_len[f->n];
+	int slots = (name_len + F2FS_SLOT_LEN - 1) / F2FS_SLOT_LEN;
+
+	if (ret && config.fix_on) {
+		int j;
+
+		for (j = 0; j < slots; j++)
+			test_and_clear_bit_le(i + j, f->bitmap);
+		FIX_MSG("Unlink [0x%x] - %s len[0x%x], type[0x%x]",
+				le32_to_cpu(dentry[i].ino),
+				batch->name[f->n], name_len,
+				dentry[i].file_type);
+		f->fixed = 1;
+	} else if (ret == 0) {
+		if (dentry[i].file_type == F2FS_FT_DIR)
+			child->links++;
+		f->dentries++;
+		child->files++;
+	}
+	f->n++;
+}
+
+/*
+ * Check the entries of a dentry frame from where it stopped.  Returns 1
+ * when the frame of a child inode was pushed on top, 0 once all are done.
+ */
+static int fsck_dentries_step(struct f2fs_sb_info *sbi, struct fsck_frame *f)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct dentry_batch *batch = f->batch;
+	struct child_info *child = &f->dir->child;
+	struct f2fs_dir_entry *dentry = f->dentry;
+	__u8 (*filenames)[F2FS_SLOT_LEN] = f->filenames;
+	enum FILE_TYPE ftype;
+	u8 *name;
+	u16 name_len;
+	int ret;
+	int i;
+
+	while (f->n < batch->nr) {
+		i = batch->slot[f->n];
+		name = (u8 *)batch->name[f->n];
+		name_len = batch->name_len[f->n];
+		ftype = dentry[i].file_type;
 
 		/* Becareful. 'dentry.file_type' is not imode. */
 		if (ftype == F2FS_FT_DIR) {
@@ -1299,11 +1477,12 @@ static int __chk_dentries(struct f2fs_sb_info *sbi, struct child_info *child,
 				(name[0] == '.' && name[1] == '.' &&
 							name_len == 2)) {
 				ret = __chk_dots_dentries(sbi, &dentry[i],
-					child, name, name_len, &filenames[i],
-					encrypted);
+					child, name, name_len,
+					batch->hash[f->n], &filenames[i],
+					f->encrypted);
 				switch (ret) {
 				case 1:
-					fixed = 1;
+					f->fixed = 1;
 				case 0:
 					child->dots++;
 					break;
@@ -1312,122 +1491,130 @@ static int __chk_dentries(struct f2fs_sb_info *sbi, struct child_info *child,
 				if (child->dots > 2) {
 					ASSERT_MSG("More than one '.' or '..', should delete the extra one\n");
 					nullify_dentry(&dentry[i], i,
-						       &filenames[i], &bitmap);
+						&filenames[i], &f->bitmap);
 					child->dots--;
-					fixed = 1;
+					f->fixed = 1;
 				}
-
-				i++;
-				free(name);
+				f->n++;
 				continue;
 			}
 		}
 
-		if (f2fs_check_hash_code(dentry + i, name, name_len, encrypted))
-			fixed = 1;
+		if (f2fs_check_hash_code(dentry + i, name, name_len,
+					batch->hash[f->n], f->encrypted))
+			f->fixed = 1;
 
-		if (max == NR_DENTRY_IN_BLOCK)
-			f2fs_check_dirent_position(name, name_len, child->pgofs,
-						child->dir_level, child->p_ino);
+		if (f->max == NR_DENTRY_IN_BLOCK)
+			f2fs_check_dirent_position(name, batch->hash[f->n],
+					f->level, child->pgofs,
+					child->dir_level, child->p_ino);
 
 		DBG(1, "[%3u]-[0x%x] name[%s] len[0x%x] ino[0x%x] type[0x%x]\n",
 				fsck->dentry_depth, i, name, name_len,
 				le32_to_cpu(dentry[i].ino),
 				dentry[i].file_type);
 
-		print_dentry(fsck->dentry_depth, name, bitmap,
-				dentry, max, i, last_blk, encrypted);
-
-		blk_cnt = 1;
-		ret = fsck_chk_node_blk(sbi,
-				NULL, le32_to_cpu(dentry[i].ino), name,
-				ftype, TYPE_INODE, &blk_cnt, NULL);
-
-		if (ret && config.fix_on) {
-			int j;
-
-			for (j = 0; j < slots; j++)
-				test_and_clear_bit_le(i + j, bitmap);
-			FIX_MSG("Unlink [0x%x] - %s len[0x%x], type[0x%x]",
-					le32_to_cpu(dentry[i].ino),
-					name, name_len,
-					dentry[i].file_type);
-			fixed = 1;
-		} else if (ret == 0) {
-			if (ftype == F2FS_FT_DIR)
-				child->links++;
-			dentries++;
-			child->files++;
-		}
+		print_dentry(fsck->dentry_depth, name, f->bitmap,
+				dentry, f->max, i, f->last_blk, f->encrypted);
 
-		i += slots;
-		free(name);
+		ret = fsck_push_inode(sbi, le32_to_cpu(dentry[i].ino), name,
+								ftype, 1);
+		if (!ret)
+			return 1;
+		fsck_dentry_done(f, ret);
 	}
-	return fixed ? -1 : dentries;
+	return 0;
 }
 
-int fsck_chk_inline_dentries(struct f2fs_sb_info *sbi,
-		struct f2fs_node *node_blk, struct child_info *child)
+/*
+ * Push the frame scanning a dentry block of the inode frame on top, or its
+ * inline dentries when @blk_addr is NULL_ADDR.
+ */
+static void fsck_push_dentries(struct f2fs_sb_info *sbi, block_t blk_addr,
+					int last_blk, int encrypted)
 {
 	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
-	struct f2fs_inline_dentry *de_blk;
-	int dentries;
+	struct fsck_frame *dir = fsck->frames[fsck->nr_frames - 1];
+	struct fsck_frame *f = fsck_push_frame(fsck);
+	int ret;
 
-	de_blk = inline_data_addr(node_blk);
-	ASSERT(de_blk != NULL);
+	f->state = FRAME_DENTRIES;
+	f->dir = dir;
+	f->blk_addr = blk_addr;
+	f->last_blk = last_blk;
+	f->encrypted = encrypted;
 
-	fsck->dentry_depth++;
-	dentries = __chk_dentries(sbi, child,
-			de_blk->dentry_bitmap,
-			de_blk->dentry, de_blk->filename,
-			NR_INLINE_DENTRY, 1,
-			file_is_encrypt(node_blk->i.i_advise));
-	if (dentries < 0) {
-		DBG(1, "[%3d] Inline Dentry Block Fixed hash_codes\n\n",
-			fsck->dentry_depth);
+	if (blk_addr == NULL_ADDR) {
+		struct f2fs_inline_dentry *de_blk;
+
+		de_blk = inline_data_addr(dir->node_blk);
+		ASSERT(de_blk != NULL);
+
+		f->bitmap = de_blk->dentry_bitmap;
+		f->dentry = de_blk->dentry;
+		f->filenames = de_blk->filename;
+		f->max = NR_INLINE_DENTRY;
 	} else {
-		DBG(1, "[%3d] Inline Dentry Block Done : "
-				"dentries:%d in %d slots (len:%d)\n\n",
-			fsck->dentry_depth, dentries,
-			(int)NR_INLINE_DENTRY, F2FS_NAME_LEN);
+		f->de_blk = f2fs_blk_alloc();
+		ASSERT(f->de_blk != NULL);
+
+		ret = dev_read_block(f->de_blk, blk_addr);
+		ASSERT(ret >= 0);
+
+		f->bitmap = f->de_blk->dentry_bitmap;
+		f->dentry = f->de_blk->dentry;
+		f->filenames = f->de_blk->filename;
+		f->max = NR_DENTRY_IN_BLOCK;
+		f->level = __get_current_level(dir->child.dir_level,
+							dir->child.pgofs);
 	}
-	fsck->dentry_depth--;
-	return dentries;
+
+	if (!f->batch) {
+		f->batch = malloc(sizeof(struct dentry_batch));
+		ASSERT(f->batch != NULL);
+	}
+
+	fsck->dentry_depth++;
+	__decode_dentries(sbi, &dir->walk, f->bitmap, f->dentry, f->filenames,
+					f->max, f->batch, &f->fixed);
 }
 
-int fsck_chk_dentry_blk(struct f2fs_sb_info *sbi, u32 blk_addr,
-		struct child_info *child, int last_blk, int encrypted)
+static void fsck_dentries_end(struct f2fs_sb_info *sbi, struct fsck_frame *f)
 {
 	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
-	struct f2fs_dentry_block *de_blk;
-	int dentries, ret;
-
-	de_blk = (struct f2fs_dentry_block *)calloc(BLOCK_SZ, 1);
-	ASSERT(de_blk != NULL);
-
-	ret = dev_read_block(de_blk, blk_addr);
-	ASSERT(ret >= 0);
+	int dentries = f->fixed ? -1 : f->dentries;
+	int ret;
 
-	fsck->dentry_depth++;
-	dentries = __chk_dentries(sbi, child,
-			de_blk->dentry_bitmap,
-			de_blk->dentry, de_blk->filename,
-			NR_DENTRY_IN_BLOCK, last_blk, encrypted);
+	if (config.stats_path)
+		fsck_stat_dentries(sbi, f->bitmap, f->max);
 
-	if (dentries < 0 && !config.ro) {
-		ret = dev_write_block(de_blk, blk_addr);
-		ASSERT(ret >= 0);
-		DBG(1, "[%3d] Dentry Block [0x%x] Fixed hash_codes\n\n",
-			fsck->dentry_depth, blk_addr);
+	if (!f->de_blk) {
+		if (dentries < 0) {
+			/* should fix this bug all the time */
+			f->dir->need_fix = 1;
+			DBG(1, "[%3d] Inline Dentry Block Fixed hash_codes\n\n",
+				fsck->dentry_depth);
+		} else {
+			DBG(1, "[%3d] Inline Dentry Block Done : "
+				"dentries:%d in %d slots (len:%d)\n\n",
+				fsck->dentry_depth, dentries,
+				(int)NR_INLINE_DENTRY, F2FS_NAME_LEN);
+		}
 	} else {
-		DBG(1, "[%3d] Dentry Block [0x%x] Done : "
+		if (dentries < 0 && !config.ro) {
+			ret = dev_write_block(f->de_blk, f->blk_addr);
+			ASSERT(ret >= 0);
+			DBG(1, "[%3d] Dentry Block [0x%x] Fixed hash_codes\n\n",
+				fsck->dentry_depth, f->blk_addr);
+		} else {
+			DBG(1, "[%3d] Dentry Block [0x%x] Done : "
 				"dentries:%d in %d slots (len:%d)\n\n",
-			fsck->dentry_depth, blk_addr, dentries,
-			NR_DENTRY_IN_BLOCK, F2FS_NAME_LEN);
+				fsck->dentry_depth, f->blk_addr, dentries,
+				NR_DENTRY_IN_BLOCK, F2FS_NAME_LEN);
+		}
+		f2fs_blk_free(f->de_blk);
 	}
 	fsck->dentry_depth--;
-	free(de_blk);
-	return 0;
 }
 
 int fsck_chk_data_blk(struct f2fs_sb_info *sbi, u32 blk_addr,
@@ -1464,12 +1651,54 @@ int fsck_chk_data_blk(struct f2fs_sb_info *sbi, u32 blk_addr,
 
 	fsck->chk.valid_blk_cnt++;
 
-	if (ftype == F2FS_FT_DIR) {
+	if (config.stats_path)
+		fsck_stat_data_blk(sbi, child, blk_addr);
+
+	/* the dentries of a directory block get a frame of their own */
+	if (ftype == F2FS_FT_DIR)
 		f2fs_set_main_bitmap(sbi, blk_addr, CURSEG_HOT_DATA);
-		return fsck_chk_dentry_blk(sbi, blk_addr, child,
-						last_blk, encrypted);
-	} else {
+	else
 		f2fs_set_main_bitmap(sbi, blk_addr, CURSEG_WARM_DATA);
+	return 0;
+}
+
+int fsck_chk_node_blk(struct f2fs_sb_info *sbi, struct f2fs_inode *inode,
+		u32 nid, u8 *name, enum FILE_TYPE ftype, enum NODE_TYPE ntype,
+		u32 *blk_cnt, struct child_info *child)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	u32 base = fsck->nr_frames;
+	struct fsck_frame *f;
+
+	/* index nodes are visited by node_walk() from the inode */
+	ASSERT(ntype == TYPE_INODE);
+
+	if (fsck_push_inode(sbi, nid, name, ftype, *blk_cnt))
+		return -EINVAL;
+
+	while (fsck->nr_frames > base) {
+		f = fsck->frames[fsck->nr_frames - 1];
+
+		if (f->state == FRAME_DENTRIES) {
+			if (fsck_dentries_step(sbi, f))
+				continue;
+			fsck_dentries_end(sbi, f);
+			fsck->nr_frames--;
+			continue;
+		}
+
+		if (fsck_inode_step(sbi, f))
+			continue;
+		*blk_cnt = f->blk_cnt;
+		f2fs_blk_free(f->node_blk);
+		fsck->nr_frames--;
+
+		/* hand the result to the entry of the parent directory */
+		if (fsck->nr_frames > base) {
+			f = fsck->frames[fsck->nr_frames - 1];
+			ASSERT(f->state == FRAME_DENTRIES);
+			fsck_dentry_done(f, 0);
+		}
 	}
 	return 0;
 }
@@ -1488,10 +1717,10 @@ void fsck_chk_orphan_node(struct f2fs_sb_info *sbi)
 	start_blk = __start_cp_addr(sbi) + 1 + get_sb(cp_payload);
 	orphan_blkaddr = __start_sum_addr(sbi) - 1 - get_sb(cp_payload);
 
-	orphan_blk = calloc(BLOCK_SZ, 1);
+	orphan_blk = f2fs_blk_alloc();
 	ASSERT(orphan_blk);
 
-	new_blk = calloc(BLOCK_SZ, 1);
+	new_blk = f2fs_blk_zalloc();
 	ASSERT(new_blk);
 
 	for (i = 0; i < orphan_blkaddr; i++) {
@@ -1522,33 +1751,30 @@ void fsck_chk_orphan_node(struct f2fs_sb_info *sbi)
 			ret = dev_write_block(new_blk, start_blk + i);
 			ASSERT(ret >= 0);
 		}
-		memset(orphan_blk, 0, BLOCK_SZ);
 		memset(new_blk, 0, BLOCK_SZ);
 	}
-	free(orphan_blk);
-	free(new_blk);
+	f2fs_blk_free(orphan_blk);
+	f2fs_blk_free(new_blk);
 }
 
 int fsck_chk_meta(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
 	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
-	struct seg_entry *se;
 	unsigned int sit_valid_segs = 0, sit_node_blks = 0;
 	unsigned int i;
 
 	/* 1. check sit usage with CP: curseg is lost? */
 	for (i = 0; i < TOTAL_SEGS(sbi); i++) {
-		se = get_seg_entry(sbi, i);
-		if (se->valid_blocks != 0)
+		if (SE_VALID_BLOCKS(sbi, i) != 0)
 			sit_valid_segs++;
 		else if (IS_CUR_SEGNO(sbi, i, NO_CHECK_TYPE)) {
 			/* curseg has not been written back to device */
 			MSG(1, "\tInfo: curseg %u is counted in valid segs\n", i);
 			sit_valid_segs++;
 		}
-		if (IS_NODESEG(se->type))
-			sit_node_blks += se->valid_blocks;
+		if (IS_NODESEG(SE_TYPE(sbi, i)))
+			sit_node_blks += SE_VALID_BLOCKS(sbi, i);
 	}
 	if (fsck->chk.sit_free_segs + sit_valid_segs != TOTAL_SEGS(sbi)) {
 		ASSERT_MSG("SIT usage does not match: sit_free_segs %u, "
@@ -1675,7 +1901,7 @@ static void fix_hard_links(struct f2fs_sb_info *sbi)
 	if (fsck->hard_link_list_head == NULL)
 		return;
 
-	node_blk = (struct f2fs_node *)calloc(BLOCK_SZ, 1);
+	node_blk = f2fs_blk_alloc();
 	ASSERT(node_blk != NULL);
 
 	node = fsck->hard_link_list_head;
@@ -1696,6 +1922,7 @@ static void fix_hard_links(struct f2fs_sb_info *sbi)
 		node = node->next;
 		free(tmp);
 	}
+	f2fs_blk_free(node_blk);
 }
 
 static void fix_nat_entries(struct f2fs_sb_info *sbi)
@@ -1768,12 +1995,11 @@ int check_curseg_offset(struct f2fs_sb_info *sbi)
 
 	for (i = 0; i < NO_CHECK_TYPE; i++) {
 		struct curseg_info *curseg = CURSEG_I(sbi, i);
-		struct seg_entry *se;
+		const char *valid_map;
 		int j, nblocks;
 
-		se = get_seg_entry(sbi, curseg->segno);
-		if (f2fs_test_bit(curseg->next_blkoff,
-					(const char *)se->cur_valid_map)) {
+		valid_map = (const char *)SE_VALID_MAP(sbi, curseg->segno);
+		if (f2fs_test_bit(curseg->next_blkoff, valid_map)) {
 			ASSERT_MSG("Next block offset is not free, type:%d", i);
 			return -EINVAL;
 		}
@@ -1782,7 +2008,7 @@ int check_curseg_offset(struct f2fs_sb_info *sbi)
 
 		nblocks = sbi->blocks_per_seg;
 		for (j = curseg->next_blkoff + 1; j < nblocks; j++) {
-			if (f2fs_test_bit(j, (const char *)se->cur_valid_map)) {
+			if (f2fs_test_bit(j, valid_map)) {
 				ASSERT_MSG("LFS must have free section:%d", i);
 				return -EINVAL;
 			}
@@ -1797,15 +2023,12 @@ int check_sit_types(struct f2fs_sb_info *sbi)
 	int err = 0;
 
 	for (i = 0; i < TOTAL_SEGS(sbi); i++) {
-		struct seg_entry *se;
-
-		se = get_seg_entry(sbi, i);
-		if (se->orig_type != se->type) {
-			if (se->orig_type == CURSEG_COLD_DATA) {
-				se->type = se->orig_type;
+		if (SE_ORIG_TYPE(sbi, i) != SE_TYPE(sbi, i)) {
+			if (SE_ORIG_TYPE(sbi, i) == CURSEG_COLD_DATA) {
+				SE_TYPE(sbi, i) = SE_ORIG_TYPE(sbi, i);
 			} else {
 				FIX_MSG("Wrong segment type [0x%x] %x -> %x",
-						i, se->orig_type, se->type);
+					i, SE_ORIG_TYPE(sbi, i), SE_TYPE(sbi, i));
 				err = -EINVAL;
 			}
 		}
@@ -1822,11 +2045,12 @@ int fsck_verify(struct f2fs_sb_info *sbi)
 	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
 	struct hard_link_node *node = NULL;
 
-	printf("\n");
+	/* the report, printed at any dbg_lv but DBG_QUIET */
+	MSG(-1, "\n");
 
 	for (i = 0; i < fsck->nr_nat_entries; i++) {
 		if (f2fs_test_bit(i, fsck->nat_area_bitmap) != 0) {
-			printf("NID[0x%x] is unreachable\n", i);
+			MSG(-1, "NID[0x%x] is unreachable\n", i);
 			nr_unref_nid++;
 		}
 	}
@@ -1834,110 +2058,110 @@ int fsck_verify(struct f2fs_sb_info *sbi)
 	if (fsck->hard_link_list_head != NULL) {
 		node = fsck->hard_link_list_head;
 		while (node) {
-			printf("NID[0x%x] has [0x%x] more unreachable links\n",
+			MSG(-1, "NID[0x%x] has [0x%x] more unreachable links\n",
 					node->nid, node->links);
 			node = node->next;
 		}
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] Unreachable nat entries                       ");
+	MSG(-1, "[FSCK] Unreachable nat entries                       ");
 	if (nr_unref_nid == 0x0) {
-		printf(" [Ok..] [0x%x]\n", nr_unref_nid);
+		MSG(-1, " [Ok..] [0x%x]\n", nr_unref_nid);
 	} else {
-		printf(" [Fail] [0x%x]\n", nr_unref_nid);
+		MSG(-1, " [Fail] [0x%x]\n", nr_unref_nid);
 		ret = EXIT_ERR_CODE;
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] SIT valid block bitmap checking                ");
+	MSG(-1, "[FSCK] SIT valid block bitmap checking                ");
 	if (memcmp(fsck->sit_area_bitmap, fsck->main_area_bitmap,
 					fsck->sit_area_bitmap_sz) == 0x0) {
-		printf("[Ok..]\n");
+		MSG(-1, "[Ok..]\n");
 	} else {
-		printf("[Fail]\n");
+		MSG(-1, "[Fail]\n");
 		ret = EXIT_ERR_CODE;
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] Hard link checking for regular file           ");
+	MSG(-1, "[FSCK] Hard link checking for regular file           ");
 	if (fsck->hard_link_list_head == NULL) {
-		printf(" [Ok..] [0x%x]\n", fsck->chk.multi_hard_link_files);
+		MSG(-1, " [Ok..] [0x%x]\n", fsck->chk.multi_hard_link_files);
 	} else {
-		printf(" [Fail] [0x%x]\n", fsck->chk.multi_hard_link_files);
+		MSG(-1, " [Fail] [0x%x]\n", fsck->chk.multi_hard_link_files);
 		ret = EXIT_ERR_CODE;
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] valid_block_count matching with CP            ");
+	MSG(-1, "[FSCK] valid_block_count matching with CP            ");
 	if (sbi->total_valid_block_count == fsck->chk.valid_blk_cnt) {
-		printf(" [Ok..] [0x%x]\n", (u32)fsck->chk.valid_blk_cnt);
+		MSG(-1, " [Ok..] [0x%x]\n", (u32)fsck->chk.valid_blk_cnt);
 	} else {
-		printf(" [Fail] [0x%x]\n", (u32)fsck->chk.valid_blk_cnt);
+		MSG(-1, " [Fail] [0x%x]\n", (u32)fsck->chk.valid_blk_cnt);
 		ret = EXIT_ERR_CODE;
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] valid_node_count matcing with CP (de lookup)  ");
+	MSG(-1, "[FSCK] valid_node_count matcing with CP (de lookup)  ");
 	if (sbi->total_valid_node_count == fsck->chk.valid_node_cnt) {
-		printf(" [Ok..] [0x%x]\n", fsck->chk.valid_node_cnt);
+		MSG(-1, " [Ok..] [0x%x]\n", fsck->chk.valid_node_cnt);
 	} else {
-		printf(" [Fail] [0x%x]\n", fsck->chk.valid_node_cnt);
+		MSG(-1, " [Fail] [0x%x]\n", fsck->chk.valid_node_cnt);
 		ret = EXIT_ERR_CODE;
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] valid_node_count matcing with CP (nat lookup) ");
+	MSG(-1, "[FSCK] valid_node_count matcing with CP (nat lookup) ");
 	if (sbi->total_valid_node_count == fsck->chk.valid_nat_entry_cnt) {
-		printf(" [Ok..] [0x%x]\n", fsck->chk.valid_nat_entry_cnt);
+		MSG(-1, " [Ok..] [0x%x]\n", fsck->chk.valid_nat_entry_cnt);
 	} else {
-		printf(" [Fail] [0x%x]\n", fsck->chk.valid_nat_entry_cnt);
+		MSG(-1, " [Fail] [0x%x]\n", fsck->chk.valid_nat_entry_cnt);
 		ret = EXIT_ERR_CODE;
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] valid_inode_count matched with CP             ");
+	MSG(-1, "[FSCK] valid_inode_count matched with CP             ");
 	if (sbi->total_valid_inode_count == fsck->chk.valid_inode_cnt) {
-		printf(" [Ok..] [0x%x]\n", fsck->chk.valid_inode_cnt);
+		MSG(-1, " [Ok..] [0x%x]\n", fsck->chk.valid_inode_cnt);
 	} else {
-		printf(" [Fail] [0x%x]\n", fsck->chk.valid_inode_cnt);
+		MSG(-1, " [Fail] [0x%x]\n", fsck->chk.valid_inode_cnt);
 		ret = EXIT_ERR_CODE;
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] free segment_count matched with CP            ");
+	MSG(-1, "[FSCK] free segment_count matched with CP            ");
 	if (le32_to_cpu(F2FS_CKPT(sbi)->free_segment_count) ==
 						fsck->chk.sit_free_segs) {
-		printf(" [Ok..] [0x%x]\n", fsck->chk.sit_free_segs);
+		MSG(-1, " [Ok..] [0x%x]\n", fsck->chk.sit_free_segs);
 	} else {
-		printf(" [Fail] [0x%x]\n", fsck->chk.sit_free_segs);
+		MSG(-1, " [Fail] [0x%x]\n", fsck->chk.sit_free_segs);
 		ret = EXIT_ERR_CODE;
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] next block offset is free                     ");
+	MSG(-1, "[FSCK] next block offset is free                     ");
 	if (check_curseg_offset(sbi) == 0) {
-		printf(" [Ok..]\n");
+		MSG(-1, " [Ok..]\n");
 	} else {
-		printf(" [Fail]\n");
+		MSG(-1, " [Fail]\n");
 		ret = EXIT_ERR_CODE;
 		config.bug_on = 1;
 	}
 
-	printf("[FSCK] fixing SIT types\n");
+	MSG(-1, "[FSCK] fixing SIT types\n");
 	if (check_sit_types(sbi) != 0)
 		force = 1;
 
-	printf("[FSCK] other corrupted bugs                          ");
+	MSG(-1, "[FSCK] other corrupted bugs                          ");
 	if (config.bug_on == 0) {
-		printf(" [Ok..]\n");
+		MSG(-1, " [Ok..]\n");
 	} else {
-		printf(" [Fail]\n");
+		MSG(-1, " [Fail]\n");
 		ret = EXIT_ERR_CODE;
 	}
 
-	/* fix global metadata */
-	if (force || (config.fix_on && !config.ro)) {
+	/* fix global metadata, but never for an image checked by -B */
+	if (!config.assert_jmp && (force || (config.fix_on && !config.ro))) {
 		struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
 
 		if (force || config.bug_on) {
@@ -1954,9 +2178,119 @@ int fsck_verify(struct f2fs_sb_info *sbi)
 	return ret;
 }
 
+static void print_stats_hist(FILE *fp, const char *name, u32 *hist)
+{
+	static const char *bucket_names[FSCK_STAT_BUCKETS] = {
+		"0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+",
+	};
+	int i;
+
+	fprintf(fp, "  \"%s\": {", name);
+	for (i = 0; i < FSCK_STAT_BUCKETS; i++)
+		fprintf(fp, "%s\"%s\": %u", i ? ", " : " ",
+					bucket_names[i], hist[i]);
+	fprintf(fp, " },\n");
+}
+
+static double stats_ratio(u64 num, u64 den)
+{
+	return den ? (double)num / den : 0.0;
+}
+
+int fsck_print_stats(struct f2fs_sb_info *sbi, const char *path)
+{
+	static const char *log_names[NO_CHECK_TYPE] = {
+		"hot_data", "warm_data", "cold_data",
+		"hot_node", "warm_node", "cold_node",
+	};
+	struct fsck_stats *stat = &F2FS_FSCK(sbi)->stat;
+	u32 segs[NO_CHECK_TYPE] = { 0 };
+	u64 vblocks[NO_CHECK_TYPE] = { 0 };
+	u32 free_segs = 0;
+	u64 frag = 0, span = 0;
+	FILE *fp;
+	unsigned int i;
+
+	if (!strcmp(path, "-"))
+		fp = fdopen(config.stats_fd, "w");
+	else
+		fp = fopen(path, "w");
+	if (!fp) {
+		MSG(0, "\tError: Failed to open stats file %s\n", path);
+		return -errno;
+	}
+
+	for (i = 0; i < TOTAL_SEGS(sbi); i++) {
+		unsigned int type = SE_TYPE(sbi, i);
+
+		if (!SE_VALID_BLOCKS(sbi, i) || type >= NO_CHECK_TYPE) {
+			free_segs++;
+			continue;
+		}
+		segs[type]++;
+		vblocks[type] += SE_VALID_BLOCKS(sbi, i);
+	}
+
+	/*
+	 * 0 when every file is a single extent, 1 when no two logically
+	 * adjacent blocks are physically adjacent.
+	 */
+	if (stat->data_blks > stat->data_files) {
+		frag = stat->extents - stat->data_files;
+		span = stat->data_blks - stat->data_files;
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"files\": { \"regular\": %u, \"dirs\": %u, "
+			"\"symlinks\": %u, \"others\": %u },\n",
+			stat->reg_files, stat->dirs,
+			stat->symlinks, stat->others);
+	fprintf(fp, "  \"inline\": { \"data\": %u, \"dentry\": %u, "
+			"\"dentry_slot_fill\": %.4f },\n",
+			stat->inline_data, stat->inline_dentry,
+			stats_ratio(stat->inline_dentry_slots,
+				(u64)stat->inline_dentry * NR_INLINE_DENTRY));
+	print_stats_hist(fp, "extents_per_file", stat->extent_hist);
+	fprintf(fp, "  \"fragmentation\": { \"files_with_data\": %u, "
+			"\"fragmented_files\": %u, \"extents\": %"PRIu64", "
+			"\"data_blocks\": %"PRIu64", \"score\": %.4f },\n",
+			stat->data_files, stat->fragmented_files,
+			stat->extents, stat->data_blks,
+			stats_ratio(frag, span));
+	fprintf(fp, "  \"directories\": { \"max_depth\": %u, "
+			"\"dentry_blocks\": %"PRIu64", "
+			"\"bucket_fill\": %.4f },\n",
+			stat->max_dir_depth, stat->dentry_blks,
+			stats_ratio(stat->dentry_slots,
+				stat->dentry_blks * NR_DENTRY_IN_BLOCK));
+	print_stats_hist(fp, "dir_hash_depth", stat->hash_depth_hist);
+	print_stats_hist(fp, "node_data_seg_distance", stat->locality_hist);
+	fprintf(fp, "  \"node_data_locality\": { \"blocks\": %"PRIu64", "
+			"\"avg_seg_distance\": %.2f },\n",
+			stat->locality_blks,
+			stats_ratio(stat->locality_dist, stat->locality_blks));
+	fprintf(fp, "  \"segments\": {\n");
+	fprintf(fp, "    \"free\": %u,\n", free_segs);
+	for (i = 0; i < NO_CHECK_TYPE; i++)
+		fprintf(fp, "    \"%s\": { \"segments\": %u, "
+				"\"valid_blocks\": %"PRIu64", "
+				"\"utilization\": %.4f }%s\n",
+				log_names[i], segs[i], vblocks[i],
+				stats_ratio(vblocks[i],
+					(u64)segs[i] * sbi->blocks_per_seg),
+				i == NO_CHECK_TYPE - 1 ? "" : ",");
+	fprintf(fp, "  }\n");
+	fprintf(fp, "}\n");
+
+	fclose(fp);
+	return 0;
+}
+
 void fsck_free(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	u32 i;
+
 	if (fsck->main_area_bitmap)
 		free(fsck->main_area_bitmap);
 
@@ -1971,4 +2305,12 @@ void fsck_free(struct f2fs_sb_info *sbi)
 
 	if (tree_mark)
 		free(tree_mark);
+
+	for (i = 0; i < fsck->max_frames; i++) {
+		if (!fsck->frames[i])
+			continue;
+		free(fsck->frames[i]->batch);
+		free(fsck->frames[i]);
+	}
+	free(fsck->frames);
 }
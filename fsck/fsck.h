@@ -44,8 +44,46 @@ struct child_info {
 	u32 pp_ino;		/*parent parent ino*/
 	struct extent_info ei;
 	u32 last_blk;
+	u32 node_blk;		/* node block holding the data addresses */
+	u32 stat_extents;	/* physically contiguous runs seen so far */
+	u32 stat_blks;
+	u32 stat_last_blk;
+	u32 stat_last_pgofs;
 };
 
+/* log2 buckets: 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63, 64+ */
+#define FSCK_STAT_BUCKETS	8
+
+struct fsck_stats {
+	u32 reg_files;
+	u32 dirs;
+	u32 symlinks;
+	u32 others;
+	u32 inline_data;
+	u32 inline_dentry;
+
+	/* extent layout of regular file and directory data */
+	u32 extent_hist[FSCK_STAT_BUCKETS];
+	u32 data_files;
+	u32 fragmented_files;
+	u64 extents;
+	u64 data_blks;
+
+	/* directories */
+	u32 max_dir_depth;
+	u32 hash_depth_hist[FSCK_STAT_BUCKETS];
+	u64 dentry_blks;
+	u64 dentry_slots;
+	u64 inline_dentry_slots;
+
+	/* segment distance between a node block and its data blocks */
+	u32 locality_hist[FSCK_STAT_BUCKETS];
+	u64 locality_blks;
+	u64 locality_dist;
+};
+
+struct fsck_frame;
+
 struct f2fs_fsck {
 	struct f2fs_sb_info sbi;
 
@@ -76,8 +114,13 @@ struct f2fs_fsck {
 	u32 nr_nat_entries;
 
 	u32 dentry_depth;
+	struct fsck_frame **frames;	/* inodes and dentry blocks in check */
+	u32 nr_frames;
+	u32 max_frames;
 	struct f2fs_nat_entry *entries;
 	u32 nat_valid_inode_cnt;
+
+	struct fsck_stats stat;
 };
 
 #define BLOCK_SZ		4096
@@ -114,33 +157,21 @@ extern void fsck_chk_orphan_node(struct f2fs_sb_info *);
 extern int fsck_chk_node_blk(struct f2fs_sb_info *, struct f2fs_inode *, u32,
 		u8 *, enum FILE_TYPE, enum NODE_TYPE, u32 *,
 		struct child_info *);
-extern void fsck_chk_inode_blk(struct f2fs_sb_info *, u32, enum FILE_TYPE,
-		struct f2fs_node *, u32 *, struct node_info *);
-extern int fsck_chk_dnode_blk(struct f2fs_sb_info *, struct f2fs_inode *,
-		u32, enum FILE_TYPE, struct f2fs_node *, u32 *,
-		struct child_info *, struct node_info *);
-extern int fsck_chk_idnode_blk(struct f2fs_sb_info *, struct f2fs_inode *,
-		enum FILE_TYPE, struct f2fs_node *, u32 *, struct child_info *);
-extern int fsck_chk_didnode_blk(struct f2fs_sb_info *, struct f2fs_inode *,
-		enum FILE_TYPE, struct f2fs_node *, u32 *, struct child_info *);
 extern int fsck_chk_data_blk(struct f2fs_sb_info *sbi, u32, struct child_info *,
 		int, enum FILE_TYPE, u32, u16, u8, int);
-extern int fsck_chk_dentry_blk(struct f2fs_sb_info *, u32, struct child_info *,
-		int, int);
-int fsck_chk_inline_dentries(struct f2fs_sb_info *, struct f2fs_node *,
-		struct child_info *);
 int fsck_chk_meta(struct f2fs_sb_info *sbi);
 
 extern void update_free_segments(struct f2fs_sb_info *);
 void print_cp_state(u32);
 extern void print_node_info(struct f2fs_node *);
 extern void print_inode_info(struct f2fs_inode *, int);
-extern struct seg_entry *get_seg_entry(struct f2fs_sb_info *, unsigned int);
 extern struct f2fs_summary_block *get_sum_block(struct f2fs_sb_info *,
 				unsigned int, int *);
 extern int get_sum_entry(struct f2fs_sb_info *, u32, struct f2fs_summary *);
 extern void update_sum_entry(struct f2fs_sb_info *, block_t,
 				struct f2fs_summary *);
+extern void update_sum_entries(struct f2fs_sb_info *, block_t,
+				struct f2fs_summary *, unsigned int);
 extern void get_node_info(struct f2fs_sb_info *, nid_t, struct node_info *);
 extern void nullify_nat_entry(struct f2fs_sb_info *, u32);
 extern void rewrite_sit_area_bitmap(struct f2fs_sb_info *);
@@ -148,16 +179,22 @@ extern void build_nat_area_bitmap(struct f2fs_sb_info *);
 extern void build_sit_area_bitmap(struct f2fs_sb_info *);
 extern void fsck_init(struct f2fs_sb_info *);
 extern int fsck_verify(struct f2fs_sb_info *);
+extern int fsck_print_stats(struct f2fs_sb_info *, const char *);
 extern void fsck_free(struct f2fs_sb_info *);
 extern int f2fs_do_mount(struct f2fs_sb_info *);
 extern void f2fs_do_umount(struct f2fs_sb_info *);
 
+extern int f2fs_init_meta_cache(struct f2fs_sb_info *);
+extern int f2fs_flush_meta_cache(struct f2fs_sb_info *);
+extern void f2fs_exit_meta_cache(struct f2fs_sb_info *);
 extern void flush_journal_entries(struct f2fs_sb_info *);
 extern void zero_journal_entries(struct f2fs_sb_info *);
 extern void flush_sit_entries(struct f2fs_sb_info *);
 extern void move_curseg_info(struct f2fs_sb_info *, u64);
 extern void write_curseg_info(struct f2fs_sb_info *);
 extern int find_next_free_block(struct f2fs_sb_info *, u64 *, int, int);
+extern void reset_alloc_cursors(struct f2fs_sb_info *);
+extern int alloc_next_free_block(struct f2fs_sb_info *, u64 *, int);
 extern void write_checkpoint(struct f2fs_sb_info *);
 extern void update_data_blkaddr(struct f2fs_sb_info *, nid_t, u16, block_t);
 extern void update_nat_blkaddr(struct f2fs_sb_info *, nid_t, nid_t, block_t);
@@ -182,6 +219,58 @@ extern void ssa_dump(struct f2fs_sb_info *, int, int);
 extern void dump_node(struct f2fs_sb_info *, nid_t);
 extern int dump_info_from_blkaddr(struct f2fs_sb_info *, u32);
 
+/* walk.c */
+#define NODE_WALK_DEPTH		4	/* inode, double indirect, indirect, direct */
+#define NODE_WALK_AHEAD		8	/* child nodes kept in readahead per level */
+
+struct node_walk_level {
+	struct f2fs_node *node_blk;
+	nid_t nid;
+	block_t blk_addr;
+	u8 version;
+	enum NODE_TYPE ntype;
+	u32 idx;		/* slot being visited */
+	u32 ra_idx;		/* first nid slot not prefetched yet */
+	int dirty;
+};
+
+struct node_walk;
+
+struct node_walk_ops {
+	/* read and check a child node, non-zero skips its file range */
+	int (*node)(struct node_walk *, nid_t, enum NODE_TYPE,
+				struct f2fs_node *, struct node_info *);
+	/*
+	 * every address slot, holes included, at file offset walk->pgofs;
+	 * non-zero pauses the walk right after the slot
+	 */
+	int (*data)(struct node_walk *, struct node_walk_level *, u16,
+								block_t);
+	/* a child node and everything below it has been visited */
+	void (*leave)(struct node_walk *, struct node_walk_level *);
+	/* upcoming blocks, dev_readahead() when not set */
+	void (*prefetch)(struct node_walk *, block_t, u32);
+};
+
+struct node_walk {
+	struct f2fs_sb_info *sbi;
+	const struct node_walk_ops *ops;
+	void *private;
+	int prefetch_data;	/* also readahead data blocks of each node */
+	u32 pgofs;
+	int depth;
+	struct node_walk_level stack[NODE_WALK_DEPTH];
+};
+
+void node_walk_init(struct node_walk *, struct f2fs_sb_info *,
+				const struct node_walk_ops *, void *);
+int node_walk(struct node_walk *, struct node_info *, struct f2fs_node *);
+int node_walk_resume(struct node_walk *);
+void node_walk_prefetch(struct node_walk *, block_t, u32);
+void node_walk_clear_slot(struct node_walk *);
+int node_walk_read_node(struct node_walk *, nid_t, enum NODE_TYPE,
+				struct f2fs_node *, struct node_info *);
+
 /* defrag.c */
 int f2fs_defragment(struct f2fs_sb_info *, u64, u64, u64, int);
 
@@ -189,14 +278,33 @@ int f2fs_defragment(struct f2fs_sb_info *, u64, u64, u64, int);
 int f2fs_resize(struct f2fs_sb_info *);
 
 /* sload.c */
+#define SLOAD_RUN_BLKS		256	/* largest write issued by sload */
+#define SLOAD_IO_DEPTH		64	/* data writes queued ahead of the device */
+
 int f2fs_sload(struct f2fs_sb_info *, const char *, const char *,
 		const char *, struct selabel_handle *);
+unsigned int reserve_new_blocks(struct f2fs_sb_info *, block_t *,
+					unsigned int, int);
 void reserve_new_block(struct f2fs_sb_info *, block_t *,
 					struct f2fs_summary *, int);
+void invalidate_block(struct f2fs_sb_info *, block_t);
 void new_data_block(struct f2fs_sb_info *, void *,
 					struct dnode_of_data *, int);
-int f2fs_build_file(struct f2fs_sb_info *, struct dentry *);
+void f2fs_write_block(struct f2fs_sb_info *, nid_t, void *, u64, pgoff_t);
+void f2fs_data_writer_open(struct f2fs_sb_info *, struct data_writer *,
+					nid_t);
+void f2fs_data_writer_append(struct f2fs_sb_info *, struct data_writer *,
+					char *, unsigned int, void *);
+void f2fs_data_writer_copy(struct f2fs_sb_info *, struct data_writer *,
+					int, u64, unsigned int, int);
+void f2fs_data_writer_skip(struct data_writer *, pgoff_t);
+void f2fs_data_writer_close(struct f2fs_sb_info *, struct data_writer *,
+					u64);
+void f2fs_write_inline_data(struct f2fs_sb_info *, nid_t, void *, u64);
 void f2fs_alloc_nid(struct f2fs_sb_info *, nid_t *, int);
+void f2fs_free_node(struct f2fs_sb_info *, nid_t, int);
+void f2fs_truncate_inode(struct f2fs_sb_info *, struct f2fs_node *);
+void f2fs_free_inode(struct f2fs_sb_info *, struct f2fs_node *);
 void set_data_blkaddr(struct dnode_of_data *);
 block_t new_node_block(struct f2fs_sb_info *,
 					struct dnode_of_data *, unsigned int);
@@ -205,7 +313,22 @@ void get_dnode_of_data(struct f2fs_sb_info *, struct dnode_of_data *,
 int f2fs_create(struct f2fs_sb_info *, struct dentry *);
 int f2fs_mkdir(struct f2fs_sb_info *, struct dentry *);
 int f2fs_symlink(struct f2fs_sb_info *, struct dentry *);
+void f2fs_make_inode(struct f2fs_sb_info *, struct dentry *);
+int f2fs_build_dentries(struct f2fs_sb_info *, nid_t, struct dentry *, int);
+int f2fs_link_dentries(struct f2fs_sb_info *, nid_t, struct dentry *, int);
+void f2fs_inc_links(struct f2fs_sb_info *, nid_t, int);
 int inode_set_selinux(struct f2fs_sb_info *, u32, const char *);
+void inode_init_xattrs(struct f2fs_sb_info *, struct f2fs_node *,
+						struct dentry *);
+int inode_set_xattr(struct f2fs_sb_info *, u32, const char *,
+					const void *, size_t);
+int inode_get_xattr(struct f2fs_sb_info *, struct f2fs_node *, const char *,
+					void *, size_t);
+int f2fs_load_tar(struct f2fs_sb_info *, const char *, nid_t);
+int f2fs_lookup(struct f2fs_sb_info *, nid_t, struct dentry *);
+struct dentry *f2fs_read_dentries(struct f2fs_sb_info *, nid_t, int *);
+void f2fs_free_dentries(struct dentry *, int);
+int f2fs_unlink(struct f2fs_sb_info *, nid_t, struct dentry *);
 int f2fs_find_path(struct f2fs_sb_info *, char *, nid_t *);
 
 #endif /* _FSCK_H_ */
@@ -17,18 +17,29 @@
  */
 #include "fsck.h"
 #include <libgen.h>
+#include <getopt.h>
+#include <selinux/label.h>
+#include "f2fs_format_utils.h"
 
 struct f2fs_fsck gfsck;
 
 void fsck_usage()
 {
 	MSG(0, "\nUsage: fsck.f2fs [options] device\n");
+	MSG(0, "       fsck.f2fs [options] -B manifest\n");
 	MSG(0, "[options]:\n");
 	MSG(0, "  -a check/fix potential corruption, reported by f2fs\n");
+	MSG(0, "  -B, --batch <manifest> only check the images listed, "
+					"one per line [- for stdin]\n");
 	MSG(0, "  -d debug level [default:0]\n");
 	MSG(0, "  -f check/fix entire partition\n");
+	MSG(0, "  -H use hugepages for block buffers\n");
+	MSG(0, "  -j images checked at once with -B "
+					"[default: one per cpu]\n");
 	MSG(0, "  -p preen mode [default:0 the same as -a [0|1]]\n");
 	MSG(0, "  -t show directory tree [-d -1]\n");
+	MSG(0, "  -S, --stats <file> write layout statistics as JSON "
+				"[- for stdout, the rest goes to stderr]\n");
 	exit(1);
 }
 
@@ -51,6 +62,7 @@ void defrag_usage()
 	MSG(0, "\nUsage: defrag.f2fs [options] device\n");
 	MSG(0, "[options]:\n");
 	MSG(0, "  -d debug level [default:0]\n");
+	MSG(0, "  -H use hugepages for block buffers\n");
 	MSG(0, "  -s start block address [default: main_blkaddr]\n");
 	MSG(0, "  -l length [default:512 (2MB)]\n");
 	MSG(0, "  -t target block address [default: main_blkaddr + 2MB]\n");
@@ -63,6 +75,7 @@ void resize_usage()
 	MSG(0, "\nUsage: resize.f2fs [options] device\n");
 	MSG(0, "[options]:\n");
 	MSG(0, "  -d debug level [default:0]\n");
+	MSG(0, "  -H use hugepages for block buffers\n");
 	MSG(0, "  -t target sectors [default: device size]\n");
 	exit(1);
 }
@@ -71,8 +84,15 @@ void sload_usage()
 {
 	MSG(0, "\nUsage: sload.f2fs [options] device\n");
 	MSG(0, "[options]:\n");
-	MSG(0, "  -f source directory [path of the source directory]\n");
+	MSG(0, "  -c compare file data by crc32 on update [default: mtime]\n");
+	MSG(0, "  -F format the device first, as mkfs.f2fs does\n");
+	MSG(0, "  -f source directory [path of the source directory,\n");
+	MSG(0, "     or of a tar archive, optionally compressed; - for stdin]\n");
+	MSG(0, "  -j reader threads [default: one per cpu, 0: none]\n");
+	MSG(0, "  -p placement list [files to lay out first, in order]\n");
+	MSG(0, "  -s file_contexts [SELinux labels of the loaded files]\n");
 	MSG(0, "  -t mount point [prefix of target fs path, default:/]\n");
+	MSG(0, "  -u update the image to the source, writing only changes\n");
 	MSG(0, "  -d debug level [default:0]\n");
 	exit(1);
 }
@@ -83,15 +103,27 @@ void f2fs_parse_options(int argc, char *argv[])
 	char *prog = basename(argv[0]);
 
 	if (!strcmp("fsck.f2fs", prog)) {
-		const char *option_string = "ad:fp:t";
+		const char *option_string = "aB:d:fHj:p:tS:";
+		static const struct option long_opt[] = {
+			{"batch", required_argument, 0, 'B'},
+			{"stats", required_argument, 0, 'S'},
+			{0, 0, 0, 0}
+		};
 
 		config.func = FSCK;
-		while ((option = getopt(argc, argv, option_string)) != EOF) {
+		while ((option = getopt_long(argc, argv, option_string,
+						long_opt, NULL)) != EOF) {
 			switch (option) {
 			case 'a':
 				config.auto_fix = 1;
 				MSG(0, "Info: Fix the reported corruption.\n");
 				break;
+			case 'B':
+				config.batch_path = optarg;
+				break;
+			case 'j':
+				config.jobs = atoi(optarg);
+				break;
 			case 'p':
 				/* preen mode has different levels:
 				 *  0: default level, the same as -a
@@ -116,9 +148,28 @@ void f2fs_parse_options(int argc, char *argv[])
 				config.fix_on = 1;
 				MSG(0, "Info: Force to fix corruption\n");
 				break;
+			case 'H':
+				config.hugepages = 1;
+				break;
 			case 't':
 				config.dbg_lv = -1;
 				break;
+			case 'S':
+				config.stats_path = optarg;
+				if (strcmp(optarg, "-") || config.stats_fd)
+					break;
+				/*
+				 * keep stdout for the JSON alone, what is still
+				 * buffered goes to stderr with the rest
+				 */
+				config.stats_fd = dup(STDOUT_FILENO);
+				if (config.stats_fd < 0 ||
+					dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+					MSG(0, "\tError: Failed to set up "
+							"stats output\n");
+					exit(1);
+				}
+				break;
 			default:
 				MSG(0, "\tError: Unknown option %c\n", option);
 				fsck_usage();
@@ -189,7 +240,7 @@ void f2fs_parse_options(int argc, char *argv[])
 
 		config.private = &dump_opt;
 	} else if (!strcmp("defrag.f2fs", prog)) {
-		const char *option_string = "d:s:l:t:i";
+		const char *option_string = "d:Hs:l:t:i";
 
 		config.func = DEFRAG;
 		while ((option = getopt(argc, argv, option_string)) != EOF) {
@@ -201,6 +252,9 @@ void f2fs_parse_options(int argc, char *argv[])
 				MSG(0, "Info: Debug level = %d\n",
 							config.dbg_lv);
 				break;
+			case 'H':
+				config.hugepages = 1;
+				break;
 			case 's':
 				if (strncmp(optarg, "0x", 2))
 					ret = sscanf(optarg, "%"PRIu64"",
@@ -236,7 +290,7 @@ void f2fs_parse_options(int argc, char *argv[])
 			ASSERT(ret >= 0);
 		}
 	} else if (!strcmp("resize.f2fs", prog)) {
-		const char *option_string = "d:t:";
+		const char *option_string = "d:Ht:";
 
 		config.func = RESIZE;
 		while ((option = getopt(argc, argv, option_string)) != EOF) {
@@ -248,6 +302,9 @@ void f2fs_parse_options(int argc, char *argv[])
 				MSG(0, "Info: Debug level = %d\n",
 							config.dbg_lv);
 				break;
+			case 'H':
+				config.hugepages = 1;
+				break;
 			case 't':
 				if (strncmp(optarg, "0x", 2))
 					ret = sscanf(optarg, "%"PRIu64"",
@@ -264,22 +321,40 @@ void f2fs_parse_options(int argc, char *argv[])
 			ASSERT(ret >= 0);
 		}
 	} else if (!strcmp("sload.f2fs", prog)) {
-		const char *option_string = "d:f:t:";
+		const char *option_string = "cd:Ff:j:p:s:t:u";
 
 		config.func = SLOAD;
 		while ((option = getopt(argc, argv, option_string)) != EOF) {
 			switch (option) {
+			case 'c':
+				config.update_crc = 1;
+				break;
 			case 'd':
 				config.dbg_lv = atoi(optarg);
 				MSG(0, "Info: Debug level = %d\n",
 						config.dbg_lv);
 				break;
+			case 'F':
+				config.format = 1;
+				break;
 			case 'f':
 				config.from_dir = (char *)optarg;
 				break;
+			case 'j':
+				config.jobs = atoi(optarg);
+				break;
+			case 'p':
+				config.placement = (char *)optarg;
+				break;
+			case 's':
+				config.file_contexts = (char *)optarg;
+				break;
 			case 't':
 				config.mount_point = (char *)optarg;
 				break;
+			case 'u':
+				config.update = 1;
+				break;
 			default:
 				MSG(0, "\tError: Unknown option %c\n", option);
 				sload_usage();
@@ -288,6 +363,14 @@ void f2fs_parse_options(int argc, char *argv[])
 		}
 	}
 
+	if (config.batch_path) {
+		if (optind != argc) {
+			MSG(0, "\tError: Devices come from the manifest\n");
+			fsck_usage();
+		}
+		return;
+	}
+
 	if ((optind + 1) != argc) {
 		MSG(0, "\tError: Device not specified\n");
 		if (config.func == FSCK)
@@ -327,7 +410,8 @@ static void do_fsck(struct f2fs_sb_info *sbi)
 				return;
 			}
 
-			if (!config.ro)
+			/* -B only reports */
+			if (!config.assert_jmp)
 				config.fix_on = 1;
 			break;
 		}
@@ -341,8 +425,10 @@ static void do_fsck(struct f2fs_sb_info *sbi)
 		 *  3. fsck -p 1 && error is detected, then bug_on is set,
 		 *     we set fix_on = 1 here, so that fsck can fix errors
 		 *     automatically
+		 * but never for an image checked by -B.
 		*/
-		config.fix_on = 1;
+		if (!config.assert_jmp)
+			config.fix_on = 1;
 	}
 
 	fsck_chk_orphan_node(sbi);
@@ -352,6 +438,8 @@ static void do_fsck(struct f2fs_sb_info *sbi)
 	fsck_chk_node_blk(sbi, NULL, sbi->root_ino_num, (u8 *)"/",
 			F2FS_FT_DIR, TYPE_INODE, &blk_cnt, NULL);
 	fsck_verify(sbi);
+	if (config.stats_path)
+		fsck_print_stats(sbi, config.stats_path);
 	fsck_free(sbi);
 }
 
@@ -454,6 +542,9 @@ static int do_resize(struct f2fs_sb_info *sbi)
 
 static int do_sload(struct f2fs_sb_info *sbi)
 {
+	struct selabel_handle *sehnd = NULL;
+	int ret;
+
 	if (!config.from_dir) {
 		MSG(0, "\tError: Need source directory\n");
 		sload_usage();
@@ -462,7 +553,276 @@ static int do_sload(struct f2fs_sb_info *sbi)
 	if (!config.mount_point)
 		config.mount_point = "/";
 
-	return f2fs_sload(sbi, config.from_dir, config.mount_point, NULL, NULL);
+	if (config.file_contexts) {
+		struct selinux_opt seopts[] = {
+			{ SELABEL_OPT_PATH, config.file_contexts },
+		};
+
+		sehnd = selabel_open(SELABEL_CTX_FILE, seopts, 1);
+		if (!sehnd) {
+			MSG(0, "\tError: Cannot open %s\n", config.file_contexts);
+			return -1;
+		}
+	}
+
+	ret = f2fs_sload(sbi, config.from_dir, config.mount_point, NULL,
+								sehnd);
+	if (sehnd)
+		selabel_close(sehnd);
+	return ret;
+}
+
+/*
+ * fsck -B: check every image of a manifest in this process, a bounded
+ * pool of workers each taking the next image with its own configuration.
+ * They check at dbg_lv DBG_QUIET, so print nothing, and a JSON record is
+ * printed per image instead.  Nothing is written back to the images.
+ */
+struct fsck_batch {
+	char **images;
+	int nr_images;
+	int next;
+	int failed;
+	FILE *out;
+	int preen_mode;
+	int hugepages;
+	pthread_mutex_t lock;
+};
+
+static double batch_ms(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000.0 +
+			(to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+static void batch_print_path(FILE *out, const char *path)
+{
+	const unsigned char *p;
+
+	fputc('"', out);
+	for (p = (const unsigned char *)path; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(out, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(out, "\\u%04x", *p);
+		else
+			fputc(*p, out);
+	}
+	fputc('"', out);
+}
+
+static void batch_check_one(struct fsck_batch *b, char *path)
+{
+	struct f2fs_configuration c;
+	struct f2fs_fsck *fsck;
+	struct f2fs_sb_info *sbi;
+	struct timespec t0, t1, t2, t3;
+	const char * volatile status = "ok";
+	volatile int mounted = 0;
+	jmp_buf jmp;
+	int ret;
+
+	fsck = calloc(1, sizeof(*fsck));
+	if (!fsck) {
+		status = "error";
+		goto out;
+	}
+	fsck->sbi.fsck = fsck;
+	sbi = &fsck->sbi;
+
+	f2fs_init_configuration(&c);
+	c.func = FSCK;
+	c.dbg_lv = DBG_QUIET;
+	c.preen_mode = b->preen_mode;
+	c.hugepages = b->hugepages;
+	c.ro = 1;
+	c.fd = c.kd = -1;
+	c.device_name = path;
+	c.assert_jmp = &jmp;
+	f2fs_set_config(&c);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	t1 = t2 = t3 = t0;
+
+	if (setjmp(jmp)) {
+		/* what this image had allocated is lost */
+		status = "aborted";
+		mounted = 0;
+		if (c.fd >= 0)
+			close(c.fd);
+		if (c.kd >= 0)
+			close(c.kd);
+		clock_gettime(CLOCK_MONOTONIC, &t3);
+		t1 = t2 = t0;
+		goto out_config;
+	}
+
+	if (f2fs_dev_is_umounted(&c) < 0) {
+		status = "mounted";
+		goto out_time;
+	}
+	ret = f2fs_get_device_info(&c);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (ret < 0) {
+		status = "error";
+		if (c.fd >= 0)
+			close(c.fd);
+		if (c.kd >= 0)
+			close(c.kd);
+		goto out_time;
+	}
+
+	if (f2fs_do_mount(sbi)) {
+		f2fs_do_umount(sbi);
+		f2fs_finalize_device(&c);
+		status = "error";
+		goto out_time;
+	}
+	mounted = 1;
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	/* report what the mount found, but never fix it */
+	c.fix_on = 0;
+	do_fsck(sbi);
+	if (c.bug_on)
+		status = "corrupted";
+	clock_gettime(CLOCK_MONOTONIC, &t3);
+
+	f2fs_do_umount(sbi);
+	f2fs_finalize_device(&c);
+out_time:
+	if (!mounted)
+		t2 = t3 = t1;
+out_config:
+	f2fs_set_config(NULL);
+out:
+	pthread_mutex_lock(&b->lock);
+	if (strcmp(status, "ok"))
+		b->failed++;
+	fprintf(b->out, "{\"image\": ");
+	batch_print_path(b->out, path);
+	fprintf(b->out, ", \"status\": \"%s\"", status);
+	if (mounted)
+		fprintf(b->out, ", \"valid_blocks\": %"PRIu64
+				", \"valid_nodes\": %u, \"valid_inodes\": %u"
+				", \"nat_entries\": %u, \"free_segments\": %u",
+				fsck->chk.valid_blk_cnt,
+				fsck->chk.valid_node_cnt,
+				fsck->chk.valid_inode_cnt,
+				fsck->chk.valid_nat_entry_cnt,
+				fsck->chk.sit_free_segs);
+	if (fsck)
+		fprintf(b->out, ", \"open_ms\": %.3f, \"mount_ms\": %.3f"
+				", \"check_ms\": %.3f, \"total_ms\": %.3f",
+				batch_ms(&t0, &t1), batch_ms(&t1, &t2),
+				batch_ms(&t2, &t3), batch_ms(&t0, &t3));
+	fprintf(b->out, "}\n");
+	fflush(b->out);
+	pthread_mutex_unlock(&b->lock);
+
+	free(fsck);
+}
+
+static void *batch_worker(void *arg)
+{
+	struct fsck_batch *b = arg;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&b->lock);
+		i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (i >= b->nr_images)
+			break;
+		batch_check_one(b, b->images[i]);
+	}
+	return NULL;
+}
+
+static int batch_read_manifest(struct fsck_batch *b, const char *path)
+{
+	FILE *fp = stdin;
+	char *line = NULL, *p;
+	size_t len = 0;
+	ssize_t n;
+	int max = 0;
+
+	if (strcmp(path, "-")) {
+		fp = fopen(path, "r");
+		if (!fp) {
+			MSG(0, "\tError: Cannot open %s\n", path);
+			return -1;
+		}
+	}
+
+	while ((n = getline(&line, &len, fp)) >= 0) {
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r' ||
+					line[n - 1] == ' ' || line[n - 1] == '\t'))
+			line[--n] = '\0';
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		if (b->nr_images == max) {
+			max = max ? max * 2 : 64;
+			b->images = realloc(b->images, max * sizeof(char *));
+			ASSERT(b->images);
+		}
+		b->images[b->nr_images] = strdup(p);
+		ASSERT(b->images[b->nr_images]);
+		b->nr_images++;
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return 0;
+}
+
+static int fsck_batch(void)
+{
+	struct fsck_batch b;
+	pthread_t *threads;
+	int nr_threads, i;
+
+	memset(&b, 0, sizeof(b));
+	pthread_mutex_init(&b.lock, NULL);
+	b.preen_mode = config.preen_mode;
+	b.hugepages = config.hugepages;
+
+	if (batch_read_manifest(&b, config.batch_path) < 0)
+		return -1;
+	if (!b.nr_images) {
+		MSG(0, "Info: No image in %s\n", config.batch_path);
+		return 0;
+	}
+
+	nr_threads = config.jobs;
+	if (nr_threads <= 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads <= 0)
+		nr_threads = 1;
+	if (nr_threads > b.nr_images)
+		nr_threads = b.nr_images;
+
+	b.out = stdout;
+	threads = calloc(nr_threads, sizeof(pthread_t));
+	ASSERT(threads);
+	for (i = 0; i < nr_threads; i++)
+		if (f2fs_thread_create(&threads[i], batch_worker, &b))
+			break;
+	if (i == 0)
+		batch_worker(&b);
+	nr_threads = i;
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < b.nr_images; i++)
+		free(b.images[i]);
+	free(b.images);
+	free(threads);
+	pthread_mutex_destroy(&b.lock);
+	return b.failed ? -1 : 0;
 }
 
 int main(int argc, char **argv)
@@ -474,6 +834,9 @@ int main(int argc, char **argv)
 
 	f2fs_parse_options(argc, argv);
 
+	if (config.batch_path)
+		return fsck_batch();
+
 	if (f2fs_dev_is_umounted(&config) < 0) {
 		if (!config.ro || config.func == DEFRAG) {
 			MSG(0, "\tError: Not available on mounted device!\n");
@@ -489,6 +852,13 @@ int main(int argc, char **argv)
 	/* Get device */
 	if (f2fs_get_device_info(&config) < 0)
 		return -1;
+
+	/* format and load in one go, without a mkfs.f2fs run in between */
+	if (config.func == SLOAD && config.format) {
+		f2fs_tune_layout(TUNE_SECTION | TUNE_ZONE | TUNE_HEAP);
+		if (f2fs_format_device() < 0)
+			return -1;
+	}
 fsck_again:
 	memset(&gfsck, 0, sizeof(gfsck));
 	gfsck.sbi.fsck = &gfsck;
@@ -525,6 +895,7 @@ fsck_again:
 	}
 
 	f2fs_do_umount(sbi);
+	f2fs_blk_pool_report();
 
 	if (config.func == FSCK && config.bug_on) {
 		if (!config.ro && config.fix_on == 0 && config.auto_fix == 0) {
@@ -10,15 +10,14 @@
  */
 #include "fsck.h"
 #include <locale.h>
+#include <sys/uio.h>
 
 static u32 get_free_segments(struct f2fs_sb_info *sbi)
 {
 	u32 i, free_segs = 0;
 
 	for (i = 0; i < TOTAL_SEGS(sbi); i++) {
-		struct seg_entry *se = get_seg_entry(sbi, i);
-
-		if (se->valid_blocks == 0x0 &&
+		if (SE_VALID_BLOCKS(sbi, i) == 0x0 &&
 				!IS_CUR_SEGNO(sbi, i, NO_CHECK_TYPE))
 			free_segs++;
 	}
@@ -28,9 +27,9 @@ static u32 get_free_segments(struct f2fs_sb_info *sbi)
 void update_free_segments(struct f2fs_sb_info *sbi)
 {
 	char *progress = "-*|*-";
-	static int i = 0;
+	static __thread int i = 0;
 
-	MSG(0, "\r [ %c ] Free segments: 0x%x", progress[i % 5], get_free_segments(sbi));
+	MSG(0, "\r [ %c ] Free segments: 0x%x", progress[i % 5], sbi->free_segments);
 	fflush(stdout);
 	i++;
 }
@@ -134,7 +133,7 @@ static void DISP_label(u_int16_t *name)
 
 void print_raw_sb_info(struct f2fs_super_block *sb)
 {
-	if (!config.dbg_lv)
+	if (!config.dbg_lv || config.dbg_lv == DBG_QUIET)
 		return;
 
 	printf("\n");
@@ -186,7 +185,7 @@ void print_ckpt_info(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
 
-	if (!config.dbg_lv)
+	if (!config.dbg_lv || config.dbg_lv == DBG_QUIET)
 		return;
 
 	printf("\n");
@@ -431,7 +430,8 @@ int validate_super_block(struct f2fs_sb_info *sbi, int block)
 		MSG(0, "Info: MKFS version\n  \"%s\"\n", config.init_version);
 		MSG(0, "Info: FSCK version\n  from \"%s\"\n    to \"%s\"\n",
 					config.sb_version, config.version);
-		if (memcmp(config.sb_version, config.version, VERSION_LEN)) {
+		if (!config.assert_jmp && memcmp(config.sb_version,
+					config.version, VERSION_LEN)) {
 			int ret;
 
 			memcpy(sbi->raw_super->version,
@@ -634,6 +634,149 @@ int sanity_check_ckpt(struct f2fs_sb_info *sbi)
 	return 0;
 }
 
+/*
+ * sload keeps the NAT, SIT and SSA blocks it touches in memory, and writes
+ * each dirty one once, in address order, with the checkpoint.
+ */
+#define META_CACHE_HASH		4096
+
+struct meta_cblock {
+	struct meta_cblock *next;	/* hash chain */
+	block_t blkaddr;
+	int dirty;
+	char buf[F2FS_BLKSIZE];
+};
+
+struct meta_cache {
+	struct meta_cblock *hash[META_CACHE_HASH];
+	unsigned int nr_dirty;
+};
+
+int f2fs_init_meta_cache(struct f2fs_sb_info *sbi)
+{
+	sbi->meta_cache = calloc(1, sizeof(struct meta_cache));
+	return sbi->meta_cache ? 0 : -ENOMEM;
+}
+
+void f2fs_exit_meta_cache(struct f2fs_sb_info *sbi)
+{
+	struct meta_cache *mc = sbi->meta_cache;
+	struct meta_cblock *mb;
+	int i;
+
+	if (!mc)
+		return;
+
+	for (i = 0; i < META_CACHE_HASH; i++) {
+		while ((mb = mc->hash[i])) {
+			mc->hash[i] = mb->next;
+			free(mb);
+		}
+	}
+	free(mc);
+	sbi->meta_cache = NULL;
+}
+
+/* @fill: read the block in, unless it is about to be overwritten */
+static struct meta_cblock *meta_cache_get(struct f2fs_sb_info *sbi,
+						block_t blkaddr, int fill)
+{
+	struct meta_cblock **head, *mb;
+
+	head = &sbi->meta_cache->hash[blkaddr % META_CACHE_HASH];
+	for (mb = *head; mb; mb = mb->next)
+		if (mb->blkaddr == blkaddr)
+			return mb;
+
+	mb = malloc(sizeof(struct meta_cblock));
+	ASSERT(mb);
+	if (fill) {
+		int ret = dev_read_block(mb->buf, blkaddr);
+		ASSERT(ret >= 0);
+	}
+	mb->blkaddr = blkaddr;
+	mb->dirty = 0;
+	mb->next = *head;
+	*head = mb;
+	return mb;
+}
+
+static int meta_read_block(struct f2fs_sb_info *sbi, void *buf,
+						block_t blkaddr)
+{
+	if (!sbi->meta_cache)
+		return dev_read_block(buf, blkaddr);
+
+	memcpy(buf, meta_cache_get(sbi, blkaddr, 1)->buf, F2FS_BLKSIZE);
+	return 0;
+}
+
+static int meta_write_block(struct f2fs_sb_info *sbi, void *buf,
+						block_t blkaddr)
+{
+	struct meta_cblock *mb;
+
+	if (!sbi->meta_cache)
+		return dev_write_block(buf, blkaddr);
+
+	mb = meta_cache_get(sbi, blkaddr, 0);
+	memcpy(mb->buf, buf, F2FS_BLKSIZE);
+	if (!mb->dirty) {
+		mb->dirty = 1;
+		sbi->meta_cache->nr_dirty++;
+	}
+	return 0;
+}
+
+static int cmp_meta_cblock(const void *a, const void *b)
+{
+	block_t x = (*(struct meta_cblock **)a)->blkaddr;
+	block_t y = (*(struct meta_cblock **)b)->blkaddr;
+
+	return x < y ? -1 : x > y;
+}
+
+int f2fs_flush_meta_cache(struct f2fs_sb_info *sbi)
+{
+	struct meta_cache *mc = sbi->meta_cache;
+	struct meta_cblock **dirty, *mb;
+	struct iovec *iov;
+	unsigned int i, start, n = 0;
+	int ret = 0;
+
+	if (!mc || !mc->nr_dirty)
+		return 0;
+
+	dirty = malloc(mc->nr_dirty * sizeof(*dirty));
+	iov = malloc(mc->nr_dirty * sizeof(*iov));
+	ASSERT(dirty && iov);
+
+	for (i = 0; i < META_CACHE_HASH; i++)
+		for (mb = mc->hash[i]; mb; mb = mb->next)
+			if (mb->dirty)
+				dirty[n++] = mb;
+	qsort(dirty, n, sizeof(*dirty), cmp_meta_cblock);
+
+	DBG(1, "Writing %u NAT/SIT/SSA blocks\n", n);
+	for (start = i = 0; i < n; i++) {
+		iov[i].iov_base = dirty[i]->buf;
+		iov[i].iov_len = F2FS_BLKSIZE;
+		dirty[i]->dirty = 0;
+		if (i + 1 < n && dirty[i + 1]->blkaddr == dirty[i]->blkaddr + 1)
+			continue;
+
+		if (!ret && dev_writev(iov + start, i + 1 - start,
+				(u64)dirty[start]->blkaddr * F2FS_BLKSIZE) < 0)
+			ret = -EIO;
+		start = i + 1;
+	}
+	mc->nr_dirty = 0;
+
+	free(iov);
+	free(dirty);
+	return ret;
+}
+
 static pgoff_t current_nat_addr(struct f2fs_sb_info *sbi, nid_t start)
 {
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
@@ -682,6 +825,10 @@ static int f2fs_init_nid_bitmap(struct f2fs_sb_info *sbi)
 		if (!(nid % NAT_ENTRY_PER_BLOCK)) {
 			int ret;
 
+			/* just formatted: only the first NAT block is used */
+			if (config.format && nid)
+				break;
+
 			start_blk = current_nat_addr(sbi, nid);
 			ret = dev_read_block((void *)&nat_block, start_blk);
 			ASSERT(ret >= 0);
@@ -738,7 +885,7 @@ int init_node_manager(struct f2fs_sb_info *sbi)
 int build_node_manager(struct f2fs_sb_info *sbi)
 {
 	int err;
-	sbi->nm_info = malloc(sizeof(struct f2fs_nm_info));
+	sbi->nm_info = calloc(1, sizeof(struct f2fs_nm_info));
 	if (!sbi->nm_info)
 		return -ENOMEM;
 
@@ -754,27 +901,30 @@ int build_sit_info(struct f2fs_sb_info *sbi)
 	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
 	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
 	struct sit_info *sit_i;
-	unsigned int sit_segs, start;
+	unsigned int sit_segs, nr_segs;
 	char *src_bitmap, *dst_bitmap;
 	unsigned int bitmap_size;
 
-	sit_i = malloc(sizeof(struct sit_info));
+	sit_i = calloc(1, sizeof(struct sit_info));
 	if (!sit_i)
 		return -ENOMEM;
 
 	SM_I(sbi)->sit_info = sit_i;
 
-	sit_i->sentries = calloc(TOTAL_SEGS(sbi) * sizeof(struct seg_entry), 1);
-
-	for (start = 0; start < TOTAL_SEGS(sbi); start++) {
-		sit_i->sentries[start].cur_valid_map
-			= calloc(SIT_VBLOCK_MAP_SIZE, 1);
-		sit_i->sentries[start].ckpt_valid_map
-			= calloc(SIT_VBLOCK_MAP_SIZE, 1);
-		if (!sit_i->sentries[start].cur_valid_map
-				|| !sit_i->sentries[start].ckpt_valid_map)
-			return -ENOMEM;
-	}
+	nr_segs = TOTAL_SEGS(sbi);
+	sit_i->valid_blocks = calloc(nr_segs, sizeof(unsigned short));
+	sit_i->ckpt_valid_blocks = calloc(nr_segs, sizeof(unsigned short));
+	sit_i->seg_type = calloc(nr_segs, 1);
+	sit_i->orig_type = calloc(nr_segs, 1);
+	sit_i->mtime = calloc(nr_segs, sizeof(unsigned long long));
+	sit_i->seg_dirty = calloc(nr_segs, 1);
+	sit_i->cur_valid_map = calloc(nr_segs, SIT_VBLOCK_MAP_SIZE);
+	sit_i->ckpt_valid_map = calloc(nr_segs, SIT_VBLOCK_MAP_SIZE);
+	if (!sit_i->valid_blocks || !sit_i->ckpt_valid_blocks ||
+			!sit_i->seg_type || !sit_i->orig_type ||
+			!sit_i->mtime || !sit_i->seg_dirty ||
+			!sit_i->cur_valid_map || !sit_i->ckpt_valid_map)
+		return -ENOMEM;
 
 	sit_segs = get_sb(segment_count_sit) >> 1;
 	bitmap_size = __bitmap_size(sbi, SIT_BITMAP);
@@ -798,7 +948,6 @@ void reset_curseg(struct f2fs_sb_info *sbi, int type)
 {
 	struct curseg_info *curseg = CURSEG_I(sbi, type);
 	struct summary_footer *sum_footer;
-	struct seg_entry *se;
 
 	sum_footer = &(curseg->sum_blk->footer);
 	memset(sum_footer, 0, sizeof(struct summary_footer));
@@ -806,8 +955,7 @@ void reset_curseg(struct f2fs_sb_info *sbi, int type)
 		SET_SUM_TYPE(sum_footer, SUM_TYPE_DATA);
 	if (IS_NODESEG(type))
 		SET_SUM_TYPE(sum_footer, SUM_TYPE_NODE);
-	se = get_seg_entry(sbi, curseg->segno);
-	se->type = type;
+	SE_TYPE(sbi, curseg->segno) = type;
 }
 
 static void read_compacted_summaries(struct f2fs_sb_info *sbi)
@@ -869,7 +1017,7 @@ static void restore_node_summary(struct f2fs_sb_info *sbi,
 	unsigned int i;
 	int ret;
 
-	node_blk = malloc(F2FS_BLKSIZE);
+	node_blk = f2fs_blk_alloc();
 	ASSERT(node_blk);
 
 	/* scan the node segment */
@@ -882,7 +1030,7 @@ static void restore_node_summary(struct f2fs_sb_info *sbi,
 		sum_entry->nid = node_blk->footer.nid;
 		addr++;
 	}
-	free(node_blk);
+	f2fs_blk_free(node_blk);
 }
 
 static void read_normal_summaries(struct f2fs_sb_info *sbi, int type)
@@ -924,26 +1072,32 @@ static void read_normal_summaries(struct f2fs_sb_info *sbi, int type)
 
 void update_sum_entry(struct f2fs_sb_info *sbi, block_t blk_addr,
 					struct f2fs_summary *sum)
+{
+	update_sum_entries(sbi, blk_addr, sum, 1);
+}
+
+/* @nr blocks from @blk_addr must lie in one segment */
+void update_sum_entries(struct f2fs_sb_info *sbi, block_t blk_addr,
+				struct f2fs_summary *sums, unsigned int nr)
 {
 	struct f2fs_summary_block *sum_blk;
 	u32 segno, offset;
 	int type, ret;
-	struct seg_entry *se;
 
 	segno = GET_SEGNO(sbi, blk_addr);
 	offset = OFFSET_IN_SEG(sbi, blk_addr);
-
-	se = get_seg_entry(sbi, segno);
+	ASSERT(offset + nr <= sbi->blocks_per_seg);
 
 	sum_blk = get_sum_block(sbi, segno, &type);
-	memcpy(&sum_blk->entries[offset], sum, sizeof(*sum));
-	sum_blk->footer.entry_type = IS_NODESEG(se->type) ? SUM_TYPE_NODE :
+	memcpy(&sum_blk->entries[offset], sums, nr * sizeof(*sums));
+	sum_blk->footer.entry_type = IS_NODESEG(SE_TYPE(sbi, segno)) ?
+							SUM_TYPE_NODE :
 							SUM_TYPE_DATA;
 
 	/* write SSA all the time */
 	if (type < SEG_TYPE_MAX) {
 		u64 ssa_blk = GET_SUM_BLKADDR(sbi, segno);
-		ret = dev_write_block(sum_blk, ssa_blk);
+		ret = meta_write_block(sbi, sum_blk, ssa_blk);
 		ASSERT(ret >= 0);
 	}
 
@@ -973,7 +1127,7 @@ static void build_curseg(struct f2fs_sb_info *sbi)
 	unsigned int segno;
 	int i;
 
-	array = malloc(sizeof(*array) * NR_CURSEG_TYPE);
+	array = calloc(NR_CURSEG_TYPE, sizeof(*array));
 	ASSERT(array);
 
 	SM_I(sbi)->curseg_array = array;
@@ -1019,7 +1173,7 @@ static struct f2fs_sit_block *get_current_sit_page(struct f2fs_sb_info *sbi,
 	if (f2fs_test_bit(offset, sit_i->sit_bitmap))
 		blk_addr += sit_i->sit_blocks;
 
-	ret = dev_read_block(sit_blk, blk_addr);
+	ret = meta_read_block(sbi, sit_blk, blk_addr);
 	ASSERT(ret >= 0);
 
 	return sit_blk;
@@ -1037,7 +1191,7 @@ void rewrite_current_sit_page(struct f2fs_sb_info *sbi,
 	if (f2fs_test_bit(offset, sit_i->sit_bitmap))
 		blk_addr += sit_i->sit_blocks;
 
-	ret = dev_write_block(sit_blk, blk_addr);
+	ret = meta_write_block(sbi, sit_blk, blk_addr);
 	ASSERT(ret >= 0);
 }
 
@@ -1071,23 +1225,18 @@ void check_block_count(struct f2fs_sb_info *sbi,
 				segno, GET_SIT_TYPE(raw_sit));
 }
 
-void seg_info_from_raw_sit(struct seg_entry *se,
+void seg_info_from_raw_sit(struct f2fs_sb_info *sbi, unsigned int segno,
 		struct f2fs_sit_entry *raw_sit)
 {
-	se->valid_blocks = GET_SIT_VBLOCKS(raw_sit);
-	se->ckpt_valid_blocks = GET_SIT_VBLOCKS(raw_sit);
-	memcpy(se->cur_valid_map, raw_sit->valid_map, SIT_VBLOCK_MAP_SIZE);
-	memcpy(se->ckpt_valid_map, raw_sit->valid_map, SIT_VBLOCK_MAP_SIZE);
-	se->type = GET_SIT_TYPE(raw_sit);
-	se->orig_type = GET_SIT_TYPE(raw_sit);
-	se->mtime = le64_to_cpu(raw_sit->mtime);
-}
-
-struct seg_entry *get_seg_entry(struct f2fs_sb_info *sbi,
-		unsigned int segno)
-{
-	struct sit_info *sit_i = SIT_I(sbi);
-	return &sit_i->sentries[segno];
+	SE_VALID_BLOCKS(sbi, segno) = GET_SIT_VBLOCKS(raw_sit);
+	SE_CKPT_VALID_BLOCKS(sbi, segno) = GET_SIT_VBLOCKS(raw_sit);
+	memcpy(SE_VALID_MAP(sbi, segno), raw_sit->valid_map,
+						SIT_VBLOCK_MAP_SIZE);
+	memcpy(SE_CKPT_VALID_MAP(sbi, segno), raw_sit->valid_map,
+						SIT_VBLOCK_MAP_SIZE);
+	SE_TYPE(sbi, segno) = GET_SIT_TYPE(raw_sit);
+	SE_ORIG_TYPE(sbi, segno) = GET_SIT_TYPE(raw_sit);
+	SE_MTIME(sbi, segno) = le64_to_cpu(raw_sit->mtime);
 }
 
 struct f2fs_summary_block *get_sum_block(struct f2fs_sb_info *sbi,
@@ -1135,7 +1284,7 @@ struct f2fs_summary_block *get_sum_block(struct f2fs_sb_info *sbi,
 	sum_blk = calloc(BLOCK_SZ, 1);
 	ASSERT(sum_blk);
 
-	ret = dev_read_block(sum_blk, ssa_blk);
+	ret = meta_read_block(sbi, sum_blk, ssa_blk);
 	ASSERT(ret >= 0);
 
 	if (IS_SUM_NODE_SEG(sum_blk->footer))
@@ -1176,17 +1325,17 @@ static void get_nat_entry(struct f2fs_sb_info *sbi, nid_t nid,
 	if (lookup_nat_in_journal(sbi, nid, raw_nat) >= 0)
 		return;
 
-	nat_block = (struct f2fs_nat_block *)calloc(BLOCK_SZ, 1);
+	nat_block = f2fs_blk_alloc();
 
 	entry_off = nid % NAT_ENTRY_PER_BLOCK;
 	block_addr = current_nat_addr(sbi, nid);
 
-	ret = dev_read_block(nat_block, block_addr);
+	ret = meta_read_block(sbi, nat_block, block_addr);
 	ASSERT(ret >= 0);
 
 	memcpy(raw_nat, &nat_block->entries[entry_off],
 					sizeof(struct f2fs_nat_entry));
-	free(nat_block);
+	f2fs_blk_free(nat_block);
 }
 
 void update_data_blkaddr(struct f2fs_sb_info *sbi, nid_t nid,
@@ -1197,7 +1346,7 @@ void update_data_blkaddr(struct f2fs_sb_info *sbi, nid_t nid,
 	block_t oldaddr, startaddr, endaddr;
 	int ret;
 
-	node_blk = (struct f2fs_node *)calloc(BLOCK_SZ, 1);
+	node_blk = f2fs_blk_alloc();
 	ASSERT(node_blk != NULL);
 
 	get_node_info(sbi, nid, &ni);
@@ -1236,7 +1385,7 @@ void update_data_blkaddr(struct f2fs_sb_info *sbi, nid_t nid,
 		ret = dev_write_block(node_blk, ni.blk_addr);
 		ASSERT(ret >= 0);
 	}
-	free(node_blk);
+	f2fs_blk_free(node_blk);
 }
 
 void update_nat_blkaddr(struct f2fs_sb_info *sbi, nid_t ino,
@@ -1247,21 +1396,21 @@ void update_nat_blkaddr(struct f2fs_sb_info *sbi, nid_t ino,
 	int entry_off;
 	int ret;
 
-	nat_block = (struct f2fs_nat_block *)calloc(BLOCK_SZ, 1);
+	nat_block = f2fs_blk_alloc();
 
 	entry_off = nid % NAT_ENTRY_PER_BLOCK;
 	block_addr = current_nat_addr(sbi, nid);
 
-	ret = dev_read_block(nat_block, block_addr);
+	ret = meta_read_block(sbi, nat_block, block_addr);
 	ASSERT(ret >= 0);
 
 	if (ino)
 		nat_block->entries[entry_off].ino = cpu_to_le32(ino);
 	nat_block->entries[entry_off].block_addr = cpu_to_le32(newaddr);
 
-	ret = dev_write_block(nat_block, block_addr);
+	ret = meta_write_block(sbi, nat_block, block_addr);
 	ASSERT(ret >= 0);
-	free(nat_block);
+	f2fs_blk_free(nat_block);
 }
 
 void get_node_info(struct f2fs_sb_info *sbi, nid_t nid, struct node_info *ni)
@@ -1280,7 +1429,6 @@ void build_sit_entries(struct f2fs_sb_info *sbi)
 	unsigned int segno;
 
 	for (segno = 0; segno < TOTAL_SEGS(sbi); segno++) {
-		struct seg_entry *se = &sit_i->sentries[segno];
 		struct f2fs_sit_block *sit_blk;
 		struct f2fs_sit_entry sit;
 		int i;
@@ -1291,12 +1439,17 @@ void build_sit_entries(struct f2fs_sb_info *sbi)
 				goto got_it;
 			}
 		}
+		/* just formatted: the SIT area is all zeros */
+		if (config.format) {
+			memset(&sit, 0, sizeof(sit));
+			goto got_it;
+		}
 		sit_blk = get_current_sit_page(sbi, segno);
 		sit = sit_blk->entries[SIT_ENTRY_OFFSET(sit_i, segno)];
 		free(sit_blk);
 got_it:
 		check_block_count(sbi, segno, &sit);
-		seg_info_from_raw_sit(se, &sit);
+		seg_info_from_raw_sit(sbi, segno, &sit);
 	}
 
 }
@@ -1307,7 +1460,7 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
 	struct f2fs_sm_info *sm_info;
 
-	sm_info = malloc(sizeof(struct f2fs_sm_info));
+	sm_info = calloc(1, sizeof(struct f2fs_sm_info));
 	if (!sm_info)
 		return -ENOMEM;
 
@@ -1327,6 +1480,7 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 
 	build_sit_entries(sbi);
 
+	reset_alloc_cursors(sbi);
 	return 0;
 }
 
@@ -1338,7 +1492,6 @@ void build_sit_area_bitmap(struct f2fs_sb_info *sbi)
 	char *ptr = NULL;
 	u32 sum_vblocks = 0;
 	u32 free_segs = 0;
-	struct seg_entry *se;
 
 	fsck->sit_area_bitmap_sz = sm_i->main_segments * SIT_VBLOCK_MAP_SIZE;
 	fsck->sit_area_bitmap = calloc(1, fsck->sit_area_bitmap_sz);
@@ -1346,13 +1499,12 @@ void build_sit_area_bitmap(struct f2fs_sb_info *sbi)
 
 	ASSERT(fsck->sit_area_bitmap_sz == fsck->main_area_bitmap_sz);
 
-	for (segno = 0; segno < TOTAL_SEGS(sbi); segno++) {
-		se = get_seg_entry(sbi, segno);
-
-		memcpy(ptr, se->cur_valid_map, SIT_VBLOCK_MAP_SIZE);
-		ptr += SIT_VBLOCK_MAP_SIZE;
+	/* the cached valid maps are already laid out in segno order */
+	memcpy(ptr, SE_VALID_MAP(sbi, 0),
+			(size_t)TOTAL_SEGS(sbi) * SIT_VBLOCK_MAP_SIZE);
 
-		if (se->valid_blocks == 0x0) {
+	for (segno = 0; segno < TOTAL_SEGS(sbi); segno++) {
+		if (SE_VALID_BLOCKS(sbi, segno) == 0x0) {
 			if (sbi->ckpt->cur_node_segno[0] == segno ||
 					sbi->ckpt->cur_data_segno[0] == segno ||
 					sbi->ckpt->cur_node_segno[1] == segno ||
@@ -1364,7 +1516,7 @@ void build_sit_area_bitmap(struct f2fs_sb_info *sbi)
 				free_segs++;
 			}
 		} else {
-			sum_vblocks += se->valid_blocks;
+			sum_vblocks += SE_VALID_BLOCKS(sbi, segno);
 		}
 	}
 	fsck->chk.sit_valid_blocks = sum_vblocks;
@@ -1394,7 +1546,6 @@ void rewrite_sit_area_bitmap(struct f2fs_sb_info *sbi)
 	for (segno = 0; segno < TOTAL_SEGS(sbi); segno++) {
 		struct f2fs_sit_block *sit_blk;
 		struct f2fs_sit_entry *sit;
-		struct seg_entry *se;
 		u16 valid_blocks = 0;
 		u16 type;
 		int i;
@@ -1407,8 +1558,7 @@ void rewrite_sit_area_bitmap(struct f2fs_sb_info *sbi)
 		for (i = 0; i < SIT_VBLOCK_MAP_SIZE; i++)
 			valid_blocks += get_bits_in_byte(sit->valid_map[i]);
 
-		se = get_seg_entry(sbi, segno);
-		type = se->type;
+		type = SE_TYPE(sbi, segno);
 		if (type >= NO_CHECK_TYPE) {
 			ASSERT_MSG("Invalide type and valid blocks=%x,%x",
 					segno, valid_blocks);
@@ -1443,18 +1593,17 @@ static void flush_sit_journal_entries(struct f2fs_sb_info *sbi)
 	for (i = 0; i < sits_in_cursum(journal); i++) {
 		struct f2fs_sit_block *sit_blk;
 		struct f2fs_sit_entry *sit;
-		struct seg_entry *se;
 
 		segno = segno_in_journal(journal, i);
-		se = get_seg_entry(sbi, segno);
 
 		sit_blk = get_current_sit_page(sbi, segno);
 		sit = &sit_blk->entries[SIT_ENTRY_OFFSET(sit_i, segno)];
 
-		memcpy(sit->valid_map, se->cur_valid_map, SIT_VBLOCK_MAP_SIZE);
-		sit->vblocks = cpu_to_le16((se->type << SIT_VBLOCKS_SHIFT) |
-							se->valid_blocks);
-		sit->mtime = cpu_to_le64(se->mtime);
+		memcpy(sit->valid_map, SE_VALID_MAP(sbi, segno),
+						SIT_VBLOCK_MAP_SIZE);
+		sit->vblocks = cpu_to_le16((SE_TYPE(sbi, segno) <<
+				SIT_VBLOCKS_SHIFT) | SE_VALID_BLOCKS(sbi, segno));
+		sit->mtime = cpu_to_le64(SE_MTIME(sbi, segno));
 
 		rewrite_current_sit_page(sbi, segno, sit_blk);
 		free(sit_blk);
@@ -1480,20 +1629,20 @@ next:
 	}
 
 	nid = le32_to_cpu(nid_in_journal(journal, i));
-	nat_block = (struct f2fs_nat_block *)calloc(BLOCK_SZ, 1);
+	nat_block = f2fs_blk_alloc();
 
 	entry_off = nid % NAT_ENTRY_PER_BLOCK;
 	block_addr = current_nat_addr(sbi, nid);
 
-	ret = dev_read_block(nat_block, block_addr);
+	ret = meta_read_block(sbi, nat_block, block_addr);
 	ASSERT(ret >= 0);
 
 	memcpy(&nat_block->entries[entry_off], &nat_in_journal(journal, i),
 					sizeof(struct f2fs_nat_entry));
 
-	ret = dev_write_block(nat_block, block_addr);
+	ret = meta_write_block(sbi, nat_block, block_addr);
 	ASSERT(ret >= 0);
-	free(nat_block);
+	f2fs_blk_free(nat_block);
 	i++;
 	goto next;
 }
@@ -1502,7 +1651,10 @@ void flush_journal_entries(struct f2fs_sb_info *sbi)
 {
 	flush_nat_journal_entries(sbi);
 	flush_sit_journal_entries(sbi);
-	write_checkpoint(sbi);
+
+	/* cached, they are only written with the final checkpoint */
+	if (!sbi->meta_cache)
+		write_checkpoint(sbi);
 }
 
 void flush_sit_entries(struct f2fs_sb_info *sbi)
@@ -1516,22 +1668,20 @@ void flush_sit_entries(struct f2fs_sb_info *sbi)
 	for (segno = 0; segno < TOTAL_SEGS(sbi); segno++) {
 		struct f2fs_sit_block *sit_blk;
 		struct f2fs_sit_entry *sit;
-		struct seg_entry *se;
 
-		se = get_seg_entry(sbi, segno);
-
-		if (!se->dirty)
+		if (!SE_DIRTY(sbi, segno))
 			continue;
 
 		sit_blk = get_current_sit_page(sbi, segno);
 		sit = &sit_blk->entries[SIT_ENTRY_OFFSET(sit_i, segno)];
-		memcpy(sit->valid_map, se->cur_valid_map, SIT_VBLOCK_MAP_SIZE);
-		sit->vblocks = cpu_to_le16((se->type << SIT_VBLOCKS_SHIFT) |
-							se->valid_blocks);
+		memcpy(sit->valid_map, SE_VALID_MAP(sbi, segno),
+						SIT_VBLOCK_MAP_SIZE);
+		sit->vblocks = cpu_to_le16((SE_TYPE(sbi, segno) <<
+				SIT_VBLOCKS_SHIFT) | SE_VALID_BLOCKS(sbi, segno));
 		rewrite_current_sit_page(sbi, segno, sit_blk);
 		free(sit_blk);
 
-		if (se->valid_blocks == 0x0 &&
+		if (SE_VALID_BLOCKS(sbi, segno) == 0x0 &&
 				!IS_CUR_SEGNO(sbi, segno, NO_CHECK_TYPE))
 			free_segs++;
 	}
@@ -1539,43 +1689,38 @@ void flush_sit_entries(struct f2fs_sb_info *sbi)
 	set_cp(free_segment_count, free_segs);
 }
 
-int find_next_free_block(struct f2fs_sb_info *sbi, u64 *to, int left, int type)
+static int __find_next_free_block(struct f2fs_sb_info *sbi, u64 *to,
+							int left, int type)
 {
-	struct seg_entry *se;
 	u32 segno;
 	u64 offset;
 
-	if (get_free_segments(sbi) <= SM_I(sbi)->reserved_segments + 1)
-		return -1;
-
 	while (*to >= SM_I(sbi)->main_blkaddr &&
 			*to < F2FS_RAW_SUPER(sbi)->block_count) {
 		segno = GET_SEGNO(sbi, *to);
 		offset = OFFSET_IN_SEG(sbi, *to);
 
-		se = get_seg_entry(sbi, segno);
-
-		if (se->valid_blocks == sbi->blocks_per_seg ||
+		if (SE_VALID_BLOCKS(sbi, segno) == sbi->blocks_per_seg ||
 				IS_CUR_SEGNO(sbi, segno, type)) {
 			*to = left ? START_BLOCK(sbi, segno) - 1:
 						START_BLOCK(sbi, segno + 1);
 			continue;
 		}
-		if (se->valid_blocks == 0 && !(segno % sbi->segs_per_sec)) {
-			struct seg_entry *se2;
+		if (SE_VALID_BLOCKS(sbi, segno) == 0 &&
+					!(segno % sbi->segs_per_sec)) {
 			unsigned int i;
 
 			for (i = 0; i < sbi->segs_per_sec; i++) {
-				se2 = get_seg_entry(sbi, segno + i);
-				if (se2->valid_blocks)
+				if (SE_VALID_BLOCKS(sbi, segno + i))
 					break;
 			}
 			if (i == sbi->segs_per_sec)
 				return 0;
 		}
 
-		if (se->type == type &&
-			!f2fs_test_bit(offset, (const char *)se->cur_valid_map))
+		if (SE_TYPE(sbi, segno) == type &&
+			!f2fs_test_bit(offset,
+				(const char *)SE_VALID_MAP(sbi, segno)))
 			return 0;
 
 		*to = left ? *to - 1: *to + 1;
@@ -1583,6 +1728,39 @@ int find_next_free_block(struct f2fs_sb_info *sbi, u64 *to, int left, int type)
 	return -1;
 }
 
+int find_next_free_block(struct f2fs_sb_info *sbi, u64 *to, int left, int type)
+{
+	if (get_free_segments(sbi) <= SM_I(sbi)->reserved_segments + 1)
+		return -1;
+	return __find_next_free_block(sbi, to, left, type);
+}
+
+/* start the allocator over after the SIT was built or the logs moved */
+void reset_alloc_cursors(struct f2fs_sb_info *sbi)
+{
+	memset(sbi->alloc_cursor, 0, sizeof(sbi->alloc_cursor));
+	sbi->free_segments = get_free_segments(sbi);
+}
+
+/*
+ * find_next_free_block() for reserve_new_blocks(): the search resumes where
+ * the last run of @type ended, and free space is checked against the count
+ * reserve_new_blocks() and invalidate_block() keep rather than a SIT pass.
+ */
+int alloc_next_free_block(struct f2fs_sb_info *sbi, u64 *to, int type)
+{
+	if (sbi->free_segments <= SM_I(sbi)->reserved_segments + 1)
+		return -1;
+
+	*to = max(sbi->alloc_cursor[type], (u64)SM_I(sbi)->main_blkaddr);
+	if (!__find_next_free_block(sbi, to, 0, type))
+		return 0;
+
+	/* blocks may have been given back behind the cursor */
+	*to = SM_I(sbi)->main_blkaddr;
+	return __find_next_free_block(sbi, to, 0, type);
+}
+
 void move_curseg_info(struct f2fs_sb_info *sbi, u64 from)
 {
 	int i, ret;
@@ -1596,7 +1774,7 @@ void move_curseg_info(struct f2fs_sb_info *sbi, u64 from)
 
 		/* update original SSA too */
 		ssa_blk = GET_SUM_BLKADDR(sbi, curseg->segno);
-		ret = dev_write_block(curseg->sum_blk, ssa_blk);
+		ret = meta_write_block(sbi, curseg->sum_blk, ssa_blk);
 		ASSERT(ret >= 0);
 
 		to = from;
@@ -1610,17 +1788,18 @@ void move_curseg_info(struct f2fs_sb_info *sbi, u64 from)
 
 		/* update new segno */
 		ssa_blk = GET_SUM_BLKADDR(sbi, curseg->segno);
-		ret = dev_read_block(&buf, ssa_blk);
+		ret = meta_read_block(sbi, &buf, ssa_blk);
 		ASSERT(ret >= 0);
 
 		memcpy(curseg->sum_blk, &buf, SUM_ENTRIES_SIZE);
 
-		/* update se->types */
+		/* update segment types */
 		reset_curseg(sbi, i);
 
 		DBG(1, "Move curseg[%d] %x -> %x after %"PRIx64"\n",
 				i, old_segno, curseg->segno, from);
 	}
+	reset_alloc_cursors(sbi);
 }
 
 void zero_journal_entries(struct f2fs_sb_info *sbi)
@@ -1689,20 +1868,20 @@ void nullify_nat_entry(struct f2fs_sb_info *sbi, u32 nid)
 			return;
 		}
 	}
-	nat_block = (struct f2fs_nat_block *)calloc(BLOCK_SZ, 1);
+	nat_block = f2fs_blk_alloc();
 
 	entry_off = nid % NAT_ENTRY_PER_BLOCK;
 	block_addr = current_nat_addr(sbi, nid);
 
-	ret = dev_read_block(nat_block, block_addr);
+	ret = meta_read_block(sbi, nat_block, block_addr);
 	ASSERT(ret >= 0);
 
 	memset(&nat_block->entries[entry_off], 0,
 					sizeof(struct f2fs_nat_entry));
 
-	ret = dev_write_block(nat_block, block_addr);
+	ret = meta_write_block(sbi, nat_block, block_addr);
 	ASSERT(ret >= 0);
-	free(nat_block);
+	f2fs_blk_free(nat_block);
 }
 
 void write_checkpoint(struct f2fs_sb_info *sbi)
@@ -1729,6 +1908,17 @@ void write_checkpoint(struct f2fs_sb_info *sbi)
 	crc = f2fs_cal_crc32(F2FS_SUPER_MAGIC, cp, CHECKSUM_OFFSET);
 	*((__le32 *)((unsigned char *)cp + CHECKSUM_OFFSET)) = cpu_to_le32(crc);
 
+	/* update original SSA too, and the metadata before the checkpoint */
+	for (i = 0; i < NO_CHECK_TYPE; i++) {
+		struct curseg_info *curseg = CURSEG_I(sbi, i);
+		u64 ssa_blk = GET_SUM_BLKADDR(sbi, curseg->segno);
+
+		ret = meta_write_block(sbi, curseg->sum_blk, ssa_blk);
+		ASSERT(ret >= 0);
+	}
+	ret = f2fs_flush_meta_cache(sbi);
+	ASSERT(ret >= 0);
+
 	cp_blk_no = get_sb(cp_blkaddr);
 	if (sbi->cur_cp == 2)
 		cp_blk_no += 1 << get_sb(log_blocks_per_seg);
@@ -1745,15 +1935,9 @@ void write_checkpoint(struct f2fs_sb_info *sbi)
 	/* update summary blocks having nullified journal entries */
 	for (i = 0; i < NO_CHECK_TYPE; i++) {
 		struct curseg_info *curseg = CURSEG_I(sbi, i);
-		u64 ssa_blk;
 
 		ret = dev_write_block(curseg->sum_blk, cp_blk_no++);
 		ASSERT(ret >= 0);
-
-		/* update original SSA too */
-		ssa_blk = GET_SUM_BLKADDR(sbi, curseg->segno);
-		ret = dev_write_block(curseg->sum_blk, ssa_blk);
-		ASSERT(ret >= 0);
 	}
 
 	/* write the last cp */
@@ -1774,7 +1958,7 @@ void build_nat_area_bitmap(struct f2fs_sb_info *sbi)
 	int ret;
 	unsigned int i;
 
-	nat_block = (struct f2fs_nat_block *)calloc(BLOCK_SZ, 1);
+	nat_block = f2fs_blk_alloc();
 	ASSERT(nat_block);
 
 	/* Alloc & build nat entry bitmap */
@@ -1880,7 +2064,7 @@ void build_nat_area_bitmap(struct f2fs_sb_info *sbi)
 			}
 		}
 	}
-	free(nat_block);
+	f2fs_blk_free(nat_block);
 
 	DBG(1, "valid nat entries (block_addr != 0x0) [0x%8x : %u]\n",
 			fsck->chk.valid_nat_entry_cnt,
@@ -1893,17 +2077,21 @@ static int check_sector_size(struct f2fs_super_block *sb)
 	u_int32_t log_sectorsize, log_sectors_per_block;
 	u_int8_t *zero_buff;
 
-	zero_buff = calloc(F2FS_BLKSIZE, 1);
-
 	log_sectorsize = log_base_2(config.sector_size);
 	log_sectors_per_block = log_base_2(config.sectors_per_blk);
 
-	if (log_sectorsize != get_sb(log_sectorsize))
-		set_sb(log_sectorsize, log_sectorsize);
+	if (log_sectorsize == get_sb(log_sectorsize) &&
+			log_sectors_per_block == get_sb(log_sectors_per_block))
+		return 0;
 
-	if (log_sectors_per_block != get_sb(log_sectors_per_block))
-		set_sb(log_sectors_per_block, log_sectors_per_block);
+	set_sb(log_sectorsize, log_sectorsize);
+	set_sb(log_sectors_per_block, log_sectors_per_block);
 
+	/* -B leaves the image as it is */
+	if (config.assert_jmp)
+		return 0;
+
+	zero_buff = calloc(F2FS_BLKSIZE, 1);
 	memcpy(zero_buff + F2FS_SUPER_OFFSET, sb, sizeof(*sb));
 	DBG(1, "\tWriting super block, at offset 0x%08x\n", 0);
 	for (index = 0; index < 2; index++) {
@@ -1987,32 +2175,53 @@ int f2fs_do_mount(struct f2fs_sb_info *sbi)
 
 void f2fs_do_umount(struct f2fs_sb_info *sbi)
 {
-	struct sit_info *sit_i = SIT_I(sbi);
 	struct f2fs_sm_info *sm_i = SM_I(sbi);
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
+	struct sit_info *sit_i;
 	unsigned int i;
 
+	/* f2fs_do_mount() may have failed half way */
+
 	/* free nm_info */
-	if (config.func == SLOAD)
-		free(nm_i->nid_bitmap);
-	free(nm_i->nat_bitmap);
-	free(sbi->nm_info);
+	if (nm_i) {
+		if (config.func == SLOAD)
+			free(nm_i->nid_bitmap);
+		free(nm_i->nat_bitmap);
+		free(sbi->nm_info);
+		sbi->nm_info = NULL;
+	}
+
+	if (!sm_i)
+		goto out;
 
 	/* free sit_info */
-	for (i = 0; i < TOTAL_SEGS(sbi); i++) {
-		free(sit_i->sentries[i].cur_valid_map);
-		free(sit_i->sentries[i].ckpt_valid_map);
+	sit_i = SIT_I(sbi);
+	if (sit_i) {
+		free(sit_i->valid_blocks);
+		free(sit_i->ckpt_valid_blocks);
+		free(sit_i->seg_type);
+		free(sit_i->orig_type);
+		free(sit_i->mtime);
+		free(sit_i->seg_dirty);
+		free(sit_i->cur_valid_map);
+		free(sit_i->ckpt_valid_map);
+		free(sit_i->sit_bitmap);
+		free(sm_i->sit_info);
 	}
-	free(sit_i->sit_bitmap);
-	free(sm_i->sit_info);
 
 	/* free sm_info */
-	for (i = 0; i < NR_CURSEG_TYPE; i++)
-		free(sm_i->curseg_array[i].sum_blk);
+	if (sm_i->curseg_array)
+		for (i = 0; i < NR_CURSEG_TYPE; i++)
+			free(sm_i->curseg_array[i].sum_blk);
 
 	free(sm_i->curseg_array);
 	free(sbi->sm_info);
+	sbi->sm_info = NULL;
+out:
+	f2fs_exit_meta_cache(sbi);
 
 	free(sbi->ckpt);
 	free(sbi->raw_super);
+	sbi->ckpt = NULL;
+	sbi->raw_super = NULL;
 }
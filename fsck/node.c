@@ -68,7 +68,7 @@ block_t new_node_block(struct f2fs_sb_info *sbi,
 
 	f2fs_inode = dn->inode_blk;
 
-	node_blk = calloc(BLOCK_SZ, 1);
+	node_blk = f2fs_blk_zalloc();
 	ASSERT(node_blk);
 
 	node_blk->footer.nid = cpu_to_le32(dn->nid);
@@ -97,6 +97,82 @@ block_t new_node_block(struct f2fs_sb_info *sbi,
 	return blkaddr;
 }
 
+/* free the node @nid and its block, the opposite of f2fs_alloc_nid() */
+void f2fs_free_node(struct f2fs_sb_info *sbi, nid_t nid, int inode)
+{
+	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
+	struct node_info ni;
+
+	get_node_info(sbi, nid, &ni);
+	if (IS_VALID_BLK_ADDR(sbi, ni.blk_addr))
+		invalidate_block(sbi, ni.blk_addr);
+	nullify_nat_entry(sbi, nid);
+	f2fs_clear_bit(nid, NM_I(sbi)->nid_bitmap);
+
+	if (inode)
+		set_cp(valid_inode_count, get_cp(valid_inode_count) - 1);
+	set_cp(valid_node_count, get_cp(valid_node_count) - 1);
+}
+
+static int truncate_data(struct node_walk *walk,
+		struct node_walk_level *level, u16 ofs, block_t blkaddr)
+{
+	if (blkaddr != NULL_ADDR && blkaddr != NEW_ADDR &&
+			IS_VALID_BLK_ADDR(walk->sbi, blkaddr))
+		invalidate_block(walk->sbi, blkaddr);
+	return 0;
+}
+
+static void truncate_leave(struct node_walk *walk,
+					struct node_walk_level *level)
+{
+	f2fs_free_node(walk->sbi, level->nid, 0);
+}
+
+static const struct node_walk_ops truncate_ops = {
+	.node = node_walk_read_node,
+	.data = truncate_data,
+	.leave = truncate_leave,
+};
+
+/*
+ * Free the data blocks and the nodes below the inode @inode_blk, which is
+ * left empty in memory for the caller to write.
+ */
+void f2fs_truncate_inode(struct f2fs_sb_info *sbi, struct f2fs_node *inode_blk)
+{
+	struct f2fs_inode *inode = &inode_blk->i;
+	nid_t ino = le32_to_cpu(inode_blk->footer.ino);
+	struct node_walk walk;
+	struct node_info ni;
+
+	if (!(inode->i_inline & (F2FS_INLINE_DATA | F2FS_INLINE_DENTRY))) {
+		get_node_info(sbi, ino, &ni);
+		node_walk_init(&walk, sbi, &truncate_ops, NULL);
+		node_walk(&walk, &ni, inode_blk);
+	}
+
+	memset(inode->i_addr, 0, ADDRS_PER_INODE(inode) * sizeof(__le32));
+	memset(inode->i_nid, 0, sizeof(inode->i_nid));
+	memset(&inode->i_ext, 0, sizeof(inode->i_ext));
+	inode->i_inline &= ~(F2FS_INLINE_DATA | F2FS_INLINE_DENTRY |
+							F2FS_DATA_EXIST);
+	inode->i_size = 0;
+	inode->i_blocks = cpu_to_le64(inode->i_xattr_nid ? 2 : 1);
+}
+
+/* free the inode @inode_blk with everything it holds */
+void f2fs_free_inode(struct f2fs_sb_info *sbi, struct f2fs_node *inode_blk)
+{
+	nid_t ino = le32_to_cpu(inode_blk->footer.ino);
+	nid_t xnid = le32_to_cpu(inode_blk->i.i_xattr_nid);
+
+	f2fs_truncate_inode(sbi, inode_blk);
+	if (xnid)
+		f2fs_free_node(sbi, xnid, 0);
+	f2fs_free_node(sbi, ino, 1);
+}
+
 /*
  * get_node_path - Get the index path of pgoff_t block
  * @offset: offset in the current index node block.
@@ -220,7 +296,7 @@ void get_dnode_of_data(struct f2fs_sb_info *sbi, struct dnode_of_data *dn,
 			struct node_info ni;
 
 			get_node_info(sbi, nids[i], &ni);
-			dn->node_blk = calloc(BLOCK_SZ, 1);
+			dn->node_blk = f2fs_blk_alloc();
 			ASSERT(dn->node_blk);
 
 			ret = dev_read_block(dn->node_blk, ni.blk_addr);
@@ -235,7 +311,7 @@ void get_dnode_of_data(struct f2fs_sb_info *sbi, struct dnode_of_data *dn,
 			ASSERT(ret >= 0);
 		}
 		if (i != 1)
-			free(parent);
+			f2fs_blk_free(parent);
 
 		if (i < level) {
 			parent = dn->node_blk;
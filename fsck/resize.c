@@ -135,21 +135,21 @@ static int get_new_sb(struct f2fs_sb_info *sbi, struct f2fs_super_block *sb)
 static void migrate_main(struct f2fs_sb_info *sbi,
 		struct f2fs_super_block *new_sb, unsigned int offset)
 {
-	void *raw = calloc(BLOCK_SZ, 1);
-	struct seg_entry *se;
+	void *raw = f2fs_blk_alloc();
 	block_t from, to;
 	int i, j, ret;
 	struct f2fs_summary sum;
 
 	ASSERT(raw != NULL);
 
-	for (i = TOTAL_SEGS(sbi); i >= 0; i--) {
-		se = get_seg_entry(sbi, i);
-		if (!se->valid_blocks)
+	for (i = TOTAL_SEGS(sbi) - 1; i >= 0; i--) {
+		const char *valid_map = (const char *)SE_VALID_MAP(sbi, i);
+
+		if (!SE_VALID_BLOCKS(sbi, i))
 			continue;
 
 		for (j = sbi->blocks_per_seg - 1; j >= 0; j--) {
-			if (!f2fs_test_bit(j, (const char *)se->cur_valid_map))
+			if (!f2fs_test_bit(j, valid_map))
 				continue;
 
 			from = START_BLOCK(sbi, i) + j;
@@ -162,7 +162,7 @@ static void migrate_main(struct f2fs_sb_info *sbi,
 
 			get_sum_entry(sbi, from, &sum);
 
-			if (IS_DATASEG(se->type))
+			if (IS_DATASEG(SE_TYPE(sbi, i)))
 				update_data_blkaddr(sbi, le32_to_cpu(sum.nid),
 					le16_to_cpu(sum.ofs_in_node), to);
 			else
@@ -170,7 +170,7 @@ static void migrate_main(struct f2fs_sb_info *sbi,
 						le32_to_cpu(sum.nid), to);
 		}
 	}
-	free(raw);
+	f2fs_blk_free(raw);
 	DBG(0, "Info: Done to migrate data and node blocks\n");
 }
 
@@ -230,9 +230,9 @@ static int shrink_nats(struct f2fs_sb_info *sbi,
 	pgoff_t block_addr;
 	int seg_off;
 
-	nat_block = malloc(BLOCK_SZ);
+	nat_block = f2fs_blk_alloc();
 	ASSERT(nat_block);
-	zero_block = calloc(BLOCK_SZ, 1);
+	zero_block = f2fs_blk_zalloc();
 	ASSERT(zero_block);
 
 	nat_blocks = get_newsb(segment_count_nat) >> 1;
@@ -260,8 +260,8 @@ static int shrink_nats(struct f2fs_sb_info *sbi,
 	ret = 0;
 	nm_i->max_nid = new_max_nid;
 not_avail:
-	free(nat_block);
-	free(zero_block);
+	f2fs_blk_free(nat_block);
+	f2fs_blk_free(zero_block);
 	return ret;
 }
 
@@ -279,7 +279,7 @@ static void migrate_nat(struct f2fs_sb_info *sbi,
 	pgoff_t block_addr;
 	int seg_off;
 
-	nat_block = malloc(BLOCK_SZ);
+	nat_block = f2fs_blk_alloc();
 	ASSERT(nat_block);
 
 	for (nid = nm_i->max_nid - 1; nid >= 0; nid -= NAT_ENTRY_PER_BLOCK) {
@@ -325,6 +325,7 @@ static void migrate_nat(struct f2fs_sb_info *sbi,
 		ASSERT(ret >= 0);
 		DBG(1, "Write NAT: %lx\n", block_addr);
 	}
+	f2fs_blk_free(nat_block);
 	DBG(0, "Info: Done to migrate NAT blocks\n");
 }
 
@@ -334,10 +335,9 @@ static void migrate_sit(struct f2fs_sb_info *sbi,
 	struct sit_info *sit_i = SIT_I(sbi);
 	unsigned int ofs = 0, pre_ofs = 0;
 	unsigned int segno, index;
-	struct f2fs_sit_block *sit_blk = calloc(BLOCK_SZ, 1);
+	struct f2fs_sit_block *sit_blk = f2fs_blk_zalloc();
 	block_t sit_blks = get_newsb(segment_count_sit) <<
 						(sbi->log_blocks_per_seg - 1);
-	struct seg_entry *se;
 	block_t blk_addr = 0;
 	int ret;
 
@@ -353,9 +353,8 @@ static void migrate_sit(struct f2fs_sb_info *sbi,
 	for (segno = 0; segno < TOTAL_SEGS(sbi); segno++) {
 		struct f2fs_sit_entry *sit;
 
-		se = get_seg_entry(sbi, segno);
 		if (segno < offset) {
-			ASSERT(se->valid_blocks == 0);
+			ASSERT(SE_VALID_BLOCKS(sbi, segno) == 0);
 			continue;
 		}
 
@@ -372,16 +371,17 @@ static void migrate_sit(struct f2fs_sb_info *sbi,
 		}
 
 		sit = &sit_blk->entries[SIT_ENTRY_OFFSET(sit_i, segno - offset)];
-		memcpy(sit->valid_map, se->cur_valid_map, SIT_VBLOCK_MAP_SIZE);
-		sit->vblocks = cpu_to_le16((se->type << SIT_VBLOCKS_SHIFT) |
-							se->valid_blocks);
+		memcpy(sit->valid_map, SE_VALID_MAP(sbi, segno),
+						SIT_VBLOCK_MAP_SIZE);
+		sit->vblocks = cpu_to_le16((SE_TYPE(sbi, segno) <<
+				SIT_VBLOCKS_SHIFT) | SE_VALID_BLOCKS(sbi, segno));
 	}
 	blk_addr = get_newsb(sit_blkaddr) + ofs;
 	ret = dev_write_block(sit_blk, blk_addr);
 	DBG(1, "Write valid sit: %x\n", blk_addr);
 	ASSERT(ret >= 0);
 
-	free(sit_blk);
+	f2fs_blk_free(sit_blk);
 	DBG(0, "Info: Done to migrate SIT blocks\n");
 }
 
@@ -402,7 +402,7 @@ static void rebuild_checkpoint(struct f2fs_sb_info *sbi,
 	new_cp = calloc(new_cp_blks * BLOCK_SZ, 1);
 	ASSERT(new_cp);
 
-	buf = malloc(BLOCK_SZ);
+	buf = f2fs_blk_alloc();
 	ASSERT(buf);
 
 	/* ovp / free segments */
@@ -498,7 +498,7 @@ static void rebuild_checkpoint(struct f2fs_sb_info *sbi,
 	ret = dev_write_block(buf, old_cp_blk_no);
 	ASSERT(ret >= 0);
 
-	free(buf);
+	f2fs_blk_free(buf);
 	free(new_cp);
 	DBG(0, "Info: Done to rebuild checkpoint blocks\n");
 }
@@ -509,14 +509,14 @@ static void rebuild_superblock(struct f2fs_sb_info *sbi,
 	int index, ret;
 	u_int8_t *buf;
 
-	buf = calloc(BLOCK_SZ, 1);
+	buf = f2fs_blk_zalloc();
 
 	memcpy(buf + F2FS_SUPER_OFFSET, new_sb, sizeof(*new_sb));
 	for (index = 0; index < 2; index++) {
 		ret = dev_write_block(buf, index);
 		ASSERT(ret >= 0);
 	}
-	free(buf);
+	f2fs_blk_free(buf);
 	DBG(0, "Info: Done to rebuild superblock\n");
 }
 
@@ -16,33 +16,74 @@
 #include "fsck.h"
 #include "node.h"
 
-void reserve_new_block(struct f2fs_sb_info *sbi, block_t *to,
-			struct f2fs_summary *sum, int type)
+/*
+ * Reserve up to @nr physically contiguous blocks of @type within one
+ * segment, starting at the first free block past the previous run of @type.
+ * Returns the number of blocks reserved at *to; summaries are left to the
+ * caller.
+ */
+unsigned int reserve_new_blocks(struct f2fs_sb_info *sbi, block_t *to,
+					unsigned int nr, int type)
 {
-	struct seg_entry *se;
+	unsigned int i;
+	u32 segno;
 	u64 blkaddr;
 	u64 offset;
 
-	blkaddr = SM_I(sbi)->main_blkaddr;
-
-	if (find_next_free_block(sbi, &blkaddr, 0, type)) {
+	if (alloc_next_free_block(sbi, &blkaddr, type)) {
 		ERR_MSG("Not enough space to allocate blocks");
 		ASSERT(0);
 	}
 
-	se = get_seg_entry(sbi, GET_SEGNO(sbi, blkaddr));
+	segno = GET_SEGNO(sbi, blkaddr);
 	offset = OFFSET_IN_SEG(sbi, blkaddr);
-	se->type = type;
-	se->valid_blocks++;
-	f2fs_set_bit(offset, (char *)se->cur_valid_map);
-	sbi->total_valid_block_count++;
-	se->dirty = 1;
+	if (SE_VALID_BLOCKS(sbi, segno) == 0 &&
+			!IS_CUR_SEGNO(sbi, segno, NO_CHECK_TYPE))
+		sbi->free_segments--;
+	SE_TYPE(sbi, segno) = type;
+	SE_DIRTY(sbi, segno) = 1;
+
+	for (i = 0; i < nr && offset + i < sbi->blocks_per_seg; i++) {
+		if (f2fs_test_bit(offset + i,
+				(const char *)SE_VALID_MAP(sbi, segno)))
+			break;
+		f2fs_set_bit(offset + i, (char *)SE_VALID_MAP(sbi, segno));
+	}
+	SE_VALID_BLOCKS(sbi, segno) += i;
+	sbi->total_valid_block_count += i;
+	sbi->alloc_cursor[type] = blkaddr + i;
 
-	/* read/write SSA */
 	*to = (block_t)blkaddr;
+	return i;
+}
+
+void reserve_new_block(struct f2fs_sb_info *sbi, block_t *to,
+			struct f2fs_summary *sum, int type)
+{
+	reserve_new_blocks(sbi, to, 1, type);
+
+	/* read/write SSA */
 	update_sum_entry(sbi, *to, sum);
 }
 
+/* give a block back, leaving its stale summary as the kernel does */
+void invalidate_block(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	u32 segno = GET_SEGNO(sbi, blkaddr);
+	u64 offset = OFFSET_IN_SEG(sbi, blkaddr);
+
+	if (!f2fs_test_bit(offset, (const char *)SE_VALID_MAP(sbi, segno)))
+		return;
+
+	f2fs_clear_bit(offset, (char *)SE_VALID_MAP(sbi, segno));
+	SE_VALID_BLOCKS(sbi, segno)--;
+	SE_DIRTY(sbi, segno) = 1;
+	sbi->total_valid_block_count--;
+	if (SE_VALID_BLOCKS(sbi, segno) == 0 &&
+			!IS_CUR_SEGNO(sbi, segno, NO_CHECK_TYPE))
+		sbi->free_segments++;
+}
+
 void new_data_block(struct f2fs_sb_info *sbi, void *block,
 				struct dnode_of_data *dn, int type)
 {
@@ -60,7 +101,7 @@ void new_data_block(struct f2fs_sb_info *sbi, void *block,
 	set_data_blkaddr(dn);
 }
 
-static void f2fs_write_block(struct f2fs_sb_info *sbi, nid_t ino, void *buffer,
+void f2fs_write_block(struct f2fs_sb_info *sbi, nid_t ino, void *buffer,
 					u64 count, pgoff_t offset)
 {
 	u64 start = F2FS_BYTES_TO_BLK(offset);
@@ -74,7 +115,7 @@ static void f2fs_write_block(struct f2fs_sb_info *sbi, nid_t ino, void *buffer,
 	int ret = -1;
 
 	get_node_info(sbi, ino, &ni);
-	inode = calloc(BLOCK_SZ, 1);
+	inode = f2fs_blk_alloc();
 	ASSERT(inode);
 
 	ret = dev_read_block(inode, ni.blk_addr);
@@ -84,7 +125,7 @@ static void f2fs_write_block(struct f2fs_sb_info *sbi, nid_t ino, void *buffer,
 		ASSERT(0);
 
 	off_in_block = offset & ((1 << F2FS_BLKSIZE_BITS) - 1);
-	len_in_block = (1 << F2FS_BLKSIZE_BITS) - off_in_block;
+	len_in_block = min(count, (u64)F2FS_BLKSIZE - off_in_block);
 	len_already = 0;
 
 	/*
@@ -94,14 +135,14 @@ static void f2fs_write_block(struct f2fs_sb_info *sbi, nid_t ino, void *buffer,
 	len = F2FS_BYTES_TO_BLK(count + off_in_block
 			+ ((1 << F2FS_BLKSIZE_BITS) - 1));
 
-	data_blk = calloc(BLOCK_SZ, 1);
+	data_blk = f2fs_blk_alloc();
 	ASSERT(data_blk);
 
 	set_new_dnode(&dn, inode, NULL, ino);
 
 	while (len) {
 		if (dn.node_blk != dn.inode_blk)
-			free(dn.node_blk);
+			f2fs_blk_free(dn.node_blk);
 
 		set_new_dnode(&dn, inode, NULL, ino);
 		get_dnode_of_data(sbi, &dn, start, ALLOC_NODE);
@@ -109,22 +150,36 @@ static void f2fs_write_block(struct f2fs_sb_info *sbi, nid_t ino, void *buffer,
 		end_offset = ADDRS_PER_PAGE(dn.node_blk);
 
 		while (dn.ofs_in_node < end_offset && len) {
+			char *src = (char *)buffer + len_already;
 			block_t blkaddr;
+			int full;
 
 			blkaddr = datablock_addr(dn.node_blk, dn.ofs_in_node);
+			full = off_in_block == 0 && len_in_block == F2FS_BLKSIZE;
 
-			/* A new page from WARM_DATA */
-			if (blkaddr == NULL_ADDR)
+			if (blkaddr == NULL_ADDR) {
+				/* A new page from WARM_DATA, zeroed for us */
 				new_data_block(sbi, data_blk, &dn,
 							CURSEG_WARM_DATA);
+			} else {
+				dn.data_blkaddr = blkaddr;
 
-			/* Copy data from buffer to file */
-			ret = dev_read_block(data_blk, dn.data_blkaddr);
-			ASSERT(ret >= 0);
-
-			memcpy(data_blk + off_in_block, buffer, len_in_block);
+				/* keep the rest of a partially written block */
+				if (!full) {
+					ret = dev_read_block(data_blk, blkaddr);
+					ASSERT(ret >= 0);
+				}
+			}
 
-			ret = dev_write_block(data_blk, dn.data_blkaddr);
+			/* Copy data from buffer to file */
+			if (full) {
+				ret = dev_write_block(src, dn.data_blkaddr);
+			} else {
+				memcpy(data_blk + off_in_block, src,
+							len_in_block);
+				ret = dev_write_block(data_blk,
+							dn.data_blkaddr);
+			}
 			ASSERT(ret >= 0);
 
 			off_in_block = 0;
@@ -157,64 +212,213 @@ static void f2fs_write_block(struct f2fs_sb_info *sbi, nid_t ino, void *buffer,
 	}
 
 	if (dn.node_blk && dn.node_blk != dn.inode_blk)
-		free(dn.node_blk);
-	free(data_blk);
-	free(inode);
+		f2fs_blk_free(dn.node_blk);
+	f2fs_blk_free(data_blk);
+	f2fs_blk_free(inode);
 }
 
-int f2fs_build_file(struct f2fs_sb_info *sbi, struct dentry *de)
+/*
+ * Start appending data to the still empty regular file @ino. The blocks
+ * of each direct node are reserved in contiguous runs, and the longest run
+ * becomes the inode extent. Cold files go to the cold data log, the others
+ * to the warm one unless the caller changes w->type.
+ */
+void f2fs_data_writer_open(struct f2fs_sb_info *sbi, struct data_writer *w,
+								nid_t ino)
 {
-	int fd, n;
-	pgoff_t off = 0;
-	char buffer[BLOCK_SZ];
+	struct node_info ni;
+	int ret;
 
-	if (de->ino == 0)
-		return -1;
+	memset(w, 0, sizeof(struct data_writer));
+	get_node_info(sbi, ino, &ni);
+	w->ino = ino;
+	w->inode_blkaddr = ni.blk_addr;
 
-	fd = open(de->full_path, O_RDONLY);
-	if (fd < 0) {
-		MSG(0, "Skip: Fail to open %s\n", de->full_path);
-		return -1;
-	}
+	w->inode = f2fs_blk_alloc();
+	ASSERT(w->inode);
+	ret = dev_read_block(w->inode, ni.blk_addr);
+	ASSERT(ret >= 0);
 
-	/* inline_data support */
-	if (de->size <= MAX_INLINE_DATA) {
-		struct node_info ni;
-		struct f2fs_node *node_blk;
-		int ret;
+	if (w->inode->i.i_advise & FADVISE_COLD_BIT)
+		w->type = CURSEG_COLD_DATA;
+	else
+		w->type = CURSEG_WARM_DATA;
+}
 
-		get_node_info(sbi, de->ino, &ni);
+static void data_writer_put_dnode(struct data_writer *w)
+{
+	struct dnode_of_data *dn = &w->dn;
+	int ret;
 
-		node_blk = calloc(BLOCK_SZ, 1);
-		ASSERT(node_blk);
+	if (!dn->node_blk)
+		return;
 
-		ret = dev_read_block(node_blk, ni.blk_addr);
+	if (dn->ndirty) {
+		ret = dev_write_block(dn->node_blk, dn->node_blkaddr);
 		ASSERT(ret >= 0);
+	}
+	if (dn->node_blk != dn->inode_blk)
+		f2fs_blk_free(dn->node_blk);
+	dn->node_blk = NULL;
+}
 
-		node_blk->i.i_inline |= F2FS_INLINE_DATA;
-		node_blk->i.i_inline |= F2FS_DATA_EXIST;
-		n = read(fd, buffer, BLOCK_SZ);
-		ASSERT(n == de->size);
-		memcpy(&node_blk->i.i_addr[1], buffer, de->size);
+/*
+ * Reserve the next run of at most @nr_blks blocks for the file, within its
+ * current direct node, and point the node and the summaries at them.
+ */
+static unsigned int data_writer_reserve(struct f2fs_sb_info *sbi,
+			struct data_writer *w, unsigned int nr_blks,
+			block_t *blkaddr)
+{
+	struct f2fs_summary sums[SLOAD_RUN_BLKS];
+	struct dnode_of_data *dn = &w->dn;
+	struct node_info ni;
+	unsigned int nr, i;
+
+	if (!dn->node_blk || dn->ofs_in_node == ADDRS_PER_PAGE(dn->node_blk)) {
+		data_writer_put_dnode(w);
+		set_new_dnode(dn, w->inode, NULL, w->ino);
+		get_dnode_of_data(sbi, dn, w->pgofs, ALLOC_NODE);
+		get_node_info(sbi, dn->nid, &ni);
+		w->dn_version = ni.version;
+	}
 
-		node_blk->i.i_size = cpu_to_le64(de->size);
+	nr = ADDRS_PER_PAGE(dn->node_blk) - dn->ofs_in_node;
+	if (nr > nr_blks)
+		nr = nr_blks;
+	if (nr > SLOAD_RUN_BLKS)
+		nr = SLOAD_RUN_BLKS;
+	nr = reserve_new_blocks(sbi, blkaddr, nr, w->type);
+
+	for (i = 0; i < nr; i++) {
+		set_summary(&sums[i], dn->nid, dn->ofs_in_node, w->dn_version);
+		dn->data_blkaddr = *blkaddr + i;
+		set_data_blkaddr(dn);
+		inc_inode_blocks(dn);
+		dn->ofs_in_node++;
+	}
+	update_sum_entries(sbi, *blkaddr, sums, nr);
 
-		ret = dev_write_block(node_blk, ni.blk_addr);
-		ASSERT(ret >= 0);
-		free(node_blk);
+	if (w->cur_len && w->cur_fofs + w->cur_len == w->pgofs &&
+			w->cur_blk + w->cur_len == *blkaddr) {
+		w->cur_len += nr;
 	} else {
-		while ((n = read(fd, buffer, BLOCK_SZ)) > 0) {
-			f2fs_write_block(sbi, de->ino, buffer, n, off);
-			off += n;
-		}
+		w->cur_fofs = w->pgofs;
+		w->cur_blk = *blkaddr;
+		w->cur_len = nr;
+	}
+	if (w->cur_len > w->ext_len) {
+		w->ext_fofs = w->cur_fofs;
+		w->ext_blk = w->cur_blk;
+		w->ext_len = w->cur_len;
+	}
+
+	w->pgofs += nr;
+	return nr;
+}
+
+/*
+ * Append @nr_blks blocks from @buf. The data goes out with dev_write_async(),
+ * which frees @release along with the last run taken from @buf.
+ */
+void f2fs_data_writer_append(struct f2fs_sb_info *sbi, struct data_writer *w,
+			char *buf, unsigned int nr_blks, void *release)
+{
+	unsigned int nr;
+	block_t blkaddr;
+	int ret;
+
+	if (!nr_blks)
+		free(release);
+
+	while (nr_blks) {
+		nr = data_writer_reserve(sbi, w, nr_blks, &blkaddr);
+		ret = dev_write_async(buf, (u64)blkaddr * F2FS_BLKSIZE,
+				nr * F2FS_BLKSIZE, nr == nr_blks ? release : NULL);
+		ASSERT(ret >= 0);
+
+		buf += nr * F2FS_BLKSIZE;
+		nr_blks -= nr;
 	}
+}
+
+/*
+ * Append @nr_blks blocks copied from @fd at @offset by dev_copy_async(),
+ * which closes @fd after the last run if @close_fd.
+ */
+void f2fs_data_writer_copy(struct f2fs_sb_info *sbi, struct data_writer *w,
+		int fd, u64 offset, unsigned int nr_blks, int close_fd)
+{
+	unsigned int nr;
+	block_t blkaddr;
+	int ret;
+
+	while (nr_blks) {
+		nr = data_writer_reserve(sbi, w, nr_blks, &blkaddr);
+		ret = dev_copy_async(fd, offset, (u64)blkaddr * F2FS_BLKSIZE,
+				nr * F2FS_BLKSIZE, nr == nr_blks && close_fd);
+		ASSERT(ret >= 0);
+
+		offset += nr * F2FS_BLKSIZE;
+		nr_blks -= nr;
+	}
+}
+
+/* leave the blocks before @pgofs as a hole */
+void f2fs_data_writer_skip(struct data_writer *w, pgoff_t pgofs)
+{
+	ASSERT(pgofs >= w->pgofs);
+	if (pgofs == w->pgofs)
+		return;
 
-	close(fd);
-	if (n < 0)
-		return -1;
+	data_writer_put_dnode(w);
+	w->pgofs = pgofs;
+}
+
+void f2fs_data_writer_close(struct f2fs_sb_info *sbi, struct data_writer *w,
+								u64 size)
+{
+	struct f2fs_node *inode = w->inode;
+	int ret;
+
+	data_writer_put_dnode(w);
+
+	inode->i.i_size = cpu_to_le64(size);
+	inode->i.i_ext.fofs = cpu_to_le32(w->ext_fofs);
+	inode->i.i_ext.blk_addr = cpu_to_le32(w->ext_blk);
+	inode->i.i_ext.len = cpu_to_le32(w->ext_len);
 
-	update_free_segments(sbi);
+	ret = dev_write_block(inode, w->inode_blkaddr);
+	ASSERT(ret >= 0);
+
+	f2fs_blk_free(inode);
+	w->inode = NULL;
+}
 
-	MSG(1, "Info: built a file %s, size=%lu\n", de->full_path, de->size);
-	return 0;
+/* store a file of at most MAX_INLINE_DATA bytes in its inode */
+void f2fs_write_inline_data(struct f2fs_sb_info *sbi, nid_t ino, void *buf,
+								u64 size)
+{
+	struct node_info ni;
+	struct f2fs_node *node_blk;
+	int ret;
+
+	ASSERT(size <= MAX_INLINE_DATA);
+	get_node_info(sbi, ino, &ni);
+
+	node_blk = f2fs_blk_alloc();
+	ASSERT(node_blk);
+
+	ret = dev_read_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	node_blk->i.i_inline |= F2FS_INLINE_DATA;
+	node_blk->i.i_inline |= F2FS_DATA_EXIST;
+	memcpy(&node_blk->i.i_addr[1], buf, size);
+
+	node_blk->i.i_size = cpu_to_le64(size);
+
+	ret = dev_write_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+	f2fs_blk_free(node_blk);
 }
@@ -16,6 +16,7 @@
 #include <libgen.h>
 #include <dirent.h>
 #include <mntent.h>
+#include <pthread.h>
 #include <selinux/selinux.h>
 #include <selinux/label.h>
 
@@ -41,34 +42,1024 @@ static void handle_selabel(struct dentry *de, int dir, char *target_out)
 #define handle_selabel(...)
 #endif
 
+/*
+ * Regular files are loaded through a pipeline: build_directory() queues
+ * them as chunks of up to SLOAD_CHUNK_BLKS blocks, reader threads fill
+ * and checksum the queued chunks, and the calling thread alone allocates
+ * blocks and updates metadata for them, in queue order, handing the data
+ * to the IO thread of dev_write_async(). The image does not depend on the
+ * number of readers.
+ *
+ * The whole blocks of chunks of at least SLOAD_COPY_MIN bytes are not read
+ * at all; dev_copy_async() moves them from the source file to the device
+ * in the kernel, and only a partial last block goes through memory.
+ *
+ * Only the data ranges of sparse files are queued, so their holes stay
+ * unallocated, and a source inode with several names becomes one inode.
+ *
+ * With a placement list, file data is queued only once the whole tree is
+ * built: first the listed files in the order of the list, then the rest in
+ * the order they were found.
+ */
+#define SLOAD_CHUNK_BLKS	256
+#define SLOAD_COPY_MIN		(16 * F2FS_BLKSIZE)
+#define SLOAD_QUEUE		64	/* chunks queued ahead of the writer */
+#define SLOAD_MAX_READERS	8
+#define SLOAD_LINK_HASH		1024
+#define SLOAD_PLACE_HASH	1024
+#define SLOAD_CON_HASH		64
+
+struct sload_file {
+	char *full_path;
+	nid_t ino;
+	int type;	/* CURSEG_*_DATA, -1 for the default of the inode */
+	u64 size;
+	u64 next;	/* offset the written data reaches */
+	u32 crc;	/* over the checksums of the chunks */
+	int copied;	/* some data never went through memory */
+	int opened;	/* data goes through sload_pipe.w */
+	int err;
+};
+
+enum {
+	CHUNK_QUEUED,
+	CHUNK_READING,
+	CHUNK_READY,
+};
+
+struct sload_chunk {
+	struct sload_file *file;
+	u64 offset;
+	u32 len;
+	u32 copy_len;	/* leading bytes left to dev_copy_async() */
+	int first;
+	int last;
+	int state;
+	int err;	/* the file could not be opened */
+	ssize_t done;	/* bytes read, -1 on read errors */
+	char *buf;	/* the rest rounded up to blocks, zero padded */
+	u32 crc;
+	int src_fd;	/* open for copy_len */
+	int fd;		/* left open when the file grew past its size */
+};
+
+struct sload_pipe {
+	struct f2fs_sb_info *sbi;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct sload_chunk ring[SLOAD_QUEUE];
+	unsigned int head;	/* next chunk for the writer */
+	unsigned int next;	/* next chunk for a reader */
+	unsigned int tail;	/* next free slot */
+	int stop;
+	int nr_readers;
+	pthread_t readers[SLOAD_MAX_READERS];
+	struct data_writer w;
+	unsigned int nr_files;
+	struct sload_link *links[SLOAD_LINK_HASH];
+	int defer;			/* queue file data after the walk */
+	struct sload_place *places;	/* in the order of the list */
+	int nr_places;
+	struct sload_place *place_hash[SLOAD_PLACE_HASH];
+	struct dentry *rest;		/* files not in the list */
+	int nr_rest, max_rest;
+	struct sload_con *cons[SLOAD_CON_HASH];
+};
+
+/* a file of the placement list */
+struct sload_place {
+	struct sload_place *next;	/* hash chain */
+	char *path;
+	int type;			/* CURSEG_*_DATA, -1 for the default */
+	struct dentry de;		/* the file, once it is found */
+};
+
+/* a security context, shared by the files labeled with it */
+struct sload_con {
+	struct sload_con *next;
+	char con[0];
+};
+
+/* the inode made for a source file with more than one link */
+struct sload_link {
+	struct sload_link *next;
+	dev_t dev;
+	ino_t ino;
+	nid_t nid;
+	int nr_names;	/* linked in the image */
+};
+
+static void sload_read_chunk(struct sload_chunk *c)
+{
+	u64 offset = c->offset + c->copy_len;
+	size_t len = c->len - c->copy_len;
+	size_t alloc, done = 0;
+	ssize_t n;
+	char byte;
+	int fd;
+
+	c->fd = -1;
+	c->src_fd = -1;
+	c->done = 0;
+
+	fd = open(c->file->full_path, O_RDONLY);
+	if (fd < 0) {
+		c->err = -errno;
+		c->copy_len = 0;
+		offset = c->offset;
+		len = c->len;
+	}
+
+	alloc = (len + F2FS_BLKSIZE - 1) & ~(F2FS_BLKSIZE - 1);
+	c->buf = malloc(alloc ? alloc : F2FS_BLKSIZE);
+	ASSERT(c->buf);
+
+	if (fd < 0) {
+		memset(c->buf, 0, alloc);
+		return;
+	}
+
+	while (done < len) {
+		n = pread64(fd, c->buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n < 0)
+				c->done = -1;
+			break;
+		}
+		done += n;
+	}
+	memset(c->buf + done, 0, alloc - done);
+	c->crc = f2fs_cal_crc32(F2FS_SUPER_MAGIC, c->buf, done);
+	if (c->done == 0)
+		c->done = done;
+
+	/* leave it to the writer to append what was added since the scan */
+	if (c->last && c->file->size > MAX_INLINE_DATA &&
+			pread64(fd, &byte, 1, c->offset + c->len) > 0)
+		c->fd = fd;
+
+	if (c->copy_len)
+		c->src_fd = fd;
+	else if (c->fd < 0)
+		close(fd);
+}
+
+static void *sload_reader(void *arg)
+{
+	struct sload_pipe *pipe = arg;
+	struct sload_chunk *c;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (1) {
+		while (pipe->next == pipe->tail && !pipe->stop)
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		if (pipe->next == pipe->tail)
+			break;
+		c = &pipe->ring[pipe->next++ % SLOAD_QUEUE];
+		c->state = CHUNK_READING;
+		pthread_mutex_unlock(&pipe->lock);
+
+		sload_read_chunk(c);
+
+		pthread_mutex_lock(&pipe->lock);
+		c->state = CHUNK_READY;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+/* append data written to a file after build_directory() saw its size */
+static int sload_write_grown(struct f2fs_sb_info *sbi, struct sload_file *file,
+								int fd)
+{
+	char buffer[BLOCK_SZ];
+	pgoff_t off = file->size;
+	int n;
+
+	/* f2fs_write_block() reads back a partial last block */
+	if (dev_async_drain() < 0)
+		return -1;
+
+	lseek(fd, off, SEEK_SET);
+	while ((n = read(fd, buffer, BLOCK_SZ)) > 0) {
+		f2fs_write_block(sbi, file->ino, buffer, n, off);
+		off += n;
+	}
+	return n;
+}
+
+static void sload_write_chunk(struct sload_pipe *pipe, struct sload_chunk *c)
+{
+	struct f2fs_sb_info *sbi = pipe->sbi;
+	struct sload_file *file = c->file;
+	int is_inline = file->size <= MAX_INLINE_DATA;
+
+	if (c->first) {
+		if (c->err) {
+			MSG(0, "Skip: Fail to open %s\n", file->full_path);
+			file->err = c->err;
+		} else if (is_inline) {
+			ASSERT(c->done == file->size);
+			f2fs_write_inline_data(sbi, file->ino, c->buf,
+								file->size);
+		} else {
+			f2fs_data_writer_open(sbi, &pipe->w, file->ino);
+			/* the list overrides the extension list */
+			if (file->type == CURSEG_COLD_DATA)
+				pipe->w.inode->i.i_advise |= FADVISE_COLD_BIT;
+			else if (file->type >= 0)
+				pipe->w.inode->i.i_advise &= ~FADVISE_COLD_BIT;
+			if (file->type >= 0)
+				pipe->w.type = file->type;
+			file->opened = 1;
+		}
+	}
+
+	/* like a short read, a failed chunk leaves zeros behind */
+	if ((c->err || c->done < 0) && !file->err)
+		file->err = -1;
+	file->crc = f2fs_cal_crc32(file->crc, &c->crc, sizeof(c->crc));
+
+	if (file->opened) {
+		if (c->offset != file->next)
+			f2fs_data_writer_skip(&pipe->w,
+					c->offset >> F2FS_BLKSIZE_BITS);
+		file->next = c->offset + c->len;
+		if (c->copy_len) {
+			f2fs_data_writer_copy(sbi, &pipe->w, c->src_fd,
+					c->offset, c->copy_len / F2FS_BLKSIZE,
+					c->src_fd != c->fd);
+			file->copied = 1;
+		}
+		f2fs_data_writer_append(sbi, &pipe->w, c->buf,
+			F2FS_BYTES_TO_BLK(c->len - c->copy_len +
+						F2FS_BLKSIZE - 1), c->buf);
+	} else {
+		free(c->buf);
+		if (c->src_fd >= 0 && c->src_fd != c->fd)
+			close(c->src_fd);
+	}
+	c->buf = NULL;
+
+	if (!c->last)
+		return;
+
+	if (file->opened)
+		f2fs_data_writer_close(sbi, &pipe->w, file->size);
+	if (c->fd >= 0) {
+		if (!file->err && sload_write_grown(sbi, file, c->fd) < 0)
+			file->err = -1;
+		close(c->fd);
+	}
+
+	if (!file->err) {
+		/* a console write per file slows small files down */
+		if ((++pipe->nr_files % 256) == 0)
+			update_free_segments(sbi);
+		if (file->copied)
+			MSG(1, "Info: built a file %s, size=%"PRIu64"\n",
+					file->full_path, file->size);
+		else
+			MSG(1, "Info: built a file %s, size=%"PRIu64", "
+					"crc=0x%08x\n", file->full_path,
+					file->size, file->crc);
+	}
+	free(file->full_path);
+	free(file);
+}
+
+/* consume the oldest queued chunk, reading it here if no reader has yet */
+static void sload_write_next(struct sload_pipe *pipe)
+{
+	struct sload_chunk *c = &pipe->ring[pipe->head % SLOAD_QUEUE];
+
+	pthread_mutex_lock(&pipe->lock);
+	if (c->state == CHUNK_QUEUED) {
+		ASSERT(pipe->next == pipe->head);
+		pipe->next++;
+		c->state = CHUNK_READING;
+		pthread_mutex_unlock(&pipe->lock);
+
+		sload_read_chunk(c);
+
+		pthread_mutex_lock(&pipe->lock);
+		c->state = CHUNK_READY;
+	}
+	while (c->state != CHUNK_READY)
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	pthread_mutex_unlock(&pipe->lock);
+
+	sload_write_chunk(pipe, c);
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->head++;
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+static void sload_queue_chunk(struct sload_pipe *pipe, struct sload_file *file,
+				u64 off, u64 len, int first, int last)
+{
+	struct sload_chunk *c;
+
+	if (pipe->tail - pipe->head == SLOAD_QUEUE)
+		sload_write_next(pipe);
+
+	pthread_mutex_lock(&pipe->lock);
+	c = &pipe->ring[pipe->tail % SLOAD_QUEUE];
+	memset(c, 0, sizeof(struct sload_chunk));
+	c->file = file;
+	c->offset = off;
+	c->len = len;
+	c->first = first;
+	c->last = last;
+	if (file->size > MAX_INLINE_DATA && len >= SLOAD_COPY_MIN)
+		c->copy_len = len & ~(F2FS_BLKSIZE - 1);
+	c->state = CHUNK_QUEUED;
+	pipe->tail++;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/*
+ * The data range of @fd from @off on, in whole blocks: [*start, *end).
+ * It is empty at the end of the file, and the whole rest of the file when
+ * holes cannot be found.
+ */
+static void sload_data_range(int fd, u64 size, u64 off, u64 *start, u64 *end)
+{
+	off_t data, hole;
+
+	data = lseek(fd, off, SEEK_DATA);
+	if (data < 0 && errno == ENXIO) {
+		*start = *end = size;
+		return;
+	}
+	if (data < 0 || (u64)data >= size) {
+		*start = data < 0 ? off : size;
+		*end = size;
+		return;
+	}
+	hole = lseek(fd, data, SEEK_HOLE);
+	if (hole < 0 || (u64)hole > size)
+		hole = size;
+
+	*start = data & ~(u64)(F2FS_BLKSIZE - 1);
+	*end = ((u64)hole + F2FS_BLKSIZE - 1) & ~(u64)(F2FS_BLKSIZE - 1);
+	if (*end > size)
+		*end = size;
+}
+
+static void sload_queue_file(struct sload_pipe *pipe, struct dentry *de,
+								int type)
+{
+	struct sload_file *file;
+	u64 off = 0, end;
+	int fd = -1, first = 1;
+
+	if (de->ino == 0)
+		return;
+
+	file = calloc(1, sizeof(struct sload_file));
+	ASSERT(file);
+	file->full_path = strdup(de->full_path);
+	ASSERT(file->full_path);
+	file->ino = de->ino;
+	file->type = type;
+	file->size = de->size;
+
+	if (de->sparse && file->size > MAX_INLINE_DATA)
+		fd = open(file->full_path, O_RDONLY);
+	end = fd < 0 ? file->size : 0;
+
+	do {
+		u64 len;
+
+		if (off >= end)
+			sload_data_range(fd, file->size, off, &off, &end);
+
+		len = end - off;
+		if (len > SLOAD_CHUNK_BLKS * F2FS_BLKSIZE)
+			len = SLOAD_CHUNK_BLKS * F2FS_BLKSIZE;
+
+		sload_queue_chunk(pipe, file, off, len, first,
+						off + len >= file->size);
+		first = 0;
+		off += len;
+	} while (off < file->size);
+
+	if (fd >= 0)
+		close(fd);
+}
+
+static struct sload_link *sload_find_link(struct sload_pipe *pipe,
+							struct stat *st)
+{
+	struct sload_link *l;
+
+	l = pipe->links[(st->st_ino ^ st->st_dev) % SLOAD_LINK_HASH];
+	for (; l; l = l->next)
+		if (l->ino == st->st_ino && l->dev == st->st_dev)
+			return l;
+	return NULL;
+}
+
+/* @nid is the inode of the source inode @st, with one name counted */
+static void sload_add_link(struct sload_pipe *pipe, struct stat *st,
+							nid_t nid)
+{
+	struct sload_link **head, *l;
+
+	head = &pipe->links[(st->st_ino ^ st->st_dev) % SLOAD_LINK_HASH];
+	l = malloc(sizeof(struct sload_link));
+	ASSERT(l);
+	l->dev = st->st_dev;
+	l->ino = st->st_ino;
+	l->nid = nid;
+	l->nr_names = 1;
+	l->next = *head;
+	*head = l;
+}
+
+/*
+ * Give a further name of an already loaded source inode the same inode.
+ * The first name gets its inode here, before the directory is built.
+ */
+static void sload_hard_link(struct sload_pipe *pipe, struct dentry *de,
+						struct stat *st)
+{
+	struct sload_link *l;
+	struct dentry tmp = *de;
+
+	/* f2fs_build_dentries() skips names already in the image */
+	if (f2fs_lookup(pipe->sbi, de->pino, &tmp))
+		return;
+
+	l = sload_find_link(pipe, st);
+	if (l) {
+		de->ino = l->nid;
+		de->hard_link = 1;
+		l->nr_names++;
+		return;
+	}
+
+	f2fs_make_inode(pipe->sbi, de);
+	sload_add_link(pipe, st, de->ino);
+}
+
+/* once no data writer holds an inode, count the names of each */
+static void sload_link_counts(struct sload_pipe *pipe)
+{
+	struct sload_link *l;
+	int i;
+
+	for (i = 0; i < SLOAD_LINK_HASH; i++) {
+		while ((l = pipe->links[i])) {
+			if (l->nr_names > 1)
+				f2fs_inc_links(pipe->sbi, l->nid,
+							l->nr_names - 1);
+			pipe->links[i] = l->next;
+			free(l);
+		}
+	}
+}
+
+/* "/" followed by the components of @path, without empty ones */
+static char *sload_clean_path(const char *path)
+{
+	char *clean = malloc(strlen(path) + 2);
+	char *dst = clean;
+
+	ASSERT(clean);
+	while (*path) {
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+		*dst++ = '/';
+		while (*path && *path != '/')
+			*dst++ = *path++;
+	}
+	if (dst == clean)
+		*dst++ = '/';
+	*dst = '\0';
+	return clean;
+}
+
+static unsigned int sload_path_hash(const char *path)
+{
+	unsigned int hash = 0;
+
+	while (*path)
+		hash = hash * 31 + (u8)*path++;
+	return hash % SLOAD_PLACE_HASH;
+}
+
+static struct sload_place *sload_find_place(struct sload_pipe *pipe,
+							const char *path)
+{
+	struct sload_place *p = pipe->place_hash[sload_path_hash(path)];
+
+	for (; p; p = p->next)
+		if (!strcmp(p->path, path))
+			return p;
+	return NULL;
+}
+
+/*
+ * Each line of the placement list is the path of a file in the image,
+ * optionally followed by "hot" or "cold" for the data log of the file.
+ */
+static int sload_read_placement(struct sload_pipe *pipe, const char *list)
+{
+	char *line = NULL, *path, *tag;
+	size_t size = 0;
+	int max = 0, ret = 0;
+	FILE *fp;
+
+	fp = fopen(list, "r");
+	if (!fp) {
+		ERR_MSG("Cannot open placement list %s\n", list);
+		return -errno;
+	}
+
+	while (getline(&line, &size, fp) >= 0) {
+		struct sload_place *p;
+		int type = -1;
+
+		path = strtok(line, " \t\n");
+		if (!path || path[0] == '#')
+			continue;
+		tag = strtok(NULL, " \t\n");
+		if (tag && !strcmp(tag, "hot")) {
+			type = CURSEG_HOT_DATA;
+		} else if (tag && !strcmp(tag, "cold")) {
+			type = CURSEG_COLD_DATA;
+		} else if (tag) {
+			ERR_MSG("Unknown placement \"%s\" of %s\n", tag, path);
+			ret = -EINVAL;
+			break;
+		}
+
+		path = sload_clean_path(path);
+		if (sload_find_place(pipe, path)) {
+			free(path);
+			continue;
+		}
+
+		if (pipe->nr_places == max) {
+			int i;
+
+			max = max ? max * 2 : 256;
+			pipe->places = realloc(pipe->places,
+					max * sizeof(struct sload_place));
+			ASSERT(pipe->places);
+
+			/* the chains point into the array */
+			memset(pipe->place_hash, 0, sizeof(pipe->place_hash));
+			for (i = 0; i < pipe->nr_places; i++) {
+				unsigned int h;
+
+				p = &pipe->places[i];
+				h = sload_path_hash(p->path);
+				p->next = pipe->place_hash[h];
+				pipe->place_hash[h] = p;
+			}
+		}
+		p = &pipe->places[pipe->nr_places++];
+		memset(p, 0, sizeof(struct sload_place));
+		p->path = path;
+		p->type = type;
+		p->next = pipe->place_hash[sload_path_hash(path)];
+		pipe->place_hash[sload_path_hash(path)] = p;
+	}
+	free(line);
+	fclose(fp);
+	pipe->defer = 1;
+	return ret;
+}
+
+/* queue the data of a file now, or keep it for sload_queue_placed() */
+static void sload_add_file(struct sload_pipe *pipe, struct dentry *de)
+{
+	struct sload_place *p;
+	struct dentry *copy;
+	char *path;
+
+	if (!pipe->defer) {
+		sload_queue_file(pipe, de, -1);
+		return;
+	}
+	if (de->ino == 0)
+		return;
+
+	path = sload_clean_path(de->path);
+	p = sload_find_place(pipe, path);
+	free(path);
+
+	if (p && !p->de.ino) {
+		copy = &p->de;
+	} else {
+		if (pipe->nr_rest == pipe->max_rest) {
+			pipe->max_rest = pipe->max_rest ?
+						pipe->max_rest * 2 : 1024;
+			pipe->rest = realloc(pipe->rest,
+					pipe->max_rest * sizeof(struct dentry));
+			ASSERT(pipe->rest);
+		}
+		copy = &pipe->rest[pipe->nr_rest++];
+	}
+
+	memset(copy, 0, sizeof(struct dentry));
+	copy->full_path = strdup(de->full_path);
+	ASSERT(copy->full_path);
+	copy->ino = de->ino;
+	copy->size = de->size;
+	copy->sparse = de->sparse;
+}
+
+static void sload_queue_placed(struct sload_pipe *pipe)
+{
+	int i;
+
+	for (i = 0; i < pipe->nr_places; i++) {
+		struct sload_place *p = &pipe->places[i];
+
+		if (p->de.ino) {
+			sload_queue_file(pipe, &p->de, p->type);
+			free(p->de.full_path);
+		} else {
+			MSG(0, "Info: %s of the placement list is not loaded\n",
+								p->path);
+		}
+		free(p->path);
+	}
+	for (i = 0; i < pipe->nr_rest; i++) {
+		sload_queue_file(pipe, &pipe->rest[i], -1);
+		free(pipe->rest[i].full_path);
+	}
+	free(pipe->places);
+	free(pipe->rest);
+	pipe->places = NULL;
+	pipe->rest = NULL;
+	pipe->nr_places = pipe->nr_rest = 0;
+	pipe->defer = 0;
+}
+
+static void sload_pipe_flush(struct sload_pipe *pipe)
+{
+	sload_queue_placed(pipe);
+	while (pipe->head != pipe->tail)
+		sload_write_next(pipe);
+	sload_link_counts(pipe);
+	update_free_segments(pipe->sbi);
+}
+
+static void sload_pipe_init(struct sload_pipe *pipe, struct f2fs_sb_info *sbi,
+								int jobs)
+{
+	int i;
+
+	memset(pipe, 0, sizeof(struct sload_pipe));
+	pipe->sbi = sbi;
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+
+	if (jobs < 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > SLOAD_MAX_READERS)
+		jobs = SLOAD_MAX_READERS;
+
+	for (i = 0; i < jobs; i++) {
+		if (f2fs_thread_create(&pipe->readers[i], sload_reader, pipe))
+			break;
+		pipe->nr_readers++;
+	}
+
+	/* without readers, keep the data writes in place as well */
+	if (pipe->nr_readers && dev_async_start(SLOAD_IO_DEPTH) < 0)
+		MSG(0, "\tInfo: data writes are not queued\n");
+	DBG(1, "%d reader threads\n", pipe->nr_readers);
+}
+
+static int sload_pipe_exit(struct sload_pipe *pipe)
+{
+	int i;
+
+	for (i = 0; i < SLOAD_CON_HASH; i++) {
+		while (pipe->cons[i]) {
+			struct sload_con *c = pipe->cons[i];
+
+			pipe->cons[i] = c->next;
+			free(c);
+		}
+	}
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->stop = 1;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+
+	for (i = 0; i < pipe->nr_readers; i++)
+		pthread_join(pipe->readers[i], NULL);
+
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+	return dev_async_stop();
+}
+
+/*
+ * The security context of @path, looked up by its clean path. Files share
+ * a few contexts, so each is kept once and its inodes get it when they
+ * are made.
+ */
+static char *sload_label(struct sload_pipe *pipe,
+			struct selabel_handle *sehnd, const char *path,
+			mode_t mode)
+{
+	char *clean = sload_clean_path(path);
+	char *con = NULL;
+	struct sload_con *c;
+	unsigned int h;
+
+	if (selabel_lookup(sehnd, &con, clean, mode) < 0 || !con) {
+		ERR_MSG("Cannot lookup security context for %s\n", clean);
+		free(clean);
+		return NULL;
+	}
+	MSG(1, "File = %s \n----->SELinux context = %s\n", clean, con);
+	free(clean);
+
+	h = sload_path_hash(con) % SLOAD_CON_HASH;
+	for (c = pipe->cons[h]; c; c = c->next)
+		if (!strcmp(c->con, con))
+			goto out;
+
+	c = malloc(sizeof(struct sload_con) + strlen(con) + 1);
+	ASSERT(c);
+	strcpy(c->con, con);
+	c->next = pipe->cons[h];
+	pipe->cons[h] = c;
+out:
+	freecon(con);
+	return c->con;
+}
+
 static int filter_dot(const struct dirent *d)
 {
 	return (strcmp(d->d_name, "..") && strcmp(d->d_name, "."));
 }
 
-static void f2fs_make_directory(struct f2fs_sb_info *sbi,
-				int entries, struct dentry *de)
+/*
+ * With -u, a directory which is in the image already is matched against
+ * the source: unchanged entries are kept as they are, changed files are
+ * truncated and loaded again into their inodes, and other changed entries
+ * and entries gone from the source are removed, so that only the changes
+ * are written.
+ */
+enum {
+	SLOAD_NEW,		/* to create */
+	SLOAD_KEEP,		/* in the image, unchanged */
+	SLOAD_REWRITE,		/* in the image, with new data */
+};
+
+#define SLOAD_CRC_XATTR		"trusted.sload.crc32"
+
+static int sload_cmp_name(const void *a, const void *b)
+{
+	const struct dentry *x = a, *y = b;
+	int ret = memcmp(x->name, y->name, min(x->len, y->len));
+
+	return ret ? ret : x->len - y->len;
+}
+
+static int sload_file_crc(const char *path, u32 *crc)
+{
+	char *buf;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	buf = malloc(SLOAD_CHUNK_BLKS * F2FS_BLKSIZE);
+	ASSERT(buf);
+
+	*crc = 0;
+	while ((n = read(fd, buf, SLOAD_CHUNK_BLKS * F2FS_BLKSIZE)) > 0)
+		*crc = f2fs_cal_crc32(*crc, buf, n);
+
+	free(buf);
+	close(fd);
+	return n < 0 ? -EIO : 0;
+}
+
+/* the xattr keeping the crc of the data of a file, for the next -u -c */
+static struct dentry_xattr *sload_crc_xattr(struct dentry *de)
 {
-	int i = 0;
+	struct dentry_xattr *x;
+	u32 crc = 0;
+
+	if (sload_file_crc(de->full_path, &crc) < 0)
+		return NULL;
+
+	x = calloc(1, sizeof(struct dentry_xattr));
+	ASSERT(x);
+	x->name = strdup(SLOAD_CRC_XATTR);
+	x->value = malloc(9);
+	ASSERT(x->name && x->value);
+	x->size = snprintf(x->value, 9, "%08x", crc);
+	return x;
+}
+
+static void sload_free_xattrs(struct dentry_xattr *x)
+{
+	while (x) {
+		struct dentry_xattr *next = x->next;
+
+		free(x->name);
+		free(x->value);
+		free(x);
+		x = next;
+	}
+}
+
+static int sload_same_link(struct f2fs_sb_info *sbi, struct f2fs_node *node_blk,
+							const char *link)
+{
+	u64 size = le64_to_cpu(node_blk->i.i_size);
+	char *data;
+	int same, ret;
+
+	if (size != strlen(link))
+		return 0;
+	if (node_blk->i.i_inline & F2FS_INLINE_DATA)
+		return !memcmp(inline_data_addr(node_blk), link, size);
+
+	data = f2fs_blk_alloc();
+	ASSERT(data);
+	ret = dev_read_block(data, le32_to_cpu(node_blk->i.i_addr[0]));
+	ASSERT(ret >= 0);
+	same = !memcmp(data, link, size);
+	f2fs_blk_free(data);
+	return same;
+}
+
+static int sload_same_data(struct f2fs_sb_info *sbi, struct f2fs_node *node_blk,
+			struct dentry *de, struct dentry_xattr *crc)
+{
+	char old[9];
+	int len;
+
+	if (le64_to_cpu(node_blk->i.i_size) != de->size)
+		return 0;
+	if (!config.update_crc)
+		return le64_to_cpu(node_blk->i.i_mtime) == de->mtime;
+
+	len = inode_get_xattr(sbi, node_blk, SLOAD_CRC_XATTR, old, 8);
+	return crc && len == (int)crc->size && !memcmp(old, crc->value, len);
+}
+
+/*
+ * Match @de against the entry of the same name in the image, in @old, and
+ * mark it in @seen. A changed entry is removed from the image unless it is
+ * a file with a single link, which is truncated. The first name met of a
+ * source file with several links decides for all of them: the others keep
+ * its inode in the image, or are made again along with it.
+ */
+static int sload_update_entry(struct sload_pipe *pipe, struct dentry *old,
+			int nr_old, char *seen, struct dentry *de,
+			struct stat *st)
+{
+	struct f2fs_sb_info *sbi = pipe->sbi;
+	struct sload_link *l = NULL;
+	struct f2fs_node *node_blk;
+	struct dentry_xattr *crc = NULL;
+	struct node_info ni;
+	struct dentry *o;
+	int state = SLOAD_KEEP, dirty = 0, ret;
+	u16 mode;
+
+	o = bsearch(de, old, nr_old, sizeof(struct dentry), sload_cmp_name);
+	if (!o)
+		return SLOAD_NEW;
+	seen[o - old] = 1;
+	if (o->file_type != de->file_type)
+		goto remove;
+
+	node_blk = f2fs_blk_alloc();
+	ASSERT(node_blk);
+	get_node_info(sbi, o->ino, &ni);
+	ret = dev_read_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	if (de->file_type == F2FS_FT_SYMLINK &&
+			!sload_same_link(sbi, node_blk, de->link))
+		goto drop;
 
+	if (de->file_type == F2FS_FT_REG_FILE && st->st_nlink > 1)
+		l = sload_find_link(pipe, st);
+	if (l) {
+		if (l->nid != o->ino)
+			goto drop;
+	} else if (de->file_type == F2FS_FT_REG_FILE) {
+		u32 links = le32_to_cpu(node_blk->i.i_links);
+
+		if (config.update_crc)
+			crc = sload_crc_xattr(de);
+		if (sload_same_data(sbi, node_blk, de, crc) &&
+				(links == 1 || st->st_nlink > 1)) {
+			if (st->st_nlink > 1)
+				sload_add_link(pipe, st, o->ino);
+		} else if (links == 1 && st->st_nlink == 1) {
+			f2fs_truncate_inode(sbi, node_blk);
+			state = SLOAD_REWRITE;
+			dirty = 1;
+		} else {
+			goto drop;
+		}
+	}
+
+	mode = le16_to_cpu(node_blk->i.i_mode);
+	if ((mode & 07777) != de->mode) {
+		node_blk->i.i_mode = cpu_to_le16((mode & S_IFMT) | de->mode);
+		dirty = 1;
+	}
+	if (le32_to_cpu(node_blk->i.i_uid) != de->uid ||
+			le32_to_cpu(node_blk->i.i_gid) != de->gid) {
+		node_blk->i.i_uid = cpu_to_le32(de->uid);
+		node_blk->i.i_gid = cpu_to_le32(de->gid);
+		dirty = 1;
+	}
+	if (le64_to_cpu(node_blk->i.i_mtime) != de->mtime) {
+		node_blk->i.i_atime = cpu_to_le64(de->mtime);
+		node_blk->i.i_ctime = cpu_to_le64(de->mtime);
+		node_blk->i.i_mtime = cpu_to_le64(de->mtime);
+		dirty = 1;
+	}
+	if (dirty) {
+		ret = dev_write_block(node_blk, ni.blk_addr);
+		ASSERT(ret >= 0);
+	}
+	if (state == SLOAD_REWRITE && crc)
+		inode_set_xattr(sbi, o->ino, crc->name, crc->value, crc->size);
+
+	de->ino = o->ino;
+	MSG(1, "Info: %s \"%s\" ino=%x\n", state == SLOAD_KEEP ? "Keep" :
+					"Rewrite", de->path, de->ino);
+	sload_free_xattrs(crc);
+	f2fs_blk_free(node_blk);
+	return state;
+drop:
+	sload_free_xattrs(crc);
+	f2fs_blk_free(node_blk);
+remove:
+	f2fs_unlink(sbi, de->pino, o);
+	return SLOAD_NEW;
+}
+
+/* move the entries in the image before the new ones, keeping their order */
+static int sload_partition(struct dentry *de, char *state, int entries)
+{
+	struct dentry *tmp = malloc(entries * sizeof(struct dentry));
+	char *tmp_state = malloc(entries);
+	int i, n = 0;
+
+	ASSERT(tmp && tmp_state);
+	for (i = 0; i < entries; i++) {
+		if (state[i] != SLOAD_NEW) {
+			tmp[n] = de[i];
+			tmp_state[n++] = state[i];
+		}
+	}
 	for (i = 0; i < entries; i++) {
-		if (de[i].file_type == F2FS_FT_DIR)
-			f2fs_mkdir(sbi, de + i);
-		else if (de[i].file_type == F2FS_FT_REG_FILE)
-			f2fs_create(sbi, de + i);
-		else if (de[i].file_type == F2FS_FT_SYMLINK)
-			f2fs_symlink(sbi, de + i);
+		if (state[i] == SLOAD_NEW) {
+			tmp[n] = de[i];
+			tmp_state[n++] = state[i];
+		}
 	}
+	memcpy(de, tmp, entries * sizeof(struct dentry));
+	memcpy(state, tmp_state, entries);
+	free(tmp);
+	free(tmp_state);
+
+	for (n = 0; n < entries && state[n] != SLOAD_NEW; n++)
+		;
+	return n;
 }
 
-static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
-			const char *dir_path, const char *target_out_dir,
-			nid_t dir_ino, struct selabel_handle *sehnd)
+static int build_directory(struct f2fs_sb_info *sbi, struct sload_pipe *pipe,
+			const char *full_path, const char *dir_path,
+			const char *target_out_dir, nid_t dir_ino,
+			struct selabel_handle *sehnd, int update)
 {
-	int entries = 0;
-	struct dentry *dentries;
+	int entries = 0, nr_old = 0, kept = 0;
+	struct dentry *dentries, *old = NULL;
 	struct dirent **namelist = NULL;
 	struct stat stat;
+	char *state, *seen = NULL;
 	int i, ret = 0;
 
 	entries = scandir(full_path, &namelist, filter_dot, (void *)alphasort);
@@ -78,9 +1069,17 @@ static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 	}
 
 	dentries = calloc(entries, sizeof(struct dentry));
-	if (dentries == NULL)
+	state = calloc(entries, 1);
+	if (dentries == NULL || state == NULL)
 		return -ENOMEM;
 
+	if (update) {
+		old = f2fs_read_dentries(sbi, dir_ino, &nr_old);
+		qsort(old, nr_old, sizeof(struct dentry), sload_cmp_name);
+		seen = calloc(nr_old ? nr_old : 1, 1);
+		ASSERT(seen);
+	}
+
 	for (i = 0; i < entries; i++) {
 		dentries[i].name = (unsigned char *)strdup(namelist[i]->d_name);
 		if (dentries[i].name == NULL) {
@@ -110,15 +1109,16 @@ static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 		handle_selabel(dentries + i, S_ISDIR(stat.st_mode),
 							target_out_dir);
 
-		if (sehnd && selabel_lookup(sehnd, &dentries[i].secon,
-					dentries[i].path, stat.st_mode) < 0)
-			ERR_MSG("Cannot lookup security context for %s\n",
-						dentries[i].path);
+		if (sehnd)
+			dentries[i].secon = sload_label(pipe, sehnd,
+					dentries[i].path, stat.st_mode);
 
 		dentries[i].pino = dir_ino;
 
 		if (S_ISREG(stat.st_mode)) {
 			dentries[i].file_type = F2FS_FT_REG_FILE;
+			dentries[i].sparse =
+				(u64)stat.st_blocks * 512 < (u64)stat.st_size;
 		} else if (S_ISDIR(stat.st_mode)) {
 			dentries[i].file_type = F2FS_FT_DIR;
 		} else if (S_ISCHR(stat.st_mode)) {
@@ -140,16 +1140,39 @@ static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 			MSG(1, "unknown file type on %s", dentries[i].path);
 			i--;
 			entries--;
+			continue;
 		}
+
+		if (update)
+			state[i] = sload_update_entry(pipe, old, nr_old, seen,
+							dentries + i, &stat);
+		if (state[i] != SLOAD_NEW || !S_ISREG(stat.st_mode))
+			continue;
+		if (config.update_crc && (stat.st_nlink == 1 ||
+					!sload_find_link(pipe, &stat)))
+			dentries[i].xattrs = sload_crc_xattr(dentries + i);
+		if (stat.st_nlink > 1)
+			sload_hard_link(pipe, dentries + i, &stat);
 	}
 
 	free(namelist);
 
-	f2fs_make_directory(sbi, entries, dentries);
+	if (update) {
+		for (i = 0; i < nr_old; i++)
+			if (!seen[i])
+				f2fs_unlink(sbi, dir_ino, old + i);
+		f2fs_free_dentries(old, nr_old);
+		free(seen);
+		kept = sload_partition(dentries, state, entries);
+	}
+
+	f2fs_build_dentries(sbi, dir_ino, dentries + kept, entries - kept);
 
 	for (i = 0; i < entries; i++) {
+		sload_free_xattrs(dentries[i].xattrs);
 		if (dentries[i].file_type == F2FS_FT_REG_FILE) {
-			f2fs_build_file(sbi, dentries + i);
+			if (state[i] != SLOAD_KEEP && !dentries[i].hard_link)
+				sload_add_file(pipe, dentries + i);
 		} else if (dentries[i].file_type == F2FS_FT_DIR) {
 			char *subdir_full_path = NULL;
 			char *subdir_dir_path;
@@ -161,36 +1184,28 @@ static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 							dentries[i].path);
 			ASSERT(ret > 0);
 
-			build_directory(sbi, subdir_full_path, subdir_dir_path,
-					target_out_dir, dentries[i].ino, sehnd);
+			build_directory(sbi, pipe, subdir_full_path,
+					subdir_dir_path, target_out_dir,
+					dentries[i].ino, sehnd,
+					update && state[i] == SLOAD_KEEP);
 			free(subdir_full_path);
 			free(subdir_dir_path);
 		} else if (dentries[i].file_type == F2FS_FT_SYMLINK) {
 			/*
-			 * It is already done in f2fs_make_directory
+			 * It is already done in f2fs_build_dentries
 			 * f2fs_make_symlink(sbi, dir_ino, &dentries[i]);
 			 */
 		} else {
 			MSG(1, "Error unknown file type\n");
 		}
 
-		if (dentries[i].secon) {
-			inode_set_selinux(sbi, dentries[i].ino, dentries[i].secon);
-			MSG(1, "File = %s \n----->SELinux context = %s\n",
-					dentries[i].path, dentries[i].secon);
-			MSG(1, "----->mode = 0x%x, uid = 0x%x, gid = 0x%x, "
-					"capabilities = 0x%lx \n",
-					dentries[i].mode, dentries[i].uid,
-					dentries[i].gid, dentries[i].capabilities);
-		}
-
 		free(dentries[i].path);
 		free(dentries[i].full_path);
 		free((void *)dentries[i].name);
-		free(dentries[i].secon);
 	}
 
 	free(dentries);
+	free(state);
 	return 0;
 }
 
@@ -199,9 +1214,16 @@ int f2fs_sload(struct f2fs_sb_info *sbi, const char *from_dir,
 				const char *target_out_dir,
 				struct selabel_handle *sehnd)
 {
+	struct sload_pipe pipe;
+	struct stat st;
 	int ret = 0;
 	nid_t mnt_ino = F2FS_ROOT_INO(sbi);
 
+	/* metadata is written once, with the checkpoint */
+	ret = f2fs_init_meta_cache(sbi);
+	if (ret)
+		return ret;
+
 	/* flush NAT/SIT journal entries */
 	flush_journal_entries(sbi);
 
@@ -211,8 +1233,29 @@ int f2fs_sload(struct f2fs_sb_info *sbi, const char *from_dir,
 		return ret;
 	}
 
-	ret = build_directory(sbi, from_dir, mount_point, target_out_dir,
-						mnt_ino, sehnd);
+	if (!strcmp(from_dir, "-") ||
+			(!stat(from_dir, &st) && !S_ISDIR(st.st_mode))) {
+		if (config.placement)
+			MSG(0, "Info: Archive order is kept, not the placement "
+							"list\n");
+		if (config.update)
+			MSG(0, "Info: Archives are only added to, not "
+							"updated\n");
+		ret = f2fs_load_tar(sbi, from_dir, mnt_ino);
+	} else {
+		sload_pipe_init(&pipe, sbi, config.jobs);
+		if (config.placement)
+			ret = sload_read_placement(&pipe, config.placement);
+		if (!ret)
+			ret = build_directory(sbi, &pipe, from_dir,
+					mount_point, target_out_dir, mnt_ino,
+					sehnd, config.update);
+		sload_pipe_flush(&pipe);
+		if (sload_pipe_exit(&pipe) < 0) {
+			ERR_MSG("Failed to write file data\n");
+			return -EIO;
+		}
+	}
 	if (ret) {
 		ERR_MSG("Failed to build due to %d\n", ret);
 		return ret;
@@ -0,0 +1,1041 @@
+/**
+ * tar.c
+ *
+ * Load a tar archive, read from a file or a pipe, into the image.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include "fsck.h"
+
+/*
+ * Members are taken in archive order: each inode and its data are written
+ * when its header is read, while the dentries of every directory are kept
+ * in memory and linked in one pass once the archive ends. Parents missing
+ * from the archive are made as 0755 directories. Understands ustar, GNU
+ * long names and pax headers, including SCHILY.xattr records.
+ */
+#define TAR_BLOCK		512
+#define TAR_BUF_SIZE		(64 * 1024)
+#define TAR_DATA_BLKS		SLOAD_RUN_BLKS
+
+/* ustar header */
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+/* one member, with the GNU and pax headers which came before it applied */
+struct tar_entry {
+	char type;
+	char *path;
+	char *link;
+	u64 size;
+	u32 mode, uid, gid, mtime;
+	struct dentry_xattr *xattrs;
+};
+
+/* pax and GNU headers for the next member */
+#define TAR_SET_SIZE	0x1
+#define TAR_SET_UID	0x2
+#define TAR_SET_GID	0x4
+#define TAR_SET_MTIME	0x8
+
+struct tar_ext {
+	unsigned int set;
+	char *path;
+	char *link;
+	u64 size;
+	u32 uid, gid, mtime;
+	struct dentry_xattr *xattrs;
+};
+
+struct tar_node {
+	struct tar_node *next;		/* hash chain */
+	char *path;
+	nid_t ino;
+	u8 file_type;
+	int dir;			/* index in tar_load.dirs if a directory */
+};
+
+struct tar_dir {
+	nid_t ino;
+	int existed;			/* on disk before the load */
+	struct dentry *children;
+	int nr, max;
+};
+
+struct tar_stream {
+	int fd;
+	pid_t pids[2];			/* decompressor and feeder */
+	char *buf;
+	size_t pos, len;
+};
+
+struct tar_load {
+	struct f2fs_sb_info *sbi;
+	struct tar_stream s;
+	struct tar_node **hash;
+	unsigned int hash_size, nr_nodes;
+	struct tar_dir *dirs;
+	int nr_dirs, max_dirs;
+	struct tar_ext ext;
+	unsigned int nr_files;
+};
+
+static const struct {
+	const char *magic;
+	unsigned int len;
+	const char *prog;
+} tar_filters[] = {
+	{ "\x1f\x8b", 2, "gzip" },
+	{ "\xfd" "7zXZ\0", 6, "xz" },
+	{ "\x28\xb5\x2f\xfd", 4, "zstd" },
+	{ "BZh", 3, "bzip2" },
+};
+
+static const char tar_zero_block[TAR_BLOCK];
+
+static ssize_t read_full(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = read(fd, (char *)buf + done, len - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* write the bytes already read and then the rest of @fd into @out */
+static void tar_feed(int fd, int out, const char *head, size_t len)
+{
+	char *buf = malloc(TAR_BUF_SIZE);
+	ssize_t ret;
+
+	if (!buf || write_full(out, head, len) < 0)
+		_exit(1);
+	while ((ret = read_full(fd, buf, TAR_BUF_SIZE)) > 0)
+		if (write_full(out, buf, ret) < 0)
+			_exit(1);
+	_exit(ret < 0);
+}
+
+/* run @prog -dc with @in as its stdin, and read its stdout instead */
+static int tar_filter(struct tar_stream *s, int fd, const char *prog)
+{
+	int out[2], in[2] = { -1, -1 };
+	int input = fd;
+
+	if (pipe(out) < 0)
+		return -errno;
+
+	/* a pipe cannot be rewound, so pass on what was read already */
+	if (lseek(fd, 0, SEEK_SET) != 0) {
+		if (pipe(in) < 0)
+			return -errno;
+		s->pids[1] = fork();
+		if (s->pids[1] < 0)
+			return -errno;
+		if (s->pids[1] == 0) {
+			close(in[0]);
+			close(out[0]);
+			close(out[1]);
+			tar_feed(fd, in[1], s->buf, s->len);
+		}
+		close(in[1]);
+		input = in[0];
+	}
+
+	s->pids[0] = fork();
+	if (s->pids[0] < 0)
+		return -errno;
+	if (s->pids[0] == 0) {
+		if (dup2(input, STDIN_FILENO) < 0 ||
+				dup2(out[1], STDOUT_FILENO) < 0)
+			_exit(127);
+		close(out[0]);
+		close(out[1]);
+		if (input != fd)
+			close(input);
+		execlp(prog, prog, "-dc", (char *)NULL);
+		_exit(127);
+	}
+
+	if (in[0] >= 0)
+		close(in[0]);
+	close(out[1]);
+	s->fd = out[0];
+	s->pos = s->len = 0;
+	return 0;
+}
+
+static int tar_stream_open(struct tar_stream *s, const char *path)
+{
+	unsigned int i;
+	ssize_t ret;
+	int fd;
+
+	memset(s, 0, sizeof(struct tar_stream));
+	s->pids[0] = s->pids[1] = -1;
+	s->buf = malloc(TAR_BUF_SIZE);
+	if (!s->buf)
+		return -ENOMEM;
+
+	if (!strcmp(path, "-")) {
+		fd = STDIN_FILENO;
+	} else {
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			ERR_MSG("Cannot open %s: %s\n", path, strerror(errno));
+			return -errno;
+		}
+	}
+	s->fd = fd;
+
+	ret = read_full(fd, s->buf, 6);
+	if (ret < 0)
+		return -errno;
+	s->len = ret;
+
+	for (i = 0; i < sizeof(tar_filters) / sizeof(tar_filters[0]); i++) {
+		if (s->len < tar_filters[i].len || memcmp(s->buf,
+				tar_filters[i].magic, tar_filters[i].len))
+			continue;
+
+		MSG(1, "Info: Decompress with %s\n", tar_filters[i].prog);
+		ret = tar_filter(s, fd, tar_filters[i].prog);
+		if (fd != STDIN_FILENO)
+			close(fd);
+		if (ret < 0)
+			ERR_MSG("Cannot run %s\n", tar_filters[i].prog);
+		return ret;
+	}
+	return 0;
+}
+
+static ssize_t tar_read(struct tar_stream *s, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		size_t nr;
+
+		if (s->pos == s->len) {
+			/* large reads bypass the buffer */
+			if (len - done >= TAR_BUF_SIZE) {
+				ret = read_full(s->fd, (char *)buf + done,
+								len - done);
+				if (ret < 0)
+					return -1;
+				return done + ret;
+			}
+			ret = read_full(s->fd, s->buf, TAR_BUF_SIZE);
+			if (ret <= 0)
+				return ret < 0 ? -1 : (ssize_t)done;
+			s->pos = 0;
+			s->len = ret;
+		}
+		nr = s->len - s->pos;
+		if (nr > len - done)
+			nr = len - done;
+		memcpy((char *)buf + done, s->buf + s->pos, nr);
+		s->pos += nr;
+		done += nr;
+	}
+	return done;
+}
+
+static int tar_skip(struct tar_stream *s, u64 len)
+{
+	char buf[TAR_BLOCK];
+
+	while (len) {
+		size_t nr = len > TAR_BLOCK ? TAR_BLOCK : len;
+
+		if (tar_read(s, buf, nr) != (ssize_t)nr)
+			return -EIO;
+		len -= nr;
+	}
+	return 0;
+}
+
+/* drain the stream so no writer dies of SIGPIPE, then reap the children */
+static int tar_stream_close(struct tar_stream *s)
+{
+	int i, status, ret = 0;
+
+	while (read_full(s->fd, s->buf, TAR_BUF_SIZE) > 0)
+		;
+	if (s->fd != STDIN_FILENO)
+		close(s->fd);
+	free(s->buf);
+
+	for (i = 0; i < 2; i++) {
+		if (s->pids[i] <= 0)
+			continue;
+		if (waitpid(s->pids[i], &status, 0) < 0 ||
+				!WIFEXITED(status) || WEXITSTATUS(status)) {
+			ERR_MSG("Decompression failed\n");
+			ret = -EIO;
+		}
+	}
+	return ret;
+}
+
+/* octal, or base-256 with the top bit of the first byte set */
+static int tar_number(const char *p, int len, u64 *val)
+{
+	int i = 0;
+
+	*val = 0;
+	if (*p & 0x80) {
+		if (*p & 0x40)
+			return -ERANGE;
+		*val = *p & 0x3f;
+		for (i = 1; i < len; i++)
+			*val = (*val << 8) | (u8)p[i];
+		return 0;
+	}
+
+	while (i < len && (p[i] == ' ' || p[i] == '\0'))
+		i++;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+		*val = (*val << 3) | (p[i] - '0');
+	if (i < len && p[i] != ' ' && p[i] != '\0')
+		return -EINVAL;
+	return 0;
+}
+
+static int tar_checksum(struct tar_header *h)
+{
+	unsigned char *p = (unsigned char *)h;
+	unsigned int sum = 0;
+	int ssum = 0, i;
+	u64 chksum;
+
+	if (tar_number(h->chksum, sizeof(h->chksum), &chksum))
+		return 0;
+
+	for (i = 0; i < TAR_BLOCK; i++) {
+		char c = (i >= 148 && i < 156) ? ' ' : p[i];
+
+		sum += (unsigned char)c;
+		ssum += (signed char)c;
+	}
+	/* some old archivers summed signed chars */
+	return chksum == sum || chksum == (u64)(int64_t)ssum;
+}
+
+static char *tar_string(const char *p, int len)
+{
+	char *str = strndup(p, len);
+
+	ASSERT(str);
+	return str;
+}
+
+static void tar_free_xattrs(struct dentry_xattr *x)
+{
+	while (x) {
+		struct dentry_xattr *next = x->next;
+
+		free(x->name);
+		free(x->value);
+		free(x);
+		x = next;
+	}
+}
+
+static void tar_reset_ext(struct tar_ext *ext)
+{
+	free(ext->path);
+	free(ext->link);
+	tar_free_xattrs(ext->xattrs);
+	memset(ext, 0, sizeof(struct tar_ext));
+}
+
+/* the data of a GNU long name, long link or pax header */
+static char *tar_read_data(struct tar_load *tl, u64 size)
+{
+	u64 padded = (size + TAR_BLOCK - 1) & ~(u64)(TAR_BLOCK - 1);
+	char *buf;
+
+	if (size > (64 << 20))
+		return NULL;
+	buf = malloc(padded + 1);
+	ASSERT(buf);
+	if (tar_read(&tl->s, buf, padded) != (ssize_t)padded) {
+		free(buf);
+		return NULL;
+	}
+	buf[size] = '\0';
+	return buf;
+}
+
+/* "<len> <key>=<value>\n" records */
+static int tar_parse_pax(struct tar_load *tl, char *buf, u64 size)
+{
+	struct tar_ext *ext = &tl->ext;
+	char *p = buf, *end = buf + size;
+
+	while (p < end) {
+		char *key, *value, *rec = p;
+		size_t vlen;
+		u64 len = 0;
+
+		while (p < end && *p >= '0' && *p <= '9')
+			len = len * 10 + (*p++ - '0');
+		if (p == end || *p != ' ' || len < 4 ||
+				len > (u64)(end - rec) ||
+				rec[len - 1] != '\n')
+			return -EINVAL;
+		key = ++p;
+		value = memchr(key, '=', rec + len - key);
+		if (!value)
+			return -EINVAL;
+		*value++ = '\0';
+		vlen = rec + len - 1 - value;
+		p = rec + len;
+
+		if (!strcmp(key, "path")) {
+			free(ext->path);
+			ext->path = tar_string(value, vlen);
+		} else if (!strcmp(key, "linkpath")) {
+			free(ext->link);
+			ext->link = tar_string(value, vlen);
+		} else if (!strcmp(key, "size")) {
+			ext->size = strtoull(value, NULL, 10);
+			ext->set |= TAR_SET_SIZE;
+		} else if (!strcmp(key, "uid")) {
+			ext->uid = strtoul(value, NULL, 10);
+			ext->set |= TAR_SET_UID;
+		} else if (!strcmp(key, "gid")) {
+			ext->gid = strtoul(value, NULL, 10);
+			ext->set |= TAR_SET_GID;
+		} else if (!strcmp(key, "mtime")) {
+			ext->mtime = strtoul(value, NULL, 10);
+			ext->set |= TAR_SET_MTIME;
+		} else if (!strncmp(key, "SCHILY.xattr.", 13)) {
+			struct dentry_xattr *x = calloc(1, sizeof(*x));
+
+			ASSERT(x);
+			x->name = strdup(key + 13);
+			x->value = malloc(vlen ? vlen : 1);
+			ASSERT(x->name && x->value);
+			memcpy(x->value, value, vlen);
+			x->size = vlen;
+			x->next = ext->xattrs;
+			ext->xattrs = x;
+		}
+	}
+	return 0;
+}
+
+/*
+ * strip "./" and "/" prefixes, repeated and trailing slashes, and refuse
+ * ".." or a component f2fs cannot name
+ */
+static int tar_clean_path(char *path)
+{
+	char *src = path, *dst = path;
+
+	while (*src) {
+		char *end;
+		size_t len;
+
+		while (*src == '/')
+			src++;
+		end = strchrnul(src, '/');
+		len = end - src;
+
+		if (len == 2 && !strncmp(src, "..", 2))
+			return -EINVAL;
+		if (len > F2FS_NAME_LEN)
+			return -ENAMETOOLONG;
+		if (len && !(len == 1 && *src == '.')) {
+			if (dst != path)
+				*dst++ = '/';
+			memmove(dst, src, len);
+			dst += len;
+		}
+		src = end;
+	}
+	*dst = '\0';
+	return 0;
+}
+
+/*
+ * Read the next member header. Returns 1 with @e filled in, 0 at the end
+ * of the archive, or a negative error.
+ */
+static int tar_next(struct tar_load *tl, struct tar_entry *e)
+{
+	struct tar_header h;
+	char *data;
+	u64 val;
+	ssize_t ret;
+
+	while (1) {
+		ret = tar_read(&tl->s, &h, TAR_BLOCK);
+		if (ret == 0)
+			return 0;
+		if (ret != TAR_BLOCK) {
+			ERR_MSG("Truncated tar archive\n");
+			return -EIO;
+		}
+		if (!memcmp(&h, tar_zero_block, TAR_BLOCK))
+			return 0;
+		if (!tar_checksum(&h)) {
+			ERR_MSG("Invalid tar header\n");
+			return -EINVAL;
+		}
+
+		memset(e, 0, sizeof(struct tar_entry));
+		e->type = h.typeflag;
+		if (tar_number(h.size, sizeof(h.size), &e->size) < 0)
+			return -EINVAL;
+
+		if (e->type != 'L' && e->type != 'K' && e->type != 'x' &&
+				e->type != 'g')
+			break;
+
+		data = tar_read_data(tl, e->size);
+		if (!data) {
+			ERR_MSG("Invalid tar extended header\n");
+			return -EIO;
+		}
+		if (e->type == 'L') {
+			free(tl->ext.path);
+			tl->ext.path = data;
+		} else if (e->type == 'K') {
+			free(tl->ext.link);
+			tl->ext.link = data;
+		} else {
+			/* global pax headers are not applied */
+			if (e->type == 'x' &&
+					tar_parse_pax(tl, data, e->size) < 0) {
+				ERR_MSG("Invalid pax header\n");
+				free(data);
+				return -EINVAL;
+			}
+			free(data);
+		}
+	}
+
+	if (tl->ext.path) {
+		e->path = tl->ext.path;
+		tl->ext.path = NULL;
+	} else if (h.prefix[0] && !memcmp(h.magic, "ustar", 6)) {
+		ret = asprintf(&e->path, "%.*s/%.*s",
+				(int)sizeof(h.prefix), h.prefix,
+				(int)sizeof(h.name), h.name);
+		ASSERT(ret > 0);
+	} else {
+		e->path = tar_string(h.name, sizeof(h.name));
+	}
+
+	if (tl->ext.link) {
+		e->link = tl->ext.link;
+		tl->ext.link = NULL;
+	} else {
+		e->link = tar_string(h.linkname, sizeof(h.linkname));
+	}
+
+	if (tar_number(h.mode, sizeof(h.mode), &val) < 0)
+		return -EINVAL;
+	e->mode = val & (S_ISUID|S_ISGID|S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO);
+	if (tar_number(h.uid, sizeof(h.uid), &val) < 0)
+		return -EINVAL;
+	e->uid = val;
+	if (tar_number(h.gid, sizeof(h.gid), &val) < 0)
+		return -EINVAL;
+	e->gid = val;
+	if (tar_number(h.mtime, sizeof(h.mtime), &val) < 0)
+		return -EINVAL;
+	e->mtime = val;
+
+	if (tl->ext.set & TAR_SET_SIZE)
+		e->size = tl->ext.size;
+	if (tl->ext.set & TAR_SET_UID)
+		e->uid = tl->ext.uid;
+	if (tl->ext.set & TAR_SET_GID)
+		e->gid = tl->ext.gid;
+	if (tl->ext.set & TAR_SET_MTIME)
+		e->mtime = tl->ext.mtime;
+	e->xattrs = tl->ext.xattrs;
+	tl->ext.xattrs = NULL;
+	tar_reset_ext(&tl->ext);
+	return 1;
+}
+
+static unsigned int tar_hash(const char *path)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*path)
+		hash = (hash ^ (u8)*path++) * 16777619u;
+	return hash;
+}
+
+static struct tar_node *tar_lookup(struct tar_load *tl, const char *path)
+{
+	struct tar_node *n;
+
+	n = tl->hash[tar_hash(path) & (tl->hash_size - 1)];
+	for (; n; n = n->next)
+		if (!strcmp(n->path, path))
+			return n;
+	return NULL;
+}
+
+static struct tar_node *tar_add_node(struct tar_load *tl, const char *path,
+						nid_t ino, u8 file_type)
+{
+	struct tar_node *n;
+	unsigned int i;
+
+	if (tl->nr_nodes == tl->hash_size) {
+		unsigned int size = tl->hash_size * 2;
+		struct tar_node **hash = calloc(size, sizeof(*hash));
+
+		ASSERT(hash);
+		for (i = 0; i < tl->hash_size; i++) {
+			while ((n = tl->hash[i])) {
+				unsigned int h = tar_hash(n->path) & (size - 1);
+
+				tl->hash[i] = n->next;
+				n->next = hash[h];
+				hash[h] = n;
+			}
+		}
+		free(tl->hash);
+		tl->hash = hash;
+		tl->hash_size = size;
+	}
+
+	n = calloc(1, sizeof(struct tar_node));
+	ASSERT(n);
+	n->path = strdup(path);
+	ASSERT(n->path);
+	n->ino = ino;
+	n->file_type = file_type;
+	n->dir = -1;
+
+	if (file_type == F2FS_FT_DIR) {
+		if (tl->nr_dirs == tl->max_dirs) {
+			tl->max_dirs = tl->max_dirs ? tl->max_dirs * 2 : 64;
+			tl->dirs = realloc(tl->dirs,
+				tl->max_dirs * sizeof(struct tar_dir));
+			ASSERT(tl->dirs);
+		}
+		memset(&tl->dirs[tl->nr_dirs], 0, sizeof(struct tar_dir));
+		tl->dirs[tl->nr_dirs].ino = ino;
+		n->dir = tl->nr_dirs++;
+	}
+
+	i = tar_hash(path) & (tl->hash_size - 1);
+	n->next = tl->hash[i];
+	tl->hash[i] = n;
+	tl->nr_nodes++;
+	return n;
+}
+
+static void tar_add_child(struct tar_load *tl, int dir, struct dentry *de)
+{
+	struct tar_dir *d = &tl->dirs[dir];
+	struct dentry *child;
+
+	if (d->nr == d->max) {
+		d->max = d->max ? d->max * 2 : 16;
+		d->children = realloc(d->children,
+					d->max * sizeof(struct dentry));
+		ASSERT(d->children);
+	}
+	child = &d->children[d->nr++];
+	memset(child, 0, sizeof(struct dentry));
+	child->name = (u8 *)strndup((char *)de->name, de->len);
+	ASSERT(child->name);
+	child->len = de->len;
+	child->file_type = de->file_type;
+	child->mode = de->mode;
+	child->ino = de->ino;
+	child->pino = d->ino;
+}
+
+static struct tar_node *tar_make(struct tar_load *tl, struct dentry *de,
+					int dir, const char *path)
+{
+	de->pino = tl->dirs[dir].ino;
+	f2fs_make_inode(tl->sbi, de);
+	tar_add_child(tl, dir, de);
+
+	MSG(1, "Info: Create \"%s\" type=%x, ino=%x / %x\n",
+			path, de->file_type, de->ino, de->pino);
+	return tar_add_node(tl, path, de->ino, de->file_type);
+}
+
+/* the entry @name of a directory which was on disk before the load */
+static struct tar_node *tar_lookup_disk(struct tar_load *tl, int dir,
+					const char *name, const char *path)
+{
+	struct dentry de = {0};
+	struct tar_node *n;
+
+	if (!tl->dirs[dir].existed)
+		return NULL;
+
+	de.name = (const u8 *)name;
+	de.len = strlen(name);
+	if (!f2fs_lookup(tl->sbi, tl->dirs[dir].ino, &de))
+		return NULL;
+
+	n = tar_add_node(tl, path, de.ino, de.file_type);
+	if (n->dir >= 0)
+		tl->dirs[n->dir].existed = 1;
+	return n;
+}
+
+/*
+ * The directory holding @path, made with default attributes if the archive
+ * did not list it yet. Returns its index in tl->dirs and sets @name to the
+ * last component of @path.
+ */
+static int tar_parent(struct tar_load *tl, char *path, const char **name,
+								u32 mtime)
+{
+	struct dentry de = {0};
+	struct tar_node *n;
+	char *slash = strrchr(path, '/');
+	int dir;
+
+	if (!slash) {
+		*name = path;
+		return 0;
+	}
+
+	*slash = '\0';
+	*name = slash + 1;
+	n = tar_lookup(tl, path);
+	if (n) {
+		dir = n->dir;
+		goto out;
+	}
+
+	dir = tar_parent(tl, path, (const char **)&de.name, mtime);
+	if (dir < 0)
+		goto out;
+	n = tar_lookup_disk(tl, dir, (const char *)de.name, path);
+	if (n) {
+		dir = n->dir;
+		goto out;
+	}
+	de.len = strlen((char *)de.name);
+	de.file_type = F2FS_FT_DIR;
+	de.mode = 0755;
+	de.mtime = mtime;
+	dir = tar_make(tl, &de, dir, path)->dir;
+out:
+	*slash = '/';
+	return dir;
+}
+
+/* new inodes get theirs when they are made; this is for directories */
+static void tar_set_xattrs(struct tar_load *tl, nid_t ino,
+				struct dentry_xattr *x, const char *path)
+{
+	for (; x; x = x->next) {
+		int ret = inode_set_xattr(tl->sbi, ino, x->name, x->value,
+								x->size);
+
+		if (ret)
+			MSG(0, "Skip: xattr %s of %s, err=%d\n",
+							x->name, path, ret);
+	}
+}
+
+/* update the attributes of a directory made before its own header */
+static void tar_update_dir(struct tar_load *tl, nid_t ino, struct tar_entry *e)
+{
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	int ret;
+
+	get_node_info(tl->sbi, ino, &ni);
+	node_blk = f2fs_blk_alloc();
+	ASSERT(node_blk);
+	ret = dev_read_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	node_blk->i.i_mode = cpu_to_le16(e->mode | S_IFDIR);
+	node_blk->i.i_uid = cpu_to_le32(e->uid);
+	node_blk->i.i_gid = cpu_to_le32(e->gid);
+	node_blk->i.i_atime = cpu_to_le64(e->mtime);
+	node_blk->i.i_ctime = cpu_to_le64(e->mtime);
+	node_blk->i.i_mtime = cpu_to_le64(e->mtime);
+
+	ret = dev_write_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+	f2fs_blk_free(node_blk);
+}
+
+static int tar_write_data(struct tar_load *tl, nid_t ino, u64 size)
+{
+	struct f2fs_sb_info *sbi = tl->sbi;
+	struct data_writer w;
+	char *buf;
+
+	if (size <= MAX_INLINE_DATA) {
+		char inline_buf[MAX_INLINE_DATA];
+
+		if (tar_read(&tl->s, inline_buf, size) != (ssize_t)size)
+			return -EIO;
+		f2fs_write_inline_data(sbi, ino, inline_buf, size);
+		return 0;
+	}
+
+	f2fs_data_writer_open(sbi, &w, ino);
+	while (w.pgofs * F2FS_BLKSIZE < size) {
+		u64 len = size - w.pgofs * F2FS_BLKSIZE;
+		unsigned int nr_blks;
+
+		if (len > TAR_DATA_BLKS * F2FS_BLKSIZE)
+			len = TAR_DATA_BLKS * F2FS_BLKSIZE;
+		nr_blks = F2FS_BYTES_TO_BLK(len + F2FS_BLKSIZE - 1);
+
+		buf = malloc(nr_blks * F2FS_BLKSIZE);
+		ASSERT(buf);
+		memset(buf + len, 0, nr_blks * F2FS_BLKSIZE - len);
+		if (tar_read(&tl->s, buf, len) != (ssize_t)len) {
+			free(buf);
+			f2fs_data_writer_close(sbi, &w, size);
+			return -EIO;
+		}
+		/* the writer frees @buf once it is on disk */
+		f2fs_data_writer_append(sbi, &w, buf, nr_blks, buf);
+	}
+	f2fs_data_writer_close(sbi, &w, size);
+	return 0;
+}
+
+static int tar_load_entry(struct tar_load *tl, struct tar_entry *e)
+{
+	struct dentry de = {0};
+	struct tar_node *n;
+	const char *name;
+	u64 done = 0, len;
+	int dir, ret;
+
+	ret = tar_clean_path(e->path);
+	if (ret == -ENAMETOOLONG) {
+		MSG(0, "Skip: name too long %s\n", e->path);
+		goto skip;
+	} else if (ret < 0) {
+		MSG(0, "Skip: unsafe path %s\n", e->path);
+		goto skip;
+	}
+	if (!e->path[0])
+		goto skip;
+
+	switch (e->type) {
+	case '0':
+	case '\0':
+	case '1':
+	case '7':
+		de.file_type = F2FS_FT_REG_FILE;
+		break;
+	case '2':
+		de.file_type = F2FS_FT_SYMLINK;
+		break;
+	case '5':
+		de.file_type = F2FS_FT_DIR;
+		break;
+	default:
+		MSG(0, "Skip: unsupported type '%c' of %s\n", e->type, e->path);
+		goto skip;
+	}
+
+	n = tar_lookup(tl, e->path);
+	if (n) {
+		if (n->file_type == F2FS_FT_DIR && e->type == '5') {
+			tar_update_dir(tl, n->ino, e);
+			tar_set_xattrs(tl, n->ino, e->xattrs, e->path);
+		} else {
+			MSG(0, "Skip the existing \"%s\"\n", e->path);
+		}
+		goto skip;
+	}
+
+	dir = tar_parent(tl, e->path, &name, e->mtime);
+	if (dir < 0) {
+		MSG(0, "Skip: parent of %s is not a directory\n", e->path);
+		goto skip;
+	}
+	de.name = (const u8 *)name;
+	de.len = strlen(name);
+	if (tar_lookup_disk(tl, dir, name, e->path)) {
+		MSG(0, "Skip the existing \"%s\"\n", e->path);
+		goto skip;
+	}
+
+	if (e->type == '1') {
+		if (tar_clean_path(e->link) < 0 ||
+				!(n = tar_lookup(tl, e->link)) ||
+				n->file_type != F2FS_FT_REG_FILE) {
+			MSG(0, "Skip: hard link %s to %s\n", e->path, e->link);
+			goto skip;
+		}
+		de.ino = n->ino;
+		f2fs_inc_links(tl->sbi, n->ino, 1);
+		tar_add_child(tl, dir, &de);
+		tar_add_node(tl, e->path, n->ino, F2FS_FT_REG_FILE);
+		goto skip;
+	}
+
+	if (e->type == '2' && (!e->link[0] || strlen(e->link) >= F2FS_BLKSIZE)) {
+		MSG(0, "Skip: symlink %s\n", e->path);
+		goto skip;
+	}
+
+	de.link = e->link;
+	de.size = e->size;
+	de.mode = e->mode;
+	de.uid = e->uid;
+	de.gid = e->gid;
+	de.mtime = e->mtime;
+	de.xattrs = e->xattrs;
+	tar_make(tl, &de, dir, e->path);
+
+	if (de.file_type != F2FS_FT_REG_FILE)
+		goto skip;
+
+	ret = tar_write_data(tl, de.ino, e->size);
+	if (ret < 0) {
+		ERR_MSG("Truncated tar archive at %s\n", e->path);
+		return ret;
+	}
+	done = e->size;
+
+	/* a console write per file slows small files down */
+	if ((++tl->nr_files % 256) == 0)
+		update_free_segments(tl->sbi);
+skip:
+	len = ((e->size + TAR_BLOCK - 1) & ~(u64)(TAR_BLOCK - 1)) - done;
+	if (tar_skip(&tl->s, len) < 0) {
+		ERR_MSG("Truncated tar archive at %s\n", e->path);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void tar_free_entry(struct tar_entry *e)
+{
+	free(e->path);
+	free(e->link);
+	tar_free_xattrs(e->xattrs);
+}
+
+/* load the archive @path, or stdin for "-", under the directory @ino */
+int f2fs_load_tar(struct f2fs_sb_info *sbi, const char *path, nid_t ino)
+{
+	struct tar_load tl;
+	struct tar_entry e;
+	int i, j, ret, err;
+
+	memset(&tl, 0, sizeof(struct tar_load));
+	tl.sbi = sbi;
+	tl.hash_size = 1024;
+	tl.hash = calloc(tl.hash_size, sizeof(struct tar_node *));
+	ASSERT(tl.hash);
+	tar_add_node(&tl, "", ino, F2FS_FT_DIR);
+	tl.dirs[0].existed = 1;
+
+	ret = tar_stream_open(&tl.s, path);
+	if (ret < 0) {
+		free(tl.s.buf);
+		goto free;
+	}
+
+	if (config.jobs && dev_async_start(SLOAD_IO_DEPTH) < 0)
+		MSG(0, "Info: Write file data synchronously\n");
+
+	while ((ret = tar_next(&tl, &e)) > 0) {
+		ret = tar_load_entry(&tl, &e);
+		tar_free_entry(&e);
+		if (ret < 0)
+			break;
+	}
+
+	err = tar_stream_close(&tl.s);
+	if (!ret)
+		ret = err;
+	if (dev_async_stop() < 0) {
+		ERR_MSG("Failed to write file data\n");
+		ret = -EIO;
+	}
+
+	/* the dentries of all the directories, in the order they were made */
+	for (i = 0; !ret && i < tl.nr_dirs; i++)
+		ret = f2fs_link_dentries(sbi, tl.dirs[i].ino,
+				tl.dirs[i].children, tl.dirs[i].nr);
+free:
+	for (i = 0; i < tl.nr_dirs; i++) {
+		for (j = 0; j < tl.dirs[i].nr; j++)
+			free((void *)tl.dirs[i].children[j].name);
+		free(tl.dirs[i].children);
+	}
+	free(tl.dirs);
+	for (i = 0; i < (int)tl.hash_size; i++) {
+		struct tar_node *n, *next;
+
+		for (n = tl.hash[i]; n; n = next) {
+			next = n->next;
+			free(n->path);
+			free(n);
+		}
+	}
+	free(tl.hash);
+	tar_reset_ext(&tl.ext);
+	return ret;
+}
@@ -0,0 +1,287 @@
+/**
+ * walk.c
+ *
+ * Iterative walker over the node tree of an inode.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "fsck.h"
+
+static u32 node_walk_slots(struct node_walk_level *level)
+{
+	if (level->ntype == TYPE_INODE)
+		return ADDRS_PER_INODE(&level->node_blk->i) + 5;
+	if (level->ntype == TYPE_DIRECT_NODE)
+		return ADDRS_PER_BLOCK;
+	return NIDS_PER_BLOCK;
+}
+
+/* first slot holding a nid instead of a data block address */
+static u32 node_walk_first_nid(struct node_walk_level *level)
+{
+	if (level->ntype == TYPE_INODE)
+		return ADDRS_PER_INODE(&level->node_blk->i);
+	if (level->ntype == TYPE_DIRECT_NODE)
+		return ADDRS_PER_BLOCK;
+	return 0;
+}
+
+/* the slots are packed members, so access them by value */
+static u32 node_walk_slot(struct node_walk_level *level, u32 idx)
+{
+	struct f2fs_node *node_blk = level->node_blk;
+	u32 first_nid = node_walk_first_nid(level);
+
+	if (level->ntype == TYPE_INODE) {
+		if (idx < first_nid)
+			return le32_to_cpu(node_blk->i.i_addr[idx]);
+		return le32_to_cpu(node_blk->i.i_nid[idx - first_nid]);
+	}
+	if (level->ntype == TYPE_DIRECT_NODE)
+		return le32_to_cpu(node_blk->dn.addr[idx]);
+	return le32_to_cpu(node_blk->in.nid[idx]);
+}
+
+static void node_walk_zero_slot(struct node_walk_level *level, u32 idx)
+{
+	struct f2fs_node *node_blk = level->node_blk;
+	u32 first_nid = node_walk_first_nid(level);
+
+	if (level->ntype == TYPE_INODE) {
+		if (idx < first_nid)
+			node_blk->i.i_addr[idx] = 0;
+		else
+			node_blk->i.i_nid[idx - first_nid] = 0;
+	} else if (level->ntype == TYPE_DIRECT_NODE) {
+		node_blk->dn.addr[idx] = 0;
+	} else {
+		node_blk->in.nid[idx] = 0;
+	}
+}
+
+static enum NODE_TYPE node_walk_child_type(struct node_walk_level *level,
+								u32 idx)
+{
+	if (level->ntype == TYPE_INODE) {
+		idx -= node_walk_first_nid(level);
+		if (idx < 2)
+			return TYPE_DIRECT_NODE;
+		if (idx < 4)
+			return TYPE_INDIRECT_NODE;
+		return TYPE_DOUBLE_INDIRECT_NODE;
+	}
+	if (level->ntype == TYPE_DOUBLE_INDIRECT_NODE)
+		return TYPE_INDIRECT_NODE;
+	return TYPE_DIRECT_NODE;
+}
+
+/* number of file offsets covered by a node of the given type */
+static u32 node_walk_span(enum NODE_TYPE ntype)
+{
+	if (ntype == TYPE_DIRECT_NODE)
+		return ADDRS_PER_BLOCK;
+	if (ntype == TYPE_INDIRECT_NODE)
+		return ADDRS_PER_BLOCK * NIDS_PER_BLOCK;
+	return ADDRS_PER_BLOCK * NIDS_PER_BLOCK * NIDS_PER_BLOCK;
+}
+
+void node_walk_prefetch(struct node_walk *walk, block_t blk_addr, u32 nr)
+{
+	if (walk->ops->prefetch)
+		walk->ops->prefetch(walk, blk_addr, nr);
+	else
+		dev_readahead((__u64)blk_addr * F2FS_BLKSIZE,
+						nr * F2FS_BLKSIZE);
+}
+
+/* keep the NODE_WALK_AHEAD child nodes from slot @from on in flight */
+static void node_walk_readahead_nodes(struct node_walk *walk,
+				struct node_walk_level *level, u32 from)
+{
+	struct f2fs_sb_info *sbi = walk->sbi;
+	u32 end = from + NODE_WALK_AHEAD;
+	u32 nr = node_walk_slots(level);
+
+	if (level->ra_idx < from)
+		level->ra_idx = from;
+	if (end > nr)
+		end = nr;
+
+	for (; level->ra_idx < end; level->ra_idx++) {
+		nid_t nid = node_walk_slot(level, level->ra_idx);
+		struct node_info ni;
+
+		if (nid == 0 || !IS_VALID_NID(sbi, nid))
+			continue;
+
+		get_node_info(sbi, nid, &ni);
+		if (IS_VALID_BLK_ADDR(sbi, ni.blk_addr))
+			node_walk_prefetch(walk, ni.blk_addr, 1);
+	}
+}
+
+/* merge physically contiguous data blocks into one readahead request */
+static void node_walk_readahead_data(struct node_walk *walk,
+					struct node_walk_level *level)
+{
+	struct f2fs_sb_info *sbi = walk->sbi;
+	u32 nr = node_walk_first_nid(level);
+	block_t start = NULL_ADDR;
+	u32 i, len = 0;
+
+	for (i = 0; i < nr; i++) {
+		block_t blk_addr = node_walk_slot(level, i);
+
+		if (len && blk_addr == start + len) {
+			len++;
+			continue;
+		}
+		if (len)
+			node_walk_prefetch(walk, start, len);
+		len = 0;
+		if (blk_addr != NULL_ADDR && blk_addr != NEW_ADDR &&
+				IS_VALID_BLK_ADDR(sbi, blk_addr)) {
+			start = blk_addr;
+			len = 1;
+		}
+	}
+	if (len)
+		node_walk_prefetch(walk, start, len);
+}
+
+static void node_walk_push(struct node_walk *walk, struct f2fs_node *node_blk,
+			struct node_info *ni, enum NODE_TYPE ntype)
+{
+	struct node_walk_level *level;
+
+	ASSERT(walk->depth < NODE_WALK_DEPTH);
+	level = &walk->stack[walk->depth++];
+
+	level->node_blk = node_blk;
+	level->nid = ni->nid;
+	level->blk_addr = ni->blk_addr;
+	level->version = ni->version;
+	level->ntype = ntype;
+	level->idx = 0;
+	level->ra_idx = node_walk_first_nid(level);
+	level->dirty = 0;
+
+	if (walk->prefetch_data)
+		node_walk_readahead_data(walk, level);
+	node_walk_readahead_nodes(walk, level, level->ra_idx);
+}
+
+void node_walk_init(struct node_walk *walk, struct f2fs_sb_info *sbi,
+			const struct node_walk_ops *ops, void *private)
+{
+	memset(walk, 0, sizeof(struct node_walk));
+	walk->sbi = sbi;
+	walk->ops = ops;
+	walk->private = private;
+}
+
+/*
+ * Clear the slot being visited in the current node and mark the node dirty,
+ * for ops which drop a bad data block address or child node.
+ */
+void node_walk_clear_slot(struct node_walk *walk)
+{
+	struct node_walk_level *level = &walk->stack[walk->depth - 1];
+
+	node_walk_zero_slot(level, level->idx);
+	level->dirty = 1;
+}
+
+/* default ops->node: read a child node without any consistency checks */
+int node_walk_read_node(struct node_walk *walk, nid_t nid,
+			enum NODE_TYPE ntype, struct f2fs_node *node_blk,
+			struct node_info *ni)
+{
+	struct f2fs_sb_info *sbi = walk->sbi;
+	int ret;
+
+	if (!IS_VALID_NID(sbi, nid))
+		return -EINVAL;
+
+	get_node_info(sbi, nid, ni);
+	if (!IS_VALID_BLK_ADDR(sbi, ni->blk_addr))
+		return -EINVAL;
+
+	ret = dev_read_block(node_blk, ni->blk_addr);
+	ASSERT(ret >= 0);
+	return 0;
+}
+
+/*
+ * Visit every address slot of the inode in file offset order, descending
+ * into direct, indirect and double indirect nodes with an explicit stack.
+ * Returns 1 when ops->data paused the walk, to be continued with
+ * node_walk_resume(), and 0 once it is over; stack[0].dirty then tells
+ * whether ops modified the inode block itself.
+ */
+int node_walk(struct node_walk *walk, struct node_info *ni,
+					struct f2fs_node *inode_blk)
+{
+	walk->pgofs = 0;
+	walk->depth = 0;
+	node_walk_push(walk, inode_blk, ni, TYPE_INODE);
+
+	return node_walk_resume(walk);
+}
+
+int node_walk_resume(struct node_walk *walk)
+{
+	const struct node_walk_ops *ops = walk->ops;
+	struct node_walk_level *level;
+	struct f2fs_node *node_blk;
+	struct node_info child_ni;
+	enum NODE_TYPE ntype;
+	nid_t nid;
+	int pause;
+
+	while (walk->depth) {
+		level = &walk->stack[walk->depth - 1];
+
+		if (level->idx >= node_walk_slots(level)) {
+			if (--walk->depth == 0)
+				break;
+			if (ops->leave)
+				ops->leave(walk, level);
+			f2fs_blk_free(level->node_blk);
+			continue;
+		}
+
+		if (level->idx < node_walk_first_nid(level)) {
+			pause = ops->data && ops->data(walk, level, level->idx,
+					node_walk_slot(level, level->idx));
+			walk->pgofs++;
+			level->idx++;
+			if (pause)
+				return 1;
+			continue;
+		}
+
+		node_walk_readahead_nodes(walk, level, level->idx);
+
+		nid = node_walk_slot(level, level->idx);
+		ntype = node_walk_child_type(level, level->idx);
+		if (nid == 0)
+			goto skip;
+
+		node_blk = f2fs_blk_alloc();
+		ASSERT(node_blk);
+		if (ops->node(walk, nid, ntype, node_blk, &child_ni)) {
+			f2fs_blk_free(node_blk);
+			goto skip;
+		}
+		level->idx++;
+		node_walk_push(walk, node_blk, &child_ni, ntype);
+		continue;
+skip:
+		walk->pgofs += node_walk_span(ntype);
+		level->idx++;
+	}
+	return 0;
+}
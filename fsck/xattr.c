@@ -80,8 +80,9 @@ static void write_all_xattrs(struct f2fs_sb_info *sbi,
 	u64 inline_size = inline_xattr_size(&inode->i);
 	int ret;
 
-	ASSERT(inode->i.i_inline & F2FS_INLINE_XATTR);
-	memcpy(inline_xattr_addr(&inode->i), txattr_addr, inline_size);
+	/* inodes made by mkfs.f2fs have no inline xattrs */
+	if (inline_size)
+		memcpy(inline_xattr_addr(&inode->i), txattr_addr, inline_size);
 
 	if (hsize <= inline_size)
 		return;
@@ -99,7 +100,7 @@ static void write_all_xattrs(struct f2fs_sb_info *sbi,
 		set_new_dnode(&dn, inode, NULL, xnid);
 		get_node_info(sbi, xnid, &ni);
 		blkaddr = ni.blk_addr;
-		xattr_node = calloc(BLOCK_SZ, 1);
+		xattr_node = f2fs_blk_alloc();
 		ASSERT(xattr_node);
 		ret = dev_read_block(xattr_node, ni.blk_addr);
 		ASSERT(ret >= 0);
@@ -112,6 +113,7 @@ static void write_all_xattrs(struct f2fs_sb_info *sbi,
 
 	ret = dev_write_block(xattr_node, blkaddr);
 	ASSERT(ret >= 0);
+	f2fs_blk_free(xattr_node);
 }
 
 int f2fs_setxattr(struct f2fs_sb_info *sbi, nid_t ino, int index, const char *name,
@@ -141,8 +143,9 @@ int f2fs_setxattr(struct f2fs_sb_info *sbi, nid_t ino, int index, const char *na
 	if (ino < 3)
 		return -EINVAL;
 
-	/* Now We just support selinux */
-	ASSERT(index == F2FS_XATTR_INDEX_SECURITY);
+	ASSERT(index == F2FS_XATTR_INDEX_USER ||
+			index == F2FS_XATTR_INDEX_TRUSTED ||
+			index == F2FS_XATTR_INDEX_SECURITY);
 
 	get_node_info(sbi, ino, &ni);
 	inode = calloc(BLOCK_SZ, 1);
@@ -228,6 +231,7 @@ int f2fs_setxattr(struct f2fs_sb_info *sbi, nid_t ino, int index, const char *na
 	ASSERT(ret >= 0);
 exit:
 	free(base_addr);
+	free(inode);
 	return error;
 }
 
@@ -239,3 +243,143 @@ int inode_set_selinux(struct f2fs_sb_info *sbi, u32 ino, const char *secon)
 	return f2fs_setxattr(sbi, ino, F2FS_XATTR_INDEX_SECURITY,
 			XATTR_SELINUX_SUFFIX, secon, strlen(secon), 1);
 }
+
+/* the index of the xattr @name given with its prefix, and its suffix */
+static int xattr_index(const char *name, const char **suffix)
+{
+	static const struct {
+		const char *prefix;
+		int index;
+	} prefixes[] = {
+		{ "user.", F2FS_XATTR_INDEX_USER },
+		{ "trusted.", F2FS_XATTR_INDEX_TRUSTED },
+		{ "security.", F2FS_XATTR_INDEX_SECURITY },
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+		size_t len = strlen(prefixes[i].prefix);
+
+		if (!strncmp(name, prefixes[i].prefix, len)) {
+			*suffix = name + len;
+			return prefixes[i].index;
+		}
+	}
+	return -EOPNOTSUPP;
+}
+
+/* set the xattr @name given with its "user.", "trusted." or "security." prefix */
+int inode_set_xattr(struct f2fs_sb_info *sbi, u32 ino, const char *name,
+					const void *value, size_t size)
+{
+	int index = xattr_index(name, &name);
+
+	if (index < 0)
+		return index;
+	return f2fs_setxattr(sbi, ino, index, name, value, size, 0);
+}
+
+/* copy the value of the xattr @name of @inode to @buf, returning its size */
+int inode_get_xattr(struct f2fs_sb_info *sbi, struct f2fs_node *inode,
+			const char *name, void *buf, size_t size)
+{
+	struct f2fs_xattr_entry *entry;
+	int index = xattr_index(name, &name);
+	void *base_addr;
+	int ret;
+
+	if (index < 0)
+		return index;
+
+	base_addr = read_all_xattrs(sbi, inode);
+	entry = __find_xattr(base_addr, index, strlen(name), name);
+	if (IS_XATTR_LAST_ENTRY(entry)) {
+		ret = -ENODATA;
+	} else if (le16_to_cpu(entry->e_value_size) > size) {
+		ret = -ERANGE;
+	} else {
+		ret = le16_to_cpu(entry->e_value_size);
+		memcpy(buf, entry->e_name + entry->e_name_len, ret);
+	}
+	free(base_addr);
+	return ret;
+}
+
+/* append an entry to the xattrs being built at @base_addr, up to @last */
+static int xattr_append(void *base_addr, struct f2fs_xattr_entry **last,
+		int index, const char *name, const void *value, size_t size)
+{
+	struct f2fs_xattr_entry *here;
+	int len = strlen(name);
+	int newsize, free;
+
+	if (len > F2FS_NAME_LEN || size > MAX_VALUE_LEN)
+		return -ERANGE;
+
+	/* the first value given for a name wins */
+	here = __find_xattr(base_addr, index, len, name);
+	if (!IS_XATTR_LAST_ENTRY(here))
+		return 0;
+
+	newsize = XATTR_ALIGN(sizeof(struct f2fs_xattr_entry) + len + size);
+	free = MIN_OFFSET - ((char *)here - (char *)base_addr);
+	if (free < newsize)
+		return -ENOSPC;
+
+	here->e_name_index = index;
+	here->e_name_len = len;
+	memcpy(here->e_name, name, len);
+	memcpy(here->e_name + len, value, size);
+	here->e_value_size = cpu_to_le16(size);
+	*last = XATTR_NEXT_ENTRY(here);
+	return 0;
+}
+
+/*
+ * Lay out the security context and the xattrs of @de in its new inode
+ * @inode, before the inode is written: inline, and in a new xattr node
+ * only if they do not fit there.
+ */
+void inode_init_xattrs(struct f2fs_sb_info *sbi, struct f2fs_node *inode,
+							struct dentry *de)
+{
+	struct f2fs_xattr_header *header;
+	struct f2fs_xattr_entry *last;
+	struct dentry_xattr *x;
+	void *base_addr;
+	int ret;
+
+	if (!de->secon && !de->xattrs)
+		return;
+
+	base_addr = calloc(inline_xattr_size(&inode->i) + BLOCK_SZ, 1);
+	ASSERT(base_addr);
+	header = XATTR_HDR(base_addr);
+	header->h_magic = cpu_to_le32(F2FS_XATTR_MAGIC);
+	header->h_refcount = cpu_to_le32(1);
+	last = XATTR_FIRST_ENTRY(base_addr);
+
+	if (de->secon) {
+		ret = xattr_append(base_addr, &last, F2FS_XATTR_INDEX_SECURITY,
+				XATTR_SELINUX_SUFFIX, de->secon,
+				strlen(de->secon));
+		if (ret)
+			MSG(0, "Skip: SELinux context of %.*s, err=%d\n",
+						de->len, de->name, ret);
+	}
+
+	for (x = de->xattrs; x; x = x->next) {
+		const char *name;
+		int index = xattr_index(x->name, &name);
+
+		ret = index < 0 ? index : xattr_append(base_addr, &last,
+					index, name, x->value, x->size);
+		if (ret)
+			MSG(0, "Skip: xattr %s of %.*s, err=%d\n",
+					x->name, de->len, de->name, ret);
+	}
+
+	write_all_xattrs(sbi, inode, (char *)last - (char *)base_addr,
+								base_addr);
+	free(base_addr);
+}
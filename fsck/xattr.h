@@ -35,6 +35,8 @@ struct f2fs_xattr_entry {
 #define XATTR_ROUND	(3)
 
 #define XATTR_SELINUX_SUFFIX "selinux"
+#define F2FS_XATTR_INDEX_USER		1
+#define F2FS_XATTR_INDEX_TRUSTED	4
 #define F2FS_XATTR_INDEX_SECURITY	6
 #define IS_XATTR_LAST_ENTRY(entry) (*(__u32 *)(entry) == 0)
 
@@ -15,6 +15,8 @@
 #include <inttypes.h>
 #include <linux/types.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include <setjmp.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -114,31 +116,45 @@ static inline uint64_t bswap_64(uint64_t val)
 
 /*
  * Debugging interfaces
+ *
+ * With dbg_lv DBG_QUIET nothing is printed, not even errors: for the images
+ * of fsck -B, which only report their results.
  */
+#define DBG_QUIET	(-2)
+
 #define FIX_MSG(fmt, ...)						\
 	do {								\
+		if (config.dbg_lv == DBG_QUIET)				\
+			break;						\
 		printf("[FIX] (%s:%4d) ", __func__, __LINE__);		\
 		printf(" --> "fmt"\n", ##__VA_ARGS__);			\
 	} while (0)
 
 #define ASSERT_MSG(fmt, ...)						\
 	do {								\
+		config.bug_on = 1;					\
+		if (config.dbg_lv == DBG_QUIET)				\
+			break;						\
 		printf("[ASSERT] (%s:%4d) ", __func__, __LINE__);	\
 		printf(" --> "fmt"\n", ##__VA_ARGS__);			\
-		config.bug_on = 1;					\
 	} while (0)
 
 #define ASSERT(exp)							\
 	do {								\
 		if (!(exp)) {						\
-			printf("[ASSERT] (%s:%4d) " #exp"\n",		\
+			if (config.dbg_lv != DBG_QUIET)			\
+				printf("[ASSERT] (%s:%4d) " #exp"\n",	\
 					__func__, __LINE__);		\
+			if (config.assert_jmp)				\
+				longjmp(*config.assert_jmp, 1);		\
 			exit(-1);					\
 		}							\
 	} while (0)
 
 #define ERR_MSG(fmt, ...)						\
 	do {								\
+		if (config.dbg_lv == DBG_QUIET)				\
+			break;						\
 		printf("[%s:%d] " fmt, __func__, __LINE__, ##__VA_ARGS__); \
 	} while (0)
 
@@ -278,9 +294,18 @@ struct f2fs_configuration {
 	int32_t fd, kd;
 	int32_t dump_fd;
 	char *device_name;
+	int image_file;			/* device_name is a regular file */
+	unsigned int no_offload;	/* kernel offloads the device refused */
+	int sparse_mode;		/* device_name is an Android sparse image */
+	char *sparse_fills;		/* its zero filled blocks, as a bitmap */
+	int dirty;			/* the device has been written to */
 	char *extension_list;
 	int dbg_lv;
 	int trim;
+	int lazy_init;			/* leave zeroing NAT/SIT to the device */
+	u_int64_t nr_files;		/* expected files, to size the NAT */
+	u_int64_t avg_file_size;	/* and their average size in bytes */
+	u_int64_t discard_chunk;	/* bytes per discard request, or 0 */
 	int func;
 	void *private;
 	int fix_on;
@@ -296,9 +321,28 @@ struct f2fs_configuration {
 	u_int64_t defrag_len;
 	u_int64_t defrag_target;
 
+	/* fsck layout statistics, "-" for stdout */
+	char *stats_path;
+	int stats_fd;		/* stdout for "-", the report goes to stderr */
+
+	/* fsck of the images listed there, "-" for stdin */
+	char *batch_path;
+	jmp_buf *assert_jmp;	/* where ASSERT() goes instead of exit() */
+
+	/* back block buffers with hugepage arenas */
+	int hugepages;
+
 	/* sload parameters */
 	char *from_dir;
 	char *mount_point;
+	int jobs;		/* reader threads, -1 for one per cpu; also
+				   the discard threads of mkfs and the
+				   workers of fsck -B */
+	char *placement;	/* files to lay out first, in boot order */
+	char *file_contexts;	/* SELinux labels of the loaded files */
+	int update;		/* write only what changed since the last load */
+	int update_crc;		/* tell changed files by crc, not mtime */
+	int format;		/* sload formats the device first */
 
 	/* to detect zbc error */
 	int smr_mode;
@@ -957,6 +1001,8 @@ extern void f2fs_init_configuration(struct f2fs_configuration *);
 extern int f2fs_dev_is_umounted(struct f2fs_configuration *);
 extern int f2fs_get_device_info(struct f2fs_configuration *);
 extern void f2fs_finalize_device(struct f2fs_configuration *);
+extern int f2fs_is_sparse_image(const char *);
+extern int f2fs_sparse_open(struct f2fs_configuration *);
 
 extern int dev_read(void *, __u64, size_t);
 extern int dev_write(void *, __u64, size_t);
@@ -964,18 +1010,43 @@ extern int dev_write_block(void *, __u64);
 extern int dev_write_dump(void *, __u64, size_t);
 /* All bytes in the buffer must be 0 use dev_fill(). */
 extern int dev_fill(void *, __u64, size_t);
+extern int dev_zero(__u64, __u64);
+struct iovec;
+extern int dev_writev(const struct iovec *, int, __u64);
 
 extern int dev_read_block(void *, __u64);
 extern int dev_read_blocks(void *, __u64, __u32 );
+extern int dev_readahead(__u64, size_t);
 extern int dev_reada_block(__u64);
 
+/* queued writes, see dev_async_start() */
+extern int dev_async_start(unsigned int);
+extern int dev_write_async(void *, __u64, size_t, void *);
+extern int dev_copy_async(int, __u64, __u64, size_t, int);
+extern int dev_async_drain(void);
+extern int dev_async_stop(void);
+
 extern int dev_read_version(void *, __u64, size_t);
+
+extern void *f2fs_blk_alloc(void);
+extern void *f2fs_blk_zalloc(void);
+extern void f2fs_blk_free(void *);
+extern void f2fs_blk_pool_release(void);
+extern void f2fs_blk_pool_report(void);
 extern void get_kernel_version(__u8 *);
 f2fs_hash_t f2fs_dentry_hash(const unsigned char *, int);
 
+#define F2FS_HASH_LANES		8
+void f2fs_dentry_hash_batch(const unsigned char **, const int *, int,
+							f2fs_hash_t *);
+
 extern int zbc_scsi_report_zones(struct f2fs_configuration *);
 
-extern struct f2fs_configuration config;
+/* the configuration of the calling thread, see f2fs_set_config() */
+extern __thread struct f2fs_configuration *f2fs_config;
+#define config	(*f2fs_config)
+extern struct f2fs_configuration *f2fs_set_config(struct f2fs_configuration *);
+extern int f2fs_thread_create(pthread_t *, void *(*)(void *), void *);
 
 #define ALIGN(val, size)	((val) + (size) - 1) / (size)
 #define SEG_ALIGN(blks)		ALIGN(blks, config.blks_per_seg)
@@ -16,6 +16,7 @@
 #include <fcntl.h>
 #include <mntent.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
 #include <sys/ioctl.h>
@@ -441,6 +442,110 @@ f2fs_hash_t f2fs_dentry_hash(const unsigned char *name, int len)
 	return f2fs_hash;
 }
 
+/*
+ * TEA over F2FS_HASH_LANES names in lockstep. Every per-lane loop has a
+ * fixed trip count and no branches, so the compiler can keep each lane
+ * in one SIMD register slot. Lanes whose name has fewer 16-byte chunks
+ * than the longest one are masked out of the remaining rounds.
+ */
+static void TEA_transform_lanes(__u32 buf0[F2FS_HASH_LANES],
+		__u32 buf1[F2FS_HASH_LANES],
+		__u32 in[4][F2FS_HASH_LANES], const __u32 mask[F2FS_HASH_LANES])
+{
+	__u32 b0[F2FS_HASH_LANES], b1[F2FS_HASH_LANES];
+	__u32 sum = 0;
+	int n, l;
+
+	for (l = 0; l < F2FS_HASH_LANES; l++) {
+		b0[l] = buf0[l];
+		b1[l] = buf1[l];
+	}
+
+	for (n = 0; n < 16; n++) {
+		sum += DELTA;
+		for (l = 0; l < F2FS_HASH_LANES; l++)
+			b0[l] += ((b1[l] << 4) + in[0][l]) ^ (b1[l] + sum) ^
+					((b1[l] >> 5) + in[1][l]);
+		for (l = 0; l < F2FS_HASH_LANES; l++)
+			b1[l] += ((b0[l] << 4) + in[2][l]) ^ (b0[l] + sum) ^
+					((b0[l] >> 5) + in[3][l]);
+	}
+
+	for (l = 0; l < F2FS_HASH_LANES; l++) {
+		buf0[l] += b0[l] & mask[l];
+		buf1[l] += b1[l] & mask[l];
+	}
+}
+
+/**
+ * Hash several dentry names at once, same result as f2fs_dentry_hash()
+ * @param names         dentry names
+ * @param lens          name lengths
+ * @param nr            number of names
+ * @param hashes        output, one hash value per name
+ */
+void f2fs_dentry_hash_batch(const unsigned char **names, const int *lens,
+					int nr, f2fs_hash_t *hashes)
+{
+	__u32 buf0[F2FS_HASH_LANES], buf1[F2FS_HASH_LANES];
+	__u32 in[4][F2FS_HASH_LANES], mask[F2FS_HASH_LANES];
+	int rounds[F2FS_HASH_LANES];
+	int base, l, r, k;
+
+	for (base = 0; base < nr; base += F2FS_HASH_LANES) {
+		int max_rounds = 0;
+
+		for (l = 0; l < F2FS_HASH_LANES; l++) {
+			const unsigned char *name;
+			int len;
+
+			buf0[l] = 0x67452301;
+			buf1[l] = 0xefcdab89;
+			rounds[l] = 0;
+
+			if (base + l >= nr)
+				continue;
+
+			name = names[base + l];
+			len = lens[base + l];
+			/* special hash codes for special dentries */
+			if ((len <= 2) && (name[0] == '.') &&
+				(name[1] == '.' || name[1] == '\0'))
+				continue;
+
+			rounds[l] = len > 16 ? (len + 15) / 16 : 1;
+			if (rounds[l] > max_rounds)
+				max_rounds = rounds[l];
+		}
+
+		for (r = 0; r < max_rounds; r++) {
+			for (l = 0; l < F2FS_HASH_LANES; l++) {
+				__u32 tmp[4];
+
+				mask[l] = r < rounds[l] ? ~0U : 0;
+				if (!mask[l]) {
+					for (k = 0; k < 4; k++)
+						in[k][l] = 0;
+					continue;
+				}
+				str2hashbuf(names[base + l] + r * 16,
+					lens[base + l] - r * 16, tmp, 4);
+				for (k = 0; k < 4; k++)
+					in[k][l] = tmp[k];
+			}
+			TEA_transform_lanes(buf0, buf1, in, mask);
+		}
+
+		for (l = 0; l < F2FS_HASH_LANES && base + l < nr; l++) {
+			if (!rounds[l])
+				hashes[base + l] = 0;
+			else
+				hashes[base + l] = cpu_to_le32(buf0[l] &
+							~F2FS_HASH_COL_BIT);
+		}
+	}
+}
+
 unsigned int addrs_per_inode(struct f2fs_inode *i)
 {
 	if (i->i_inline & F2FS_INLINE_XATTR)
@@ -453,15 +558,30 @@ unsigned int addrs_per_inode(struct f2fs_inode *i)
  */
 #define CRCPOLY_LE 0xedb88320
 
-u_int32_t f2fs_cal_crc32(u_int32_t crc, void *buf, int len)
+/* sload checksums every source file, so go a byte at a time */
+static u_int32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table(void)
 {
-	int i;
-	unsigned char *p = (unsigned char *)buf;
-	while (len--) {
-		crc ^= *p++;
-		for (i = 0; i < 8; i++)
+	u_int32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
 			crc = (crc >> 1) ^ ((crc & 1) ? CRCPOLY_LE : 0);
+		crc32_table[i] = crc;
 	}
+}
+
+u_int32_t f2fs_cal_crc32(u_int32_t crc, void *buf, int len)
+{
+	unsigned char *p = (unsigned char *)buf;
+
+	pthread_once(&crc32_once, crc32_init_table);
+	while (len--)
+		crc = (crc >> 8) ^ crc32_table[(crc ^ *p++) & 0xff];
 	return crc;
 }
 
@@ -485,6 +605,7 @@ int f2fs_crc_valid(u_int32_t blk_crc, void *buf, int len)
  */
 void f2fs_init_configuration(struct f2fs_configuration *c)
 {
+	memset(c, 0, sizeof(struct f2fs_configuration));
 	c->total_sectors = 0;
 	c->sector_size = DEFAULT_SECTOR_SIZE;
 	c->sectors_per_blk = DEFAULT_SECTORS_PER_BLOCK;
@@ -501,6 +622,7 @@ void f2fs_init_configuration(struct f2fs_configuration *c)
 	c->device_name = NULL;
 	c->trim = 1;
 	c->ro = 0;
+	c->jobs = -1;
 }
 
 static int is_mounted(const char *mpt, const char *device)
@@ -584,7 +706,12 @@ int f2fs_get_device_info(struct f2fs_configuration *c)
 	struct hd_geometry geom;
 	u_int64_t wanted_total_sectors = c->total_sectors;
 
-	fd = open(c->device_name, O_RDWR);
+	if (!c->sparse_mode)
+		c->sparse_mode = f2fs_is_sparse_image(c->device_name);
+	if (c->sparse_mode)
+		fd = f2fs_sparse_open(c);
+	else
+		fd = open(c->device_name, O_RDWR);
 	if (fd < 0) {
 		MSG(0, "\tError: Failed to open the device!\n");
 		return -1;
@@ -602,6 +729,7 @@ int f2fs_get_device_info(struct f2fs_configuration *c)
 
 	if (S_ISREG(stat_buf.st_mode)) {
 		c->total_sectors = stat_buf.st_size / c->sector_size;
+		c->image_file = 1;
 	} else if (S_ISBLK(stat_buf.st_mode)) {
 		if (ioctl(fd, BLKSSZGET, &sector_size) < 0) {
 			MSG(0, "\tError: Using the default sector size\n");
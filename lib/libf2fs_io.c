@@ -6,6 +6,7 @@
  *
  * Dual licensed under the GPL or LGPL version 2 licenses.
  */
+#define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
 
 #include <stdio.h>
@@ -14,16 +15,89 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <mntent.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <linux/hdreg.h>
 
 #include <f2fs_fs.h>
 
-struct f2fs_configuration config;
+#ifdef HAVE_LINUX_FALLOC_H
+#include <linux/falloc.h>
+#endif
+
+#ifndef BLKDISCARD
+#define BLKDISCARD	_IO(0x12,119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES	_IO(0x12,124)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT	_IO(0x12,127)
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
+/*
+ * config is the configuration of the calling thread: the one of the process
+ * unless f2fs_set_config() gave the thread its own, so that threads of one
+ * process can each work on a device. Threads of libf2fs and of the tools
+ * take the one of their creator, see f2fs_thread_create().
+ */
+struct f2fs_configuration f2fs_process_config;
+__thread struct f2fs_configuration *f2fs_config = &f2fs_process_config;
+
+/* returns the configuration the thread had; NULL is the process one */
+struct f2fs_configuration *f2fs_set_config(struct f2fs_configuration *c)
+{
+	struct f2fs_configuration *old = f2fs_config;
+
+	f2fs_config = c ? c : &f2fs_process_config;
+	return old;
+}
+
+struct thread_start {
+	void *(*fn)(void *);
+	void *arg;
+	struct f2fs_configuration *cfg;
+};
+
+static void *thread_start(void *arg)
+{
+	struct thread_start ts = *(struct thread_start *)arg;
+	void *ret;
+
+	free(arg);
+	f2fs_config = ts.cfg;
+	ret = ts.fn(ts.arg);
+	f2fs_blk_pool_release();
+	return ret;
+}
+
+/* pthread_create() for @fn to run with the configuration of the caller */
+int f2fs_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+	struct thread_start *ts = malloc(sizeof(struct thread_start));
+	int ret;
+
+	if (!ts)
+		return ENOMEM;
+	ts->fn = fn;
+	ts->arg = arg;
+	ts->cfg = f2fs_config;
+	ret = pthread_create(thread, NULL, thread_start, ts);
+	if (ret)
+		free(ts);
+	return ret;
+}
 
 /*
  * IO interfaces
@@ -57,6 +131,7 @@ int dev_readahead(__u64 offset, size_t len)
 
 int dev_write(void *buf, __u64 offset, size_t len)
 {
+	config.dirty = 1;
 	if (lseek64(config.fd, (off64_t)offset, SEEK_SET) < 0)
 		return -1;
 	if (write(config.fd, buf, len) < 0)
@@ -78,11 +153,67 @@ int dev_write_dump(void *buf, __u64 offset, size_t len)
 	return 0;
 }
 
+/* the ways of dev_zero() and dev_copy() that failed once, in no_offload */
+#define NO_ZEROOUT	0x01
+#define NO_DISCARD_ZERO	0x02
+#define NO_PUNCH	0x04
+#define NO_ZERO_RANGE	0x08
+#define NO_CLONE	0x10
+#define NO_COPY_RANGE	0x20
+#define NO_SPLICE	0x40
+
+/*
+ * Have the kernel zero @len bytes at @offset without writing them from
+ * here: BLKZEROOUT, which is WRITE ZEROES where the device has it, or
+ * BLKDISCARD on devices whose discarded blocks read back as zeros, and
+ * punched holes or zeroed ranges in an image file. Returns -1 when the
+ * device offers none of them.
+ */
+int dev_zero(__u64 offset, __u64 len)
+{
+	__u64 range[2] = { offset, len };
+
+	config.dirty = 1;
+	if (config.image_file) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+		if (!(config.no_offload & NO_PUNCH) && !fallocate(config.fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				offset, len))
+			return 0;
+		config.no_offload |= NO_PUNCH;
+#endif
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_ZERO_RANGE)
+		if (!(config.no_offload & NO_ZERO_RANGE) && !fallocate(config.fd,
+				FALLOC_FL_ZERO_RANGE, offset, len))
+			return 0;
+		config.no_offload |= NO_ZERO_RANGE;
+#endif
+		return -1;
+	}
+
+	if (!(config.no_offload & NO_ZEROOUT)) {
+		if (!ioctl(config.fd, BLKZEROOUT, &range))
+			return 0;
+		config.no_offload |= NO_ZEROOUT;
+	}
+	if (!(config.no_offload & NO_DISCARD_ZERO)) {
+		unsigned int zeroes = 0;
+
+		if (!ioctl(config.fd, BLKDISCARDZEROES, &zeroes) && zeroes &&
+				!ioctl(config.fd, BLKDISCARD, &range))
+			return 0;
+		config.no_offload |= NO_DISCARD_ZERO;
+	}
+	return -1;
+}
+
 int dev_fill(void *buf, __u64 offset, size_t len)
 {
 	/* Only allow fill to zero */
 	if (*((__u8*)buf))
 		return -1;
+	if (!dev_zero(offset, len))
+		return 0;
 	if (lseek64(config.fd, (off64_t)offset, SEEK_SET) < 0)
 		return -1;
 	if (write(config.fd, buf, len) < 0)
@@ -105,14 +236,1009 @@ int dev_reada_block(__u64 blk_addr)
 	return dev_readahead(blk_addr * F2FS_BLKSIZE, F2FS_BLKSIZE);
 }
 
+#ifndef FICLONERANGE
+struct file_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
+static __thread int splice_pipe[2] = { -1, -1 };
+
+static int copy_pwrite(int fd, void *buf, size_t len, off64_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite64(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Write the @iovcnt buffers of @iov back to back at @offset, with as few
+ * requests as the kernel takes.
+ */
+int dev_writev(const struct iovec *iov, int iovcnt, __u64 offset)
+{
+	off64_t off = offset;
+	size_t skip = 0;	/* bytes of iov[0] already written */
+	ssize_t n;
+
+	config.dirty = 1;
+	while (iovcnt) {
+#ifdef HAVE_PWRITEV
+		if (!skip) {
+			n = pwritev64(config.fd, iov, iovcnt < IOV_MAX ?
+						iovcnt : IOV_MAX, off);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+			off += n;
+			while (iovcnt && (size_t)n >= iov->iov_len) {
+				n -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			skip = n;
+			continue;
+		}
+#endif
+		/* the rest of a buffer written in part */
+		if (copy_pwrite(config.fd, (char *)iov->iov_base + skip,
+					iov->iov_len - skip, off) < 0)
+			return -1;
+		off += iov->iov_len - skip;
+		skip = 0;
+		iov++;
+		iovcnt--;
+	}
+	return 0;
+}
+
+/* the fallback, and the zeros past the end of a source that shrank */
+static int copy_bounce(int src_fd, off64_t *src_off, off64_t *dst_off,
+								size_t len)
+{
+	char buf[F2FS_BLKSIZE];
+	ssize_t n = 0;
+
+	while (len) {
+		size_t chunk = len < F2FS_BLKSIZE ? len : F2FS_BLKSIZE;
+
+		if (src_fd >= 0)
+			n = pread64(src_fd, buf, chunk, *src_off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			src_fd = -1;
+			memset(buf, 0, chunk);
+			n = chunk;
+		}
+		if (copy_pwrite(config.fd, buf, n, *dst_off) < 0)
+			return -1;
+		*src_off += n;
+		*dst_off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* returns the bytes copied, short at the end of the source, or -1 */
+static ssize_t copy_splice(int src_fd, off64_t *src_off, off64_t *dst_off,
+								size_t len)
+{
+#ifdef HAVE_SPLICE
+	char buf[F2FS_BLKSIZE];
+	size_t done = 0;
+	ssize_t in, out, n;
+
+	if (splice_pipe[0] < 0 && pipe(splice_pipe) < 0)
+		return -1;
+
+	while (done < len) {
+		in = splice(src_fd, src_off, splice_pipe[1], NULL,
+				len - done, SPLICE_F_MOVE);
+		if (in < 0 && errno == EINTR)
+			continue;
+		if (in < 0)
+			return done ? (ssize_t)done : -1;
+		if (in == 0)
+			break;
+
+		while (in) {
+			out = splice(splice_pipe[0], NULL, config.fd, dst_off,
+						in, SPLICE_F_MOVE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out > 0) {
+				in -= out;
+				done += out;
+				continue;
+			}
+
+			/* the device takes no splice, empty the pipe by hand */
+			config.no_offload |= NO_SPLICE;
+			while (in) {
+				n = read(splice_pipe[0], buf,
+					in < F2FS_BLKSIZE ? in : F2FS_BLKSIZE);
+				if (n <= 0 ||
+					copy_pwrite(config.fd, buf, n,
+							*dst_off) < 0)
+					return -1;
+				*dst_off += n;
+				in -= n;
+				done += n;
+			}
+			return done;
+		}
+	}
+	return done;
+#else
+	config.no_offload |= NO_SPLICE;
+	return -1;
+#endif
+}
+
+/*
+ * Copy @len bytes at @src_offset of @src_fd to @offset of the device with
+ * no bounce through user space where the kernel allows it: a reflink or
+ * copy_file_range() into an image file, splice() into a block device.
+ * Bytes past the end of the source are written as zeros.
+ */
+static int dev_copy(int src_fd, __u64 src_offset, __u64 offset, size_t len)
+{
+	off64_t src_off = src_offset, dst_off = offset;
+	ssize_t n;
+
+	if (config.image_file && !(config.no_offload & NO_CLONE)
+			&& !(src_offset & (F2FS_BLKSIZE - 1))
+			&& !(offset & (F2FS_BLKSIZE - 1))
+			&& !(len & (F2FS_BLKSIZE - 1))) {
+		struct file_clone_range fcr = {
+			.src_fd = src_fd,
+			.src_offset = src_offset,
+			.src_length = len,
+			.dest_offset = offset,
+		};
+
+		if (ioctl(config.fd, FICLONERANGE, &fcr) == 0)
+			return 0;
+		/* no reflinks here, or a source that shrank */
+		if (errno != EINVAL)
+			config.no_offload |= NO_CLONE;
+	}
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (config.image_file && !(config.no_offload & NO_COPY_RANGE) &&
+								len) {
+		n = copy_file_range(src_fd, &src_off, config.fd, &dst_off,
+								len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			config.no_offload |= NO_COPY_RANGE;
+			break;
+		}
+		if (n == 0)
+			break;
+		len -= n;
+	}
+#endif
+
+	if (!config.image_file && !(config.no_offload & NO_SPLICE) && len) {
+		n = copy_splice(src_fd, &src_off, &dst_off, len);
+		if (n > 0)
+			len -= n;
+		if (n >= 0 && len)
+			src_fd = -1;	/* hit the end of the source */
+	}
+
+	return copy_bounce(src_fd, &src_off, &dst_off, len);
+}
+
+/*
+ * Queued writes
+ *
+ * After dev_async_start(), dev_write_async() and dev_copy_async() hand
+ * writes to a single IO thread through a bounded ring, so the caller can
+ * prepare the next ones meanwhile. Writes complete in the order they were
+ * queued, and @release, when set, is freed once its write is done. Errors
+ * are reported by dev_async_drain(). Without the IO thread the write is
+ * done in place.
+ */
+struct async_write {
+	void *buf;		/* or NULL to copy from src_fd */
+	int src_fd;
+	__u64 src_offset;
+	__u64 offset;
+	size_t len;
+	void *release;
+	int close_fd;
+};
+
+/* the IO thread of the calling thread */
+static __thread struct async_io {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct async_write *ring;
+	unsigned int depth;
+	unsigned int head;	/* oldest write not yet completed */
+	unsigned int tail;	/* next free slot */
+	int running;
+	int stop;
+	int err;
+} async_io = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int async_do_write(struct async_write *aw)
+{
+	int ret;
+
+	if (aw->buf)
+		ret = copy_pwrite(config.fd, aw->buf, aw->len, aw->offset);
+	else
+		ret = dev_copy(aw->src_fd, aw->src_offset, aw->offset,
+								aw->len);
+	free(aw->release);
+	if (aw->close_fd)
+		close(aw->src_fd);
+	return ret;
+}
+
+static void *async_io_thread(void *arg)
+{
+	struct async_io *a = arg;
+	struct async_write aw;
+	int ret;
+
+	pthread_mutex_lock(&a->lock);
+	while (1) {
+		while (a->head == a->tail && !a->stop)
+			pthread_cond_wait(&a->cond, &a->lock);
+		if (a->head == a->tail)
+			break;
+		aw = a->ring[a->head % a->depth];
+		pthread_mutex_unlock(&a->lock);
+
+		ret = async_do_write(&aw);
+
+		pthread_mutex_lock(&a->lock);
+		if (ret < 0 && !a->err)
+			a->err = -EIO;
+		a->head++;
+		pthread_cond_broadcast(&a->cond);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return arg;
+}
+
+/* start the IO thread with room for @depth queued writes */
+int dev_async_start(unsigned int depth)
+{
+	if (async_io.running)
+		return 0;
+
+	async_io.ring = calloc(depth, sizeof(struct async_write));
+	if (!async_io.ring)
+		return -ENOMEM;
+	async_io.depth = depth;
+	async_io.head = async_io.tail = 0;
+	async_io.stop = 0;
+	async_io.err = 0;
+
+	if (f2fs_thread_create(&async_io.thread, async_io_thread, &async_io)) {
+		free(async_io.ring);
+		async_io.ring = NULL;
+		return -EAGAIN;
+	}
+	async_io.running = 1;
+	return 0;
+}
+
+static int async_queue(struct async_write *req)
+{
+	config.dirty = 1;
+	if (!async_io.running)
+		return async_do_write(req);
+
+	pthread_mutex_lock(&async_io.lock);
+	while (async_io.tail - async_io.head == async_io.depth)
+		pthread_cond_wait(&async_io.cond, &async_io.lock);
+	async_io.ring[async_io.tail % async_io.depth] = *req;
+	async_io.tail++;
+	pthread_cond_broadcast(&async_io.cond);
+	pthread_mutex_unlock(&async_io.lock);
+	return 0;
+}
+
+int dev_write_async(void *buf, __u64 offset, size_t len, void *release)
+{
+	struct async_write req = {
+		.buf = buf,
+		.src_fd = -1,
+		.offset = offset,
+		.len = len,
+		.release = release,
+	};
+
+	return async_queue(&req);
+}
+
+/* queue dev_copy() of a source file range, closing @src_fd if @close_fd */
+int dev_copy_async(int src_fd, __u64 src_offset, __u64 offset, size_t len,
+								int close_fd)
+{
+	struct async_write req = {
+		.src_fd = src_fd,
+		.src_offset = src_offset,
+		.offset = offset,
+		.len = len,
+		.close_fd = close_fd,
+	};
+
+	return async_queue(&req);
+}
+
+/* wait for every queued write, before reading back what they cover */
+int dev_async_drain(void)
+{
+	int err;
+
+	if (!async_io.running)
+		return 0;
+
+	pthread_mutex_lock(&async_io.lock);
+	while (async_io.head != async_io.tail)
+		pthread_cond_wait(&async_io.cond, &async_io.lock);
+	err = async_io.err;
+	pthread_mutex_unlock(&async_io.lock);
+	return err ? -1 : 0;
+}
+
+int dev_async_stop(void)
+{
+	int ret;
+
+	if (!async_io.running)
+		return 0;
+
+	ret = dev_async_drain();
+
+	pthread_mutex_lock(&async_io.lock);
+	async_io.stop = 1;
+	pthread_cond_broadcast(&async_io.cond);
+	pthread_mutex_unlock(&async_io.lock);
+
+	pthread_join(async_io.thread, NULL);
+	free(async_io.ring);
+	async_io.ring = NULL;
+	async_io.running = 0;
+	return ret;
+}
+
+/*
+ * 4KB block buffers
+ *
+ * Freed buffers are kept on a per-thread free list, linked through their
+ * first bytes, so a walk over thousands of blocks reuses a handful of them.
+ * With config.hugepages they are carved out of 2MB arenas instead of malloc.
+ * A buffer may be freed by another thread than the one that allocated it, so
+ * arenas are not unmapped when a thread exits: its list goes to blk_spare for
+ * the next thread that runs dry, see f2fs_blk_pool_release().
+ */
+#define BLK_POOL_MAX		256
+#define BLK_ARENA_SIZE		(2 * 1024 * 1024)
+
+struct blk_pool {
+	void *free_list;
+	unsigned int nr_free;
+	unsigned long long allocs;	/* f2fs_blk_[z]alloc() calls */
+	unsigned long long reused;	/* served from the free list */
+	unsigned long long zeroed;	/* buffers cleared by f2fs_blk_zalloc() */
+	unsigned long long mallocs;	/* buffers taken from malloc */
+	unsigned int arenas;		/* arenas mapped with config.hugepages */
+};
+
+static __thread struct blk_pool blk_pool;
+
+static struct {
+	pthread_mutex_t lock;
+	void *free_list;
+} blk_spare = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void blk_pool_push(void *buf)
+{
+	*(void **)buf = blk_pool.free_list;
+	blk_pool.free_list = buf;
+	blk_pool.nr_free++;
+}
+
+static void blk_pool_grow_arena(void)
+{
+	void *arena = MAP_FAILED;
+	char *buf;
+	int i;
+
+#ifdef MAP_HUGETLB
+	arena = mmap(NULL, BLK_ARENA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (arena == MAP_FAILED) {
+		/* no reserved hugepages, ask for transparent ones */
+		arena = mmap(NULL, BLK_ARENA_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (arena == MAP_FAILED)
+			return;
+#ifdef MADV_HUGEPAGE
+		madvise(arena, BLK_ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+	}
+	blk_pool.arenas++;
+
+	buf = arena;
+	for (i = BLK_ARENA_SIZE / F2FS_BLKSIZE - 1; i >= 0; i--)
+		blk_pool_push(buf + i * F2FS_BLKSIZE);
+}
+
+/* take up to an arena worth of buffers left by exited threads */
+static void blk_pool_take_spare(void)
+{
+	void *buf;
+	int i;
+
+	pthread_mutex_lock(&blk_spare.lock);
+	for (i = 0; i < BLK_ARENA_SIZE / F2FS_BLKSIZE; i++) {
+		buf = blk_spare.free_list;
+		if (!buf)
+			break;
+		blk_spare.free_list = *(void **)buf;
+		blk_pool_push(buf);
+	}
+	pthread_mutex_unlock(&blk_spare.lock);
+}
+
+/* The contents are undefined, use this for buffers filled by a read. */
+void *f2fs_blk_alloc(void)
+{
+	void *buf;
+
+	blk_pool.allocs++;
+
+	if (!blk_pool.free_list && config.hugepages) {
+		blk_pool_take_spare();
+		if (!blk_pool.free_list)
+			blk_pool_grow_arena();
+	}
+
+	if (blk_pool.free_list) {
+		buf = blk_pool.free_list;
+		blk_pool.free_list = *(void **)buf;
+		blk_pool.nr_free--;
+		blk_pool.reused++;
+		return buf;
+	}
+
+	/* no arenas, or mapping one failed */
+	blk_pool.mallocs++;
+	return malloc(F2FS_BLKSIZE);
+}
+
+void *f2fs_blk_zalloc(void)
+{
+	void *buf = f2fs_blk_alloc();
+
+	if (buf) {
+		memset(buf, 0, F2FS_BLKSIZE);
+		blk_pool.zeroed++;
+	}
+	return buf;
+}
+
+void f2fs_blk_free(void *buf)
+{
+	if (!buf)
+		return;
+	if (blk_pool.nr_free >= BLK_POOL_MAX && !config.hugepages)
+		free(buf);
+	else
+		blk_pool_push(buf);
+}
+
+/* Called by a thread on its way out, to give back its free buffers. */
+void f2fs_blk_pool_release(void)
+{
+	void *buf, *next;
+
+	buf = blk_pool.free_list;
+	if (!buf)
+		return;
+
+	if (config.hugepages) {
+		while (*(void **)buf)
+			buf = *(void **)buf;
+		pthread_mutex_lock(&blk_spare.lock);
+		*(void **)buf = blk_spare.free_list;
+		blk_spare.free_list = blk_pool.free_list;
+		pthread_mutex_unlock(&blk_spare.lock);
+	} else {
+		for (; buf; buf = next) {
+			next = *(void **)buf;
+			free(buf);
+		}
+	}
+	blk_pool.free_list = NULL;
+	blk_pool.nr_free = 0;
+}
+
+void f2fs_blk_pool_report(void)
+{
+	MSG(1, "Info: block buffers: %llu allocated, %llu reused, "
+		"%llu zeroed, %llu from malloc, %u hugepage arenas\n",
+		blk_pool.allocs, blk_pool.reused, blk_pool.zeroed,
+		blk_pool.mallocs, blk_pool.arenas);
+}
+
+/*
+ * Sparse images
+ *
+ * An Android sparse image keeps only the written ranges of the device, as
+ * raw or fill chunks, and lets the rest be "don't care". Tools work on an
+ * unlinked image file next to it, expanded on open, and written back as a
+ * sparse image when the device is finalized, if it was written to. Holes of
+ * that file before the main area are zeroed metadata and stay zeros; in the
+ * main area they are free space, which the image does not care about,
+ * except for the zero fills of the image it was expanded from: those may be
+ * valid blocks of zeros, and are kept in c->sparse_fills to stay fills.
+ */
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+#define SPARSE_CHUNK_RAW	0xCAC1
+#define SPARSE_CHUNK_FILL	0xCAC2
+#define SPARSE_CHUNK_DONT_CARE	0xCAC3
+#define SPARSE_CHUNK_CRC32	0xCAC4
+#define SPARSE_MAX_RAW		0x80000		/* blocks, for 32-bit total_sz */
+#define SPARSE_READ_BLKS	256
+
+struct sparse_header {
+	__le32 magic;
+	__le16 major_version;
+	__le16 minor_version;
+	__le16 file_hdr_sz;
+	__le16 chunk_hdr_sz;
+	__le32 blk_sz;
+	__le32 total_blks;
+	__le32 total_chunks;
+	__le32 image_checksum;
+} __attribute__((packed));
+
+struct sparse_chunk_header {
+	__le16 chunk_type;
+	__le16 reserved1;
+	__le32 chunk_sz;		/* in blocks */
+	__le32 total_sz;		/* in bytes, with this header */
+} __attribute__((packed));
+
+static int sparse_read_header(int fd, struct sparse_header *sh)
+{
+	if (pread64(fd, sh, sizeof(*sh), 0) != sizeof(*sh))
+		return -1;
+	if (le32_to_cpu(sh->magic) != SPARSE_HEADER_MAGIC)
+		return -1;
+	if (le16_to_cpu(sh->major_version) != 1 ||
+			le16_to_cpu(sh->file_hdr_sz) < sizeof(*sh) ||
+			le16_to_cpu(sh->chunk_hdr_sz) <
+				sizeof(struct sparse_chunk_header) ||
+			le32_to_cpu(sh->blk_sz) != F2FS_BLKSIZE) {
+		MSG(0, "\tError: Unsupported sparse image!!!\n");
+		return -1;
+	}
+	return 0;
+}
+
+int f2fs_is_sparse_image(const char *path)
+{
+	struct sparse_header sh;
+	struct stat st;
+	int fd, ret;
+
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ret = pread64(fd, &sh, sizeof(sh), 0) == sizeof(sh) &&
+			le32_to_cpu(sh.magic) == SPARSE_HEADER_MAGIC;
+	close(fd);
+	return ret;
+}
+
+/* an unlinked file next to what @path links to, so on the same file system */
+static int sparse_tmpfile(const char *path)
+{
+	char *real = realpath(path, NULL);
+	char *tmp;
+	int fd = -1;
+
+	if (real)
+		path = real;
+	tmp = malloc(strlen(path) + 8);
+	if (tmp) {
+		sprintf(tmp, "%s.XXXXXX", path);
+		fd = mkstemp(tmp);
+		if (fd >= 0)
+			unlink(tmp);
+		free(tmp);
+	}
+	free(real);
+	return fd;
+}
+
+static int sparse_expand(int in, int out, struct sparse_header *sh,
+							char *fills)
+{
+	u_int32_t buf[F2FS_BLKSIZE / sizeof(u_int32_t)];
+	struct sparse_chunk_header ch;
+	off64_t pos = le16_to_cpu(sh->file_hdr_sz), dst = 0;
+	u_int32_t i, j, nr;
+
+	for (i = 0; i < le32_to_cpu(sh->total_chunks); i++) {
+		if (pread64(in, &ch, sizeof(ch), pos) != sizeof(ch))
+			return -1;
+		pos += le16_to_cpu(sh->chunk_hdr_sz);
+		nr = le32_to_cpu(ch.chunk_sz);
+		if (dst / F2FS_BLKSIZE + nr > le32_to_cpu(sh->total_blks))
+			return -1;
+
+		switch (le16_to_cpu(ch.chunk_type)) {
+		case SPARSE_CHUNK_RAW:
+			for (j = 0; j < nr; j++) {
+				if (pread64(in, buf, F2FS_BLKSIZE, pos) !=
+								F2FS_BLKSIZE ||
+					copy_pwrite(out, buf, F2FS_BLKSIZE,
+								dst) < 0)
+					return -1;
+				pos += F2FS_BLKSIZE;
+				dst += F2FS_BLKSIZE;
+			}
+			break;
+		case SPARSE_CHUNK_FILL:
+			if (pread64(in, buf, sizeof(u_int32_t), pos) !=
+							sizeof(u_int32_t))
+				return -1;
+			pos += le32_to_cpu(ch.total_sz) -
+					le16_to_cpu(sh->chunk_hdr_sz);
+			/* zeros are the holes of the new file already */
+			if (!buf[0]) {
+				for (j = 0; j < nr; j++)
+					f2fs_set_bit(dst / F2FS_BLKSIZE + j,
+								fills);
+				dst += (off64_t)nr * F2FS_BLKSIZE;
+				break;
+			}
+			for (j = 1; j < F2FS_BLKSIZE / sizeof(u_int32_t); j++)
+				buf[j] = buf[0];
+			for (j = 0; j < nr; j++, dst += F2FS_BLKSIZE)
+				if (copy_pwrite(out, buf, F2FS_BLKSIZE,
+								dst) < 0)
+					return -1;
+			break;
+		case SPARSE_CHUNK_DONT_CARE:
+			dst += (off64_t)nr * F2FS_BLKSIZE;
+			break;
+		case SPARSE_CHUNK_CRC32:
+			pos += le32_to_cpu(ch.total_sz) -
+					le16_to_cpu(sh->chunk_hdr_sz);
+			break;
+		default:
+			MSG(0, "\tError: Unknown sparse chunk 0x%x\n",
+					le16_to_cpu(ch.chunk_type));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Open the image file that stands for the sparse image c->device_name:
+ * its contents expanded, or c->total_sectors of zeros for a new one.
+ */
+int f2fs_sparse_open(struct f2fs_configuration *c)
+{
+	struct sparse_header sh;
+	off64_t size = c->total_sectors * c->sector_size;
+	int in, fd;
+
+	fd = sparse_tmpfile(c->device_name);
+	if (fd < 0) {
+		MSG(0, "\tError: Failed to create the image file!\n");
+		return -1;
+	}
+
+	in = open(c->device_name, O_RDONLY);
+	if (in >= 0 && !sparse_read_header(in, &sh)) {
+		size = (off64_t)le32_to_cpu(sh.total_blks) * F2FS_BLKSIZE;
+		c->sparse_fills = calloc(1, (size / F2FS_BLKSIZE + 7) / 8);
+		if (!c->sparse_fills || ftruncate64(fd, size) < 0 ||
+				sparse_expand(in, fd, &sh, c->sparse_fills)) {
+			MSG(0, "\tError: Failed to read the sparse image!\n");
+			goto err;
+		}
+	} else if (!size) {
+		MSG(0, "\tError: A new sparse image needs its size "
+							"in sectors\n");
+		goto err;
+	} else if (ftruncate64(fd, size) < 0) {
+		goto err;
+	}
+	if (in >= 0)
+		close(in);
+	return fd;
+err:
+	if (in >= 0)
+		close(in);
+	close(fd);
+	free(c->sparse_fills);
+	c->sparse_fills = NULL;
+	return -1;
+}
+
+struct sparse_out {
+	int fd;
+	off64_t pos;		/* end of the output */
+	off64_t chunk_pos;	/* header of the open chunk */
+	u_int16_t type;		/* of the open chunk, or 0 */
+	u_int32_t fill;
+	u_int32_t nr;		/* blocks in the open chunk */
+	u_int32_t nr_chunks;
+};
+
+static int sparse_close_chunk(struct sparse_out *so)
+{
+	struct sparse_chunk_header ch;
+	u_int32_t total = sizeof(ch);
+
+	if (!so->type)
+		return 0;
+	if (so->type == SPARSE_CHUNK_RAW)
+		total += so->nr * F2FS_BLKSIZE;
+	else if (so->type == SPARSE_CHUNK_FILL)
+		total += sizeof(u_int32_t);
+
+	ch.chunk_type = cpu_to_le16(so->type);
+	ch.reserved1 = 0;
+	ch.chunk_sz = cpu_to_le32(so->nr);
+	ch.total_sz = cpu_to_le32(total);
+	so->type = 0;
+	so->nr_chunks++;
+	return copy_pwrite(so->fd, &ch, sizeof(ch), so->chunk_pos);
+}
+
+/* append @nr blocks of @type, from @buf for raw ones */
+static int sparse_add(struct sparse_out *so, u_int16_t type,
+				u_int32_t fill, void *buf, u_int32_t nr)
+{
+	if (so->type != type || (type == SPARSE_CHUNK_FILL &&
+				so->fill != fill) ||
+			(type == SPARSE_CHUNK_RAW &&
+				so->nr + nr > SPARSE_MAX_RAW)) {
+		if (sparse_close_chunk(so) < 0)
+			return -1;
+		so->type = type;
+		so->fill = fill;
+		so->nr = 0;
+		so->chunk_pos = so->pos;
+		so->pos += sizeof(struct sparse_chunk_header);
+		if (type == SPARSE_CHUNK_FILL) {
+			__le32 v = cpu_to_le32(fill);
+
+			if (copy_pwrite(so->fd, &v, sizeof(v), so->pos) < 0)
+				return -1;
+			so->pos += sizeof(v);
+		}
+	}
+	if (type == SPARSE_CHUNK_RAW) {
+		if (copy_pwrite(so->fd, buf, nr * F2FS_BLKSIZE, so->pos) < 0)
+			return -1;
+		so->pos += nr * F2FS_BLKSIZE;
+	}
+	so->nr += nr;
+	return 0;
+}
+
+/* free space from @main_blk on but for the @fills, zeroed metadata before */
+static int sparse_add_hole(struct sparse_out *so, u64 blk, u64 end,
+						u64 main_blk, char *fills)
+{
+	if (blk < main_blk) {
+		u64 n = (end < main_blk ? end : main_blk) - blk;
+
+		if (sparse_add(so, SPARSE_CHUNK_FILL, 0, NULL, n) < 0)
+			return -1;
+		blk += n;
+	}
+	while (blk < end) {
+		int fill = fills && f2fs_test_bit(blk, fills);
+		u64 n = 1;
+
+		while (blk + n < end &&
+				(fills && f2fs_test_bit(blk + n, fills)) == fill)
+			n++;
+		if (sparse_add(so, fill ? SPARSE_CHUNK_FILL :
+				SPARSE_CHUNK_DONT_CARE, 0, NULL, n) < 0)
+			return -1;
+		blk += n;
+	}
+	return 0;
+}
+
+static int sparse_add_data(struct sparse_out *so, int fd, u64 blk, u64 end)
+{
+	u_int32_t *buf = malloc(SPARSE_READ_BLKS * F2FS_BLKSIZE);
+	int ret = -1;
+
+	if (!buf)
+		return -1;
+
+	while (blk < end) {
+		u_int32_t nr = end - blk < SPARSE_READ_BLKS ?
+						end - blk : SPARSE_READ_BLKS;
+		u_int32_t i, j, raw = 0;
+
+		if (pread64(fd, buf, nr * F2FS_BLKSIZE,
+				blk * F2FS_BLKSIZE) != nr * F2FS_BLKSIZE)
+			goto out;
+
+		for (i = 0; i < nr; i++) {
+			u_int32_t *b = buf + i * (F2FS_BLKSIZE / 4);
+
+			for (j = 1; j < F2FS_BLKSIZE / 4; j++)
+				if (b[j] != b[0])
+					break;
+			if (j < F2FS_BLKSIZE / 4) {
+				raw++;
+				continue;
+			}
+			/* a block of one repeated word is a fill */
+			if (raw && sparse_add(so, SPARSE_CHUNK_RAW, 0,
+						b - raw * (F2FS_BLKSIZE / 4),
+						raw) < 0)
+				goto out;
+			raw = 0;
+			if (sparse_add(so, SPARSE_CHUNK_FILL,
+					le32_to_cpu(b[0]), NULL, 1) < 0)
+				goto out;
+		}
+		if (raw && sparse_add(so, SPARSE_CHUNK_RAW, 0,
+				buf + (nr - raw) * (F2FS_BLKSIZE / 4),
+				raw) < 0)
+			goto out;
+		blk += nr;
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Write the image file of c->fd back to c->device_name, as sparse image.
+ * It is rewritten in place, so a symlink stays one and the file keeps its
+ * owner and mode.
+ */
+static int f2fs_sparse_write(struct f2fs_configuration *c)
+{
+	struct sparse_out so = { .pos = sizeof(struct sparse_header) };
+	struct sparse_header sh;
+	struct f2fs_super_block sb;
+	struct stat st;
+	u64 blk = 0, total, data, hole, main_blk;
+
+	if (fstat(c->fd, &st) < 0)
+		return -1;
+	total = st.st_size / F2FS_BLKSIZE;
+
+	/* without a superblock, all holes are kept as zeros */
+	if (pread64(c->fd, &sb, sizeof(sb), F2FS_SUPER_OFFSET) ==
+				sizeof(sb) &&
+			le32_to_cpu(sb.magic) == F2FS_SUPER_MAGIC)
+		main_blk = le32_to_cpu(sb.main_blkaddr);
+	else
+		main_blk = total;
+
+	so.fd = open(c->device_name, O_WRONLY | O_CREAT, 0644);
+	if (so.fd < 0)
+		return -1;
+
+	while (blk < total) {
+		data = blk;
+		hole = total;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		{
+			off64_t off;
+
+			off = lseek64(c->fd, blk * F2FS_BLKSIZE, SEEK_DATA);
+			if (off < 0 && errno == ENXIO)
+				data = total;
+			else if (off >= 0)
+				data = off / F2FS_BLKSIZE;
+			if (data < total) {
+				off = lseek64(c->fd, data * F2FS_BLKSIZE,
+								SEEK_HOLE);
+				if (off >= 0)
+					hole = (off + F2FS_BLKSIZE - 1) /
+								F2FS_BLKSIZE;
+			}
+		}
+#endif
+		if (hole > total)
+			hole = total;
+		if (data > blk && sparse_add_hole(&so, blk, data,
+					main_blk, c->sparse_fills) < 0)
+			goto err;
+		if (data < hole && sparse_add_data(&so, c->fd, data,
+								hole) < 0)
+			goto err;
+		blk = hole;
+	}
+	if (sparse_close_chunk(&so) < 0)
+		goto err;
+
+	memset(&sh, 0, sizeof(sh));
+	sh.magic = cpu_to_le32(SPARSE_HEADER_MAGIC);
+	sh.major_version = cpu_to_le16(1);
+	sh.file_hdr_sz = cpu_to_le16(sizeof(struct sparse_header));
+	sh.chunk_hdr_sz = cpu_to_le16(sizeof(struct sparse_chunk_header));
+	sh.blk_sz = cpu_to_le32(F2FS_BLKSIZE);
+	sh.total_blks = cpu_to_le32(total);
+	sh.total_chunks = cpu_to_le32(so.nr_chunks);
+	if (copy_pwrite(so.fd, &sh, sizeof(sh), 0) < 0)
+		goto err;
+
+	if (ftruncate64(so.fd, so.pos) < 0 || fsync(so.fd) < 0)
+		goto err;
+
+	MSG(0, "Info: Sparse image: %"PRIu64" blocks in %u chunks, "
+			"%"PRIu64" bytes\n", total, so.nr_chunks,
+			(u64)so.pos);
+	close(so.fd);
+	return 0;
+err:
+	close(so.fd);
+	return -1;
+}
+
 void f2fs_finalize_device(struct f2fs_configuration *c)
 {
-	/*
-	 * We should call fsync() to flush out all the dirty pages
-	 * in the block device page cache.
-	 */
-	if (fsync(c->fd) < 0)
-		MSG(0, "\tError: Could not conduct fsync!!!\n");
+	if (c->sparse_mode) {
+		/* the image file is a scratch copy, left when not written */
+		if (c->dirty && f2fs_sparse_write(c) < 0)
+			MSG(0, "\tError: Failed to write the sparse image!!!\n");
+		free(c->sparse_fills);
+		c->sparse_fills = NULL;
+	} else {
+		/*
+		 * We should call fsync() to flush out all the dirty pages
+		 * in the block device page cache.
+		 */
+		if (fsync(c->fd) < 0)
+			MSG(0, "\tError: Could not conduct fsync!!!\n");
+	}
 
 	if (close(c->fd) < 0)
 		MSG(0, "\tError: Failed to close device file!!!\n");
@@ -16,16 +16,125 @@
 #include <sys/stat.h>
 #include <sys/mount.h>
 #include <time.h>
+#include <sys/uio.h>
 #include <uuid/uuid.h>
 
 #include "f2fs_fs.h"
 #include "f2fs_format_utils.h"
 
-extern struct f2fs_configuration config;
 struct f2fs_super_block raw_sb;
 struct f2fs_super_block *sb = &raw_sb;
 struct f2fs_checkpoint *cp;
 
+/* the trim left the whole device reading as zeros */
+static int dev_zeroed;
+
+/*
+ * The metadata blocks are queued as they are made and written in one pass
+ * sorted by address, runs of adjacent blocks in one request each, as each
+ * request is a round trip on network block devices.
+ */
+struct meta_block {
+	u_int64_t offset;
+	void *buf;
+};
+
+static struct meta_block *meta_blocks;
+static int nr_meta_blocks, max_meta_blocks;
+
+/* queue a copy of the block @buf, to be written at @offset */
+static int meta_write(void *buf, u_int64_t offset)
+{
+	struct meta_block *mb;
+	int i;
+
+	/* a block written again replaces the queued one */
+	for (i = 0; i < nr_meta_blocks; i++) {
+		if (meta_blocks[i].offset == offset) {
+			memcpy(meta_blocks[i].buf, buf, F2FS_BLKSIZE);
+			return 0;
+		}
+	}
+
+	if (nr_meta_blocks == max_meta_blocks) {
+		int max = max_meta_blocks ? max_meta_blocks * 2 : 32;
+
+		mb = realloc(meta_blocks, max * sizeof(struct meta_block));
+		if (!mb)
+			return -1;
+		meta_blocks = mb;
+		max_meta_blocks = max;
+	}
+	mb = &meta_blocks[nr_meta_blocks];
+	mb->buf = malloc(F2FS_BLKSIZE);
+	if (!mb->buf)
+		return -1;
+	memcpy(mb->buf, buf, F2FS_BLKSIZE);
+	mb->offset = offset;
+	nr_meta_blocks++;
+	return 0;
+}
+
+/* read the block at @blkaddr as it is going to be */
+static int meta_read_block(void *buf, u_int64_t blkaddr)
+{
+	int i;
+
+	for (i = 0; i < nr_meta_blocks; i++) {
+		if (meta_blocks[i].offset == blkaddr * F2FS_BLKSIZE) {
+			memcpy(buf, meta_blocks[i].buf, F2FS_BLKSIZE);
+			return 0;
+		}
+	}
+	return dev_read_block(buf, blkaddr);
+}
+
+static int cmp_meta_block(const void *a, const void *b)
+{
+	const struct meta_block *x = a, *y = b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* write out the queued blocks */
+static int meta_flush(void)
+{
+	struct iovec *iov;
+	int i, start, ret = 0;
+
+	if (!nr_meta_blocks)
+		return 0;
+
+	iov = malloc(nr_meta_blocks * sizeof(struct iovec));
+	if (!iov)
+		return -1;
+	qsort(meta_blocks, nr_meta_blocks, sizeof(struct meta_block),
+							cmp_meta_block);
+
+	for (start = i = 0; i < nr_meta_blocks; i++) {
+		iov[i].iov_base = meta_blocks[i].buf;
+		iov[i].iov_len = F2FS_BLKSIZE;
+		if (i + 1 < nr_meta_blocks && meta_blocks[i + 1].offset ==
+				meta_blocks[i].offset + F2FS_BLKSIZE)
+			continue;
+
+		DBG(1, "\tWriting %d metadata blocks at offset 0x%08"PRIx64"\n",
+				i + 1 - start, meta_blocks[start].offset);
+		if (!ret && dev_writev(iov + start, i + 1 - start,
+					meta_blocks[start].offset) < 0)
+			ret = -1;
+		start = i + 1;
+	}
+
+	for (i = 0; i < nr_meta_blocks; i++)
+		free(meta_blocks[i].buf);
+	free(meta_blocks);
+	free(iov);
+	meta_blocks = NULL;
+	nr_meta_blocks = max_meta_blocks = 0;
+	return ret;
+}
+
 /* Return first segment number of each area */
 #define prev_zone(cur)		(config.cur_seg[cur] - config.segs_per_zone)
 #define next_zone(cur)		(config.cur_seg[cur] + config.segs_per_zone)
@@ -117,6 +226,35 @@ next:
 	free(config.extension_list);
 }
 
+/*
+ * NAT blocks for config.nr_files files of config.avg_file_size bytes; the
+ * one not given is what fills @total_blks. Each file takes its inode and
+ * the direct and indirect nodes of its size, with half as many again for
+ * directories, xattrs and later growth.
+ */
+static u_int32_t nat_blocks_for_files(u_int32_t total_blks)
+{
+	u_int64_t files = config.nr_files, size = config.avg_file_size;
+	u_int64_t blks, dnodes, nodes;
+
+	if (!files)
+		files = ALIGN((u_int64_t)total_blks * F2FS_BLKSIZE, size);
+	if (!size)
+		size = (u_int64_t)total_blks * F2FS_BLKSIZE / files;
+
+	blks = ALIGN(size, F2FS_BLKSIZE);
+	dnodes = 0;
+	if (blks > DEF_ADDRS_PER_INODE)
+		dnodes = ALIGN(blks - DEF_ADDRS_PER_INODE, ADDRS_PER_BLOCK);
+	nodes = files * (1 + dnodes + ALIGN(dnodes, NIDS_PER_BLOCK));
+	nodes += nodes / 2;
+
+	/* a node per block at most, as without the hint */
+	if (nodes > total_blks)
+		nodes = total_blks;
+	return ALIGN(nodes, NAT_ENTRY_PER_BLOCK);
+}
+
 static int f2fs_prepare_super_block(void)
 {
 	u_int32_t blk_size_bytes;
@@ -131,6 +269,7 @@ static int f2fs_prepare_super_block(void)
 	u_int32_t sit_bitmap_size, max_sit_bitmap_size;
 	u_int32_t max_nat_bitmap_size, max_nat_segments;
 	u_int32_t total_zones;
+	u_int64_t nr_nids;
 
 	set_sb(magic, F2FS_SUPER_MAGIC);
 	set_sb(major_ver, F2FS_MAJOR_VERSION);
@@ -201,7 +340,12 @@ static int f2fs_prepare_super_block(void)
 			(get_sb(segment_count_ckpt) + get_sb(segment_count_sit))) *
 			config.blks_per_seg;
 
-	blocks_for_nat = ALIGN(total_valid_blks_available, NAT_ENTRY_PER_BLOCK);
+	if (config.nr_files || config.avg_file_size)
+		blocks_for_nat = nat_blocks_for_files(
+					total_valid_blks_available);
+	else
+		blocks_for_nat = ALIGN(total_valid_blks_available,
+					NAT_ENTRY_PER_BLOCK);
 
 	set_sb(segment_count_nat, SEG_ALIGN(blocks_for_nat));
 	/*
@@ -238,6 +382,16 @@ static int f2fs_prepare_super_block(void)
 
 	set_sb(segment_count_nat, get_sb(segment_count_nat) * 2);
 
+	/* what fsck.f2fs and sload.f2fs pay for the NAT on every run */
+	nr_nids = (u_int64_t)(get_sb(segment_count_nat) / 2) *
+				config.blks_per_seg * NAT_ENTRY_PER_BLOCK;
+	MSG(0, "Info: NAT = %u segments for %"PRIu64" nodes: a full scan "
+		"reads %u MB, fsck tables take %"PRIu64" MB\n",
+		get_sb(segment_count_nat), nr_nids,
+		(get_sb(segment_count_nat) / 2) << log_blks_per_seg >> 8,
+		(nr_nids * sizeof(struct f2fs_nat_entry) + nr_nids / 8 +
+							(1 << 20) - 1) >> 20);
+
 	set_sb(ssa_blkaddr, get_sb(nat_blkaddr) + get_sb(segment_count_nat) *
 			config.blks_per_seg);
 
@@ -359,6 +513,12 @@ static int f2fs_init_sit_area(void)
 	sit_seg_addr = get_sb(sit_blkaddr);
 	sit_seg_addr *= blk_size;
 
+	if (config.lazy_init && (dev_zeroed || !dev_zero(sit_seg_addr,
+			(u_int64_t)seg_size * (get_sb(segment_count_sit) / 2)))) {
+		free(zero_buf);
+		return 0;
+	}
+
 	DBG(1, "\tFilling sit area at offset 0x%08"PRIx64"\n", sit_seg_addr);
 	for (index = 0; index < (get_sb(segment_count_sit) / 2); index++) {
 		if (dev_fill(zero_buf, sit_seg_addr, seg_size)) {
@@ -393,6 +553,12 @@ static int f2fs_init_nat_area(void)
 	nat_seg_addr = get_sb(nat_blkaddr);
 	nat_seg_addr *= blk_size;
 
+	if (config.lazy_init && (dev_zeroed || !dev_zero(nat_seg_addr,
+			(u_int64_t)seg_size * get_sb(segment_count_nat)))) {
+		free(nat_buf);
+		return 0;
+	}
+
 	DBG(1, "\tFilling nat area at offset 0x%08"PRIx64"\n", nat_seg_addr);
 	for (index = 0; index < get_sb(segment_count_nat) / 2; index++) {
 		if (dev_fill(nat_buf, nat_seg_addr, seg_size)) {
@@ -502,14 +668,14 @@ static int f2fs_write_check_point_pack(void)
 	cp_seg_blk_offset *= blk_size_bytes;
 
 	DBG(1, "\tWriting main segments, cp at offset 0x%08"PRIx64"\n", cp_seg_blk_offset);
-	if (dev_write(cp, cp_seg_blk_offset, blk_size_bytes)) {
+	if (meta_write(cp, cp_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the cp to disk!!!\n");
 		goto free_cp_payload;
 	}
 
 	for (i = 0; i < get_sb(cp_payload); i++) {
 		cp_seg_blk_offset += blk_size_bytes;
-		if (dev_fill(cp_payload, cp_seg_blk_offset, blk_size_bytes)) {
+		if (meta_write(cp_payload, cp_seg_blk_offset)) {
 			MSG(1, "\tError: While zeroing out the sit bitmap area "
 					"on disk!!!\n");
 			goto free_cp_payload;
@@ -579,7 +745,7 @@ static int f2fs_write_check_point_pack(void)
 	cp_seg_blk_offset += blk_size_bytes;
 	DBG(1, "\tWriting Segment summary for HOT/WARM/COLD_DATA, at offset 0x%08"PRIx64"\n",
 			cp_seg_blk_offset);
-	if (dev_write(sum_compact, cp_seg_blk_offset, blk_size_bytes)) {
+	if (meta_write(sum_compact, cp_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the sum_blk to disk!!!\n");
 		goto free_cp_payload;
 	}
@@ -594,7 +760,7 @@ static int f2fs_write_check_point_pack(void)
 	cp_seg_blk_offset += blk_size_bytes;
 	DBG(1, "\tWriting Segment summary for HOT_NODE, at offset 0x%08"PRIx64"\n",
 			cp_seg_blk_offset);
-	if (dev_write(sum, cp_seg_blk_offset, blk_size_bytes)) {
+	if (meta_write(sum, cp_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the sum_blk to disk!!!\n");
 		goto free_cp_payload;
 	}
@@ -606,7 +772,7 @@ static int f2fs_write_check_point_pack(void)
 	cp_seg_blk_offset += blk_size_bytes;
 	DBG(1, "\tWriting Segment summary for WARM_NODE, at offset 0x%08"PRIx64"\n",
 			cp_seg_blk_offset);
-	if (dev_write(sum, cp_seg_blk_offset, blk_size_bytes)) {
+	if (meta_write(sum, cp_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the sum_blk to disk!!!\n");
 		goto free_cp_payload;
 	}
@@ -617,7 +783,7 @@ static int f2fs_write_check_point_pack(void)
 	cp_seg_blk_offset += blk_size_bytes;
 	DBG(1, "\tWriting Segment summary for COLD_NODE, at offset 0x%08"PRIx64"\n",
 			cp_seg_blk_offset);
-	if (dev_write(sum, cp_seg_blk_offset, blk_size_bytes)) {
+	if (meta_write(sum, cp_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the sum_blk to disk!!!\n");
 		goto free_cp_payload;
 	}
@@ -625,7 +791,7 @@ static int f2fs_write_check_point_pack(void)
 	/* cp page2 */
 	cp_seg_blk_offset += blk_size_bytes;
 	DBG(1, "\tWriting cp page2, at offset 0x%08"PRIx64"\n", cp_seg_blk_offset);
-	if (dev_write(cp, cp_seg_blk_offset, blk_size_bytes)) {
+	if (meta_write(cp, cp_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the cp to disk!!!\n");
 		goto free_cp_payload;
 	}
@@ -642,14 +808,14 @@ static int f2fs_write_check_point_pack(void)
 				config.blks_per_seg) *
 				blk_size_bytes;
 	DBG(1, "\tWriting cp page 1 of checkpoint pack 2, at offset 0x%08"PRIx64"\n", cp_seg_blk_offset);
-	if (dev_write(cp, cp_seg_blk_offset, blk_size_bytes)) {
+	if (meta_write(cp, cp_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the cp to disk!!!\n");
 		goto free_cp_payload;
 	}
 
 	for (i = 0; i < get_sb(cp_payload); i++) {
 		cp_seg_blk_offset += blk_size_bytes;
-		if (dev_fill(cp_payload, cp_seg_blk_offset, blk_size_bytes)) {
+		if (meta_write(cp_payload, cp_seg_blk_offset)) {
 			MSG(1, "\tError: While zeroing out the sit bitmap area "
 					"on disk!!!\n");
 			goto free_cp_payload;
@@ -660,7 +826,7 @@ static int f2fs_write_check_point_pack(void)
 	cp_seg_blk_offset += blk_size_bytes * (le32_to_cpu(cp->cp_pack_total_block_count)
 			- get_sb(cp_payload) - 1);
 	DBG(1, "\tWriting cp page 2 of checkpoint pack 2, at offset 0x%08"PRIx64"\n", cp_seg_blk_offset);
-	if (dev_write(cp, cp_seg_blk_offset, blk_size_bytes)) {
+	if (meta_write(cp, cp_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the cp to disk!!!\n");
 		goto free_cp_payload;
 	}
@@ -688,7 +854,7 @@ static int f2fs_write_super_block(void)
 	memcpy(zero_buff + F2FS_SUPER_OFFSET, sb, sizeof(*sb));
 	DBG(1, "\tWriting super block, at offset 0x%08x\n", 0);
 	for (index = 0; index < 2; index++) {
-		if (dev_write(zero_buff, index * F2FS_BLKSIZE, F2FS_BLKSIZE)) {
+		if (meta_write(zero_buff, index * F2FS_BLKSIZE)) {
 			MSG(1, "\tError: While while writing supe_blk "
 					"on disk!!! index : %d\n", index);
 			free(zero_buff);
@@ -710,7 +876,7 @@ static int discard_obsolete_dnode(struct f2fs_node *raw_node, u_int64_t offset)
 			offset >= get_sb(main_blkaddr) + get_sb(block_count))
 			break;
 
-		if (dev_read_block(raw_node, offset)) {
+		if (meta_read_block(raw_node, offset)) {
 			MSG(1, "\tError: While traversing direct node!!!\n");
 			return -1;
 		}
@@ -718,7 +884,7 @@ static int discard_obsolete_dnode(struct f2fs_node *raw_node, u_int64_t offset)
 		memset(raw_node, 0, F2FS_BLKSIZE);
 
 		DBG(1, "\tDiscard dnode, at offset 0x%08"PRIx64"\n", offset);
-		if (dev_write_block(raw_node, offset)) {
+		if (meta_write(raw_node, offset * F2FS_BLKSIZE)) {
 			MSG(1, "\tError: While discarding direct node!!!\n");
 			return -1;
 		}
@@ -784,7 +950,7 @@ static int f2fs_write_root_inode(void)
         main_area_node_seg_blk_offset *= blk_size_bytes;
 
 	DBG(1, "\tWriting root inode (hot node), %x %x %x at offset 0x%08"PRIu64"\n", get_sb(main_blkaddr), config.cur_seg[CURSEG_HOT_NODE], config.blks_per_seg, main_area_node_seg_blk_offset/512);
-	if (dev_write(raw_node, main_area_node_seg_blk_offset, F2FS_BLKSIZE)) {
+	if (meta_write(raw_node, main_area_node_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the raw_node to disk!!!\n");
 		free(raw_node);
 		return -1;
@@ -836,7 +1002,7 @@ static int f2fs_update_nat_root(void)
 	nat_seg_blk_offset *= blk_size_bytes;
 
 	DBG(1, "\tWriting nat root, at offset 0x%08"PRIx64"\n", nat_seg_blk_offset);
-	if (dev_write(nat_blk, nat_seg_blk_offset, F2FS_BLKSIZE)) {
+	if (meta_write(nat_blk, nat_seg_blk_offset)) {
 		MSG(1, "\tError: While writing the nat_blk set0 to disk!\n");
 		free(nat_blk);
 		return -1;
@@ -879,7 +1045,7 @@ static int f2fs_add_default_dentry_root(void)
 	data_blk_offset *= blk_size_bytes;
 
 	DBG(1, "\tWriting default dentry root, at offset 0x%08"PRIx64"\n", data_blk_offset);
-	if (dev_write(dent_blk, data_blk_offset, F2FS_BLKSIZE)) {
+	if (meta_write(dent_blk, data_blk_offset)) {
 		MSG(1, "\tError: While writing the dentry_blk to disk!!!\n");
 		free(dent_blk);
 		return -1;
@@ -932,6 +1098,7 @@ int f2fs_format_device(void)
 		MSG(0, "\tError: Failed to trim whole device!!!\n");
 		goto exit;
 	}
+	dev_zeroed = err;
 
 	err = f2fs_init_sit_area();
 	if (err < 0) {
@@ -957,7 +1124,18 @@ int f2fs_format_device(void)
 		goto exit;
 	}
 
+	/* the superblock points at nothing not yet on the device */
+	err = meta_flush();
+	if (!err && fsync(config.fd) < 0)
+		err = -1;
+	if (err < 0) {
+		MSG(0, "\tError: Failed to write the metadata!!!\n");
+		goto exit;
+	}
+
 	err = f2fs_write_super_block();
+	if (!err)
+		err = meta_flush();
 	if (err < 0) {
 		MSG(0, "\tError: Failed to write the Super Block!!!\n");
 		goto exit;
@@ -22,23 +22,32 @@
 #include "f2fs_fs.h"
 #include "f2fs_format_utils.h"
 
-extern struct f2fs_configuration config;
+/* the parts of the layout left to f2fs_tune_layout() */
+static int tune = TUNE_SECTION | TUNE_ZONE | TUNE_HEAP;
+static int print_plan;
 
 static void mkfs_usage()
 {
 	MSG(0, "\nUsage: mkfs.f2fs [options] device [sectors]\n");
 	MSG(0, "[options]:\n");
 	MSG(0, "  -a heap-based allocation [default:1]\n");
+	MSG(0, "  -b average file size in KB, to size the NAT\n");
 	MSG(0, "  -d debug level [default:0]\n");
+	MSG(0, "  -D discard chunk in MB [default:1024]\n");
 	MSG(0, "  -e [extension list] e.g. \"mp3,gif,mov\"\n");
+	MSG(0, "  -j discard threads [default: one per cpu, up to 8]\n");
 	MSG(0, "  -l label\n");
+	MSG(0, "  -L lazy init [leave zeroing NAT/SIT to the device]\n");
 	MSG(0, "  -o overprovision ratio [default:5]\n");
+	MSG(0, "  -P print the layout planned for the device and exit\n");
 	MSG(0, "  -O set feature\n");
 	MSG(0, "  -q quiet mode\n");
 	MSG(0, "  -s # of segments per section [default:1]\n");
+	MSG(0, "  -S write an Android sparse image [needs sectors]\n");
 	MSG(0, "  -z # of sections per zone [default:1]\n");
 	MSG(0, "  -t 0: nodiscard, 1: discard [default:1]\n");
 	MSG(0, "  -m support SMR device [default:0]\n");
+	MSG(0, "  -n # of files expected, to size the NAT\n");
 	MSG(0, "sectors: number of sectors. [default: determined by device size]\n");
 	exit(1);
 }
@@ -72,7 +81,7 @@ static void parse_feature(char *features)
 
 static void f2fs_parse_options(int argc, char *argv[])
 {
-	static const char *option_string = "qa:d:e:l:mo:O:s:z:t:";
+	static const char *option_string = "qa:b:d:D:e:j:l:Lmn:o:O:Ps:Sz:t:";
 	int32_t option=0;
 
 	while ((option = getopt(argc,argv,option_string)) != EOF) {
@@ -82,13 +91,23 @@ static void f2fs_parse_options(int argc, char *argv[])
 			break;
 		case 'a':
 			config.heap = atoi(optarg);
+			tune &= ~TUNE_HEAP;
+			break;
+		case 'b':
+			config.avg_file_size = atoll(optarg) << 10;
 			break;
 		case 'd':
 			config.dbg_lv = atoi(optarg);
 			break;
+		case 'D':
+			config.discard_chunk = atoll(optarg) << 20;
+			break;
 		case 'e':
 			config.extension_list = strdup(optarg);
 			break;
+		case 'j':
+			config.jobs = atoi(optarg);
+			break;
 		case 'l':		/*v: volume label */
 			if (strlen(optarg) > 512) {
 				MSG(0, "Error: Volume Label should be less than "
@@ -97,20 +116,34 @@ static void f2fs_parse_options(int argc, char *argv[])
 			}
 			config.vol_label = optarg;
 			break;
+		case 'L':
+			config.lazy_init = 1;
+			break;
 		case 'm':
 			config.smr_mode = 1;
 			break;
+		case 'n':
+			config.nr_files = atoll(optarg);
+			break;
 		case 'o':
 			config.overprovision = atof(optarg);
 			break;
 		case 'O':
 			parse_feature(strdup(optarg));
 			break;
+		case 'P':
+			print_plan = 1;
+			break;
 		case 's':
 			config.segs_per_sec = atoi(optarg);
+			tune &= ~TUNE_SECTION;
+			break;
+		case 'S':
+			config.sparse_mode = 1;
 			break;
 		case 'z':
 			config.secs_per_zone = atoi(optarg);
+			tune &= ~TUNE_ZONE;
 			break;
 		case 't':
 			config.trim = atoi(optarg);
@@ -151,6 +184,10 @@ int main(int argc, char *argv[])
 	if (f2fs_get_device_info(&config) < 0)
 		return -1;
 
+	f2fs_tune_layout(tune | (print_plan ? TUNE_EXPLAIN : 0));
+	if (print_plan)
+		return 0;
+
 	if (f2fs_format_device() < 0)
 		return -1;
 
@@ -12,9 +12,17 @@
 #define _GNU_SOURCE
 #endif
 
+#include "f2fs_format_utils.h"
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
@@ -33,7 +41,170 @@
 #ifndef BLKSECDISCARD
 #define BLKSECDISCARD	_IO(0x12,125)
 #endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES	_IO(0x12,124)
+#endif
+
+#define DISCARD_MAX_JOBS	8
+#define DISCARD_CHUNK		(1ULL << 30)	/* bytes per request */
+#define SECTION_MAX_BYTES	(512ULL << 20)	/* largest tuned section */
+
+/*
+ * The device is discarded in chunks, which worker threads take in turn,
+ * so that a slow discard is spread over the queues of the device and
+ * progress can be shown. A failure stops the others from taking more.
+ */
+struct discard_work {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long request;	/* BLKDISCARD or BLKSECDISCARD */
+	u_int64_t next;		/* start of the next chunk to take */
+	u_int64_t end;
+	u_int64_t chunk;
+	u_int64_t done;		/* bytes discarded */
+	int running;		/* workers not yet finished */
+	int err;
+};
+
+static void *discard_worker(void *arg)
+{
+	struct discard_work *w = arg;
+	unsigned long long range[2];
+	int ret;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->err && w->next < w->end) {
+		range[0] = w->next;
+		range[1] = w->end - w->next < w->chunk ?
+					w->end - w->next : w->chunk;
+		w->next += range[1];
+		pthread_mutex_unlock(&w->lock);
+
+		ret = ioctl(config.fd, w->request, &range);
+
+		pthread_mutex_lock(&w->lock);
+		if (ret < 0 && !w->err)
+			w->err = -errno;
+		else if (!ret)
+			w->done += range[1];
+		pthread_cond_signal(&w->cond);
+	}
+	w->running--;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/*
+ * The queue attribute @name of the device, or of the disk of a partition,
+ * read into @buf. Returns -1 when sysfs does not have it.
+ */
+static int queue_attr(struct stat *st, const char *name, char *buf, int size)
+{
+	char path[96];
+	FILE *f;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s",
+			major(st->st_rdev), minor(st->st_rdev), name);
+	f = fopen(path, "r");
+	if (!f) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s",
+			major(st->st_rdev), minor(st->st_rdev), name);
+		f = fopen(path, "r");
+	}
+	if (f) {
+		if (fgets(buf, size, f))
+			ret = 0;
+		fclose(f);
+	}
+	return ret;
+}
+
+/* a numeric queue limit, 0 when unknown */
+static u_int64_t queue_limit(struct stat *st, const char *name)
+{
+	char buf[32];
+
+	if (queue_attr(st, name, buf, sizeof(buf)) < 0)
+		return 0;
+	return strtoull(buf, NULL, 10);
+}
+
+static u_int64_t discard_granularity(struct stat *st)
+{
+	u_int64_t gran = queue_limit(st, "discard_granularity");
+
+	return gran ? gran : config.sector_size;
+}
+
+/* discard [0, @len) with @request, returns 0 or -errno */
+static int discard_range(unsigned long request, u_int64_t len,
+						u_int64_t gran)
+{
+	struct discard_work w = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.request = request,
+		.end = len,
+	};
+	pthread_t threads[DISCARD_MAX_JOBS];
+	int jobs = config.jobs, i, shown = 0;
+
+	w.chunk = config.discard_chunk ? config.discard_chunk : DISCARD_CHUNK;
+	w.chunk = (w.chunk + gran - 1) / gran * gran;
+
+	if (jobs < 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > DISCARD_MAX_JOBS)
+		jobs = DISCARD_MAX_JOBS;
+	if (jobs < 1)
+		jobs = 1;
+
+	for (i = 0; i < jobs; i++) {
+		if (f2fs_thread_create(&threads[i], discard_worker, &w))
+			break;
+		w.running++;
+	}
+	if (!i) {
+		discard_worker(&w);
+		return w.err;
+	}
+	jobs = i;
 
+	pthread_mutex_lock(&w.lock);
+	while (w.running) {
+		struct timespec ts;
+		int pct = w.done * 100 / len;
+
+		if (pct > shown) {
+			MSG(0, "\rInfo: Discarded %3d%%", pct);
+			fflush(stdout);
+			shown = pct;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&w.cond, &w.lock, &ts);
+	}
+	pthread_mutex_unlock(&w.lock);
+	if (shown)
+		MSG(0, "\rInfo: Discarded %3d%%\n", (int)(w.done * 100 / len));
+
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+	return w.err;
+}
+
+static int discard_zeroes_data(void)
+{
+	unsigned int zeroes = 0;
+
+	if (ioctl(config.fd, BLKDISCARDZEROES, &zeroes) < 0)
+		return 0;
+	return zeroes ? 1 : 0;
+}
+
+/* returns 1 when the whole device reads as zeros afterwards */
 int f2fs_trim_device()
 {
 	unsigned long long range[2];
@@ -57,24 +228,29 @@ int f2fs_trim_device()
 		if (fallocate(config.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
 				range[0], range[1]) < 0) {
 			MSG(0, "Info: fallocate(PUNCH_HOLE|KEEP_SIZE) is failed\n");
+		} else {
+			return 1;
 		}
 #endif
 		return 0;
 	} else if (S_ISBLK(stat_buf.st_mode)) {
+		u_int64_t gran = discard_granularity(&stat_buf);
+
 #ifdef BLKSECDISCARD
-		if (ioctl(config.fd, BLKSECDISCARD, &range) < 0) {
+		if (discard_range(BLKSECDISCARD, range[1], gran) < 0) {
 			MSG(0, "Info: This device doesn't support BLKSECDISCARD\n");
 		} else {
 			MSG(0, "Info: Secure Discarded %lu sectors\n",
 						config.total_sectors);
-			return 0;
+			return discard_zeroes_data();
 		}
 #endif
-		if (ioctl(config.fd, BLKDISCARD, &range) < 0) {
+		if (discard_range(BLKDISCARD, range[1], gran) < 0) {
 			MSG(0, "Info: This device doesn't support BLKDISCARD\n");
 		} else {
 			MSG(0, "Info: Discarded %lu sectors\n",
 						config.total_sectors);
+			return discard_zeroes_data();
 		}
 	} else
 		return -1;
@@ -82,3 +258,115 @@ int f2fs_trim_device()
 	return 0;
 }
 
+static u_int64_t gcd64(u_int64_t a, u_int64_t b)
+{
+	while (b) {
+		u_int64_t t = a % b;
+
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Fit the parts of the layout flagged in @tune to the queue limits of the
+ * device:
+ * - a section spans the erase unit, taken as the largest of the optimal
+ *   and minimum IO sizes and the discard granularity, so that cleaning a
+ *   section frees whole erase blocks or RAID stripes;
+ * - a zone spans the zones of a zoned device, where a section must also
+ *   be a whole zone, or the chunks of a RAID device;
+ * - the logs of a rotational disk are kept together, without the heap
+ *   allocation spreading them over the whole disk.
+ * Overprovision follows from the section size, as it does for -s.
+ * Nothing is known about image files, which keep the defaults.
+ */
+void f2fs_tune_layout(int tune)
+{
+	u_int64_t seg_bytes = (u_int64_t)config.blks_per_seg * F2FS_BLKSIZE;
+	u_int64_t dev_bytes = config.total_sectors * config.sector_size;
+	u_int64_t opt_io, min_io, gran, chunk, unit, sec_bytes;
+	int explain = tune & TUNE_EXPLAIN;
+	struct stat st;
+	char zoned[32] = "none";
+	int rotational;
+
+	if (fstat(config.fd, &st) < 0 || !S_ISBLK(st.st_mode)) {
+		if (explain)
+			MSG(0, "Plan: not a block device, default layout\n");
+		return;
+	}
+
+	opt_io = queue_limit(&st, "optimal_io_size");
+	min_io = queue_limit(&st, "minimum_io_size");
+	gran = queue_limit(&st, "discard_granularity");
+	chunk = queue_limit(&st, "chunk_sectors") << 9;
+	rotational = queue_limit(&st, "rotational") ? 1 : 0;
+	if (queue_attr(&st, "zoned", zoned, sizeof(zoned)) < 0)
+		strcpy(zoned, "none");
+	zoned[strcspn(zoned, "\n")] = 0;
+
+	if (explain) {
+		MSG(0, "Plan: optimal_io_size = %"PRIu64", minimum_io_size = "
+			"%"PRIu64", discard_granularity = %"PRIu64"\n",
+			opt_io, min_io, gran);
+		MSG(0, "Plan: chunk_sectors = %"PRIu64" bytes, rotational = "
+			"%d, zoned = %s\n", chunk, rotational, zoned);
+	}
+
+	if (strcmp(zoned, "none") && chunk && (tune & TUNE_SECTION) &&
+			!config.smr_mode) {
+		/* a section is a zone, written sequentially as a whole */
+		config.segs_per_sec = (chunk + seg_bytes - 1) / seg_bytes;
+		if (explain)
+			MSG(0, "Plan: zoned device, a section per zone of "
+				"%"PRIu64" MB: -s %u\n", chunk >> 20,
+				config.segs_per_sec);
+		tune &= ~(TUNE_SECTION | TUNE_ZONE);
+	}
+
+	unit = opt_io > min_io ? opt_io : min_io;
+	if (gran > unit)
+		unit = gran;
+	if ((tune & TUNE_SECTION) && unit > config.sector_size) {
+		/* the smallest run of segments made of whole units */
+		sec_bytes = unit / gcd64(unit, seg_bytes) * seg_bytes;
+		if (sec_bytes > seg_bytes && sec_bytes <= SECTION_MAX_BYTES &&
+				sec_bytes * 64 <= dev_bytes) {
+			config.segs_per_sec = sec_bytes / seg_bytes;
+			if (explain)
+				MSG(0, "Plan: erase unit of %"PRIu64" KB, "
+					"sections of %"PRIu64" MB: -s %u\n",
+					unit >> 10, sec_bytes >> 20,
+					config.segs_per_sec);
+		} else if (explain) {
+			MSG(0, "Plan: erase unit of %"PRIu64" KB %s\n",
+				unit >> 10, sec_bytes <= seg_bytes ?
+				"fits in a segment, -s 1" :
+				"is too large for sections, -s 1");
+		}
+	}
+
+	sec_bytes = seg_bytes * config.segs_per_sec;
+	if ((tune & TUNE_ZONE) && chunk > sec_bytes && !(chunk % sec_bytes) &&
+			chunk * 16 <= dev_bytes) {
+		config.secs_per_zone = chunk / sec_bytes;
+		if (explain)
+			MSG(0, "Plan: chunks of %"PRIu64" MB, zones of "
+				"%u sections: -z %u\n", chunk >> 20,
+				config.secs_per_zone, config.secs_per_zone);
+	}
+
+	if ((tune & TUNE_HEAP) && rotational) {
+		config.heap = 0;
+		if (explain)
+			MSG(0, "Plan: rotational disk, logs kept together: "
+								"-a 0\n");
+	}
+
+	config.segs_per_zone = config.segs_per_sec * config.secs_per_zone;
+	MSG(0, "Info: Layout for the device: %u segments per section, "
+			"%u sections per zone, heap %s\n", config.segs_per_sec,
+			config.secs_per_zone, config.heap ? "on" : "off");
+}
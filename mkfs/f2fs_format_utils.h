@@ -10,7 +10,12 @@
 
 #include "f2fs_fs.h"
 
-extern struct f2fs_configuration config;
+/* what f2fs_tune_layout() may change, not given by the user */
+#define TUNE_SECTION	0x1
+#define TUNE_ZONE	0x2
+#define TUNE_HEAP	0x4
+#define TUNE_EXPLAIN	0x8	/* print why */
 
+void f2fs_tune_layout(int);
 int f2fs_trim_device(void);
 int f2fs_format_device(void);